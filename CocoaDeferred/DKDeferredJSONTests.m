@@ -7,8 +7,937 @@
 //
 
 #import "DKDeferredJSONTests.h"
+#import <DeferredKit/DeferredKit.h>
+#import "SBJsonSIMD.h"
+#import "SBJsonStructuralIndex.h"
+
+
+// writes SBJsonEventParser events down as short strings
+@interface DKJSONEventRecorder : NSObject <SBJsonEventParserDelegate>
+{
+  NSMutableArray *events;
+  NSString *skipKey;
+  NSString *buildKey;
+}
+@property(readonly) NSMutableArray *events;
+@property(copy) NSString *skipKey;
+@property(copy) NSString *buildKey;
+@end
+
+@implementation DKJSONEventRecorder
+
+@synthesize events, skipKey, buildKey;
+
+- (id)init {
+  if ((self = [super init])) {
+    events = [[NSMutableArray alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [events release];
+  [skipKey release];
+  [buildKey release];
+  [super dealloc];
+}
+
+- (void)parserStartedObject:(SBJsonEventParser *)parser { [events addObject:@"{"]; }
+- (void)parserEndedObject:(SBJsonEventParser *)parser { [events addObject:@"}"]; }
+- (void)parserStartedArray:(SBJsonEventParser *)parser { [events addObject:@"["]; }
+- (void)parserEndedArray:(SBJsonEventParser *)parser { [events addObject:@"]"]; }
+
+- (void)parser:(SBJsonEventParser *)parser foundKey:(const char *)bytes 
+        length:(NSUInteger)length escaped:(BOOL)escaped {
+  NSString *k = [parser stringWithBytes:bytes length:length escaped:escaped];
+  [events addObject:[@"k:" stringByAppendingString:k]];
+  if ([k isEqualToString:skipKey])
+    [parser skipValue];
+  else if ([k isEqualToString:buildKey])
+    [events addObject:[parser objectForValue]];
+}
+
+- (void)parser:(SBJsonEventParser *)parser foundString:(const char *)bytes 
+        length:(NSUInteger)length escaped:(BOOL)escaped {
+  [events addObject:[@"s:" stringByAppendingString:
+                     [parser stringWithBytes:bytes length:length escaped:escaped]]];
+}
+
+- (void)parser:(SBJsonEventParser *)parser foundNumber:(const char *)bytes length:(NSUInteger)length {
+  [events addObject:[parser numberWithBytes:bytes length:length]];
+}
+
+- (void)parser:(SBJsonEventParser *)parser foundBool:(BOOL)x { 
+  [events addObject:(x ? @"true" : @"false")]; 
+}
+
+- (void)parserFoundNull:(SBJsonEventParser *)parser { [events addObject:[NSNull null]]; }
+
+@end
+
+
+// a model for SBJsonModelDecoder
+@interface DKJSONTestItem : NSObject
+{
+  int itemID;
+  NSString *name;
+  NSString *body;
+  NSString *kind;
+  double score;
+  float ratio;
+  BOOL flagged;
+  unsigned long long big;
+  NSArray *tags;
+  NSArray *children;
+  DKJSONTestItem *parent;
+}
+@property int itemID;
+@property(copy) NSString *name, *body, *kind;
+@property double score;
+@property float ratio;
+@property(getter=isFlagged) BOOL flagged;
+@property unsigned long long big;
+@property(retain) NSArray *tags, *children;
+@property(retain) DKJSONTestItem *parent;
+@end
+
+@implementation DKJSONTestItem
+
+@synthesize itemID, name, body, kind, score, ratio, flagged, big, tags, children, parent;
+
+- (void)dealloc {
+  [name release];
+  [body release];
+  [kind release];
+  [tags release];
+  [children release];
+  [parent release];
+  [super dealloc];
+}
+
+@end
 
 
 @implementation DKDeferredJSONTests
 
+- (void)testParseData {
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  const char *bom = "\xEF\xBB\xBF {\"a\": [1, \"b\\u00e9\", true, null]} ";
+  NSData *data = [NSData dataWithBytes:bom length:strlen(bom)];
+  id o = [parser objectWithData:data];
+  STAssertNotNil(o, @"parsed %@", [parser errorTrace]);
+  STAssertEqualObjects([[o objectForKey:@"a"] objectAtIndex:1], @"b\u00e9", @"escapes", nil);
+  
+  // scanning stops at length, the buffer need not be NUL terminated
+  const char *doc = "[\"abc\"]garbage";
+  o = [parser objectWithBytes:doc length:7];
+  STAssertEqualObjects(o, array_(@"abc"), @"bounded by length", nil);
+  
+  // truncated documents fail instead of reading past the end
+  STAssertNil([parser objectWithBytes:doc length:4], @"unterminated string", nil);
+  STAssertNil([parser objectWithBytes:"[tru" length:4], @"truncated literal", nil);
+  STAssertNil([parser objectWithBytes:"[1," length:3], @"truncated array", nil);
+  STAssertNil([parser objectWithBytes:"[\"\\u00e9\"]" length:6], @"truncated \\u escape", nil);
+  STAssertNil([parser objectWithBytes:"[\"\\ud83d\\ude00\"]" length:12], @"truncated surrogate", nil);
+  STAssertNil([parser objectWithData:[NSData data]], @"empty input", nil);
+  
+  // invalid UTF-8 is an error rather than a hang
+  STAssertNil([parser objectWithBytes:"[\"\xC3\x28\"]" length:6], @"invalid utf-8", nil);
+}
+
+- (void)testParseNumbers {
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  NSArray *a = [parser objectWithString:
+                @"[0, -12, 9223372036854775807, -9223372036854775808, 0.1, -2.5e-3, 1.5e30, 123456789012345678901234567890]"];
+  STAssertEquals([[a objectAtIndex:0] longLongValue], 0LL, nil);
+  STAssertEquals([[a objectAtIndex:1] longLongValue], -12LL, nil);
+  STAssertEquals([[a objectAtIndex:2] longLongValue], LLONG_MAX, nil);
+  STAssertEquals([[a objectAtIndex:3] longLongValue], LLONG_MIN, nil);
+  STAssertEquals([[a objectAtIndex:4] doubleValue], 0.1, nil);
+  STAssertEquals([[a objectAtIndex:5] doubleValue], -2.5e-3, nil);
+  STAssertEquals([[a objectAtIndex:6] doubleValue], 1.5e30, nil);
+  STAssertTrue([[a objectAtIndex:7] isKindOfClass:[NSDecimalNumber class]], @"big integers stay exact", nil);
+  STAssertFalse([[a objectAtIndex:4] isKindOfClass:[NSDecimalNumber class]], nil);
+  
+  parser.useDecimalNumbers = YES;
+  a = [parser objectWithString:@"[1, 0.1]"];
+  STAssertTrue([[a objectAtIndex:1] isKindOfClass:[NSDecimalNumber class]], @"opt in to decimals", nil);
+}
+
+// a document shaped like our id and coordinate payloads
+static NSData *_numberCorpus() {
+  NSMutableString *s = [NSMutableString stringWithString:@"["];
+  srandom(42);
+  for (int i = 0; i < 20000; i++) {
+    [s appendFormat:@"%@{\"id\":%ld,\"lat\":%.6f,\"lng\":%.6f}", (i ? @"," : @""),
+     random(), (random() % 180000000) / 1e6 - 90.0, (random() % 360000000) / 1e6 - 180.0];
+  }
+  [s appendString:@"]"];
+  return [s dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (void)testParseNumbersBenchmark {
+  NSData *corpus = _numberCorpus();
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  for (int decimals = 0; decimals < 2; decimals++) {
+    parser.useDecimalNumbers = decimals;
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    id o = [parser objectWithData:corpus];
+    NSLog(@"parse %lu bytes of numbers (%@): %.3fs", (unsigned long)[corpus length],
+          (decimals ? @"NSDecimalNumber" : @"native"), CFAbsoluteTimeGetCurrent() - start);
+    STAssertEquals([o count], (NSUInteger)20000, nil);
+    [pool release];
+  }
+}
+
+- (void)testInternedKeys {
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  NSArray *a = [parser objectWithString:
+                @"[{\"name\": 1}, {\"name\": 2}, {\"na\\u006de\": 3}]"];
+  STAssertNotNil(a, @"parsed %@", [parser errorTrace]);
+  id k0 = [[[a objectAtIndex:0] allKeys] lastObject];
+  id k1 = [[[a objectAtIndex:1] allKeys] lastObject];
+  STAssertTrue(k0 == k1, @"repeated keys share one string", nil);
+  STAssertEqualObjects([[a objectAtIndex:2] objectForKey:@"name"], 
+                       [NSNumber numberWithInt:3], @"escaped keys still decode", nil);
+  
+  // and across parses with the same parser
+  NSDictionary *d = [parser objectWithString:@"{\"name\": 4}"];
+  STAssertTrue([[d allKeys] lastObject] == k0, @"per parser table", nil);
+}
+
+static NSData *_textCorpus(BOOL pretty) {
+  NSString *blob = @"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+                   @"eiusmod tempor incididunt ut labore et dolore magna aliqua. ";
+  NSMutableArray *items = [NSMutableArray array];
+  for (int i = 0; i < 2000; i++) {
+    NSMutableString *body = [NSMutableString string];
+    for (int j = 0; j < 8; j++)
+      [body appendString:blob];
+    [body appendFormat:@"\"quoted\" line %d\n\ttabbed \u00e9", i];
+    [items addObject:dict_(nsni(i), @"id", body, @"body", @"user", @"kind")];
+  }
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  writer.humanReadable = pretty;
+  return [[writer stringWithObject:items] dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (void)testScanLevelsAgree {
+  NSData *corpus = _textCorpus(YES);
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  SBJsonSIMDSelect(SBJsonSIMDScalar);
+  id expected = [parser objectWithData:corpus];
+  SBJsonSIMDLevel best = SBJsonSIMDSelect(SBJsonSIMDBest);
+  STAssertNotNil(expected, @"parsed %@", [parser errorTrace]);
+  STAssertEqualObjects([parser objectWithData:corpus], expected, @"level %d", best);
+  
+  // JSON whitespace does not include form feed or vertical tab
+  STAssertNil([parser objectWithString:@"[1,\f2]"], nil);
+  STAssertNotNil([parser objectWithString:@" [1,\r\n\t2] "], nil);
+}
+
+- (void)testScanBenchmark {
+  for (int pretty = 0; pretty < 2; pretty++) {
+    NSData *corpus = _textCorpus(pretty);
+    SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+    SBJsonSIMDLevel levels[2] = { SBJsonSIMDScalar, SBJsonSIMDBest };
+    for (int i = 0; i < 2; i++) {
+      SBJsonSIMDLevel level = SBJsonSIMDSelect(levels[i]);
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+      id o = [parser objectWithData:corpus];
+      NSLog(@"parse %lu bytes of %@ text (scan level %d): %.3fs", (unsigned long)[corpus length],
+            (pretty ? @"pretty printed" : @"compact"), level, CFAbsoluteTimeGetCurrent() - start);
+      STAssertEquals([o count], (NSUInteger)2000, nil);
+      [pool release];
+    }
+  }
+  SBJsonSIMDSelect(SBJsonSIMDBest);
+}
+
+- (void)testStreamParserSplits {
+  const char *doc = "\xEF\xBB\xBF {\"a\": [1, -2.5e3, \"b\\u00e9\\\"\", true, null, false],"
+                    " \"caf\xC3\xA9\": {\"\": []}, \"n\": 12345678901234567890}";
+  size_t length = strlen(doc);
+  id expected = [[[[SBJsonParser alloc] init] autorelease] 
+                 objectWithBytes:doc length:length];
+  STAssertNotNil(expected, nil);
+  
+  // split in two at every offset, then byte by byte
+  for (size_t i = 0; i <= length; i++) {
+    SBJsonStreamParser *parser = [[[SBJsonStreamParser alloc] init] autorelease];
+    [parser parseBytes:doc length:i];
+    [parser parseBytes:doc + i length:length - i];
+    STAssertEquals(parser.status, SBJsonStreamParserComplete, @"split at %d", i);
+    STAssertEqualObjects([parser finish], expected, @"split at %d", i);
+  }
+  SBJsonStreamParser *parser = [[[SBJsonStreamParser alloc] init] autorelease];
+  for (size_t i = 0; i < length; i++)
+    [parser parseBytes:doc + i length:1];
+  STAssertEqualObjects([parser finish], expected, @"one byte at a time", nil);
+}
+
+- (void)testStreamParserChunks {
+  NSData *corpus = _textCorpus(YES);
+  id expected = [[[[SBJsonParser alloc] init] autorelease] objectWithData:corpus];
+  SBJsonStreamParser *parser = [[[SBJsonStreamParser alloc] init] autorelease];
+  srandom(7);
+  for (NSUInteger i = 0; i < [corpus length];) {
+    NSUInteger n = MIN((NSUInteger)(random() % 4096), [corpus length] - i);
+    [parser parseBytes:(const char *)[corpus bytes] + i length:n];
+    i += n;
+  }
+  STAssertEqualObjects([parser finish], expected, nil);
+  
+  [parser reset];
+  [parser parse:[@"[{\"id\": 1}]  " dataUsingEncoding:NSUTF8StringEncoding]];
+  STAssertEquals(parser.status, SBJsonStreamParserComplete, nil);
+  STAssertEqualObjects([parser finish], array_(dict_(nsni(1), @"id")), @"reusable after reset", nil);
+}
+
+- (void)testStreamParserErrors {
+  NSArray *bad = array_(@"", @"[1,]", @"{\"a\":1,}", @"[1 x]", @"{\"a\" 1}", @"[1]x", 
+                        @"\"str\"", @"[+1]", @"[tru]", @"[\"a", @"{\"a\":", @"[01]", @"{\"a\":1 ]");
+  for (NSString *json in bad) {
+    SBJsonStreamParser *parser = [[[SBJsonStreamParser alloc] init] autorelease];
+    [parser parse:[json dataUsingEncoding:NSUTF8StringEncoding]];
+    STAssertNil([parser finish], @"rejects %@", json);
+    STAssertNotNil(parser.errorTrace, @"explains %@", json);
+  }
+  
+  // missing commas are let through, as SBJsonParser does
+  NSArray *lenient = array_(@"[1 2]", @"[[] {}]", @"{\"a\": 1 \"b\": [2 3]}");
+  SBJsonParser *strict = [[[SBJsonParser alloc] init] autorelease];
+  for (NSString *json in lenient) {
+    SBJsonStreamParser *parser = [[[SBJsonStreamParser alloc] init] autorelease];
+    [parser parse:[json dataUsingEncoding:NSUTF8StringEncoding]];
+    id expected = [strict objectWithString:json];
+    STAssertNotNil(expected, @"%@", json);
+    STAssertEqualObjects([parser finish], expected, @"accepts %@", json);
+  }
+  
+  SBJsonStreamParser *parser = [[[SBJsonStreamParser alloc] init] autorelease];
+  parser.maxDepth = 4;
+  STAssertEquals([parser parse:[@"[[[[[1]]]]]" dataUsingEncoding:NSUTF8StringEncoding]],
+                 SBJsonStreamParserError, @"depth limit", nil);
+}
+
+- (void)testEventParser {
+  NSData *doc = [@"{\"a\": [1, 2.5, \"x\\ny\", true, false, null], \"skip\": {\"b\": [[]]},"
+                 @" \"build\": {\"c\": [3]}, \"d\": {}}" dataUsingEncoding:NSUTF8StringEncoding];
+  SBJsonEventParser *parser = [[[SBJsonEventParser alloc] init] autorelease];
+  DKJSONEventRecorder *recorder = [[[DKJSONEventRecorder alloc] init] autorelease];
+  recorder.skipKey = @"skip";
+  recorder.buildKey = @"build";
+  parser.delegate = recorder;
+  STAssertTrue([parser parse:doc], @"parsed %@", parser.errorTrace);
+  NSArray *expected = array_(@"{", @"k:a", @"[", nsni(1), [NSNumber numberWithDouble:2.5], @"s:x\ny",
+                             @"true", @"false", [NSNull null], @"]", @"k:skip", 
+                             @"k:build", dict_(array_(nsni(3)), @"c"), @"k:d", @"{", @"}", @"}");
+  STAssertEqualObjects(recorder.events, expected, nil);
+  STAssertEquals(parser.depth, (NSUInteger)0, nil);
+  
+  NSArray *bad = array_(@"[1,]", @"{\"a\" 1}", @"[1 2]", @"[\"\\x\"]", @"[01]", @"[1", 
+                        @"{\"skip\": [1, 2}", @"[tru]", @"3");
+  for (NSString *json in bad) {
+    STAssertFalse([parser parse:[json dataUsingEncoding:NSUTF8StringEncoding]], @"rejects %@", json);
+    STAssertNotNil(parser.errorTrace, @"explains %@", json);
+  }
+}
+
+- (void)testPathExtractor {
+  NSData *doc = [@"{\"result\": {\"total\": 3, \"items\": [{\"id\": 1, \"blob\": \"x]}\\\"\"},"
+                 @" {\"id\": 2, \"tags\": [\"a\", \"b\"]}, {\"id\": 3}], \"next\": null}}"
+                 dataUsingEncoding:NSUTF8StringEncoding];
+  NSArray *paths = array_(@"result.items[*].id", @"result.total", @"/result/items/1/tags/0",
+                          @"result.items[1].tags", @"result.missing", @"result.next");
+  SBJsonPathExtractor *extractor = [[[SBJsonPathExtractor alloc] initWithPaths:paths] autorelease];
+  NSDictionary *values = [extractor valuesWithData:doc];
+  STAssertNotNil(values, @"extracted %@", extractor.errorTrace);
+  STAssertEqualObjects([values objectForKey:@"result.items[*].id"], 
+                       array_(nsni(1), nsni(2), nsni(3)), nil);
+  STAssertEqualObjects([values objectForKey:@"result.total"], nsni(3), nil);
+  STAssertEqualObjects([values objectForKey:@"/result/items/1/tags/0"], @"a", nil);
+  STAssertEqualObjects([values objectForKey:@"result.items[1].tags"], array_(@"a", @"b"), nil);
+  STAssertEqualObjects([values objectForKey:@"result.next"], [NSNull null], nil);
+  STAssertNil([values objectForKey:@"result.missing"], nil);
+  
+  STAssertNil([[[SBJsonPathExtractor alloc] initWithPaths:array_(@"a[b]")] autorelease], nil);
+  STAssertNil([extractor valuesWithData:[@"{\"result\": [1,]}" dataUsingEncoding:NSUTF8StringEncoding]], nil);
+  STAssertNotNil(extractor.errorTrace, nil);
+}
+
+- (void)testPathExtractorBenchmark {
+  NSData *corpus = _textCorpus(NO);
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  SBJsonPathExtractor *extractor = [[[SBJsonPathExtractor alloc] 
+                                     initWithPaths:array_(@"[*].id")] autorelease];
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  id o = [parser objectWithData:corpus];
+  NSLog(@"parse %lu bytes: %.3fs", (unsigned long)[corpus length], CFAbsoluteTimeGetCurrent() - start);
+  STAssertEquals([o count], (NSUInteger)2000, nil);
+  start = CFAbsoluteTimeGetCurrent();
+  o = [[extractor valuesWithData:corpus] objectForKey:@"[*].id"];
+  NSLog(@"extract [*].id from %lu bytes: %.3fs", (unsigned long)[corpus length], CFAbsoluteTimeGetCurrent() - start);
+  STAssertEquals([o count], (NSUInteger)2000, nil);
+  [pool release];
+}
+
+- (void)testWriteData {
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  NSString *tricky = [NSString stringWithFormat:@"q\"b\\c%C\n\t%C caf%C %C", 
+                      (unichar)0x1f, (unichar)0x01, (unichar)0xe9, (unichar)0x263a];
+  NSArray *o = array_(tricky, @"", nsni(-12), [NSNumber numberWithBool:YES], [NSNull null], 
+                      dict_(@"v", @"k"));
+  NSData *data = [writer dataWithObject:o];
+  STAssertNotNil(data, @"wrote %@", writer.errorTrace);
+  NSString *str = [writer stringWithObject:o];
+  STAssertEqualObjects(data, [str dataUsingEncoding:NSUTF8StringEncoding], @"same bytes as the string", nil);
+  STAssertTrue([str rangeOfString:@"\\u001f"].length, @"control characters as \\u escapes: %@", str);
+  STAssertEqualObjects([[[[SBJsonParser alloc] init] autorelease] objectWithData:data], o, @"round trips", nil);
+  
+  writer.humanReadable = YES;
+  STAssertEqualObjects([writer stringWithObject:array_(dict_(nsni(1), @"a"))], 
+                       @"[\n  {\n    \"a\" : 1\n  }\n]", nil);
+  STAssertNil([writer dataWithObject:@"scalar"], nil);
+}
+
+- (void)testWriteDataBenchmark {
+  NSMutableArray *params = [NSMutableArray array];
+  for (int i = 0; i < 20000; i++)
+    [params addObject:dict_(nsni(i), @"id", @"some \"quoted\" text", @"note", 
+                            [NSNumber numberWithDouble:i / 3.0], @"score")];
+  NSDictionary *call = dict_(@"items.save", @"method", params, @"params", @"1.1", @"version");
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  NSData *viaString = [[writer stringWithObject:call] dataUsingEncoding:NSUTF8StringEncoding];
+  CFAbsoluteTime mid = CFAbsoluteTimeGetCurrent();
+  NSData *data = [writer dataWithObject:call];
+  CFAbsoluteTime stop = CFAbsoluteTimeGetCurrent();
+  NSLog(@"write %lu bytes of params: string+encode %.3fs, data %.3fs (%.1f MB/s)", (unsigned long)[data length], 
+        mid - start, stop - mid, [data length] / (stop - mid) / 1e6);
+  STAssertEqualObjects(data, viaString, nil);
+  [pool release];
+}
+
+typedef struct {
+  NSMutableData *data;
+  NSUInteger chunks, largest, stopAfter;
+} DKChunkSink;
+
+static BOOL _collectChunk(const char *bytes, NSUInteger length, void *context) {
+  DKChunkSink *sink = context;
+  [sink->data appendBytes:bytes length:length];
+  sink->largest = MAX(sink->largest, length);
+  return ++sink->chunks != sink->stopAfter;
+}
+
+- (void)testWriteChunks {
+  NSMutableString *longString = [NSMutableString string];
+  for (int i = 0; i < 3000; i++)
+    [longString appendFormat:@"%d \"q\"\n%C%C ", i, (unichar)0xd83d, (unichar)0xde00];
+  NSArray *o = array_(longString, [NSArray arrayWithObject:[NSNumber numberWithInt:7]], 
+                      dict_(longString, @"again"));
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  NSData *whole = [writer dataWithObject:o];
+  
+  writer.chunkSize = 1000;
+  DKChunkSink sink = { [NSMutableData data], 0, 0, 0 };
+  STAssertTrue([writer writeObject:o toFunction:_collectChunk context:&sink], @"wrote %@", writer.errorTrace, nil);
+  STAssertEqualObjects(sink.data, whole, @"chunks add up to the document", nil);
+  STAssertTrue(sink.largest <= 1000, @"largest chunk %u", sink.largest, nil);
+  STAssertTrue(sink.chunks > [whole length] / 1000, @"%u chunks", sink.chunks, nil);
+  
+  DKChunkSink stopped = { [NSMutableData data], 0, 0, 2 };
+  STAssertFalse([writer writeObject:o toFunction:_collectChunk context:&stopped], nil);
+  STAssertEquals(stopped.chunks, (NSUInteger)2, @"no chunks after the function says stop", nil);
+  STAssertEquals([[writer.errorTrace lastObject] code], (NSInteger)EOUTPUT, nil);
+  
+  NSOutputStream *stream = [NSOutputStream outputStreamToMemory];
+  [stream open];
+  STAssertTrue([writer writeObject:o toStream:stream], nil);
+  STAssertEqualObjects([stream propertyForKey:NSStreamDataWrittenToMemoryStreamKey], whole, nil);
+  [stream close];
+}
+
+- (void)testWriteNumbers {
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  NSArray *o = array_([NSNumber numberWithLongLong:LLONG_MIN], [NSNumber numberWithLongLong:LLONG_MAX],
+                      [NSNumber numberWithUnsignedLongLong:ULLONG_MAX], nsni(0), nsni(-7),
+                      [NSNumber numberWithDouble:0.1], [NSNumber numberWithDouble:1.0 / 3],
+                      [NSNumber numberWithDouble:3.0], [NSNumber numberWithDouble:1e21],
+                      [NSNumber numberWithFloat:0.1f], [NSDecimalNumber decimalNumberWithString:@"1.000000000000000000001"]);
+  STAssertEqualObjects([writer stringWithObject:o],
+                       @"[-9223372036854775808,9223372036854775807,18446744073709551615,0,-7,"
+                       @"0.1,0.3333333333333333,3,1e+21,0.1,1.000000000000000000001]", nil);
+  
+  NSMutableArray *doubles = [NSMutableArray array];
+  for (int i = 0; i < 10000; i++)
+    [doubles addObject:[NSNumber numberWithDouble:(random() - RAND_MAX / 2) / (double)(random() + 1) * pow(10, i % 40 - 20)]];
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  NSArray *back = [parser objectWithData:[writer dataWithObject:doubles]];
+  for (NSUInteger i = 0; i < [doubles count]; i++)
+    STAssertEquals([[back objectAtIndex:i] doubleValue], [[doubles objectAtIndex:i] doubleValue], @"round trips", nil);
+  
+  STAssertNil([writer dataWithObject:array_([NSNumber numberWithDouble:NAN])], nil);
+  STAssertNil([writer dataWithObject:array_([NSNumber numberWithDouble:INFINITY])], nil);
+}
+
+- (void)testWriterBenchmark {
+  NSMutableArray *ints = [NSMutableArray array], *doubles = [NSMutableArray array];
+  NSMutableArray *ascii = [NSMutableArray array], *escaped = [NSMutableArray array];
+  for (int i = 0; i < 100000; i++) {
+    [ints addObject:[NSNumber numberWithInt:i * 7919 - 50000]];
+    [doubles addObject:[NSNumber numberWithDouble:i / 7.0]];
+    [ascii addObject:[NSString stringWithFormat:@"item %d", i]];
+    [escaped addObject:[NSString stringWithFormat:@"caf%C \"%d\"\n%C", (unichar)0xe9, i, (unichar)0x263a]];
+  }
+  NSDictionary *cases = dict_(ints, @"ints", doubles, @"doubles", ascii, @"short ascii", 
+                              escaped, @"escaped unicode");
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  for (NSString *name in cases) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    NSData *data = [writer dataWithObject:[cases objectForKey:name]];
+    CFAbsoluteTime stop = CFAbsoluteTimeGetCurrent();
+    NSLog(@"write 100000 %@: %.3fs (%.1f MB/s)", name, stop - start, [data length] / (stop - start) / 1e6);
+    STAssertNotNil(data, nil);
+    [pool release];
+  }
+}
+
+- (void)testModelDecoder {
+  SBJsonClassMapping *m = [SBJsonClassMapping mappingWithClass:[DKJSONTestItem class]];
+  STAssertTrue([m mapKeys:array_(@"name", @"score", @"ratio", @"flagged", @"big", @"tags")], nil);
+  STAssertTrue([m mapKey:@"id" toProperty:@"itemID"], nil);
+  STAssertTrue([m mapKey:@"children" toProperty:@"children" mapping:m], nil);
+  STAssertTrue([m mapKey:@"parent" toProperty:@"parent" mapping:m], nil);
+  STAssertFalse([m mapKey:@"x" toProperty:@"missing"], @"no such property");
+  STAssertFalse([m mapKey:@"x" toProperty:@"score" mapping:m], @"scalars have no nested mapping");
+
+  NSData *doc = [@"{\"id\": 7, \"extra\": {\"tags\": [1, {}]}, \"name\": \"se\\u0076en\", \"score\": 1.25,"
+                 @" \"ratio\": 5e-1, \"flagged\": true, \"big\": 18446744073709551615, \"tags\": [\"a\", null],"
+                 @" \"children\": [{\"id\": 8, \"name\": null}, {\"id\": 9.9, \"name\": 5, \"score\": 3}],"
+                 @" \"parent\": {\"id\": -1, \"parent\": null}}" dataUsingEncoding:NSUTF8StringEncoding];
+  SBJsonModelDecoder *decoder = [[[SBJsonModelDecoder alloc] initWithMapping:m] autorelease];
+  DKJSONTestItem *item = [decoder objectWithData:doc];
+  STAssertTrue([item isKindOfClass:[DKJSONTestItem class]], @"decoded %@", decoder.errorTrace);
+  STAssertEquals(item.itemID, 7, nil);
+  STAssertEqualObjects(item.name, @"seven", nil);
+  STAssertEquals(item.score, 1.25, nil);
+  STAssertEquals(item.ratio, 0.5f, nil);
+  STAssertTrue(item.flagged, nil);
+  STAssertEquals(item.big, ULLONG_MAX, nil);
+  STAssertEqualObjects(item.tags, array_(@"a", [NSNull null]), nil);
+  STAssertEquals([item.children count], (NSUInteger)2, nil);
+  DKJSONTestItem *child = [item.children lastObject];
+  STAssertTrue([child isKindOfClass:[DKJSONTestItem class]], nil);
+  STAssertEquals(child.itemID, 9, @"truncated", nil);
+  STAssertNil(child.name, @"a number isn't an NSString", nil);
+  STAssertEquals(child.score, 3.0, nil);
+  STAssertEquals(item.parent.itemID, -1, nil);
+  STAssertNil(item.parent.parent, nil);
+
+  NSArray *list = [decoder objectWithData:[@"[{\"id\": 1}, [{\"id\": 2}], 3]" 
+                                           dataUsingEncoding:NSUTF8StringEncoding]];
+  STAssertEquals([list count], (NSUInteger)3, @"decoded %@", decoder.errorTrace);
+  STAssertEquals([[list objectAtIndex:0] itemID], 1, nil);
+  STAssertEquals([[[list objectAtIndex:1] lastObject] itemID], 2, nil);
+  STAssertEqualObjects([list lastObject], nsni(3), nil);
+
+  // as a decodeFunction
+  NSData *bad = [@"{\"id\": 1,}" dataUsingEncoding:NSUTF8StringEncoding];
+  STAssertNil([decoder objectWithData:bad], nil);
+  STAssertTrue([[decoder :bad] isKindOfClass:[NSError class]], nil);
+  STAssertEquals([[decoder :doc] itemID], 7, nil);
+}
+
+- (void)testModelDecoderBenchmark {
+  NSData *corpus = _textCorpus(NO);
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  SBJsonClassMapping *m = [SBJsonClassMapping mappingWithClass:[DKJSONTestItem class]];
+  [m mapKey:@"id" toProperty:@"itemID"];
+  [m mapKeys:array_(@"body", @"kind")];
+  SBJsonModelDecoder *decoder = [[[SBJsonModelDecoder alloc] initWithMapping:m] autorelease];
+
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  NSMutableArray *items = [NSMutableArray array];
+  for (NSDictionary *d in [parser objectWithData:corpus]) {
+    DKJSONTestItem *item = [[DKJSONTestItem alloc] init];
+    item.itemID = [[d objectForKey:@"id"] intValue];
+    item.body = [d objectForKey:@"body"];
+    item.kind = [d objectForKey:@"kind"];
+    [items addObject:item];
+    [item release];
+  }
+  NSLog(@"parse and copy %lu bytes into models: %.3fs", (unsigned long)[corpus length], CFAbsoluteTimeGetCurrent() - start);
+  [pool release];
+
+  pool = [[NSAutoreleasePool alloc] init];
+  start = CFAbsoluteTimeGetCurrent();
+  NSArray *decoded = [decoder objectWithData:corpus];
+  NSLog(@"decode %lu bytes into models: %.3fs", (unsigned long)[corpus length], CFAbsoluteTimeGetCurrent() - start);
+  STAssertEquals([decoded count], (NSUInteger)2000, nil);
+  STAssertEquals([[decoded lastObject] itemID], 1999, nil);
+  STAssertEqualObjects([[decoded lastObject] kind], @"user", nil);
+  [pool release];
+}
+
+- (void)testMessagePack {
+  NSMutableString *longText = [NSMutableString string];
+  for (int i = 0; i < 100; i++)
+    [longText appendFormat:@"caf%C %d ", (unichar)0xe9, i];
+  NSMutableArray *many = [NSMutableArray array];
+  for (int i = 0; i < 70000; i++)
+    [many addObject:nsni(i % 3)];
+  NSDictionary *doc = dict_(array_(nsni(0), nsni(127), nsni(128), nsni(-32), nsni(-33), nsni(-129),
+                                   [NSNumber numberWithLongLong:-4000000000LL],
+                                   [NSNumber numberWithUnsignedLongLong:ULLONG_MAX]), @"ints",
+                            array_([NSNumber numberWithDouble:0.1], [NSNumber numberWithFloat:1.5f],
+                                   [NSNumber numberWithBool:YES], [NSNumber numberWithBool:NO]), @"others",
+                            array_(@"", @"short", longText, [NSNull null], 
+                                   [NSData dataWithBytes:"\0\1\2" length:3]), @"strings",
+                            many, @"many",
+                            dict_(dict_(nsni(1), @"x"), @"nested"), @"maps");
+  NSError *error = nil;
+  NSData *packed = [DKMessagePack dataWithObject:doc error:&error];
+  STAssertNotNil(packed, @"packed %@", error);
+  id back = [DKMessagePack objectWithData:packed error:&error];
+  STAssertEqualObjects(back, doc, @"round trip %@", error);
+  STAssertTrue([[back objectForKey:@"many"] isKindOfClass:[NSMutableArray class]], nil);
+  
+  const uint8_t expected[] = { 0x93, 0x01, 0xd0, 0xdf, 0xcd, 0x01, 0x00 };
+  packed = [DKMessagePack dataWithObject:array_(nsni(1), nsni(-32 - 1), nsni(256)) error:NULL];
+  STAssertEqualObjects(packed, [NSData dataWithBytes:expected length:sizeof(expected)], @"smallest forms", nil);
+  STAssertEqualObjects([DKMessagePack dataWithObject:[NSDate dateWithTimeIntervalSince1970:0] error:NULL],
+                       [DKMessagePack dataWithObject:[[NSDate dateWithTimeIntervalSince1970:0] proxyForJson] error:NULL],
+                       @"proxyForJson is used", nil);
+  
+  STAssertNil([DKMessagePack dataWithObject:[NSURL URLWithString:@"http://a/"] error:&error], nil);
+  STAssertEquals([error code], (NSInteger)DKMessagePackUnsupportedError, nil);
+  const char *bad[] = { "\x92\x01", "\xc1", "\xa2\xff\xfe", "\x01\x02", "\xdd\xff\xff\xff\xff" };
+  NSInteger codes[] = { DKMessagePackTruncatedError, DKMessagePackInvalidError, DKMessagePackInvalidError,
+                        DKMessagePackTrailingDataError, DKMessagePackTruncatedError };
+  for (int i = 0; i < 5; i++) {
+    error = nil;
+    STAssertNil([DKMessagePack objectWithBytes:bad[i] length:strlen(bad[i]) error:&error], @"rejects %d", i);
+    STAssertEquals([error code], codes[i], @"error for %d", i);
+  }
+}
+
+- (void)testMessagePackBenchmark {
+  NSData *corpora[2] = { _numberCorpus(), _textCorpus(NO) };
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  for (int i = 0; i < 2; i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    id o = [parser objectWithData:corpora[i]];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    NSData *json = [writer dataWithObject:o];
+    CFAbsoluteTime jsonWrite = CFAbsoluteTimeGetCurrent() - start;
+    start = CFAbsoluteTimeGetCurrent();
+    [parser objectWithData:json];
+    CFAbsoluteTime jsonRead = CFAbsoluteTimeGetCurrent() - start;
+    
+    start = CFAbsoluteTimeGetCurrent();
+    NSData *packed = [DKMessagePack dataWithObject:o error:NULL];
+    CFAbsoluteTime packWrite = CFAbsoluteTimeGetCurrent() - start;
+    start = CFAbsoluteTimeGetCurrent();
+    id back = [DKMessagePack objectWithData:packed error:NULL];
+    CFAbsoluteTime packRead = CFAbsoluteTimeGetCurrent() - start;
+    
+    NSLog(@"%@ corpus: JSON %lu bytes, write %.3fs, read %.3fs; MessagePack %lu bytes, write %.3fs, read %.3fs",
+          (i ? @"text" : @"number"), (unsigned long)[json length], jsonWrite, jsonRead, (unsigned long)[packed length], packWrite, packRead);
+    STAssertEquals([back count], [o count], nil);
+    [pool release];
+  }
+}
+
+- (void)testStructuralIndex {
+  const char *doc = "{\"a\\\"[\": [1, \"\\\\\", {}], \"b\":\"x,\"}";
+  SBJsonStructuralIndex index;
+  STAssertTrue(SBJsonStructuralIndexBuild(&index, doc, strlen(doc)), nil);
+  NSMutableString *found = [NSMutableString string];
+  for (size_t i = 0; i < index.count; i++)
+    [found appendFormat:@"%c", doc[index.offsets[i]]];
+  STAssertEqualObjects(found, @"{\"\":[,\"\",{}],\"\":\"\"}", @"escaped quotes and quoted structure skipped", nil);
+  SBJsonStructuralIndexFree(&index);
+}
+
+- (void)testIndexedParsing {
+  NSData *corpora[3] = { _numberCorpus(), _textCorpus(NO), _textCorpus(YES) };
+  SBJsonParser *recursive = [[[SBJsonParser alloc] init] autorelease];
+  recursive.indexedParsingThreshold = 0;
+  SBJsonParser *indexed = [[[SBJsonParser alloc] init] autorelease];
+  indexed.indexedParsingThreshold = 1;
+  indexed.parallelParsingThreshold = 0;
+  SBJsonParser *parallel = [[[SBJsonParser alloc] init] autorelease];
+  parallel.indexedParsingThreshold = parallel.parallelParsingThreshold = 1;
+  for (int i = 0; i < 3; i++) {
+    id expected = [recursive objectWithData:corpora[i]];
+    STAssertNotNil(expected, @"parsed %@", [recursive errorTrace]);
+    STAssertEqualObjects([indexed objectWithData:corpora[i]], expected, @"indexed corpus %d", i);
+    STAssertEqualObjects([parallel objectWithData:corpora[i]], expected, @"parallel corpus %d", i);
+  }
+  
+  NSArray *good = array_(@"[]", @"{}", @"[1 2]", @" [\"a\\\"b\", \"\\u00e9\\n\", {\"k\\\"\": [[], {}]}, \"caf\u00e9\"] ",
+                         @"[{\"a\": [1, {\"b\": null}]}, true, false, -1.5e3, \"x,]\", [\"\\\\\"], 7]");
+  for (NSString *json in good) {
+    id expected = [recursive objectWithString:json];
+    STAssertNotNil(expected, @"parsed %@", json);
+    STAssertEqualObjects([indexed objectWithString:json], expected, @"indexed %@", json);
+    STAssertEqualObjects([parallel objectWithString:json], expected, @"parallel %@", json);
+  }
+  
+  NSArray *bad = array_(@"", @"[1,]", @"{\"a\":1,}", @"{\"a\" 1}", @"[1]x", @"[+1]", @"[tru]",
+                        @"[\"a", @"{\"a\":", @"[01]", @"[1,,2]", @"[1, 2, 3,]", @"[[1}, 2, 3]", @"[1, \\\"2\"]");
+  for (NSString *json in bad) {
+    STAssertNil([recursive objectWithString:json], @"rejects %@", json);
+    STAssertNil([indexed objectWithString:json], @"indexed rejects %@", json);
+    STAssertNil([parallel objectWithString:json], @"parallel rejects %@", json);
+    STAssertEquals([[[parallel errorTrace] objectAtIndex:0] code],
+                   [[[recursive errorTrace] objectAtIndex:0] code], @"same error for %@", json);
+  }
+  
+  parallel.maxDepth = 2;
+  STAssertNotNil([parallel objectWithString:@"[[1], [2], [3]]"], nil);
+  STAssertNil([parallel objectWithString:@"[[1], [[2]], [3]]"], @"depth limit", nil);
+}
+
+- (void)testKeyCacheCollisions {
+  // key0, key556 and key901 hash to the same slot of the 512 entry key cache,
+  // so each key evicts the one of the object around it while its value is scanned
+  NSString *json = @"{\"key0\": {\"key556\": {\"key901\": 1}, \"key0\": 2}, \"key556\": [{\"key0\": 3}]}";
+  id expected = dict_(dict_(dict_(nsni(1), @"key901"), @"key556", nsni(2), @"key0"), @"key0",
+                      array_(dict_(nsni(3), @"key0")), @"key556");
+  SBJsonParser *recursive = [[[SBJsonParser alloc] init] autorelease];
+  recursive.indexedParsingThreshold = 0;
+  SBJsonParser *indexed = [[[SBJsonParser alloc] init] autorelease];
+  indexed.indexedParsingThreshold = 1;
+  for (int i = 0; i < 3; i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    STAssertEqualObjects([recursive objectWithString:json], expected, @"recursive pass %d", i);
+    STAssertEqualObjects([indexed objectWithString:json], expected, @"indexed pass %d", i);
+    [pool release];
+  }
+  STAssertEqualObjects([recursive keyWithBytes:"\"key556\"" length:8], @"key556", nil);
+}
+
+- (void)testIndexedParsingBenchmark {
+  // one top level array of both kinds of item
+  NSMutableData *corpus = [NSMutableData dataWithData:_numberCorpus()];
+  NSData *text = _textCorpus(NO);
+  for (int i = 0; i < 4; i++) {
+    [corpus replaceBytesInRange:NSMakeRange([corpus length] - 1, 1) withBytes:"," length:1];
+    [corpus appendData:[text subdataWithRange:NSMakeRange(1, [text length] - 1)]];
+  }
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  NSUInteger thresholds[3][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 } };
+  NSString *engines[3] = { @"recursive", @"indexed", @"parallel" };
+  for (int i = 0; i < 3; i++) {
+    parser.indexedParsingThreshold = thresholds[i][0];
+    parser.parallelParsingThreshold = thresholds[i][1];
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    id o = [parser objectWithData:corpus];
+    NSLog(@"parse %lu bytes (%@): %.3fs", (unsigned long)[corpus length], engines[i], CFAbsoluteTimeGetCurrent() - start);
+    STAssertEquals([o count], (NSUInteger)28000, nil);
+    [pool release];
+  }
+}
+
+- (void)testDocument {
+  NSData *corpora[2] = { _numberCorpus(), _textCorpus(YES) };
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  SBJsonDocumentParser *documents = [[[SBJsonDocumentParser alloc] init] autorelease];
+  for (int i = 0; i < 2; i++) {
+    SBJsonDocument *doc = [documents documentWithData:corpora[i]];
+    STAssertNotNil(doc, @"parsed %@", [documents errorTrace]);
+    STAssertEqualObjects([doc root], [parser objectWithData:corpora[i]], @"corpus %d", i);
+  }
+  
+  NSString *json = @"{\"a\\\"\": [1, -2.5e3, 12345678901234567890, -9223372036854775808, \"b\\u00e9\\u0000\", true, null, false],"
+                   @" \"caf\u00e9\": {\"\": []}, \"k\": 2}";
+  NSData *data = [json dataUsingEncoding:NSUTF8StringEncoding];
+  NSDictionary *root = [[documents documentWithData:data] root];
+  STAssertEqualObjects(root, [parser objectWithData:data], nil);
+  STAssertFalse([root isKindOfClass:[NSMutableDictionary class]], @"immutable", nil);
+  STAssertNil([root objectForKey:@"missing"], nil);
+  NSArray *a = [root objectForKey:@"a\""];
+  STAssertTrue([[a objectAtIndex:2] isKindOfClass:[NSDecimalNumber class]], @"big integers stay exact", nil);
+  STAssertEquals([[a objectAtIndex:3] longLongValue], LLONG_MIN, nil);
+  STAssertEquals([[a objectAtIndex:4] length], (NSUInteger)3, @"escaped NUL kept", nil);
+  STAssertThrows([a objectAtIndex:8], nil);
+  
+  NSData *repeatedData = [@"{\"k\": 1, \"j\": 0, \"k\": 2, \"k\": [3]}" dataUsingEncoding:NSUTF8StringEncoding];
+  NSDictionary *repeated = [[documents documentWithData:repeatedData] root];
+  STAssertEqualObjects([repeated objectForKey:@"k"], array_(nsni(3)), @"last of repeated keys", nil);
+  STAssertEquals([repeated count], (NSUInteger)2, @"repeated keys counted once", nil);
+  STAssertEquals([[repeated allKeys] count], (NSUInteger)2, @"and enumerated once", nil);
+  STAssertEqualObjects(repeated, [parser objectWithData:repeatedData], nil);
+  
+  // large objects look their keys up in a table, rebuilt when keys repeat
+  NSMutableString *large = [NSMutableString stringWithString:@"{\"k7\": -1"];
+  for (int i = 0; i < 100; i++)
+    [large appendFormat:@", \"k%d\": %d", i, i];
+  [large appendString:@"}"];
+  NSData *largeData = [large dataUsingEncoding:NSUTF8StringEncoding];
+  NSDictionary *indexed = [[documents documentWithData:largeData] root];
+  STAssertEquals([indexed count], (NSUInteger)100, nil);
+  STAssertEqualObjects(indexed, [parser objectWithData:largeData], nil);
+  for (NSString *k in indexed)
+    STAssertEqualObjects([indexed objectForKey:k], nsni([[k substringFromIndex:1] intValue]), @"%@", k);
+  STAssertNil([indexed objectForKey:@"k100"], nil);
+  STAssertTrue([indexed allKeys] == [indexed allKeys], @"key strings made once", nil);
+  
+  // the document outlives the parser and its buffers
+  SBJsonDocumentParser *temporary = [[SBJsonDocumentParser alloc] init];
+  SBJsonDocument *doc = [temporary documentWithData:[NSMutableData dataWithData:data]];
+  [temporary release];
+  STAssertEqualObjects([doc root], root, nil);
+  
+  NSArray *bad = array_(@"[1,]", @"{\"a\" 1}", @"[1]x", @"\"str\"", @"[\"a", @"[01]");
+  for (NSString *b in bad)
+    STAssertNil([documents documentWithData:[b dataUsingEncoding:NSUTF8StringEncoding]], @"rejects %@", b);
+  STAssertNil([documents documentWithData:[NSData dataWithBytes:"[\"\xC3\x28\"]" length:6]], @"invalid UTF-8", nil);
+  STAssertEquals([[[documents errorTrace] lastObject] code], (NSInteger)EUNICODE, nil);
+}
+
+- (void)testDocumentBenchmark {
+  NSData *corpus = _numberCorpus();
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  SBJsonDocumentParser *documents = [[[SBJsonDocumentParser alloc] init] autorelease];
+  for (int i = 0; i < 2; i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    id o = i ? [[documents documentWithData:corpus] retain] : [[parser objectWithData:corpus] retain];
+    CFAbsoluteTime parse = CFAbsoluteTimeGetCurrent() - start;
+    [pool release];
+    start = CFAbsoluteTimeGetCurrent();
+    [o release];
+    NSLog(@"%@ of %lu bytes: parse %.3fs, free %.3fs", (i ? @"SBJsonDocument" : @"SBJsonParser"),
+          (unsigned long)[corpus length], parse, CFAbsoluteTimeGetCurrent() - start);
+  }
+  
+  SBJsonDocument *doc = [documents documentWithData:corpus];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  double sum = 0;
+  for (NSDictionary *item in [doc root])
+    sum += [[item objectForKey:@"lat"] doubleValue];
+  NSLog(@"SBJsonDocument lookup in every element: %.3fs (sum %f)", CFAbsoluteTimeGetCurrent() - start, sum);
+}
+
+static NSData *_nestedCorpus(NSUInteger levels) {
+  NSMutableData *data = [NSMutableData data];
+  for (NSUInteger i = 0; i < levels; i++)
+    [data appendBytes:(i % 2 ? "{\"k\": " : "[") length:(i % 2 ? 6 : 1)];
+  [data appendBytes:"1" length:1];
+  for (NSUInteger i = levels; i-- > 0; )
+    [data appendBytes:(i % 2 ? "}" : "]") length:1];
+  return data;
+}
+
+// Runs on a thread with a small stack, through the index and on several threads if asked to
+- (void)_parseNested:(NSMutableDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  parser.maxDepth = 0;
+  if ([job objectForKey:@"indexed"])
+    parser.indexedParsingThreshold = parser.parallelParsingThreshold = 1;
+  id o = [parser objectWithData:[job objectForKey:@"data"]];
+  if (o)
+    [job setObject:o forKey:@"result"];
+  [pool release];
+}
+
+- (id)_nestedResult:(NSMutableDictionary *)job {
+  NSThread *thread = [[[NSThread alloc] initWithTarget:self selector:@selector(_parseNested:) object:job] autorelease];
+  [thread setStackSize:512 * 1024];
+  [thread start];
+  // the job is only read again once the thread is done with it
+  while (![thread isFinished])
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+  return [job objectForKey:@"result"];
+}
+
+static NSUInteger _nestedLevels(id o) {
+  NSUInteger levels = 0;
+  for (; [o isKindOfClass:[NSArray class]] || [o isKindOfClass:[NSDictionary class]]; levels++)
+    o = [o isKindOfClass:[NSArray class]] ? [o lastObject] : [o objectForKey:@"k"];
+  return [o isEqual:nsni(1)] ? levels : 0;
+}
+
+- (void)testDeepNesting {
+  id o = [self _nestedResult:[NSMutableDictionary dictionaryWithObject:_nestedCorpus(20000) forKey:@"data"]];
+  STAssertEquals(_nestedLevels(o), (NSUInteger)20000, @"parsed on a 512KB stack", nil);
+  
+  // the same through the index, in parts built on the parallel path's own threads
+  NSMutableData *deep = [NSMutableData dataWithBytes:"[" length:1];
+  for (int i = 0; i < 4; i++) {
+    if (i)
+      [deep appendBytes:"," length:1];
+    [deep appendData:_nestedCorpus(20000)];
+  }
+  [deep appendBytes:"]" length:1];
+  NSMutableDictionary *job = [NSMutableDictionary dictionaryWithObject:deep forKey:@"data"];
+  [job setObject:[NSNumber numberWithBool:YES] forKey:@"indexed"];
+  o = [self _nestedResult:job];
+  STAssertEquals([o count], (NSUInteger)4, nil);
+  for (id element in o)
+    STAssertEquals(_nestedLevels(element), (NSUInteger)20000, @"indexed on a 512KB stack", nil);
+  
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  STAssertNotNil([parser objectWithData:_nestedCorpus(512)], @"parsed %@", [parser errorTrace]);
+  STAssertNil([parser objectWithData:_nestedCorpus(513)], nil);
+  STAssertEquals([[[parser errorTrace] objectAtIndex:0] code], (NSInteger)EDEPTH, @"depth limit", nil);
+  
+  // the error, then one for each enclosing container
+  STAssertNil([parser objectWithString:@"{\"a\": [1, {\"b\": tru}]}"], nil);
+  NSArray *trace = [[parser errorTrace] valueForKey:@"localizedDescription"];
+  STAssertEqualObjects(trace, array_(@"Expected 'true'", @"Object value expected for key: b",
+                                     @"Expected value while parsing array", @"Object value expected for key: a"), nil);
+  STAssertNil([parser objectWithString:@"[[1, 2,]]"], nil);
+  trace = [[parser errorTrace] valueForKey:@"localizedDescription"];
+  STAssertEqualObjects(trace, array_(@"Trailing comma disallowed in array", @"Expected value while parsing array"), nil);
+  
+  parser.indexedParsingThreshold = 1;
+  STAssertNil([parser objectWithString:@"{\"a\": [1, {\"b\": tru}]}"], nil);
+  trace = [[parser errorTrace] valueForKey:@"localizedDescription"];
+  STAssertEqualObjects(trace, array_(@"Expected 'true'", @"Object value expected for key: b",
+                                     @"Expected value while parsing array", @"Object value expected for key: a"),
+                       @"the same through the index", nil);
+}
+
+- (void)testDeepNestingBenchmark {
+  // a thousand documents of a few hundred levels
+  NSMutableData *corpus = [NSMutableData dataWithBytes:"[" length:1];
+  NSData *nested = _nestedCorpus(400);
+  for (int i = 0; i < 1000; i++) {
+    if (i)
+      [corpus appendBytes:"," length:1];
+    [corpus appendData:nested];
+  }
+  [corpus appendBytes:"]" length:1];
+  // and the same through the index
+  SBJsonParser *parser = [[[SBJsonParser alloc] init] autorelease];
+  parser.parallelParsingThreshold = 0;
+  NSUInteger thresholds[2] = { 0, 1 };
+  NSString *engines[2] = { @"iterative", @"indexed" };
+  for (int i = 0; i < 2; i++) {
+    parser.indexedParsingThreshold = thresholds[i];
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    id o = [parser objectWithData:corpus];
+    NSLog(@"parse %lu bytes nested 400 deep (%@): %.3fs", (unsigned long)[corpus length], engines[i],
+          CFAbsoluteTimeGetCurrent() - start);
+    STAssertEquals([o count], (NSUInteger)1000, @"parsed %@", [parser errorTrace]);
+    [pool release];
+  }
+}
+
 @end
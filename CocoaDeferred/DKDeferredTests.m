@@ -8,6 +8,10 @@
 #import "DKDeferredTests.h"
 #import <DeferredKit/DeferredKit.h>
 
+// tests that hit this need DKTestServer.py running
+#define DKTestServerSocket @"unix:///tmp/DKTestServer.sock"
+#define DKTestServerURL @"http://127.0.0.1:8765"
+
 
 @interface DKDeferredTests : GTMTestCase {
   // pause 
@@ -46,6 +50,34 @@
 - (void)testMappedPriorityQueue;
 - (void)testMappedPriorityQueueWithDeferreds;
 - (void)testDeferredPausedPool;
+- (void)testRetryPolicy;
+- (void)testDeferredURLRetry;
+- (void)testDeferredURLHedge;
+- (void)testURLConnectionScheduler;
+- (void)testCachedURLRevalidation;
+- (void)testDeferredURLGzip;
+- (void)testDeferredURLGzipIncomplete;
+- (void)testDeferredURLGzipMembers;
+- (void)testDeferredURLMetrics;
+- (void)testLoadJSONDoc;
+- (void)testLoadJSONDocPaths;
+- (void)testLoadJSONDocBothPaths;
+- (void)testJSONProxyStreamedBody;
+- (void)testJSONProxyBatch;
+- (void)testJSONProxyNamespaces;
+- (void)testJSONProxyUnixSocket;
+- (void)testJSONProxyCachePolicy;
+- (void)testJSONProxyMessagePack;
+- (void)testCacheMessagePack;
+- (void)testLoadJSONLines;
+- (void)testLoadJSONLinesBackpressure;
+- (void)testLoadJSONLinesErrors;
+- (void)testLoadJSONLinesCancel;
+- (id)_cbAppendChunk:(id)buffer :(id)chunk;
+- (id)_cbRecordOrder:(id)order :(id)name :(id)results;
+- (id)_cbCollectBatch:(id)batches :(id)batch;
+- (id)_cbCollectBatchSlowly:(id)context :(id)batch;
+- (id)_cbStopWith:(id)error :(id)batch;
 
 @end
 
@@ -302,4 +334,503 @@
   NSLog(@"got... %@", r);
 }
 
+- (void)testRetryPolicy {
+  DKRetryPolicy *p = [DKRetryPolicy retryPolicy];
+  p.jitter = 0.0;
+  STAssertEquals([p delayForAttempt:1], 0.5, @"first backoff", nil);
+  STAssertEquals([p delayForAttempt:3], 2.0, @"exponential backoff", nil);
+  p.maxDelay = 1.0;
+  STAssertEquals([p delayForAttempt:10], 1.0, @"capped backoff", nil);
+  p.jitter = 0.5;
+  for (int i = 0; i < 20; i++) {
+    NSTimeInterval delay = [p delayForAttempt:2];
+    STAssertTrue(delay >= 0.5 && delay <= 1.0, @"jittered backoff", nil);
+  }
+  STAssertTrue([p shouldRetryStatus:503 attempt:1], @"retryable status", nil);
+  STAssertFalse([p shouldRetryStatus:404 attempt:1], @"non-retryable status", nil);
+  STAssertFalse([p shouldRetryStatus:503 attempt:3], @"attempts exhausted", nil);
+  NSError *timeout = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+  NSError *badURL = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadURL userInfo:nil];
+  STAssertTrue([p shouldRetryError:timeout attempt:1], @"retryable error", nil);
+  STAssertFalse([p shouldRetryError:badURL attempt:1], @"non-retryable error", nil);
+  NSMutableURLRequest *post = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:DKTestServerURL]];
+  [post setHTTPMethod:@"POST"];
+  STAssertFalse([p shouldRetryRequest:post], @"POST is not retried", nil);
+  STAssertEquals([p hedgeDelayForRequest:post], 0.0, @"hedging off by default", nil);
+  
+  DKLatencyHistogram *h = [[[DKLatencyHistogram alloc] init] autorelease];
+  for (int j = 0; j < 95; j++)
+    [h addSample:0.010];
+  for (int k = 0; k < 5; k++)
+    [h addSample:2.0];
+  STAssertTrue([h percentile:0.5] >= 0.010 && [h percentile:0.5] < 0.013, @"median bucket", nil);
+  STAssertTrue([h percentile:0.99] >= 2.0 && [h percentile:0.99] < 2.5, @"tail bucket", nil);
+}
+
+- (void)testDeferredURLRetry {
+  DKRetryPolicy *p = [DKRetryPolicy retryPolicy];
+  p.baseDelay = 0.05;
+  NSString *u = [NSString stringWithFormat:@"%@/flaky?key=%@&fail=2&status=503", DKTestServerURL, _uuid1()];
+  DKDeferredURLConnection *d = [[[DKDeferredURLConnection alloc]
+                                 initRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:u]]
+                                 decodeFunction:nil retryPolicy:p paused:NO] autorelease];
+  id r = waitForDeferred(d);
+  STAssertTrue([r isKindOfClass:[NSData class]], @"retried to success", nil);
+  STAssertEquals(d.attempts, 3, @"one attempt per failure plus the success", nil);
+  STAssertEquals(d.statusCode, (NSInteger)200, @"final status", nil);
+  
+  u = [NSString stringWithFormat:@"%@/flaky?key=%@&fail=5&status=0", DKTestServerURL, _uuid1()];
+  d = [[[DKDeferredURLConnection alloc]
+        initRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:u]]
+        decodeFunction:nil retryPolicy:p paused:NO] autorelease];
+  r = waitForDeferred(d);
+  STAssertTrue([r isKindOfClass:[NSError class]], @"errback once attempts are exhausted", nil);
+  STAssertEquals(d.attempts, 3, @"maxAttempts", nil);
+}
+
+- (void)testDeferredURLHedge {
+  DKRetryPolicy *p = [DKRetryPolicy hedgedRetryPolicy];
+  p.hedgeDelay = 0.2;
+  p.hedgeMinSamples = 1000;
+  NSString *u = [NSString stringWithFormat:@"%@/slow?key=%@&delay=5&times=1", DKTestServerURL, _uuid1()];
+  NSDate *start = [NSDate date];
+  DKDeferredURLConnection *d = [[[DKDeferredURLConnection alloc]
+                                 initRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:u]]
+                                 decodeFunction:nil retryPolicy:p paused:NO] autorelease];
+  id r = waitForDeferred(d);
+  STAssertTrue([r isKindOfClass:[NSData class]], @"hedged result", nil);
+  STAssertTrue(-[start timeIntervalSinceNow] < 2.0, @"hedge answered before the slow request", nil);
+  STAssertEquals([DKDeferredURLConnection requestCount], 0, @"slower connection was cancelled", nil);
+}
+
+- (id)_cbRecordOrder:(id)order :(id)name :(id)results {
+  [order addObject:name];
+  return results;
+}
+
+- (void)testURLConnectionScheduler {
+  DKURLConnectionScheduler *s = [[[DKURLConnectionScheduler alloc] init] autorelease];
+  s.maxConnections = 3;
+  s.maxConnectionsPerHost = 2;
+  NSMutableArray *ds = [NSMutableArray array];
+  for (int i = 0; i < 5; i++) {
+    [ds addObject:[s loadURL:[NSString stringWithFormat:
+                              @"%@/slow?key=%@&delay=0.5", DKTestServerURL, _uuid1()]
+                    priority:DKURLPriorityNormal]];
+  }
+  for (int i = 0; i < 2; i++) {
+    [ds addObject:[s loadURL:[NSString stringWithFormat:
+                              @"http://localhost:8765/slow?key=%@&delay=0.5", _uuid1()]
+                    priority:DKURLPriorityNormal]];
+  }
+  // two for the busy host, the other host still gets a slot
+  STAssertEquals([s inFlight], 3, @"global limit", nil);
+  STAssertEquals([s waiting], 4, @"waiting loads", nil);
+  waitForDeferred([DKDeferredList deferredList:ds]);
+  STAssertEquals([s inFlight], 0, @"all loads finished", nil);
+  STAssertEquals([s waiting], 0, @"nothing left waiting", nil);
+  
+  // interactive loads jump ahead of background loads for the same host
+  NSMutableArray *order = [NSMutableArray array];
+  [s setMaxConnections:1 forHost:@"127.0.0.1"];
+  NSString *u = [NSString stringWithFormat:@"%@/slow?key=%@&delay=0.5", DKTestServerURL, _uuid1()];
+  DKDeferred *first = [s loadURL:u priority:DKURLPriorityNormal];
+  DKDeferred *bg = [[s loadURL:u priority:DKURLPriorityBackground]
+                    addBoth:curryTS(self, @selector(_cbRecordOrder:::), order, @"background")];
+  DKDeferred *fg = [[s loadURL:u priority:DKURLPriorityInteractive]
+                    addBoth:curryTS(self, @selector(_cbRecordOrder:::), order, @"interactive")];
+  waitForDeferred([DKDeferredList deferredList:array_(first, bg, fg)]);
+  STAssertEqualObjects(order, array_(@"interactive", @"background"), @"priority order", nil);
+}
+
+- (void)testCachedURLRevalidation {
+  NSString *key = _uuid1();
+  NSString *u = [NSString stringWithFormat:@"%@/cached?key=%@&max_age=0", DKTestServerURL, key];
+  NSString *stats = [NSString stringWithFormat:@"%@/stats?key=%@", DKTestServerURL, key];
+  [[DKDeferredCache sharedCache] deleteValueForKey:u];
+  id r = waitForDeferred([DKDeferred loadURL:u cached:YES]);
+  STAssertEqualObjects([[[NSString alloc] initWithData:r encoding:NSUTF8StringEncoding] autorelease],
+                       @"cached body", @"first load", nil);
+  DKDeferredCacheEntry *entry = waitForDeferred([[DKDeferredCache sharedCache] entryForKey:u]);
+  STAssertTrue([entry isKindOfClass:[DKDeferredCacheEntry class]], @"stale entry kept", nil);
+  STAssertTrue([entry canRevalidate], @"etag stored", nil);
+  
+  // expired (max-age=0), so this is a conditional request answered with a 304
+  r = waitForDeferred([DKDeferred loadURL:u cached:YES]);
+  STAssertEqualObjects([[[NSString alloc] initWithData:r encoding:NSUTF8StringEncoding] autorelease],
+                       @"cached body", @"body served from cache", nil);
+  r = waitForDeferred([DKDeferred loadURL:stats]);
+  STAssertEqualObjects([[[NSString alloc] initWithData:r encoding:NSUTF8StringEncoding] autorelease],
+                       @"full=1 notmodified=1", @"revalidated, not downloaded", nil);
+}
+
+- (id)_cbAppendChunk:(id)buffer :(id)chunk {
+  [buffer appendData:chunk];
+  return nil;
+}
+
+- (void)testDeferredURLGzip {
+  NSMutableData *streamed = [NSMutableData data];
+  NSString *u = [NSString stringWithFormat:@"%@/gzip?n=200000", DKTestServerURL];
+  DKDeferredURLConnection *d = [DKDeferredURLConnection deferredURLConnection:u];
+  d.dataCallback = curryTS(self, @selector(_cbAppendChunk::), streamed);
+  id r = waitForDeferred(d);
+  STAssertEquals([r length], (NSUInteger)200000, @"body inflated", nil);
+  STAssertEqualObjects(streamed, r, @"streamed chunks add up to the body", nil);
+  STAssertTrue(!memcmp([r bytes], "0123456789abcdef", 16), @"decoded content", nil);
+}
+
+// several gzip members one after another, and a first chunk too short to tell the format by
+- (void)testDeferredURLGzipMembers {
+  NSString *u = [NSString stringWithFormat:@"%@/gzip?n=200000&members=3", DKTestServerURL];
+  id r = waitForDeferred([DKDeferredURLConnection deferredURLConnection:u]);
+  STAssertTrue([r isKindOfClass:[NSData class]], @"all members inflated: %@", r);
+  STAssertEquals([r length], (NSUInteger)200000, nil);
+  STAssertTrue(!memcmp((const char *)[r bytes] + 199984, "0123456789abcdef", 16), @"decoded content", nil);
+  
+  u = [NSString stringWithFormat:@"%@/gzip?n=200000&members=2&split=1", DKTestServerURL];
+  r = waitForDeferred([DKDeferredURLConnection deferredURLConnection:u]);
+  STAssertTrue([r isKindOfClass:[NSData class]], @"a 1-byte first chunk: %@", r);
+  STAssertEquals([r length], (NSUInteger)200000, nil);
+}
+
+- (void)testDeferredURLGzipIncomplete {
+  NSString *u = [NSString stringWithFormat:@"%@/gzip?n=200000&cut=8", DKTestServerURL];
+  id r = waitForDeferred([DKDeferredURLConnection deferredURLConnection:u]);
+  STAssertTrue([r isKindOfClass:[NSError class]], @"cut off before the end of the stream: %@", r);
+  u = [NSString stringWithFormat:@"%@/gzip?n=200000&junk=16", DKTestServerURL];
+  r = waitForDeferred([DKDeferredURLConnection deferredURLConnection:u]);
+  STAssertTrue([r isKindOfClass:[NSError class]], @"bytes after the end of the stream: %@", r);
+}
+
+- (void)testLoadJSONDoc {
+  NSString *u = [NSString stringWithFormat:@"%@/json?n=20000", DKTestServerURL];
+  id r = waitForDeferred([DKDeferred loadJSONDoc:u]);
+  STAssertTrue([r isKindOfClass:[NSArray class]], @"decoded while streaming: %@", r);
+  STAssertEquals([r count], (NSUInteger)20000, nil);
+  STAssertEqualObjects([[r lastObject] objectForKey:@"name"], @"item 19999", nil);
+  STAssertEqualObjects([[[r lastObject] objectForKey:@"tags"] lastObject], @"b\n\"c\"", nil);
+}
+
+// what arrives through the data callback is decoded as the whole body would be
+- (void)testLoadJSONDocBothPaths {
+  NSArray *bodies = array_(@"[1, 2]", @"[1 2]", @"{\"a\": 1 \"b\": [2 3]}", @"[1,]", @"[1]x", @"{\"a\": 1 ]");
+  for (NSString *body in bodies) {
+    NSString *u = [NSString stringWithFormat:@"%@/json?body=%@", DKTestServerURL,
+                   [body stringByAddingPercentEscapesUsingEncoding:NSUTF8StringEncoding]];
+    id streamed = waitForDeferred([DKDeferred loadJSONDoc:u]);
+    id buffered = _decodeJSON([body dataUsingEncoding:NSUTF8StringEncoding]);
+    if ([buffered isKindOfClass:[NSError class]])
+      STAssertTrue([streamed isKindOfClass:[NSError class]], @"both reject %@: %@", body, streamed);
+    else
+      STAssertEqualObjects(streamed, buffered, @"both accept %@", body);
+  }
+}
+
+- (void)testLoadJSONDocPaths {
+  NSString *u = [NSString stringWithFormat:@"%@/json?n=500", DKTestServerURL];
+  id r = waitForDeferred([DKDeferred loadJSONDoc:u paths:array_(@"[*].id", @"[499].name")]);
+  STAssertTrue([r isKindOfClass:[NSDictionary class]], @"extracted: %@", r);
+  STAssertEquals([[r objectForKey:@"[*].id"] count], (NSUInteger)500, nil);
+  STAssertEqualObjects([r objectForKey:@"[499].name"], @"item 499", nil);
+}
+
+- (void)testDeferredURLMetrics {
+  NSString *u = [NSString stringWithFormat:@"%@/slow?key=%@&delay=0.3", DKTestServerURL, _uuid1()];
+  DKDeferredURLConnection *d = [DKDeferredURLConnection deferredURLConnection:u];
+  waitForDeferred(d);
+  DKURLConnectionMetrics *m = d.metrics;
+  STAssertEqualObjects(m.host, @"127.0.0.1", @"host", nil);
+  STAssertTrue([m timeToFirstByte] >= 0.3, @"server latency is first byte time", nil);
+  STAssertTrue([m queueTime] < 0.1, @"not queued", nil);
+  STAssertTrue([m totalTime] >= [m timeToFirstByte], @"total covers every phase", nil);
+  STAssertEquals(m.bytesReceived, 2LL, @"bytes on the wire", nil);
+  STAssertEquals(m.attempts, 1, @"one attempt", nil);
+  STAssertTrue([[DKDeferredURLConnection latencyHistogramForHost:@"127.0.0.1"
+                                                           phase:DKURLPhaseFirstByte] count] > 0,
+               @"aggregated per host", nil);
+}
+
+- (void)testJSONProxyStreamedBody {
+  NSMutableArray *params = [NSMutableArray array];
+  for (int i = 0; i < 20000; i++)
+    [params addObject:dict_(nsni(i), @"id", @"some \"quoted\" text", @"note")];
+  id service = [DKDeferred jsonService:[NSString stringWithFormat:@"%@/rpc", DKTestServerURL]];
+  [service setStreamsRequestBody:YES];
+  id r = waitForDeferred([[service items] save:params]);
+  STAssertTrue([r isKindOfClass:[NSDictionary class]], @"response: %@", r, nil);
+  NSDictionary *result = [r objectForKey:@"result"];
+  STAssertEqualObjects([result objectForKey:@"method"], @"items.save", @"namespace kept the setting", nil);
+  STAssertEqualObjects([result objectForKey:@"chunked"], [NSNumber numberWithBool:YES], @"sent from a body stream", nil);
+  STAssertEqualObjects([result objectForKey:@"params"], params, @"whole body arrived", nil);
+}
+
+- (void)testJSONProxyBatch {
+  id service = [DKDeferred jsonService:[NSString stringWithFormat:@"%@/rpc", DKTestServerURL]];
+  [service setBatchWindow:0.1];
+  [service setMaxBatchSize:10];
+  NSMutableArray *calls = [NSMutableArray array];
+  for (int i = 0; i < 25; i++)
+    [calls addObject:[[service items] get:array_(nsni(i))]];
+  DKDeferred *failed = [[service items] fail:array_(nsni(0))];
+  DKDeferred *dropped = [service drop:array_(nsni(0))];
+  
+  for (int i = 0; i < 25; i++) {
+    id r = waitForDeferred([calls objectAtIndex:i]);
+    STAssertTrue([r isKindOfClass:[NSDictionary class]], @"response: %@", r, nil);
+    NSDictionary *result = [r objectForKey:@"result"];
+    STAssertEqualObjects([result objectForKey:@"method"], @"items.get", @"method", nil);
+    STAssertEqualObjects([result objectForKey:@"params"], array_(nsni(i)), @"matched by id", nil);
+    STAssertEqualObjects([result objectForKey:@"batch"], nsni(i < 20 ? 10 : 7), 
+                         @"two full batches, then the rest when the window closes", nil);
+  }
+  id err = waitForDeferred(failed);
+  STAssertTrue([err isKindOfClass:[NSError class]], @"error response errs back: %@", err, nil);
+  STAssertEqualObjects([[[err userInfo] objectForKey:@"error"] objectForKey:@"message"], @"failed", nil);
+  STAssertTrue([waitForDeferred(dropped) isKindOfClass:[NSError class]], @"missing response errs back", nil);
+}
+
+- (void)testJSONProxyNamespaces {
+  id service = [DKDeferred jsonService:[NSString stringWithFormat:@"%@/rpc", DKTestServerURL]];
+  id items = [service items];
+  STAssertTrue(items == [service items], @"namespace proxies are kept", nil);
+  STAssertTrue([items tags] == [[service items] tags], @"at every level", nil);
+  
+  id first = waitForDeferred([[items tags] get:array_(nsni(1))]);
+  id second = waitForDeferred([[items tags] get:array_(nsni(2))]);
+  STAssertEqualObjects([[first objectForKey:@"result"] objectForKey:@"method"], @"items.tags.get", nil);
+  STAssertEqualObjects([[second objectForKey:@"result"] objectForKey:@"method"], @"items.tags.get", 
+                       @"cached name", nil);
+  STAssertFalse([[first objectForKey:@"id"] isEqual:[second objectForKey:@"id"]], @"fresh id per call", nil);
+  
+  [service setStreamsRequestBody:YES];
+  STAssertTrue([[items tags] streamsRequestBody], @"setting reaches existing namespaces", nil);
+}
+
+- (void)testJSONProxyUnixSocket {
+  id service = [DKDeferred jsonService:DKTestServerSocket];
+  DKDeferred *slow = [[service items] sleep:array_([NSNumber numberWithDouble:0.3])];
+  DKDeferred *fast = [[service items] get:array_(nsni(7))];
+  id r = waitForDeferred(fast);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"params"], array_(nsni(7)), 
+                       @"matched by id: %@", r, nil);
+  STAssertEquals(slow.fired, -1, @"the slow call is still in flight", nil);
+  r = waitForDeferred(slow);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"method"], @"items.sleep", nil);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"transport"], @"unix", nil);
+  
+  [service setBatchWindow:0.05];
+  DKDeferred *one = [service get:array_(nsni(1))];
+  DKDeferred *failed = [service fail:array_(nsni(2))];
+  DKDeferred *dropped = [service drop:array_(nsni(3))];
+  r = waitForDeferred(one);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"batch"], nsni(3), @"sent as one batch", nil);
+  STAssertTrue([waitForDeferred(failed) isKindOfClass:[NSError class]], nil);
+  STAssertTrue([waitForDeferred(dropped) isKindOfClass:[NSError class]], nil);
+  r = waitForDeferred([service drop:array_(nsni(4))]);
+  STAssertTrue([r isKindOfClass:[NSError class]], @"an empty batch response fails the batch: %@", r);
+  
+  STAssertTrue([waitForDeferred([[DKDeferred jsonService:@"unix:///tmp/no-such.sock"] get:array_(nsni(1))])
+                isKindOfClass:[NSError class]], @"no server", nil);
+  
+  // the proxy and its transport are gone before the answer comes
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  DKDeferred *orphan = [[[[DKDeferred jsonService:DKTestServerSocket] items]
+                         sleep:array_([NSNumber numberWithDouble:0.1])] retain];
+  [pool release];
+  r = waitForDeferred([orphan autorelease]);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"method"], @"items.sleep", 
+                       @"answered after the proxy was released: %@", r);
+  
+  id http = [DKDeferred jsonService:[NSString stringWithFormat:@"%@/rpc", DKTestServerURL]];
+  id unix = [DKDeferred jsonService:DKTestServerSocket];
+  for (id s in array_(http, unix)) {
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for (int i = 0; i < 200; i++)
+      waitForDeferred([s get:array_(nsni(i))]);
+    NSLog(@"200 sequential calls over %@: %.1fms per call", s, (CFAbsoluteTimeGetCurrent() - start) * 5);
+  }
+}
+
+- (void)testJSONProxyCachePolicy {
+  DKDeferredCache *cache = [DKDeferredCache sharedCache];
+  [cache setMemoryValue:@"v" forKey:@"k" timeout:60];
+  STAssertEqualObjects([cache memoryValueForKey:@"k"], @"v", nil);
+  [cache deleteMemoryValueForKey:@"k"];
+  STAssertNil([cache memoryValueForKey:@"k"], nil);
+  
+  id service = [DKDeferred jsonService:[NSString stringWithFormat:@"%@/rpc", DKTestServerURL]];
+  [service setCachePolicy:[DKJSONRPCCachePolicy cachePolicyWithTTL:60 idempotent:YES] forMethod:@"items.get"];
+  [service setCachePolicy:[DKJSONRPCCachePolicy cachePolicyWithTTL:0 idempotent:YES] forMethod:@"items.peek"];
+  NSString *tag = _uuid1();
+  NSDictionary *p1 = dict_(tag, @"tag", nsni(1), @"page");
+  NSDictionary *p2 = dict_(nsni(1), @"page", tag, @"tag");
+  
+  DKDeferred *a = [[service items] get:array_(p1)];
+  DKDeferred *b = [[service items] get:array_(p2)];
+  id ra = waitForDeferred(a), rb = waitForDeferred(b);
+  id seq = [[ra objectForKey:@"result"] objectForKey:@"seq"];
+  STAssertNotNil(seq, @"response: %@", ra, nil);
+  STAssertEqualObjects([[rb objectForKey:@"result"] objectForKey:@"seq"], seq, @"shared one request", nil);
+  
+  // a caller that changes its result doesn't change anyone else's
+  [[ra objectForKey:@"result"] setObject:@"changed" forKey:@"seq"];
+  STAssertEqualObjects([[rb objectForKey:@"result"] objectForKey:@"seq"], seq, @"joined caller's copy", nil);
+  
+  DKDeferred *c = [[service items] get:array_(p1)];
+  STAssertTrue(c.fired != -1, @"answered from the cache right away", nil);
+  id rc = waitForDeferred(c);
+  STAssertEqualObjects([[rc objectForKey:@"result"] objectForKey:@"seq"], seq, @"cached copy", nil);
+  [[rc objectForKey:@"result"] removeObjectForKey:@"seq"];
+  STAssertEqualObjects([[waitForDeferred([[service items] get:array_(p2)]) objectForKey:@"result"] objectForKey:@"seq"],
+                       seq, @"each hit gets its own copy", nil);
+  
+  DKDeferred *e = [[service items] peek:array_(p1)];
+  DKDeferred *f = [[service items] peek:array_(p1)];
+  id se = [[waitForDeferred(e) objectForKey:@"result"] objectForKey:@"seq"];
+  STAssertEqualObjects([[waitForDeferred(f) objectForKey:@"result"] objectForKey:@"seq"], se, 
+                       @"joined the call in flight", nil);
+  id sg = [[waitForDeferred([[service items] peek:array_(p1)]) objectForKey:@"result"] objectForKey:@"seq"];
+  STAssertFalse([sg isEqual:se], @"no TTL, so sent again once done", nil);
+  
+  id s1 = [[waitForDeferred([[service items] list:array_(p1)]) objectForKey:@"result"] objectForKey:@"seq"];
+  id s2 = [[waitForDeferred([[service items] list:array_(p1)]) objectForKey:@"result"] objectForKey:@"seq"];
+  STAssertFalse([s1 isEqual:s2], @"no policy, no caching", nil);
+}
+
+- (void)testJSONProxyMessagePack {
+  id service = [DKDeferred jsonService:[NSString stringWithFormat:@"%@/rpc", DKTestServerURL]];
+  [service setAcceptsMessagePack:YES];
+  NSArray *params = array_(nsni(-70000), [NSNumber numberWithDouble:0.25], @"text", [NSNull null]);
+  id r = waitForDeferred([[service points] add:params]);
+  STAssertTrue([r isKindOfClass:[NSDictionary class]], @"response: %@", r, nil);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"encoding"], @"json", 
+                       @"the first call goes out as JSON", nil);
+  STAssertTrue([[service points] acceptsMessagePack], @"namespaces share the transport", nil);
+  r = waitForDeferred([[service points] add:params]);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"encoding"], @"msgpack", 
+                       @"then MessagePack, once the service has answered in it", nil);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"params"], params, nil);
+  STAssertEqualObjects([[r objectForKey:@"result"] objectForKey:@"method"], @"points.add", nil);
+}
+
+- (void)testCacheMessagePack {
+  DKDeferredCache *cache = [[[DKDeferredCache alloc] initWithDirectory:@"_dkmptest" 
+                                                            maxEntries:50 cullFrequency:3] autorelease];
+  cache.valueEncoding = DKCacheValueEncodingMessagePack;
+  NSString *key = _uuid1();
+  id value = dict_(array_(nsni(1), [NSNumber numberWithDouble:2.5]), @"list", @"text", @"name");
+  waitForDeferred([cache setValue:value forKey:key timeout:60]);
+  STAssertEqualObjects(waitForDeferred([cache valueForKey:key]), value, @"packed", nil);
+  
+  // not a JSON type, so archived
+  NSString *other = _uuid1();
+  NSURL *url = [NSURL URLWithString:@"http://example.com/a"];
+  waitForDeferred([cache setValue:url forKey:other timeout:60]);
+  
+  // has a proxyForJson, but is archived rather than packed as its proxy
+  NSString *dated = _uuid1();
+  id withDate = array_([NSDate dateWithTimeIntervalSinceReferenceDate:1000.0], @"x");
+  waitForDeferred([cache setValue:withDate forKey:dated timeout:60]);
+  STAssertEqualObjects(waitForDeferred([cache valueForKey:dated]), withDate, @"dates come back as dates", nil);
+  
+  cache.valueEncoding = DKCacheValueEncodingArchive;
+  STAssertEqualObjects(waitForDeferred([cache valueForKey:key]), value, @"read whatever the setting", nil);
+  STAssertEqualObjects(waitForDeferred([cache valueForKey:other]), url, @"archived", nil);
+}
+
+- (id)_cbCollectBatch:(id)batches :(id)batch {
+  [batches addObject:batch];
+  return nil;
+}
+
+- (void)testLoadJSONLines {
+  NSMutableArray *batches = [NSMutableArray array];
+  NSString *u = [NSString stringWithFormat:@"%@/ndjson?n=2000&chunk=777", DKTestServerURL];
+  DKDeferredURLConnection *d = [DKDeferred loadJSONLines:u
+                                          recordCallback:curryTS(self, @selector(_cbCollectBatch::), batches)];
+  id r = waitForDeferred(d);
+  STAssertEqualObjects(r, nsni(2000), @"record count: %@", r);
+  NSMutableArray *records = [NSMutableArray array];
+  for (NSArray *batch in batches) {
+    STAssertTrue([batch count] <= 100, @"batch of %lu", (unsigned long)[batch count]);
+    [records addObjectsFromArray:batch];
+  }
+  STAssertEquals([records count], (NSUInteger)2000, nil);
+  for (NSUInteger i = 0; i < [records count]; i++)
+    STAssertEqualObjects([[records objectAtIndex:i] objectForKey:@"id"], nsni(i), @"in order", nil);
+  STAssertEquals([d.data length], (NSUInteger)0, @"body not buffered", nil);
+}
+
+// takes a while over each batch, and notes whether the connection was paused meanwhile
+- (id)_cbCollectBatchSlowly:(id)context :(id)batch {
+  [[context objectForKey:@"records"] addObjectsFromArray:batch];
+  DKDeferredURLConnection *d = [[context objectForKey:@"connection"] nonretainedObjectValue];
+  if (d.readingPaused)
+    [context setObject:[NSNumber numberWithBool:YES] forKey:@"paused"];
+  return [DKDeferred wait:0.02 value:nil];
+}
+
+- (void)testLoadJSONLinesBackpressure {
+  NSMutableDictionary *context = [NSMutableDictionary dictionaryWithObject:[NSMutableArray array] forKey:@"records"];
+  DKJSONLineStream *stream = [[[DKJSONLineStream alloc] initWithRecordCallback:
+                               curryTS(self, @selector(_cbCollectBatchSlowly::), context)] autorelease];
+  stream.batchSize = 10;
+  stream.maxPendingBatches = 2;
+  NSString *u = [NSString stringWithFormat:@"%@/ndjson?n=1000&chunk=4096", DKTestServerURL];
+  DKDeferredURLConnection *d = [DKDeferred loadJSONLines:u stream:stream];
+  [context setObject:[NSValue valueWithNonretainedObject:d] forKey:@"connection"];
+  id r = waitForDeferred(d);
+  STAssertEqualObjects(r, nsni(1000), @"fired once every batch was consumed: %@", r);
+  STAssertEquals([[context objectForKey:@"records"] count], (NSUInteger)1000, nil);
+  STAssertNotNil([context objectForKey:@"paused"], @"reads paused while the consumer caught up", nil);
+  STAssertFalse(d.readingPaused, nil);
+}
+
+- (id)_cbStopWith:(id)error :(id)batch {
+  return error;
+}
+
+- (void)testLoadJSONLinesErrors {
+  NSMutableArray *batches = [NSMutableArray array];
+  NSString *u = [NSString stringWithFormat:@"%@/ndjson?n=2000&chunk=64&bad=1500", DKTestServerURL];
+  id r = waitForDeferred([DKDeferred loadJSONLines:u
+                                    recordCallback:curryTS(self, @selector(_cbCollectBatch::), batches)]);
+  STAssertTrue([r isKindOfClass:[NSError class]], @"errback on a bad record: %@", r);
+  STAssertEqualObjects([r domain], SBJSONErrorDomain, nil);
+  NSUInteger count = 0;
+  for (NSArray *batch in batches)
+    count += [batch count];
+  STAssertEquals(count, (NSUInteger)1500, @"the records before it were delivered", nil);
+  
+  NSError *stop = [NSError errorWithDomain:DKDeferredErrorDomain code:DKDeferredGenericError userInfo:EMPTY_DICT];
+  u = [NSString stringWithFormat:@"%@/ndjson?n=10000&chunk=1024&delay=0.01", DKTestServerURL];
+  r = waitForDeferred([DKDeferred loadJSONLines:u recordCallback:curryTS(self, @selector(_cbStopWith::), stop)]);
+  STAssertEquals(r, stop, @"the consumer stops the load", nil);
+}
+
+// cancels the load on the first batch, while still busy with it
+- (id)_cbCancelLoad:(id)context :(id)batch {
+  [[context objectForKey:@"records"] addObjectsFromArray:batch];
+  [[[context objectForKey:@"connection"] nonretainedObjectValue] cancel];
+  return [DKDeferred wait:0.02 value:nil];
+}
+
+- (void)testLoadJSONLinesCancel {
+  NSMutableDictionary *context = [NSMutableDictionary dictionaryWithObject:[NSMutableArray array] forKey:@"records"];
+  DKJSONLineStream *stream = [[[DKJSONLineStream alloc] initWithRecordCallback:
+                               curryTS(self, @selector(_cbCancelLoad::), context)] autorelease];
+  stream.batchSize = 10;
+  NSString *u = [NSString stringWithFormat:@"%@/ndjson?n=1000&chunk=4096", DKTestServerURL];
+  DKDeferredURLConnection *d = [DKDeferred loadJSONLines:u stream:stream];
+  [context setObject:[NSValue valueWithNonretainedObject:d] forKey:@"connection"];
+  id r = waitForDeferred(d);
+  STAssertTrue([r isKindOfClass:[NSError class]], @"canceled: %@", r);
+  STAssertEquals([r code], (NSInteger)DKDeferredCanceledError, nil);
+  
+  // the batches read before the cancel aren't delivered once the consumer is done
+  waitForDeferred([DKDeferred wait:0.1 value:nil]);
+  STAssertEquals([[context objectForKey:@"records"] count], (NSUInteger)10, nil);
+}
+
 @end
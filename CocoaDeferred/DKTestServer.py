@@ -0,0 +1,371 @@
+#!/usr/bin/env python
+#
+#  DKTestServer.py
+#  CocoaDeferred
+#
+#  Local stand-in server for the DeferredTest target. Run it before the
+#  tests that talk to DKTestServerURL:
+#
+#    python DKTestServer.py [port]
+#
+#  /flaky?key=K&fail=N&status=S   the first N requests for key K answer with
+#                                 status S (or drop the connection if S is 0),
+#                                 later ones answer 200 "ok"
+#  /slow?key=K&delay=D&times=N    the first N requests for key K wait D
+#                                 seconds before answering 200 "ok"
+#  /cached?key=K&max_age=N        answers with an ETag and max-age=N, 304 when
+#                                 the request's If-None-Match still matches
+#  /stats?key=K                   "full=F notmodified=M" for /cached?key=K
+#  /gzip?n=N                      N bytes of text sent with Content-Encoding gzip
+#  /gzip?n=N&cut=C&junk=J         ... missing its last C bytes, or followed by J
+#                                 bytes that aren't compressed
+#  /gzip?n=N&members=M&split=S    ... compressed as M gzip members one after
+#                                 another, with the first S bytes written on
+#                                 their own a moment before the rest
+#  /json?n=N                      a JSON array of N small objects
+#  /json?body=B                   B as it is, valid JSON or not
+#  /ndjson?n=N&chunk=C&delay=D&bad=I
+#                                 N small objects, one per line, written C
+#                                 bytes at a time with D seconds in between,
+#                                 so lines are split between writes; some
+#                                 lines end in CRLF, there is a blank line,
+#                                 the last has no newline and line I (from 0)
+#                                 is not valid JSON
+#  POST /rpc                      answers a JSON-RPC call with its method and
+#                                 params, whether the body came chunked, its
+#                                 length and the number of calls in it. Takes
+#                                 batches too, and answers them out of order;
+#                                 methods ending in "fail" get an error and
+#                                 ones ending in "drop" no response at all;
+#                                 "seq" counts the calls answered so far.
+#                                 Speaks MessagePack instead of JSON when the
+#                                 request's Content-Type or Accept header asks
+#                                 for application/x-msgpack; "encoding" tells
+#                                 what the call came in
+#
+#  It also answers the same JSON-RPC calls, one per line, on the Unix socket
+#  /tmp/DKTestServer.sock (or the second argument). Each line is handled on
+#  its own thread, so answers come back in the order they are ready; methods
+#  ending in "sleep" wait params[0] seconds first, and a batch of nothing but
+#  "drop" calls is answered with an empty array.
+#
+
+import gzip
+import io
+import json
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+
+try:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+    from socketserver import ThreadingMixIn, StreamRequestHandler, UnixStreamServer
+    from urllib.parse import urlparse, parse_qs
+except ImportError:  # python 2
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+    from SocketServer import ThreadingMixIn, StreamRequestHandler, UnixStreamServer
+    from urlparse import urlparse, parse_qs
+
+
+_hits = {}
+_counts = {}
+_hits_lock = threading.Lock()
+
+
+def hit(key):
+    """Returns how many requests were seen for key before this one."""
+    with _hits_lock:
+        n = _hits.get(key, 0)
+        _hits[key] = n + 1
+        return n
+
+
+def count(key):
+    with _hits_lock:
+        _counts[key] = _counts.get(key, 0) + 1
+
+
+def rpc_response(call, info):
+    if call['method'].endswith('fail'):
+        return {'result': None, 'error': {'message': 'failed'}, 'id': call['id']}
+    if call['method'].endswith('sleep'):
+        time.sleep(float(call['params'][0]))
+    result = dict(info, method=call['method'], params=call['params'], seq=hit('rpc'))
+    return {'result': result, 'error': None, 'id': call['id']}
+
+
+def rpc_answer(calls, info):
+    if isinstance(calls, list):
+        info['batch'] = len(calls)
+        return [rpc_response(call, info) for call in reversed(calls)
+                if not call['method'].endswith('drop')]
+    info['batch'] = 1
+    return rpc_response(calls, info)
+
+
+MSGPACK = 'application/x-msgpack'
+
+
+def msgpack_pack(o):
+    """The MessagePack for the JSON types, enough for the test suite."""
+    if o is None:
+        return b'\xc0'
+    if o is True or o is False:
+        return b'\xc3' if o else b'\xc2'
+    if isinstance(o, int):
+        if 0 <= o < 0x80:
+            return struct.pack('B', o)
+        if -32 <= o < 0:
+            return struct.pack('b', o)
+        return b'\xd3' + struct.pack('>q', o) if o < 0 else b'\xcf' + struct.pack('>Q', o)
+    if isinstance(o, float):
+        return b'\xcb' + struct.pack('>d', o)
+    if isinstance(o, bytes) and not isinstance(o, str):
+        return b'\xc6' + struct.pack('>I', len(o)) + o
+    if not isinstance(o, (list, tuple, dict)):
+        b = o.encode('utf-8')
+        return (struct.pack('B', 0xa0 | len(b)) if len(b) < 32 else b'\xdb' + struct.pack('>I', len(b))) + b
+    if isinstance(o, dict):
+        items = [msgpack_pack(k) + msgpack_pack(v) for k, v in o.items()]
+        return b'\xdf' + struct.pack('>I', len(items)) + b''.join(items)
+    return b'\xdd' + struct.pack('>I', len(o)) + b''.join(msgpack_pack(v) for v in o)
+
+
+def msgpack_unpack(data):
+    def read(i):
+        t = ord(data[i:i + 1])
+        i += 1
+        if t < 0x80 or t >= 0xe0:
+            return struct.unpack('b', data[i - 1:i])[0] if t >= 0xe0 else t, i
+        if 0xa0 <= t <= 0xbf or t in (0xd9, 0xda, 0xdb, 0xc4, 0xc5, 0xc6):
+            if 0xa0 <= t <= 0xbf:
+                n = t & 0x1f
+            else:
+                size = {0xd9: 1, 0xda: 2, 0xdb: 4, 0xc4: 1, 0xc5: 2, 0xc6: 4}[t]
+                n = struct.unpack('>' + {1: 'B', 2: 'H', 4: 'I'}[size], data[i:i + size])[0]
+                i += size
+            raw = data[i:i + n]
+            return (raw if t in (0xc4, 0xc5, 0xc6) else raw.decode('utf-8')), i + n
+        if 0x80 <= t <= 0x9f or t in (0xdc, 0xdd, 0xde, 0xdf):
+            if t <= 0x9f:
+                n = t & 0x0f
+            else:
+                size = 2 if t in (0xdc, 0xde) else 4
+                n = struct.unpack('>' + ('H' if size == 2 else 'I'), data[i:i + size])[0]
+                i += size
+            is_map = t < 0x90 or t in (0xde, 0xdf)
+            items = []
+            for _ in range(n * 2 if is_map else n):
+                v, i = read(i)
+                items.append(v)
+            return (dict(zip(items[::2], items[1::2])) if is_map else items), i
+        if t in (0xc0, 0xc2, 0xc3):
+            return {0xc0: None, 0xc2: False, 0xc3: True}[t], i
+        fmt = {0xca: '>f', 0xcb: '>d', 0xcc: '>B', 0xcd: '>H', 0xce: '>I', 0xcf: '>Q',
+               0xd0: '>b', 0xd1: '>h', 0xd2: '>i', 0xd3: '>q'}[t]
+        size = struct.calcsize(fmt)
+        return struct.unpack(fmt, data[i:i + size])[0], i + size
+    return read(0)[0]
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.0'
+
+    def log_message(self, fmt, *args):
+        sys.stderr.write('%s\n' % (fmt % args))
+
+    def param(self, name, default=None):
+        return self.query.get(name, [default])[0]
+
+    def respond(self, status, body, content_type='text/plain', headers=None):
+        if not isinstance(body, bytes):
+            body = body.encode('utf-8')
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        for k, v in (headers or {}).items():
+            self.send_header(k, v)
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        parsed = urlparse(self.path)
+        self.query = parse_qs(parsed.query)
+        handler = getattr(self, 'get_' + parsed.path.strip('/'), None)
+        if handler is None:
+            return self.respond(404, 'not found')
+        handler()
+
+    def do_POST(self):
+        parsed = urlparse(self.path)
+        self.query = parse_qs(parsed.query)
+        handler = getattr(self, 'post_' + parsed.path.strip('/'), None)
+        if handler is None:
+            return self.respond(404, 'not found')
+        handler()
+
+    def read_body(self):
+        if self.headers.get('Transfer-Encoding', '').lower() != 'chunked':
+            return self.rfile.read(int(self.headers.get('Content-Length', '0')))
+        chunks = []
+        while True:
+            size = int(self.rfile.readline().split(b';')[0], 16)
+            if size == 0:
+                while self.rfile.readline().strip():
+                    pass
+                return b''.join(chunks)
+            chunks.append(self.rfile.read(size))
+            self.rfile.readline()
+
+    def post_rpc(self):
+        body = self.read_body()
+        packed = self.headers.get('Content-Type', '').startswith(MSGPACK)
+        calls = msgpack_unpack(body) if packed else json.loads(body.decode('utf-8'))
+        info = {'chunked': self.headers.get('Transfer-Encoding', '').lower() == 'chunked',
+                'length': len(body), 'encoding': 'msgpack' if packed else 'json'}
+        answer = rpc_answer(calls, info)
+        if MSGPACK in self.headers.get('Accept', ''):
+            self.respond(200, msgpack_pack(answer), content_type=MSGPACK)
+        else:
+            self.respond(200, json.dumps(answer), content_type='application/json')
+
+    def get_flaky(self):
+        n = hit('flaky:' + self.param('key', ''))
+        status = int(self.param('status', '503'))
+        if n < int(self.param('fail', '1')):
+            if status == 0:
+                self.close_connection = True
+                self.connection.shutdown(2)
+                return
+            return self.respond(status, 'fail %d' % n)
+        self.respond(200, 'ok')
+
+    def get_slow(self):
+        n = hit('slow:' + self.param('key', ''))
+        if n < int(self.param('times', '1')):
+            time.sleep(float(self.param('delay', '2')))
+        self.respond(200, 'ok')
+
+    def get_cached(self):
+        key = self.param('key', '')
+        etag = '"%s-v1"' % key
+        headers = {'ETag': etag,
+                   'Cache-Control': 'max-age=%s' % self.param('max_age', '0')}
+        if self.headers.get('If-None-Match') == etag:
+            count('notmodified:' + key)
+            self.send_response(304)
+            for k, v in headers.items():
+                self.send_header(k, v)
+            self.end_headers()
+            return
+        count('full:' + key)
+        self.respond(200, 'cached body', headers=headers)
+
+    def get_gzip(self):
+        n = int(self.param('n', '100000'))
+        members = int(self.param('members', '1'))
+        split = int(self.param('split', '0'))
+        body = (b'0123456789abcdef' * (n // 16 + 1))[:n]
+        buf = io.BytesIO()
+        step = n // members + 1
+        for i in range(0, n, step):
+            f = gzip.GzipFile(fileobj=buf, mode='wb')
+            f.write(body[i:i + step])
+            f.close()
+        data = buf.getvalue()
+        data = data[:len(data) - int(self.param('cut', '0'))] + b'x' * int(self.param('junk', '0'))
+        if not split:
+            return self.respond(200, data, headers={'Content-Encoding': 'gzip'})
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain')
+        self.send_header('Content-Length', str(len(data)))
+        self.send_header('Content-Encoding', 'gzip')
+        self.end_headers()
+        self.wfile.write(data[:split])
+        self.wfile.flush()
+        time.sleep(0.2)
+        self.wfile.write(data[split:])
+
+    def get_json(self):
+        body = self.param('body')
+        if body is not None:
+            return self.respond(200, body, content_type='application/json')
+        n = int(self.param('n', '1000'))
+        items = [{'id': i, 'name': 'item %d' % i, 'tags': ['a', 'b\n"c"'], 'score': i / 8.0}
+                 for i in range(n)]
+        self.respond(200, json.dumps(items), content_type='application/json')
+
+    def get_ndjson(self):
+        n = int(self.param('n', '1000'))
+        chunk = int(self.param('chunk', '1000'))
+        delay = float(self.param('delay', '0'))
+        bad = int(self.param('bad', '-1'))
+        lines = []
+        for i in range(n):
+            line = '{"id": %d, "name": ' % i if i == bad else json.dumps({'id': i, 'name': 'item %d' % i})
+            lines.append(line + ('\r\n' if i % 7 == 0 else '\n') + ('\n' if i == 3 else ''))
+        body = ''.join(lines).rstrip().encode('utf-8')
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/x-ndjson')
+        self.end_headers()
+        for i in range(0, len(body), chunk):
+            self.wfile.write(body[i:i + chunk])
+            self.wfile.flush()
+            if delay:
+                time.sleep(delay)
+
+    def get_stats(self):
+        key = self.param('key', '')
+        with _hits_lock:
+            full = _counts.get('full:' + key, 0)
+            notmodified = _counts.get('notmodified:' + key, 0)
+        self.respond(200, 'full=%d notmodified=%d' % (full, notmodified))
+
+
+class SocketHandler(StreamRequestHandler):
+    """Newline-delimited JSON-RPC over a persistent Unix socket connection."""
+
+    def handle(self):
+        lock = threading.Lock()
+
+        def answer(line):
+            response = rpc_answer(json.loads(line.decode('utf-8')), {'transport': 'unix'})
+            with lock:
+                self.wfile.write(json.dumps(response).encode('utf-8') + b'\n')
+                self.wfile.flush()
+
+        for line in iter(self.rfile.readline, b''):
+            if line.strip():
+                t = threading.Thread(target=answer, args=(line,))
+                t.daemon = True
+                t.start()
+
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+class SocketServer(ThreadingMixIn, UnixStreamServer):
+    daemon_threads = True
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8765
+    path = sys.argv[2] if len(sys.argv) > 2 else '/tmp/DKTestServer.sock'
+    if os.path.exists(path):
+        os.unlink(path)
+    unix = SocketServer(path, SocketHandler)
+    t = threading.Thread(target=unix.serve_forever)
+    t.daemon = True
+    t.start()
+    server = Server(('127.0.0.1', port), Handler)
+    sys.stderr.write('DKTestServer listening on http://127.0.0.1:%d and unix:%s\n' % (port, path))
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -67,7 +67,7 @@
 
 - (void)locationManager:(CLLocationManager *)manager 
        didFailWithError:(NSError *)error {
-  NSLog(@"locationManager:%@ didFailWithError:%@ %@", manager, error, [error userInfo]);
+  DKLogWarn(@"locationManager:%@ didFailWithError:%@ %@", manager, error, [error userInfo]);
   [manager stopUpdatingLocation];
   [self errback:error];
 }
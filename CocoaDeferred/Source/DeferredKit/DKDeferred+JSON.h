@@ -8,18 +8,60 @@
 #import <Foundation/Foundation.h>
 #import "JSON/JSON.h"
 #import "DKDeferred.h"
+#import "DKJSONRPCTransport.h"
+
+@class DKJSONLineStream;
+
+/**
+ * DKDeferredURLConnection decode functions: the JSON document in the body,
+ * and a JSON-RPC response with an error turned into an NSError.
+ */
+id _decodeJSON(id results);
+id _decodeJSONResonse(id results);
 
 @interface DKDeferred (JSONAdditions)
 
 /**
  * Returns a Deferred which will callback with the native representation
- * of the JSON document at <code>aUrl</code>.
+ * of the JSON document at <code>aUrl</code>. The document is parsed as
+ * it downloads, so it is ready shortly after the last byte arrives.
  */
 + (id)loadJSONDoc:(NSString *)aUrl;
 
+/**
+ * Returns a Deferred which will callback with an NSDictionary of the values
+ * found at <code>paths</code> in the JSON document at <code>aUrl</code>,
+ * as returned by SBJsonPathExtractor. The rest of the document is skipped
+ * over without being decoded.
+ */
++ (id)loadJSONDoc:(NSString *)aUrl paths:(NSArray *)paths;
+
+/**
+ * Returns a Deferred which will callback with the JSON document at
+ * <code>aUrl</code> decoded into model objects by <code>mapping</code>,
+ * as by SBJsonModelDecoder.
+ */
++ (id)loadJSONDoc:(NSString *)aUrl mapping:(SBJsonClassMapping *)mapping;
+
+/**
+ * Streams the newline delimited JSON at <code>aUrl</code> to
+ * <code>recordCallback</code>, which is called with an NSArray of the next
+ * records as they arrive, through a DKJSONLineStream with the default
+ * settings. Returns a Deferred which will callback with the number of
+ * records once the body has ended and every record has been consumed.
+ */
++ (id)loadJSONLines:(NSString *)aUrl recordCallback:(id<DKCallback>)recordCallback;
+
+/**
+ * As above, through the given stream.
+ */
++ (id)loadJSONLines:(NSString *)aUrl stream:(DKJSONLineStream *)stream;
+
 /**
  * Returns a DKJSONServiceProxy which you can use to transparently call
- * JSON-RPC methods on your web service. 
+ * JSON-RPC methods on your web service. A <code>unix:</code> URL, as in
+ * <code>unix:///var/run/service.sock</code>, reaches a service on the same
+ * host through a DKJSONRPCSocketTransport instead of HTTP.
  */
 + (id)jsonService:(NSString *)aUrl;
 
@@ -52,13 +94,79 @@
  *    [[[service someNamespace] someMethod:array_(arg1, arg2)]
  *     addCallbacks:callbackP(_fromJSONResponse) :callbackP(_fromJSONResponseError)];
  *  </pre>
+ *
+ * A proxy works out the method name for each selector once, and creates the
+ * proxy for each namespace once and keeps it, so repeated calls through a
+ * long-lived proxy don't build any strings or proxies.
  */
+@class DKJSONRPCBatch;
+@class DKJSONRPCCachePolicy;
+
 @interface DKJSONServiceProxy : NSObject
 {
   NSString *serviceURL;
   NSString *serviceName;
+  id<DKJSONRPCTransport> transport;
+  BOOL streamsRequestBody;
+  DKJSONRPCBatch *batch;
+  CFMutableDictionaryRef methodNames;
+  CFMutableDictionaryRef children;
+  NSMutableDictionary *cachePolicies;
+  NSMutableDictionary *inFlight;
 }
 
+/**
+ * When YES, calls are serialized on a background thread straight into the
+ * request's HTTPBodyStream, a chunk at a time, instead of into an NSData
+ * first. Use it for large arguments: no more than a chunk of the body is
+ * held in memory. The body is sent chunked, and such calls are never
+ * retried, as the stream can only be read once. Proxies for namespaces
+ * follow the setting. Default NO.
+ */
+@property(nonatomic, assign) BOOL streamsRequestBody;
+
+/**
+ * When greater than zero, calls are not sent right away. The proxy collects
+ * them for this many seconds after the first one and then sends them together
+ * as one JSON-RPC batch, a JSON array of calls. Each call's deferred gets the
+ * response with its id, and errs back alone if that response has an error or
+ * is missing. Proxies for namespaces share the batch of the proxy they came
+ * from. Default 0.
+ */
+@property(nonatomic, assign) NSTimeInterval batchWindow;
+
+/**
+ * A batch is sent as soon as it holds this many calls. Default 20.
+ */
+@property(nonatomic, assign) NSUInteger maxBatchSize;
+
+/**
+ * When YES, calls over HTTP negotiate MessagePack with the service instead
+ * of JSON, as described for DKJSONRPCHTTPTransport. The setting belongs to
+ * the transport, so proxies for namespaces share it. Has no effect on other
+ * transports. Default NO.
+ */
+@property(nonatomic, assign) BOOL acceptsMessagePack;
+
+/**
+ * Sends the calls collected so far without waiting for the window to close.
+ */
+- (void)flushBatch;
+
+/**
+ * Sets how calls to <code>method</code>, the full dotted name, are cached;
+ * nil sends every call again. Proxies for namespaces share the policies of
+ * the proxy they came from.
+ *
+ * Calls are identical when their method and params are: the cache key is
+ * the MD5 of the method and params written with sorted keys, so the order
+ * of dictionary keys doesn't matter. Cached results live in the memory
+ * tier of [DKDeferredCache sharedCache] as immutable copies; each caller,
+ * whether it joined a call or was answered from the cache, gets a mutable
+ * copy of its own to change as it likes.
+ */
+- (void)setCachePolicy:(DKJSONRPCCachePolicy *)policy forMethod:(NSString *)method;
+
 /**
  * Returns an initialized DKJSONServiceProxy which will direct method calls to 
  * <code>url</code>
@@ -71,6 +179,13 @@
  */
 - (id)initWithURL:(NSString *)aUrl serviceName:(NSString *)aService;
 
+/**
+ * Returns an initialized DKJSONServiceProxy which will send method calls
+ * through <code>aTransport</code>, with the method preconfigured to
+ * <code>serviceName</code>.
+ */
+- (id)initWithTransport:(id<DKJSONRPCTransport>)aTransport serviceName:(NSString *)aService;
+
 /**
  * Executes a JSON-RPC call on the server. Returns a deferred which will callback
  * with the native representation of the method results.
@@ -80,6 +195,110 @@
 @end
 
 
+/**
+ * DKJSONRPCCachePolicy
+ *
+ * How a DKJSONServiceProxy treats the calls of one method. The result of a
+ * call to a method with a TTL answers identical calls for that many seconds.
+ * Identical calls to an idempotent method made while one is in flight share
+ * its response instead of sending their own. Errors are never cached.
+ */
+@interface DKJSONRPCCachePolicy : NSObject
+{
+  NSTimeInterval ttl;
+  BOOL idempotent;
+}
+
+@property(readonly) NSTimeInterval ttl;
+@property(readonly) BOOL idempotent;
+
++ (id)cachePolicyWithTTL:(NSTimeInterval)ttl idempotent:(BOOL)idempotent;
+- (id)initWithTTL:(NSTimeInterval)ttl idempotent:(BOOL)idempotent;
+
+@end
+
+
+/**
+ * DKJSONLineStream
+ *
+ * Consumes a body of newline delimited JSON (NDJSON), one record per line,
+ * as it downloads, for streams that go on for minutes or don't end at all.
+ * Hooked up as both the dataCallback and the decodeFunction of a
+ * DKDeferredURLConnection that doesn't buffer its body.
+ *
+ * Lines are found in each chunk in place and their records parsed from the
+ * chunk's bytes; only a line split between chunks is copied. Blank lines are
+ * skipped, and a final line without a newline is a record too. A line that
+ * isn't valid JSON stops the load with its parse error.
+ *
+ * Records are handed to <code>recordCallback</code> in order, in NSArrays
+ * of at most <code>batchSize</code>, as soon as each chunk has been read.
+ * The callback can return a Deferred to say it's still busy with a batch;
+ * later batches then wait for it. When <code>maxPendingBatches</code> are
+ * waiting the connection stops reading until half of them have been
+ * consumed, so a slow consumer slows the server down rather than piling up
+ * records. An NSError, from the callback or its Deferred, stops the load;
+ * when the load fails or is canceled, batches not yet handed over are dropped.
+ */
+@interface DKJSONLineStream : NSObject
+{
+  DKDeferredURLConnection *connection;
+  id<DKCallback> recordCallback;
+  SBJsonParser *parser;
+  NSMutableData *partial;
+  NSMutableArray *batch;
+  NSMutableArray *pending;
+  NSUInteger batchSize;
+  NSUInteger maxPendingBatches;
+  NSUInteger recordCount;
+  NSUInteger lineCount;
+  BOOL consuming;
+  BOOL finished;
+  NSError *error;
+  DKDeferred *drained;
+}
+
+@property(nonatomic, assign) NSUInteger batchSize; // 100
+@property(nonatomic, assign) NSUInteger maxPendingBatches; // 4
+@property(nonatomic, readonly) NSUInteger recordCount;
+
+- (id)initWithRecordCallback:(id<DKCallback>)recordCallback;
+// reads the connection's body through the stream
+- (void)attachToConnection:(DKDeferredURLConnection *)connection;
+// the dataCallback and decodeFunction
+- (id)feed:(NSData *)chunk;
+- (id)finish:(id)results;
+
+@end
+
+
+/**
+ * Lets an SBJsonPathExtractor be used as the decodeFunction of a
+ * DKDeferredURLConnection. Returns the extracted values, or an NSError
+ * if the document is invalid.
+ */
+@interface SBJsonPathExtractor (DKCallback) <DKCallback>
+@end
+
+
+/**
+ * Lets an SBJsonModelDecoder be used as the decodeFunction of a
+ * DKDeferredURLConnection. Returns the decoded model, or an NSError
+ * if the document is invalid.
+ */
+@interface SBJsonModelDecoder (DKCallback) <DKCallback>
+@end
+
+
+/**
+ * Lets an SBJsonDocumentParser be used as the decodeFunction of a
+ * DKDeferredURLConnection. Returns the SBJsonDocument, or an NSError
+ * if the document is invalid.
+ */
+@interface SBJsonDocumentParser (DKCallback) <DKCallback>
+@end
+
+
 @interface NSDate (JSONCustomization)
 
 - (id)proxyForJson;
@@ -6,20 +6,20 @@
 //
 
 #import "DKDeferred+JSON.h"
+#import <libkern/OSAtomic.h>
 
 /**
  * == DKDeferredURLConnection Decode Functions
  */
 id _decodeJSON(id results) {
   if (results && ! (results == [NSNull null])) {
-    NSString *objstr = [[NSString alloc] initWithData:results encoding:NSUTF8StringEncoding];
     NSError *error = nil;
-    id ret = [[[SBJSON alloc] init]
-              objectWithString:objstr error:&error];
+    SBJSON *json = [[SBJSON alloc] init];
+    id ret = [json objectWithData:results error:&error];
+    [json release];
     if (!ret && error) {
       return error;
     }
-    [objstr release];
     return ret;
   }
   return nil;
@@ -40,14 +40,298 @@ id _decodeJSONResonse(id results) {
 }
 
 
+/**
+ * Parses a connection's body while it downloads. Hooked up as both the
+ * dataCallback and the decodeFunction of the connection, so the document is
+ * already built when the last chunk arrives.
+ */
+@interface DKJSONStreamDecoder : NSObject
+{
+  SBJsonStreamParser *parser;
+  BOOL fed;
+}
+
+- (id)feed:(NSData *)chunk;
+- (id)decode:(id)results;
+
+@end
+
+@implementation DKJSONStreamDecoder
+
+- (id)init {
+  if ((self = [super init])) {
+    parser = [[SBJsonStreamParser alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [parser release];
+  [super dealloc];
+}
+
+- (id)feed:(NSData *)chunk {
+  fed = YES;
+  [parser parse:chunk];
+  return nil;
+}
+
+- (id)decode:(id)results {
+  if (!fed) // the body didn't come through the connection's data callback
+    return _decodeJSON(results);
+  id ret = [parser finish];
+  if (!ret)
+    return [[parser errorTrace] lastObject];
+  return ret;
+}
+
+@end
+
+
+@interface DKJSONLineStream ()
+- (BOOL)_addLine:(const char *)bytes length:(NSUInteger)length error:(NSError **)outError;
+- (void)_flushBatch;
+- (void)_deliver;
+- (id)_cbConsumed:(id)result;
+- (id)_cbDrain:(id)result;
+- (void)_failWithError:(NSError *)anError;
+@end
+
+@implementation DKJSONLineStream
+
+@synthesize batchSize, maxPendingBatches, recordCount;
+
+- (id)initWithRecordCallback:(id<DKCallback>)callback {
+  if ((self = [super init])) {
+    recordCallback = [callback retain];
+    parser = [[SBJsonParser alloc] init];
+    partial = [[NSMutableData alloc] init];
+    batch = [[NSMutableArray alloc] init];
+    pending = [[NSMutableArray alloc] init];
+    batchSize = 100;
+    maxPendingBatches = 4;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [recordCallback release];
+  [parser release];
+  [partial release];
+  [batch release];
+  [pending release];
+  [error release];
+  [drained release];
+  [super dealloc];
+}
+
+- (void)attachToConnection:(DKDeferredURLConnection *)aConnection {
+  connection = aConnection; // not retained, it retains us through its callbacks
+  connection.buffersData = NO;
+  connection.dataCallback = callbackTS(self, feed:);
+  [connection addBoth:callbackTS(self, _cbDrain:)];
+}
+
+- (id)feed:(NSData *)chunk {
+  if (error)
+    return error;
+  NSError *lineError = nil;
+  const char *line = [chunk bytes], *end = line + [chunk length], *nl;
+  for (; !lineError && (nl = memchr(line, '\n', end - line)); line = nl + 1) {
+    if ([partial length]) {
+      [partial appendBytes:line length:nl - line];
+      [self _addLine:[partial bytes] length:[partial length] error:&lineError];
+      [partial setLength:0];
+    } else {
+      [self _addLine:line length:nl - line error:&lineError];
+    }
+  }
+  if (!lineError)
+    [partial appendBytes:line length:end - line];
+  
+  // the records before a bad line still go out
+  [self _flushBatch];
+  [self _deliver];
+  if (lineError)
+    [self _failWithError:lineError];
+  if (error)
+    return error;
+  if ([pending count] >= maxPendingBatches)
+    [connection pauseReading];
+  return nil;
+}
+
+- (id)finish:(id)results {
+  connection = nil;
+  NSError *lineError = nil;
+  if (!error && [partial length])
+    [self _addLine:[partial bytes] length:[partial length] error:&lineError];
+  [partial setLength:0];
+  finished = YES;
+  [self _flushBatch];
+  [self _deliver];
+  if (lineError)
+    [self _failWithError:lineError];
+  if (error)
+    return error;
+  return [NSNumber numberWithUnsignedInteger:recordCount];
+}
+
+- (BOOL)_addLine:(const char *)bytes length:(NSUInteger)length error:(NSError **)outError {
+  lineCount++;
+  NSUInteger i = 0;
+  while (i < length && (unsigned char)bytes[i] <= ' ')
+    i++;
+  if (i == length) // blank, or just the \r of a CRLF
+    return YES;
+  
+  id record = [parser fragmentWithBytes:bytes length:length];
+  if (!record) {
+    NSError *parseError = [[parser errorTrace] lastObject];
+    *outError = [NSError errorWithDomain:[parseError domain] code:[parseError code]
+                                userInfo:dict_([NSString stringWithFormat:@"line %lu: %@", 
+                                                (unsigned long)lineCount, [parseError localizedDescription]],
+                                               NSLocalizedDescriptionKey)];
+    return NO;
+  }
+  recordCount++;
+  [batch addObject:record];
+  if ([batch count] >= batchSize)
+    [self _flushBatch];
+  return YES;
+}
+
+- (void)_flushBatch {
+  if (![batch count])
+    return;
+  [pending addObject:batch];
+  [batch release];
+  batch = [[NSMutableArray alloc] init];
+}
+
+/**
+ * Hands the waiting batches to the consumer until it returns a Deferred that
+ * hasn't fired yet, resuming reads once enough of them are gone and firing
+ * <code>drained</code> once they all are.
+ */
+- (void)_deliver {
+  while (!consuming && !error && [pending count]) {
+    NSArray *next = [[[pending objectAtIndex:0] retain] autorelease];
+    [pending removeObjectAtIndex:0];
+    id ret = [recordCallback :next];
+    if ([ret isKindOfClass:[NSError class]]) {
+      [self _failWithError:ret];
+    } else if ([ret isKindOfClass:[DKDeferred class]]) {
+      consuming = YES;
+      [ret addBoth:callbackTS(self, _cbConsumed:)];
+    }
+  }
+  if (consuming || error)
+    return;
+  if ([pending count] <= maxPendingBatches / 2)
+    [connection resumeReading];
+  if (finished && ![pending count] && drained) {
+    DKDeferred *d = [drained autorelease];
+    drained = nil;
+    [d callback:[NSNumber numberWithUnsignedInteger:recordCount]];
+  }
+}
+
+- (id)_cbConsumed:(id)result {
+  consuming = NO;
+  if ([result isKindOfClass:[NSError class]])
+    [self _failWithError:result];
+  else
+    [self _deliver];
+  return result;
+}
+
+/**
+ * After the body ends, holds the connection's Deferred until the last batch
+ * is consumed. If the load fails or is canceled instead, the connection is
+ * gone and the batches still waiting are dropped.
+ */
+- (id)_cbDrain:(id)result {
+  connection = nil;
+  if ([result isKindOfClass:[NSError class]]) {
+    if (!error)
+      error = [result retain];
+    [pending removeAllObjects];
+    [batch removeAllObjects];
+    [partial setLength:0];
+    return result;
+  }
+  if (error)
+    return error;
+  if (consuming || [pending count]) {
+    drained = [[DKDeferred deferred] retain];
+    return drained;
+  }
+  return result;
+}
+
+- (void)_failWithError:(NSError *)anError {
+  if (error)
+    return;
+  error = [anError retain];
+  [pending removeAllObjects];
+  [connection abortWithError:error];
+  connection = nil;
+  if (drained) {
+    DKDeferred *d = [drained autorelease];
+    drained = nil;
+    [d errback:error];
+  }
+}
+
+@end
+
+
 @implementation DKDeferred (JSONAdditions)
 
 + (id)loadJSONDoc:(NSString *)aUrl {
+  DKJSONStreamDecoder *decoder = [[[DKJSONStreamDecoder alloc] init] autorelease];
+  DKDeferredURLConnection *d = [[[DKDeferredURLConnection alloc] 
+                                 initWithRequest:[NSURLRequest 
+                                                  requestWithURL:[NSURL URLWithString:aUrl]]
+                                 pauseFor:0.0f
+                                 decodeFunction:callbackTS(decoder, decode:)] autorelease];
+  d.dataCallback = callbackTS(decoder, feed:);
+  return d;
+}
+
++ (id)loadJSONDoc:(NSString *)aUrl paths:(NSArray *)paths {
+  SBJsonPathExtractor *extractor = [[[SBJsonPathExtractor alloc] initWithPaths:paths] autorelease];
+  if (!extractor)
+    return [DKDeferred fail:[NSError errorWithDomain:DKDeferredErrorDomain code:DKDeferredGenericError
+                                            userInfo:dict_(@"invalid JSON path", NSLocalizedDescriptionKey)]];
   return [[[DKDeferredURLConnection alloc] 
-          initWithRequest:[NSURLRequest 
-                           requestWithURL:[NSURL URLWithString:aUrl]]
-          pauseFor:0.0f
-          decodeFunction:callbackP(_decodeJSON)] autorelease];
+           initWithRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:aUrl]]
+           pauseFor:0.0f
+           decodeFunction:extractor] autorelease];
+}
+
++ (id)loadJSONDoc:(NSString *)aUrl mapping:(SBJsonClassMapping *)mapping {
+  SBJsonModelDecoder *decoder = [[[SBJsonModelDecoder alloc] initWithMapping:mapping] autorelease];
+  return [[[DKDeferredURLConnection alloc] 
+           initWithRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:aUrl]]
+           pauseFor:0.0f
+           decodeFunction:decoder] autorelease];
+}
+
++ (id)loadJSONLines:(NSString *)aUrl recordCallback:(id<DKCallback>)recordCallback {
+  DKJSONLineStream *stream = [[[DKJSONLineStream alloc] initWithRecordCallback:recordCallback] autorelease];
+  return [self loadJSONLines:aUrl stream:stream];
+}
+
++ (id)loadJSONLines:(NSString *)aUrl stream:(DKJSONLineStream *)stream {
+  DKDeferredURLConnection *d = [[[DKDeferredURLConnection alloc] 
+                                 initWithRequest:[NSURLRequest 
+                                                  requestWithURL:[NSURL URLWithString:aUrl]]
+                                 pauseFor:0.0f
+                                 decodeFunction:callbackTS(stream, finish:)] autorelease];
+  [stream attachToConnection:d];
+  return d;
 }
 
 + (id)jsonService:(NSString *)aUrl name:(NSString *)serviceName {
@@ -61,16 +345,176 @@ id _decodeJSONResonse(id results) {
 
 @end
 
+@interface DKJSONServiceProxy ()
+- (id)callWithName:(NSString *)name args:(NSArray *)args;
+- (id)_sendCallWithName:(NSString *)name args:(NSArray *)args;
+- (id)_cachedCallWithName:(NSString *)name args:(NSArray *)args 
+                   policy:(DKJSONRPCCachePolicy *)policy;
+@end
+
+
+/**
+ * The calls a DKJSONServiceProxy and its namespaces have collected for
+ * the next batch. The first call opens the window; the batch is sent when
+ * it closes or when the batch is full, whichever comes first.
+ */
+@interface DKJSONRPCBatch : NSObject
+{
+  id<DKJSONRPCTransport> transport;
+  NSTimeInterval window;
+  NSUInteger maxSize;
+  NSMutableArray *calls;
+  NSMutableDictionary *deferreds;
+  BOOL streamed;
+}
+
+@property(nonatomic, assign) NSTimeInterval window;
+@property(nonatomic, assign) NSUInteger maxSize;
+
+- (id)initWithTransport:(id<DKJSONRPCTransport>)aTransport;
+- (DKDeferred *)addCall:(NSDictionary *)call streamed:(BOOL)streamBody;
+- (void)flush;
+
+@end
+
+@implementation DKJSONRPCBatch
+
+@synthesize window, maxSize;
+
+- (id)initWithTransport:(id<DKJSONRPCTransport>)aTransport {
+  if ((self = [super init])) {
+    transport = [aTransport retain];
+    maxSize = 20;
+    calls = [[NSMutableArray alloc] init];
+    deferreds = [[NSMutableDictionary alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [transport release];
+  [calls release];
+  [deferreds release];
+  [super dealloc];
+}
+
+- (DKDeferred *)addCall:(NSDictionary *)call streamed:(BOOL)streamBody {
+  DKDeferred *d = [DKDeferred deferred];
+  [calls addObject:call];
+  [deferreds setObject:d forKey:[call objectForKey:@"id"]];
+  streamed = streamed || streamBody;
+  if ([calls count] >= maxSize)
+    [self flush];
+  else if ([calls count] == 1)
+    [self performSelector:@selector(flush) withObject:nil afterDelay:window];
+  return d;
+}
+
+- (void)flush {
+  // the pending perform may hold the last reference
+  [[self retain] autorelease];
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(flush) object:nil];
+  if (![calls count])
+    return;
+  
+  NSArray *batch = [NSArray arrayWithArray:calls];
+  NSDictionary *waiting = [NSDictionary dictionaryWithDictionary:deferreds];
+  BOOL streamBody = streamed;
+  [calls removeAllObjects];
+  [deferreds removeAllObjects];
+  streamed = NO;
+  [[transport sendMessage:batch streamed:streamBody]
+   addBoth:curryTS(self, @selector(_cbResponses:results:), waiting)];
+}
+
+/**
+ * Hands each response in the batch to the deferred of the call with its id.
+ * Calls left without a response fail with the error of the whole request,
+ * if there was one.
+ */
+- (id)_cbResponses:(NSDictionary *)waiting results:(id)results {
+  NSMutableDictionary *pending = [NSMutableDictionary dictionaryWithDictionary:waiting];
+  if ([results isKindOfClass:[NSArray class]]) {
+    for (id response in results) {
+      id callID = ([response isKindOfClass:[NSDictionary class]] ? 
+                   [response objectForKey:@"id"] : nil);
+      DKDeferred *d = (callID ? [pending objectForKey:callID] : nil);
+      if (!d)
+        continue;
+      [[d retain] autorelease];
+      [pending removeObjectForKey:callID];
+      if (d.fired != -1)
+        continue;
+      id ret = _decodeJSONResonse(response);
+      if ([ret isKindOfClass:[NSError class]])
+        [d errback:ret];
+      else
+        [d callback:ret];
+    }
+  }
+  
+  id error = results;
+  if ([results isKindOfClass:[NSDictionary class]])
+    error = _decodeJSONResonse(results);
+  if (![error isKindOfClass:[NSError class]])
+    error = [NSError errorWithDomain:DKDeferredURLErrorDomain code:DKDeferredURLError 
+                            userInfo:dict_(@"No response for this call in the batch", 
+                                           NSLocalizedDescriptionKey)];
+  for (DKDeferred *d in [pending allValues]) {
+    if (d.fired == -1)
+      [d errback:error];
+  }
+  return nil;
+}
+
+@end
+
+
+// every forwarded selector takes and returns objects
+static NSMethodSignature *DKJSONProxySignature = nil;
+
+// ids for calls, unique within the process
+static int32_t DKJSONRPCLastID = 0;
+
+static void _setStreamsRequestBody(const void *key, const void *child, void *streams) {
+  [(DKJSONServiceProxy *)child setStreamsRequestBody:*(BOOL *)streams];
+}
+
 @implementation DKJSONServiceProxy
 
+@synthesize streamsRequestBody;
+
++ (void)initialize {
+  if (self == [DKJSONServiceProxy class])
+    DKJSONProxySignature = [[NSMethodSignature signatureWithObjCTypes:"@:@@@"] retain];
+}
+
 - (id)initWithURL:(NSString *)aUrl {
   return [self initWithURL:aUrl serviceName:nil];
 }
 
 - (id)initWithURL:(NSString *)aUrl serviceName:(NSString *)aService {
-  if ((self = [super init])) {
+  id<DKJSONRPCTransport> t;
+  if ([aUrl hasPrefix:@"unix:"])
+    t = [[DKJSONRPCSocketTransport alloc] initWithPath:[[NSURL URLWithString:aUrl] path]];
+  else
+    t = [[DKJSONRPCHTTPTransport alloc] initWithURL:aUrl];
+  self = [self initWithTransport:t serviceName:aService];
+  [t release];
+  if (self)
     serviceURL = [aUrl retain];
+  return self;
+}
+
+- (id)initWithTransport:(id<DKJSONRPCTransport>)aTransport serviceName:(NSString *)aService {
+  if ((self = [super init])) {
+    transport = [aTransport retain];
     serviceName = [aService retain];
+    batch = [[DKJSONRPCBatch alloc] initWithTransport:aTransport];
+    cachePolicies = [[NSMutableDictionary alloc] init];
+    inFlight = [[NSMutableDictionary alloc] init];
+    methodNames = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+    children = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
   }
   return self;
 }
@@ -78,75 +522,283 @@ id _decodeJSONResonse(id results) {
 - (void)dealloc {
   [serviceURL release];
   [serviceName release];
+  [transport release];
+  [batch release];
+  [cachePolicies release];
+  [inFlight release];
+  CFRelease(methodNames);
+  CFRelease(children);
   [super dealloc];
 }
 
 - (NSString *)description {
   return [NSString stringWithFormat:@"<DKJSONServiceProxy url=%@ service=%@>", 
-          serviceURL, serviceName];
+          (serviceURL ? (id)serviceURL : (id)transport), serviceName];
+}
+
+- (void)setStreamsRequestBody:(BOOL)streams {
+  streamsRequestBody = streams;
+  CFDictionaryApplyFunction(children, _setStreamsRequestBody, &streams);
+}
+
+- (NSTimeInterval)batchWindow {
+  return batch.window;
+}
+
+- (void)setBatchWindow:(NSTimeInterval)window {
+  batch.window = window;
+}
+
+- (NSUInteger)maxBatchSize {
+  return batch.maxSize;
+}
+
+- (void)setMaxBatchSize:(NSUInteger)size {
+  batch.maxSize = size;
+}
+
+- (BOOL)acceptsMessagePack {
+  return ([(id)transport respondsToSelector:@selector(acceptsMessagePack)] &&
+          [(DKJSONRPCHTTPTransport *)transport acceptsMessagePack]);
+}
+
+- (void)setAcceptsMessagePack:(BOOL)accepts {
+  if ([(id)transport respondsToSelector:@selector(setAcceptsMessagePack:)])
+    [(DKJSONRPCHTTPTransport *)transport setAcceptsMessagePack:accepts];
+}
+
+- (void)flushBatch {
+  [batch flush];
 }
 
 - (id):(NSArray *)args {
-  NSDictionary *methodCall = dict_(serviceName, @"method", 
-                                   args, @"params", 
-                                   _uuid1(), @"id", 
-                                   @"1.1", @"version");
-  NSError *error = nil;
-  NSString *post = [[[SBJSON alloc] init] stringWithObject:methodCall error:&error];
-  if (error)
-    return [DKDeferred fail:error];
+  return [self callWithName:serviceName args:args];
+}
+
+- (void)setCachePolicy:(DKJSONRPCCachePolicy *)policy forMethod:(NSString *)method {
+  if (policy)
+    [cachePolicies setObject:policy forKey:method];
+  else
+    [cachePolicies removeObjectForKey:method];
+}
+
+- (id)callWithName:(NSString *)name args:(NSArray *)args {
+  DKJSONRPCCachePolicy *policy = ([cachePolicies count] ? 
+                                  [cachePolicies objectForKey:name] : nil);
+  if (policy)
+    return [self _cachedCallWithName:name args:args policy:policy];
+  return [self _sendCallWithName:name args:args];
+}
+
+/**
+ * A deep copy of a decoded JSON value: with mutable containers and strings,
+ * as the parser returns them, or immutable ones that can be shared.
+ */
+static id _copyJSONValue(id value, BOOL mutable) {
+  if ([value isKindOfClass:[NSArray class]]) {
+    NSMutableArray *copy = [NSMutableArray arrayWithCapacity:[value count]];
+    for (id element in value)
+      [copy addObject:_copyJSONValue(element, mutable)];
+    return mutable ? copy : [NSArray arrayWithArray:copy];
+  }
+  if ([value isKindOfClass:[NSDictionary class]]) {
+    NSMutableDictionary *copy = [NSMutableDictionary dictionaryWithCapacity:[value count]];
+    for (id key in value)
+      [copy setObject:_copyJSONValue([value objectForKey:key], mutable) forKey:key];
+    return mutable ? copy : [NSDictionary dictionaryWithDictionary:copy];
+  }
+  if ([value isKindOfClass:[NSString class]])
+    return [(mutable ? [value mutableCopy] : [value copy]) autorelease];
+  return value;
+}
+
+/**
+ * Answers from the memory cache, joins an identical call in flight, or
+ * sends the call and lets later identical calls join it. Every caller gets
+ * a deferred and a copy of the result of its own, so their callbacks don't
+ * see each other's results; the memory cache keeps an immutable one.
+ */
+- (id)_cachedCallWithName:(NSString *)name args:(NSArray *)args 
+                   policy:(DKJSONRPCCachePolicy *)policy {
+  SBJsonWriter *writer = [[[SBJsonWriter alloc] init] autorelease];
+  writer.sortKeys = YES;
+  NSString *canonical = [writer stringWithObject:array_([transport description], name, 
+                                                        (args ? (id)args : (id)[NSNull null]))];
+  if (!canonical)
+    return [self _sendCallWithName:name args:args];
+  NSString *key = [@"jsonrpc:" stringByAppendingString:md5(canonical)];
+  
+  if (policy.ttl > 0.0) {
+    id cached = [[DKDeferredCache sharedCache] memoryValueForKey:key];
+    if (cached)
+      return [DKDeferred succeed:_copyJSONValue(cached, YES)];
+  }
   
-  NSMutableURLRequest *req = [[NSMutableURLRequest alloc] 
-                              initWithURL:[NSURL URLWithString:serviceURL]];
-  [req setValue:@"application/json" forHTTPHeaderField:@"Accept"];
-  [req setValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
-  [req setValue:@"DeferredKit JSON-RPC Proxy 1.0" forHTTPHeaderField:@"User-Agent"];
-  [req setHTTPMethod:@"POST"];
-  [req setHTTPBody:[post dataUsingEncoding:NSUTF8StringEncoding]];
-  DKDeferred *d = [[DKDeferredURLConnection alloc] 
-                   initWithRequest:req pauseFor:0.0f
-                   decodeFunction:[callbackP(_decodeJSONResonse) 
-                                   composeWith:callbackP(_decodeJSON)]];
+  DKDeferred *d = [DKDeferred deferred];
+  NSMutableArray *waiting = (policy.idempotent ? [inFlight objectForKey:key] : nil);
+  if (waiting) {
+    [waiting addObject:d];
+    return d;
+  }
+  waiting = [NSMutableArray arrayWithObject:d];
+  if (policy.idempotent)
+    [inFlight setObject:waiting forKey:key];
+  [[self _sendCallWithName:name args:args]
+   addBoth:curryTS(self, @selector(_cbCall:policy:waiting:results:), key, policy, waiting)];
   return d;
 }
 
-- (id)callWithName:(NSString *)name args:(NSArray *)args {
-  if (serviceName)
-    [serviceName release];
-  serviceName = [name retain];
-  return [self :args];
+- (id)_cbCall:(NSString *)key policy:(DKJSONRPCCachePolicy *)policy 
+      waiting:(NSArray *)waiting results:(id)results {
+  if ([inFlight objectForKey:key] == waiting)
+    [inFlight removeObjectForKey:key];
+  BOOL failed = [results isKindOfClass:[NSError class]];
+  if (!failed)
+    results = _copyJSONValue(results, NO);
+  if (!failed && results && policy.ttl > 0.0)
+    [[DKDeferredCache sharedCache] setMemoryValue:results forKey:key timeout:policy.ttl];
+  for (DKDeferred *d in waiting) {
+    if (d.fired != -1)
+      continue;
+    if (failed)
+      [d errback:results];
+    else
+      [d callback:_copyJSONValue(results, YES)];
+  }
+  return nil;
+}
+
+- (id)_sendCallWithName:(NSString *)name args:(NSArray *)args {
+  NSDictionary *methodCall = dict_(name, @"method", 
+                                   args, @"params", 
+                                   [NSNumber numberWithInt:OSAtomicIncrement32Barrier(&DKJSONRPCLastID)], @"id", 
+                                   @"1.1", @"version");
+  if (batch.window > 0.0)
+    return [batch addCall:methodCall streamed:streamsRequestBody];
+  return [[transport sendMessage:methodCall streamed:streamsRequestBody]
+          addCallback:callbackP(_decodeJSONResonse)];
+}
+
+/**
+ * The JSON-RPC method name for a forwarded selector: its name without the
+ * colons, under this proxy's namespace. Names are built once per selector.
+ */
+- (NSString *)_methodNameForSelector:(SEL)aSelector {
+  NSString *method = (NSString *)CFDictionaryGetValue(methodNames, aSelector);
+  if (!method) {
+    NSString *mName = [[NSString stringWithUTF8String:sel_getName(aSelector)]
+                       stringByReplacingOccurrencesOfString:@":" withString:@""];
+    if ([serviceName length]) {
+      method = [NSString stringWithFormat:@"%@.%@", serviceName, mName];
+    } else {
+      method = mName;
+    }
+    CFDictionarySetValue(methodNames, aSelector, method);
+  }
+  return method;
 }
 
 - (NSMethodSignature *)methodSignatureForSelector:(SEL)aSelector {
+  if (CFDictionaryContainsKey(methodNames, aSelector))
+    return DKJSONProxySignature;
   NSMethodSignature *ret = nil;
   if (! (ret = [super methodSignatureForSelector:aSelector])) { 
-    ret = [NSMethodSignature signatureWithObjCTypes:"@:@@@"];
+    [self _methodNameForSelector:aSelector];
+    ret = DKJSONProxySignature;
   }
   return ret;
 }
 
+/**
+ * Calls the method if the argument is an array, and otherwise returns the
+ * proxy for the namespace, which is created the first time and kept.
+ */
 - (void)forwardInvocation:(NSInvocation *)invocation {
-  NSString *mName = [[NSString stringWithUTF8String:sel_getName([invocation selector])]
-                     stringByReplacingOccurrencesOfString:@":" withString:@""];
-  NSString *method;
-  if (! (serviceName == nil)) {
-    method = [NSString stringWithFormat:@"%@.%@", serviceName, mName];
-  } else {
-    method = mName;
-  }
+  SEL aSelector = [invocation selector];
+  NSString *method = [self _methodNameForSelector:aSelector];
   id callingArg = nil;
   [invocation getArgument:&callingArg atIndex:2];
   if (! (callingArg == nil) && [callingArg isKindOfClass:[NSArray class]]) {
-    [invocation setSelector:@selector(callWithName:args:)];
-    [invocation setArgument:&method atIndex:2];
-    [invocation setArgument:&callingArg atIndex:3];
-    [invocation invokeWithTarget:self];
+    id d = [self callWithName:method args:callingArg];
+    [invocation setReturnValue:&d];
     return;
   }
-  [invocation setSelector:@selector(initWithURL:serviceName:)];
-  [invocation setArgument:&serviceURL atIndex:2];
-  [invocation setArgument:&method atIndex:3];
-  [invocation invokeWithTarget:[DKJSONServiceProxy alloc]];
+  DKJSONServiceProxy *child = (DKJSONServiceProxy *)CFDictionaryGetValue(children, aSelector);
+  if (!child) {
+    child = [[DKJSONServiceProxy alloc] initWithTransport:transport serviceName:method];
+    child->serviceURL = [serviceURL retain];
+    child->streamsRequestBody = streamsRequestBody;
+    [child->batch release];
+    child->batch = [batch retain];
+    [child->cachePolicies release];
+    child->cachePolicies = [cachePolicies retain];
+    [child->inFlight release];
+    child->inFlight = [inFlight retain];
+    CFDictionarySetValue(children, aSelector, child);
+    [child release];
+  }
+  [invocation setReturnValue:&child];
+}
+
+@end
+
+
+@implementation DKJSONRPCCachePolicy
+
+@synthesize ttl, idempotent;
+
++ (id)cachePolicyWithTTL:(NSTimeInterval)aTTL idempotent:(BOOL)isIdempotent {
+  return [[[self alloc] initWithTTL:aTTL idempotent:isIdempotent] autorelease];
+}
+
+- (id)initWithTTL:(NSTimeInterval)aTTL idempotent:(BOOL)isIdempotent {
+  if ((self = [super init])) {
+    ttl = aTTL;
+    idempotent = isIdempotent;
+  }
+  return self;
+}
+
+@end
+
+
+@implementation SBJsonPathExtractor (DKCallback)
+
+- (id):(id)results {
+  if (!results || results == [NSNull null])
+    return nil;
+  id ret = [self valuesWithData:results];
+  if (!ret)
+    return [[self errorTrace] lastObject];
+  return ret;
+}
+
+@end
+
+
+@implementation SBJsonModelDecoder (DKCallback)
+
+- (id):(id)results {
+  if (!results || results == [NSNull null])
+    return nil;
+  id ret = [self objectWithData:results];
+  if (!ret)
+    return [[self errorTrace] lastObject];
+  return ret;
+}
+
+@end
+
+
+@implementation SBJsonDocumentParser (DKCallback)
+
+- (id):(id)results {
+  if (!results || results == [NSNull null])
+    return nil;
+  id ret = [self documentWithData:results];
+  if (!ret)
+    return [[self errorTrace] lastObject];
+  return ret;
 }
 
 @end
@@ -14,12 +14,14 @@
 + (id)loadImage:(NSString *)aUrl cached:(BOOL)cached paused:(BOOL)_paused {
   DKDeferred *d;
   if (cached) {
-    d = [[DKDeferredCache sharedCache] valueForKey:aUrl];
+    d = [[DKDeferredCache sharedCache] entryForKey:aUrl];
     if (_paused)
       d = pauseDeferred(d);
     [d addBoth:curryTS((id)self, @selector(_cachedLoadURLCallback:results:), aUrl)];
-  } else {
-    d = [self loadURL:aUrl paused:_paused];
+  } else if (_paused) {
+    d = [self loadURL:aUrl paused:YES];
+  } else { // keep image traffic from crowding out other requests to the host
+    d = [self loadURL:aUrl priority:DKURLPriorityBackground];
   }
   [d addBoth:curryTS((id)self, @selector(_loadImageCallback:results:), aUrl)];
   return d;
@@ -32,8 +34,10 @@
     if (_paused)
       d = pauseDeferred(d);
     [d addBoth:curryTS((id)self, @selector(_uncachedURLLoadCallback:results:), aUrl)];
-  } else {
-    d = [self loadURL:aUrl paused:_paused];
+  } else if (_paused) {
+    d = [self loadURL:aUrl paused:YES];
+  } else { // keep image traffic from crowding out other requests to the host
+    d = [self loadURL:aUrl priority:DKURLPriorityBackground];
   }
   [[d addBoth:curryTS((id)self, @selector(_loadImageCallback:results:), aUrl)]
    addBoth:curryTS((id)self, @selector(_resizeImageCallbackSize:url:cache:results:), 
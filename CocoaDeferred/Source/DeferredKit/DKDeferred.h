@@ -20,6 +20,18 @@
 #define DKDeferredResultKey @"result"
 #define DKDeferredExceptionKey @"exception"
 
+// hex MD5 of the string's UTF-8, as used for cache keys
+NSString* md5(NSString *str);
+
+/**
+ * Priority classes for loads queued by DKURLConnectionScheduler
+ */
+typedef enum {
+  DKURLPriorityBackground = -1,
+  DKURLPriorityNormal = 0,
+  DKURLPriorityInteractive = 1
+} DKURLPriority;
+
 #define __CHAINED_DEFERRED_REUSE_ERROR [NSException \
   exceptionWithName:@"DeferredInstanceError" \
   reason:@"Chained deferreds can not be re-used" \
@@ -125,6 +137,7 @@
 + (id)loadURL:(NSString *)aUrl paused:(BOOL)_paused;
 + (id)loadURL:(NSString *)aUrl cached:(BOOL)cached;
 + (id)loadURL:(NSString *)aUrl cached:(BOOL)cached paused:(BOOL)_paused;
++ (id)loadURL:(NSString *)aUrl priority:(DKURLPriority)priority;
 // callback methods
 - (id)addBoth:(id<DKCallback>)fn;
 - (id)addCallback:(id<DKCallback>)fn;
@@ -294,6 +307,149 @@
 @end
 
 
+/**
+ * DKLatencyHistogram
+ *
+ * A thread safe, log-bucketed histogram of latencies. Bucket widths grow
+ * by 25% so percentiles are accurate to within a bucket across the range
+ * of 1ms to several minutes. Old samples are decayed by halving every
+ * bucket once <code>decayThreshold</code> samples have been recorded so
+ * percentiles follow recent behaviour.
+ */
+#define DKLatencyHistogramBuckets 64
+
+@interface DKLatencyHistogram : NSObject
+{
+  unsigned long buckets[DKLatencyHistogramBuckets];
+  unsigned long count;
+  unsigned long decayThreshold;
+}
+
+@property(readonly) unsigned long count;
+@property(assign) unsigned long decayThreshold;
+
+- (void)addSample:(NSTimeInterval)seconds;
+// returns the upper bound of the bucket holding the given (0.0 - 1.0) percentile
+- (NSTimeInterval)percentile:(double)p;
+- (void)reset;
+
+@end
+
+
+/**
+ * DKURLConnectionMetrics
+ *
+ * Phase timestamps for one DKDeferredURLConnection, as CFAbsoluteTimes that
+ * stay 0 until the phase is reached. <code>queued</code> is when the 
+ * connection was created, so for loads added to a DKURLConnectionScheduler
+ * the wait for a slot shows up as queue time rather than server latency.
+ * <code>firstByte</code> is when the response headers of the attempt that
+ * won arrived and <code>bytesReceived</code> counts bytes on the wire.
+ */
+#define DKURLPhaseQueue @"queue"
+#define DKURLPhaseFirstByte @"firstByte"
+#define DKURLPhaseTransfer @"transfer"
+#define DKURLPhaseDecode @"decode"
+#define DKURLPhaseTotal @"total"
+
+@interface DKURLConnectionMetrics : NSObject
+{
+  NSString *host;
+  CFAbsoluteTime queued;
+  CFAbsoluteTime started;
+  CFAbsoluteTime firstByte;
+  CFAbsoluteTime lastByte;
+  CFAbsoluteTime decodeStart;
+  CFAbsoluteTime decodeEnd;
+  long long bytesReceived;
+  int attempts;
+}
+
+@property(readwrite, retain) NSString *host;
+@property(assign) CFAbsoluteTime queued;
+@property(assign) CFAbsoluteTime started;
+@property(assign) CFAbsoluteTime firstByte;
+@property(assign) CFAbsoluteTime lastByte;
+@property(assign) CFAbsoluteTime decodeStart;
+@property(assign) CFAbsoluteTime decodeEnd;
+@property(assign) long long bytesReceived;
+@property(assign) int attempts;
+
+- (NSTimeInterval)queueTime;
+- (NSTimeInterval)timeToFirstByte;
+- (NSTimeInterval)transferTime;
+- (NSTimeInterval)decodeTime;
+- (NSTimeInterval)totalTime;
+
+@end
+
+
+/**
+ * DKRetryPolicy
+ *
+ * Describes how a DKDeferredURLConnection recovers from transient failures.
+ * A failed attempt is retried on the same connection object after an
+ * exponentially increasing, jittered delay:
+ * <pre>
+ * delay = min(maxDelay, baseDelay * multiplier^(attempt - 1))
+ * delay = delay - delay * jitter * random(0, 1)
+ * </pre>
+ * An attempt is retried while <code>attempts < maxAttempts</code> and either
+ * its HTTP status code is in <code>retryableStatusCodes</code> or
+ * <code>retryableErrorFunc</code> returns a non-nil value for its NSError.
+ * A <code>Retry-After</code> header raises the delay for that attempt.
+ *
+ * When <code>hedgePercentile</code> is non-zero slow requests are hedged: once
+ * a request has waited longer for a response than that percentile of recent
+ * response latencies to its host (or <code>hedgeDelay</code> until enough
+ * samples exist) a duplicate request is issued. The first connection to
+ * receive a response is kept and the slower one is cancelled.
+ *
+ * Requests other than GET and HEAD are neither retried nor hedged unless
+ * <code>allowsNonIdempotent</code> is set. Requests with an HTTPBodyStream
+ * never are, as the stream can't be sent twice.
+ */
+@interface DKRetryPolicy : NSObject
+{
+  int maxAttempts;
+  NSTimeInterval baseDelay;
+  NSTimeInterval maxDelay;
+  double multiplier;
+  double jitter;
+  NSIndexSet *retryableStatusCodes;
+  id<DKCallback> retryableErrorFunc;
+  double hedgePercentile;
+  NSTimeInterval hedgeDelay;
+  unsigned long hedgeMinSamples;
+  BOOL allowsNonIdempotent;
+}
+
+@property(nonatomic, assign) int maxAttempts;
+@property(nonatomic, assign) NSTimeInterval baseDelay;
+@property(nonatomic, assign) NSTimeInterval maxDelay;
+@property(nonatomic, assign) double multiplier;
+@property(nonatomic, assign) double jitter;
+@property(nonatomic, retain) NSIndexSet *retryableStatusCodes;
+@property(nonatomic, retain) id<DKCallback> retryableErrorFunc;
+@property(nonatomic, assign) double hedgePercentile;
+@property(nonatomic, assign) NSTimeInterval hedgeDelay;
+@property(nonatomic, assign) unsigned long hedgeMinSamples;
+@property(nonatomic, assign) BOOL allowsNonIdempotent;
+
+// 3 attempts, 0.5s doubling backoff capped at 30s, 50% jitter, no hedging
++ (id)retryPolicy;
+// as above, hedging at the 95th percentile (0.5s until enough samples)
++ (id)hedgedRetryPolicy;
+- (NSTimeInterval)delayForAttempt:(int)attempt;
+- (BOOL)shouldRetryStatus:(NSInteger)status attempt:(int)attempt;
+- (BOOL)shouldRetryError:(NSError *)error attempt:(int)attempt;
+- (BOOL)shouldRetryRequest:(NSURLRequest *)req;
+// returns 0 if the request should not be hedged
+- (NSTimeInterval)hedgeDelayForRequest:(NSURLRequest *)req;
+
+@end
+
+
 /**
  * DKDeferredURLConnection
  *
@@ -301,8 +457,20 @@
  * with the NSData value of the entire URL when done downloading. Can
  * be started paused in which case [d callback:nill] will start the
  * connection.
+ *
+ * Given a DKRetryPolicy transient failures are retried and slow requests
+ * are hedged without allocating a new connection deferred. The policy
+ * defaults to <code>+defaultRetryPolicy</code>, which is nil (no retries)
+ * unless set.
+ *
+ * A <code>dataCallback</code> sees the body as it arrives, for consumers of
+ * long or endless bodies, which should also turn off <code>buffersData</code>.
+ * Such a consumer can stop the load by returning an NSError, which the
+ * connection errbacks with, and can hold off the server by pausing reads
+ * while it catches up: the connection is taken off the run loop so the
+ * socket's buffers fill and TCP flow control slows the sender down.
  */
-@interface DKDeferredURLConnection : DKDeferred 
+@interface DKDeferredURLConnection : DKDeferred
 {
   NSString *url;
   NSMutableData *_data;
@@ -313,6 +481,23 @@
   id<DKCallback> progressCallback;
   id<DKCallback> decodeFunction;
   NSTimeInterval refreshFrequency;
+  DKRetryPolicy *retryPolicy;
+  NSURLConnection *hedgeConnection;
+  CFAbsoluteTime attemptStartTime;
+  CFAbsoluteTime hedgeStartTime;
+  int attempts;
+  NSInteger statusCode;
+  NSURLResponse *response;
+  id<DKCallback> dataCallback;
+  struct z_stream_s *_zstream;
+  int _inflateState; // 0 not yet known, -1 not compressed, 1 inflating, 2 past the end
+  BOOL _inflateMembers; // gzip, where another member may follow the end
+  NSMutableData *_inflateHead; // the first byte, until there are two to tell the format by
+  long receivedLength;
+  BOOL deliveredData;
+  DKURLConnectionMetrics *metrics;
+  BOOL buffersData;
+  BOOL readingPaused;
 }
 
 @property(nonatomic, readonly) NSString *url;
@@ -321,6 +506,16 @@
 @property(nonatomic, readonly) double percentComplete;
 @property(nonatomic, readwrite, retain) id<DKCallback> progressCallback;
 @property(nonatomic, readwrite, assign) NSTimeInterval refreshFrequency;
+@property(nonatomic, readonly) DKRetryPolicy *retryPolicy;
+@property(nonatomic, readonly) int attempts;
+@property(nonatomic, readonly) NSInteger statusCode;
+@property(nonatomic, readonly) NSURLResponse *response;
+// called with each decoded chunk of the body as it arrives, returns an NSError to stop the load
+@property(nonatomic, readwrite, retain) id<DKCallback> dataCallback;
+// whether the body is kept for the decodeFunction and data (YES)
+@property(nonatomic, assign) BOOL buffersData;
+@property(nonatomic, readonly) BOOL readingPaused;
+@property(nonatomic, readonly) DKURLConnectionMetrics *metrics;
 
 // initializers
 + (id)deferredURLConnection:(NSString *)aUrl;
@@ -328,18 +523,42 @@
 - (id)initWithURL:(NSString *)aUrl;
 - (id)initWithURL:(NSString *)aUrl paused:(BOOL)_paused;
 - (id)initWithURL:(NSString *)aUrl pauseFor:(NSTimeInterval)pause;
-- (id)initWithRequest:(NSURLRequest *)req 
+- (id)initWithRequest:(NSURLRequest *)req
              pauseFor:(NSTimeInterval)pause
        decodeFunction:(id<DKCallback>)decodeF;
-- (id)initRequest:(NSURLRequest *)req 
+- (id)initRequest:(NSURLRequest *)req
+   decodeFunction:(id<DKCallback>)decodeF
+           paused:(BOOL)_paused;
+- (id)initRequest:(NSURLRequest *)req
    decodeFunction:(id<DKCallback>)decodeF
+      retryPolicy:(DKRetryPolicy *)policy
            paused:(BOOL)_paused;
 // internal callbacks
 - (id)_cbStartLoading:(id)result;
 - (void)setProgressCallback:(id<DKCallback>)callback withFrequency:(NSTimeInterval)frequency;
 - (void)_cbProgressUpdate;
-// tracks how many DKDeferredURLConnections are currently active
+- (void)_cbRetry;
+- (void)_cbHedge;
+// stop and restart reading the body; call on the thread the connection runs on
+- (void)pauseReading;
+- (void)resumeReading;
+// stops loading and errbacks with error
+- (void)abortWithError:(NSError *)error;
+- (void)_receiveChunk:(NSData *)chunk;
+- (BOOL)_receiveBody:(NSData *)data;
+- (BOOL)_beginInflate:(NSData *)firstChunk;
+- (BOOL)_inflate:(NSData *)data;
+- (void)_endInflate;
+// tracks how many NSURLConnections are currently active (thread safe)
 + (int)requestCount;
+// policy used by initializers that don't take one
++ (DKRetryPolicy *)defaultRetryPolicy;
++ (void)setDefaultRetryPolicy:(DKRetryPolicy *)policy;
+// response latencies per host, used to pick hedging thresholds
++ (DKLatencyHistogram *)latencyHistogramForHost:(NSString *)host;
+// per host histograms of each DKURLPhase* of finished loads
++ (DKLatencyHistogram *)latencyHistogramForHost:(NSString *)host phase:(NSString *)phase;
++ (void)_recordMetrics:(DKURLConnectionMetrics *)m;
 
 @end
 
@@ -372,7 +591,25 @@
   * The current cache implementation used in DKDeferred. It implements
   * the DKCache protocol and uses a simple filesystem backend stored in
   * the users' applications cache directory.
+  *
+  * In front of the files sits a small memory tier for values that are
+  * cheap to recompute but read often, like JSON-RPC results. It is only
+  * used through the memory methods, is synchronous and safe to use from
+  * any thread, and holds up to <code>maxMemoryEntries</code> values,
+  * dropping the oldest first. Values are kept as is, not copied.
+  *
+  * Files are written with NSKeyedArchiver unless <code>valueEncoding</code>
+  * is DKCacheValueEncodingMessagePack, in which case values are written as
+  * MessagePack, which is smaller and much quicker to read back. Only values
+  * made entirely of JSON types and NSData are packed; anything else, such as
+  * an NSDate, is still archived so that it comes back as it went in. Either
+  * kind of file is read whatever the current setting.
   */
+typedef enum {
+  DKCacheValueEncodingArchive = 0,
+  DKCacheValueEncodingMessagePack = 1
+} DKCacheValueEncoding;
+
 @interface DKDeferredCache : NSObject <DKCache>
 {
   int maxEntries;
@@ -380,19 +617,42 @@
   NSString *dir;
   NSTimeInterval defaultTimeout;
   NSOperationQueue *operationQueue;
+  int maxMemoryEntries;
+  NSMutableDictionary *memory;
+  NSMutableArray *memoryKeys;
+  NSLock *memoryLock;
+  DKCacheValueEncoding valueEncoding;
 }
 
 @property(assign) NSTimeInterval defaultTimeout;
+@property(assign) int maxMemoryEntries; // 200
+@property(assign) DKCacheValueEncoding valueEncoding; // DKCacheValueEncodingArchive
 
 + (id)sharedCache;
 - (id)initWithDirectory:(NSString *)_dir 
              maxEntries:(int)_maxEntries
           cullFrequency:(int)_cullFrequency;
+// stores response metadata (validators etc.) alongside the value
+- (id)setValue:(NSObject *)_value forKey:(NSString *)_key
+       timeout:(NSTimeInterval)_seconds
+      metadata:(NSDictionary *)_metadata; // deferred -> nil
+// unlike valueForKey: also returns expired entries that can be revalidated
+- (id)entryForKey:(NSString *)_key; // deferred -> DKDeferredCacheEntry
+// memory tier, synchronous; a timeout of 0 means defaultTimeout
+- (id)memoryValueForKey:(NSString *)_key; // nil if missing or expired
+- (void)setMemoryValue:(id)_value forKey:(NSString *)_key timeout:(NSTimeInterval)_seconds;
+- (void)deleteMemoryValueForKey:(NSString *)_key;
+- (id)_setValue:(NSObject *)value 
+         forKey:(NSString *)key
+        timeout:(NSNumber *)timeout 
+            arg:(id)arg;
 - (id)_setValue:(NSObject *)value 
          forKey:(NSString *)key
         timeout:(NSNumber *)timeout 
+       metadata:(id)metadata
             arg:(id)arg;
 - (id)_getValue:(NSString *)key;
+- (id)_getEntry:(NSString *)key;
 - (id)_getManyValues:(NSArray *)keys;
 - (void)_cull;
 - (int)_getNumEntries;
@@ -400,6 +660,32 @@
 @end
 
 
+/**
+ * DKDeferredCacheEntry
+ *
+ * A value read back from DKDeferredCache along with the metadata it was
+ * stored with. For cached URL loads the metadata holds the ETag, 
+ * Last-Modified and Cache-Control headers of the response, which is what
+ * allows an expired entry to be revalidated instead of downloaded again.
+ */
+@interface DKDeferredCacheEntry : NSObject
+{
+  id value;
+  NSDictionary *metadata;
+  NSDate *expires;
+}
+
+@property(readonly) id value;
+@property(readonly) NSDictionary *metadata;
+@property(readonly) NSDate *expires;
+
+- (id)initWithValue:(id)_value metadata:(NSDictionary *)_metadata expires:(NSDate *)_expires;
+- (BOOL)isExpired;
+- (BOOL)canRevalidate;
+
+@end
+
+
 @interface NSObject(DKDeferredCache)
 
 + (BOOL)canBeStoredInCache;
@@ -507,3 +793,50 @@
 - (void)setFinalizeFunc:(id<DKCallback>)f;
 
 @end
+
+
+/**
+ * = DKURLConnectionScheduler =
+ *
+ * Queues paused DKDeferredURLConnections by host so one busy host can't
+ * starve the others. At most <code>maxConnectionsPerHost</code> loads run
+ * against a host (overridable per host) and <code>maxConnections</code> in
+ * total. Waiting loads sit in a DKMappedPriorityQueue per host ordered by
+ * priority class and then by age. When a slot frees up the host with the
+ * most urgent waiting load is served; hosts of equal priority take turns.
+ *
+ * Like DKDeferredPool, deferreds added must be paused, the scheduler resumes
+ * them with [d callback:nil].
+ */
+@interface DKURLConnectionScheduler : NSObject
+{
+  NSMutableDictionary *_queues; // {host => DKMappedPriorityQueue}
+  NSMutableDictionary *_running; // {host => NSNumber}
+  NSMutableDictionary *_hostLimits; // {host => NSNumber}
+  NSMutableArray *_hosts; // round robin order
+  NSMutableSet *_active;
+  NSUInteger _nextHost;
+  unsigned long _sequence;
+  volatile int32_t inFlight;
+  int maxConnections;
+  int maxConnectionsPerHost;
+  NSLock *wLock;
+}
+
+@property(assign) int maxConnections;
+@property(assign) int maxConnectionsPerHost;
+@property(readonly) int inFlight;
+
++ (id)sharedScheduler;
+- (id)add:(DKDeferred *)d host:(NSString *)host priority:(DKURLPriority)priority;
+- (id)loadRequest:(NSURLRequest *)req 
+   decodeFunction:(id<DKCallback>)decodeF
+         priority:(DKURLPriority)priority;
+- (id)loadURL:(NSString *)aUrl priority:(DKURLPriority)priority;
+- (void)setMaxConnections:(int)numConnections forHost:(NSString *)host;
+- (int)waiting;
+- (void)drain;
+- (id)_cbFinished:(id)load :(id)results;
+- (void)_resumeWaiting;
+
+@end
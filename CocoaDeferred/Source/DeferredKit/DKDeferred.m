@@ -6,7 +6,10 @@
  */
 
 #import "DKDeferred.h"
+#import "DKMessagePack.h"
 #import <CommonCrypto/CommonDigest.h>
+#import <libkern/OSAtomic.h>
+#import <zlib.h>
 
 
 NSString* md5(NSString *str) {
@@ -19,6 +22,55 @@ NSString* md5(NSString *str) {
           result[8], result[9], result[10], result[11], result[12], result[13], result[14], result[15]];
 }
 
+// case insensitive, NSHTTPURLResponse normalizes header names
+static id _headerValue(NSDictionary *headers, NSString *name) {
+  for (NSString *k in headers) {
+    if ([k caseInsensitiveCompare:name] == NSOrderedSame)
+      return [headers objectForKey:k];
+  }
+  return nil;
+}
+
+// the response headers DKDeferredCache keeps with a cached URL load
+static NSDictionary *_cacheMetadata(NSURLResponse *response) {
+  NSMutableDictionary *ret = [NSMutableDictionary dictionary];
+  if (![response isKindOfClass:[NSHTTPURLResponse class]])
+    return ret;
+  NSDictionary *headers = [(NSHTTPURLResponse *)response allHeaderFields];
+  for (NSString *name in array_(@"ETag", @"Last-Modified", @"Cache-Control")) {
+    id v = _headerValue(headers, name);
+    if (v)
+      [ret setObject:v forKey:name];
+  }
+  return ret;
+}
+
+static BOOL _canRevalidate(NSDictionary *metadata) {
+  return ([metadata objectForKey:@"ETag"] || [metadata objectForKey:@"Last-Modified"]);
+}
+
+// seconds a response may be served without revalidating, -1 if it 
+// shouldn't be stored at all
+static NSTimeInterval _cacheLifetime(NSDictionary *metadata, NSTimeInterval defaultTimeout) {
+  NSString *cc = [metadata objectForKey:@"Cache-Control"];
+  if (!cc)
+    return defaultTimeout;
+  NSTimeInterval ret = defaultTimeout;
+  NSCharacterSet *ws = [NSCharacterSet whitespaceCharacterSet];
+  for (NSString *directive in [[cc lowercaseString] componentsSeparatedByString:@","]) {
+    directive = [directive stringByTrimmingCharactersInSet:ws];
+    if ([directive isEqualToString:@"no-store"])
+      return -1;
+    else if ([directive isEqualToString:@"no-cache"])
+      return 0;
+    else if ([directive hasPrefix:@"max-age="])
+      ret = MAX(0, [[directive substringFromIndex:8] doubleValue]);
+  }
+  return ret;
+}
+
+int DKLogLevel = DKLogLevelWarn;
+
 id _gatherResultsCallback(id results) {
   NSMutableArray *ret = [NSMutableArray array];
   for (int i = 0; i < [results count]; i++) {
@@ -65,7 +117,7 @@ id _gatherResultsCallback(id results) {
   return d;
 }
 
-// used by +wait:value:
+// used by +wait:value: and cached loads
 + (id)_returnValueCallback:(id)value results:(id)results_ {
   return value;
 }
@@ -121,7 +173,7 @@ id _gatherResultsCallback(id results) {
 + (id)loadURL:(NSString *)aUrl cached:(BOOL)cached paused:(BOOL)_paused {
   id ret;
   if (cached) {
-    ret = [[DKDeferredCache sharedCache] valueForKey:aUrl];
+    ret = [[DKDeferredCache sharedCache] entryForKey:aUrl];
     if (_paused)
       ret = pauseDeferred(ret);
     [ret addBoth:curryTS((id)self, @selector(_cachedLoadURLCallback:results:), aUrl)];
@@ -131,6 +183,10 @@ id _gatherResultsCallback(id results) {
   return ret;
 }
 
++ (id)loadURL:(NSString *)aUrl priority:(DKURLPriority)priority {
+  return [[DKURLConnectionScheduler sharedScheduler] loadURL:aUrl priority:priority];
+}
+
 + (id)_uncachedURLLoadCallback:(NSString *)url results:(id)_results {
   if (isDeferred(_results))
     return [_results addBoth:curryTS((id)self, @selector(_uncachedURLLoadCallback:results:), url)];
@@ -143,20 +199,66 @@ id _gatherResultsCallback(id results) {
   return nil;
 }
 
++ (id)_loadURL:(NSString *)aUrl revalidating:(id)entry {
+  NSMutableURLRequest *req = [NSMutableURLRequest
+                              requestWithURL:[NSURL URLWithString:aUrl]
+                              cachePolicy:NSURLRequestReloadIgnoringCacheData
+                              timeoutInterval:15.0f];
+  if (! (entry == [NSNull null])) {
+    NSString *etag = [[entry metadata] objectForKey:@"ETag"];
+    NSString *modified = [[entry metadata] objectForKey:@"Last-Modified"];
+    if (etag)
+      [req setValue:etag forHTTPHeaderField:@"If-None-Match"];
+    if (modified)
+      [req setValue:modified forHTTPHeaderField:@"If-Modified-Since"];
+  }
+  DKDeferredURLConnection *d = [[[DKDeferredURLConnection alloc]
+                                 initRequest:req decodeFunction:nil paused:NO] autorelease];
+  return [d addBoth:curryTS((id)self, @selector(_storeURLCallback:connection:entry:results:),
+                            aUrl, d, entry)];
+}
+
++ (id)_storeURLCallback:(NSString *)url connection:(DKDeferredURLConnection *)c
+                  entry:(id)entry results:(id)_results {
+  if ([_results isKindOfClass:[NSError class]])
+    return _results;
+  NSInteger status = c.statusCode;
+  if (status == 304 && entry == [NSNull null])
+    return _results;
+  if (! (status == 0 || status == 200 || status == 203 || status == 304))
+    return _results; // not something we can serve again later
+  DKDeferredCache *cache = [DKDeferredCache sharedCache];
+  NSDictionary *metadata = _cacheMetadata(c.response);
+  id value = _results;
+  if (status == 304) { // keep the body we have, take any updated headers
+    NSMutableDictionary *merged = [NSMutableDictionary dictionaryWithDictionary:[entry metadata]];
+    [merged addEntriesFromDictionary:metadata];
+    metadata = merged;
+    value = [entry value];
+  }
+  NSTimeInterval lifetime = _cacheLifetime(metadata, [cache defaultTimeout]);
+  if (lifetime < 0) {
+    [cache deleteValueForKey:url];
+  } else if (lifetime > 0 || _canRevalidate(metadata)) {
+    // fire once the entry is written, so the next cached load finds it
+    return [[cache setValue:value forKey:url timeout:lifetime metadata:metadata]
+            addBoth:curryTS((id)self, @selector(_returnValueCallback:results:), value)];
+  }
+  return value;
+}
+
 + (id)_cachedLoadURLCallback:(NSString *)url results:(id)_results {
   if (isDeferred(_results))
     return [_results addBoth:curryTS((id)self, @selector(_cachedLoadURLCallback:results:), url)];
   
-  if (_results == [NSNull null]) {
-    return [[DKDeferredURLConnection loadURL:url] 
-            addBoth:curryTS((id)self, @selector(_cachedLoadURLCallback:results:), url)];
-  } else {
-    [[DKDeferredCache sharedCache] 
-     setValue:_results forKey:url
-     timeout:[[DKDeferredCache sharedCache] defaultTimeout]];
-    return _results;
+  if ([_results isKindOfClass:[DKDeferredCacheEntry class]]) {
+    if (![_results isExpired])
+      return [_results value];
+    return [self _loadURL:url revalidating:_results];
+  } else if (_results == [NSNull null]) {
+    return [self _loadURL:url revalidating:_results];
   }
-  return nil;
+  return _results; // a bare value from -[DKDeferredCache valueForKey:]
 }
 
 + (id)_cbStartConnection:(id)aUrl {
@@ -660,12 +762,211 @@ id _gatherResultsCallback(id results) {
 @end
 
 
+id _isTransientURLError(id error) {
+  if ([error isKindOfClass:[NSError class]] &&
+      [[error domain] isEqualToString:NSURLErrorDomain]) {
+    switch ([error code]) {
+      case NSURLErrorTimedOut:
+      case NSURLErrorCannotFindHost:
+      case NSURLErrorCannotConnectToHost:
+      case NSURLErrorNetworkConnectionLost:
+      case NSURLErrorDNSLookupFailed:
+        return error;
+    }
+  }
+  return nil;
+}
+
+
+@implementation DKLatencyHistogram
+
+@synthesize count, decayThreshold;
+
+// bucket i holds samples of up to 1.25^i milliseconds
+static int _latencyBucket(NSTimeInterval seconds) {
+  double ms = seconds * 1000.0;
+  if (ms <= 1.0)
+    return 0;
+  int i = (int)ceil(log(ms) / log(1.25));
+  return (i >= DKLatencyHistogramBuckets) ? DKLatencyHistogramBuckets - 1 : i;
+}
+
+- (id)init {
+  if ((self = [super init])) {
+    decayThreshold = 1024;
+    [self reset];
+  }
+  return self;
+}
+
+- (void)addSample:(NSTimeInterval)seconds {
+  @synchronized(self) {
+    buckets[_latencyBucket(seconds)] += 1;
+    count += 1;
+    if (decayThreshold && count >= decayThreshold) {
+      count = 0;
+      for (int i = 0; i < DKLatencyHistogramBuckets; i++) {
+        buckets[i] >>= 1;
+        count += buckets[i];
+      }
+    }
+  }
+}
+
+- (NSTimeInterval)percentile:(double)p {
+  NSTimeInterval ret = 0.0;
+  @synchronized(self) {
+    if (count) {
+      unsigned long rank = (unsigned long)ceil(p * count);
+      unsigned long seen = 0;
+      int i;
+      for (i = 0; i < DKLatencyHistogramBuckets - 1; i++) {
+        seen += buckets[i];
+        if (seen && seen >= rank)
+          break;
+      }
+      ret = pow(1.25, i) / 1000.0;
+    }
+  }
+  return ret;
+}
+
+- (void)reset {
+  @synchronized(self) {
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+  }
+}
+
+@end
+
+
+@implementation DKURLConnectionMetrics
+
+@synthesize host, queued, started, firstByte, lastByte, decodeStart, decodeEnd;
+@synthesize bytesReceived, attempts;
+
+- (void)dealloc {
+  [host release];
+  [super dealloc];
+}
+
+static NSTimeInterval _phase(CFAbsoluteTime from, CFAbsoluteTime to) {
+  return (from && to && to > from) ? to - from : 0.0;
+}
+
+- (NSTimeInterval)queueTime { return _phase(queued, started); }
+- (NSTimeInterval)timeToFirstByte { return _phase(started, firstByte); }
+- (NSTimeInterval)transferTime { return _phase(firstByte, lastByte); }
+- (NSTimeInterval)decodeTime { return _phase(decodeStart, decodeEnd); }
+- (NSTimeInterval)totalTime { return _phase(queued, decodeEnd ? decodeEnd : lastByte); }
+
+- (NSString *)description {
+  return [NSString stringWithFormat:
+          @"<%@ %@ queue:%.3f firstByte:%.3f transfer:%.3f decode:%.3f total:%.3f bytes:%lld attempts:%d>",
+          [self class], host, [self queueTime], [self timeToFirstByte], [self transferTime],
+          [self decodeTime], [self totalTime], bytesReceived, attempts];
+}
+
+@end
+
+
+@implementation DKRetryPolicy
+
+@synthesize maxAttempts, baseDelay, maxDelay, multiplier, jitter;
+@synthesize retryableStatusCodes, retryableErrorFunc;
+@synthesize hedgePercentile, hedgeDelay, hedgeMinSamples, allowsNonIdempotent;
+
++ (id)retryPolicy {
+  return [[[self alloc] init] autorelease];
+}
+
++ (id)hedgedRetryPolicy {
+  DKRetryPolicy *p = [self retryPolicy];
+  p.hedgePercentile = 0.95;
+  return p;
+}
+
+- (id)init {
+  if ((self = [super init])) {
+    maxAttempts = 3;
+    baseDelay = 0.5;
+    maxDelay = 30.0;
+    multiplier = 2.0;
+    jitter = 0.5;
+    NSMutableIndexSet *codes = [NSMutableIndexSet indexSet];
+    [codes addIndex:408];
+    [codes addIndex:429];
+    [codes addIndex:500];
+    [codes addIndexesInRange:NSMakeRange(502, 3)]; // 502, 503, 504
+    retryableStatusCodes = [codes copy];
+    retryableErrorFunc = [callbackP(_isTransientURLError) retain];
+    hedgePercentile = 0.0;
+    hedgeDelay = 0.5;
+    hedgeMinSamples = 20;
+    allowsNonIdempotent = NO;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [retryableStatusCodes release];
+  [retryableErrorFunc release];
+  [super dealloc];
+}
+
+- (NSTimeInterval)delayForAttempt:(int)attempt {
+  NSTimeInterval delay = baseDelay * pow(multiplier, (attempt > 1) ? attempt - 1 : 0);
+  if (delay > maxDelay)
+    delay = maxDelay;
+  return delay - delay * jitter * ((double)arc4random() / (double)UINT32_MAX);
+}
+
+- (BOOL)shouldRetryStatus:(NSInteger)status attempt:(int)attempt {
+  return attempt < maxAttempts && status > 0 && [retryableStatusCodes containsIndex:status];
+}
+
+- (BOOL)shouldRetryError:(NSError *)error attempt:(int)attempt {
+  return attempt < maxAttempts && retryableErrorFunc && !([retryableErrorFunc :error] == nil);
+}
+
+- (BOOL)shouldRetryRequest:(NSURLRequest *)req {
+  // a body stream can only be read once
+  if ([req HTTPBodyStream])
+    return NO;
+  NSString *method = [req HTTPMethod];
+  return (allowsNonIdempotent || !method ||
+          [method isEqualToString:@"GET"] || [method isEqualToString:@"HEAD"]);
+}
+
+- (NSTimeInterval)hedgeDelayForRequest:(NSURLRequest *)req {
+  if (hedgePercentile <= 0.0 || ![self shouldRetryRequest:req])
+    return 0.0;
+  DKLatencyHistogram *h = [DKDeferredURLConnection latencyHistogramForHost:[[req URL] host]];
+  if ([h count] < hedgeMinSamples)
+    return hedgeDelay;
+  return [h percentile:hedgePercentile];
+}
+
+@end
+
+
+@interface DKDeferredURLConnection () // private methods
+- (void)_startAttempt;
+- (void)_connectionDidEnd:(NSURLConnection *)aConnection;
+@end
+
+
 @implementation DKDeferredURLConnection
 
-static NSInteger __urlConnectionCount;
+static volatile int32_t __urlConnectionCount;
+static DKRetryPolicy *__defaultRetryPolicy;
+static NSMutableDictionary *__latencyHistograms;
 
 @synthesize url, refreshFrequency, progressCallback;
 @synthesize expectedContentLength, percentComplete;
+@synthesize retryPolicy, attempts, statusCode, response, dataCallback, metrics;
+@synthesize buffersData, readingPaused;
 
 + (id)deferredURLConnection:(NSString *)aUrl {
   return [[(DKDeferredURLConnection *)[DKDeferredURLConnection alloc] initWithURL:aUrl] autorelease];
@@ -699,19 +1000,31 @@ static NSInteger __urlConnectionCount;
 - (id)initRequest:(NSURLRequest *)req 
    decodeFunction:(id<DKCallback>)decodeF
            paused:(BOOL)_paused {
+  return [self initRequest:req
+            decodeFunction:decodeF
+               retryPolicy:[DKDeferredURLConnection defaultRetryPolicy]
+                    paused:_paused];
+}
+
+- (id)initRequest:(NSURLRequest *)req
+   decodeFunction:(id<DKCallback>)decodeF
+      retryPolicy:(DKRetryPolicy *)policy
+           paused:(BOOL)_paused {
   if ((self = [super initWithCanceller:nil])) {
-    if (!__urlConnectionCount) {
-      __urlConnectionCount = 0;
-    }
     refreshFrequency = 1.0f;
     expectedContentLength = 0L;
     percentComplete = 0.0f;
     progressCallback = nil;
     url = [[req URL] retain];
+    metrics = [[DKURLConnectionMetrics alloc] init];
+    metrics.host = [[req URL] host];
+    metrics.queued = CFAbsoluteTimeGetCurrent();
     _data = [[NSMutableData data] retain];
     [_data setLength:0];
+    buffersData = YES;
     request = [req retain];
     decodeFunction = [decodeF retain];
+    retryPolicy = [policy retain];
     if (_paused) {
       return [[DKDeferred deferred] addCallback:callbackTS(self, _cbStartLoading:)];
     } else {
@@ -724,36 +1037,25 @@ static NSInteger __urlConnectionCount;
 - (id)initWithRequest:(NSURLRequest *)req pauseFor:(NSTimeInterval)pause
        decodeFunction:(id<DKCallback>)decodeF {
   if ((self = [super initWithCanceller:nil])) {
-    // init __urlConnetionCount
-    if (!__urlConnectionCount) {
-      __urlConnectionCount = 0;
-    }
     refreshFrequency = 1.0f;
     expectedContentLength = 0L;
     percentComplete = 0.0f;
     progressCallback = nil;
     url = [[req URL] retain];
+    metrics = [[DKURLConnectionMetrics alloc] init];
+    metrics.host = [[req URL] host];
+    metrics.queued = CFAbsoluteTimeGetCurrent();
     _data = [[NSMutableData data] retain];
     [_data setLength:0];
+    buffersData = YES;
     request = [req retain];
     decodeFunction = [decodeF retain];
+    retryPolicy = [[DKDeferredURLConnection defaultRetryPolicy] retain];
     if (pause > 0) {
       [DKDeferred callLater:pause func:callbackTS(self, _cbStartLoading:)];
     } else {
-      connection = [[NSURLConnection 
-                     connectionWithRequest:request
-                     delegate:self] retain];
-      __urlConnectionCount += 1;
-      NSLog(@"loading %@ : %@", self.started, url);
-      if (!connection) {
-        __urlConnectionCount -= 1;
-        NSLog(@"error:???");
-        [self errback:
-         [NSError
-          errorWithDomain:DKDeferredURLErrorDomain 
-          code:DKDeferredURLError 
-          userInfo:EMPTY_DICT]];
-      }
+      DKLogDebug(@"loading %@ : %@", self.started, url);
+      [self _startAttempt];
     }
   }
   return self;
@@ -778,46 +1080,271 @@ static NSInteger __urlConnectionCount;
 }
 
 - (void)connection:(NSURLConnection *)aConnection 
-didReceiveResponse:(NSURLResponse *)response {
+didReceiveResponse:(NSURLResponse *)aResponse {
+  if (! (aConnection == connection || aConnection == hedgeConnection))
+    return;
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_cbHedge) object:nil];
+  CFAbsoluteTime startTime = attemptStartTime;
+  if (hedgeConnection) { // first response wins the race, drop the slower request
+    NSURLConnection *slower = (aConnection == connection) ? hedgeConnection : connection;
+    if (aConnection == hedgeConnection)
+      startTime = hedgeStartTime;
+    [slower cancel];
+    [self _connectionDidEnd:slower];
+    if (!connection) {
+      connection = hedgeConnection;
+      hedgeConnection = nil;
+    }
+  }
+  metrics.firstByte = CFAbsoluteTimeGetCurrent();
+  [[DKDeferredURLConnection latencyHistogramForHost:[[request URL] host]]
+   addSample:metrics.firstByte - startTime];
+  [response release];
+  response = [aResponse retain];
+  statusCode = 0;
+  if ([response isKindOfClass:[NSHTTPURLResponse class]])
+    statusCode = [(NSHTTPURLResponse *)response statusCode];
+  if (retryPolicy && [retryPolicy shouldRetryRequest:request] && 
+      [retryPolicy shouldRetryStatus:statusCode attempt:attempts]) {
+    NSTimeInterval delay = [retryPolicy delayForAttempt:attempts];
+    NSTimeInterval retryAfter = [[[(NSHTTPURLResponse *)response allHeaderFields]
+                                  objectForKey:@"Retry-After"] doubleValue];
+    if (retryAfter > delay)
+      delay = MIN(retryAfter, retryPolicy.maxDelay);
+    [connection cancel];
+    [self _connectionDidEnd:connection];
+    [self performSelector:@selector(_cbRetry) withObject:nil afterDelay:delay];
+    return;
+  }
   expectedContentLength = [response expectedContentLength];
 //  NSLog(@" - didreceiveresponse - %@", [(NSHTTPURLResponse *)response allHeaderFields]);
   percentComplete = 0.0f;
+  receivedLength = 0;
   [_data setLength:0];
+  [self _endInflate];
   [self _cbProgressUpdate];
 }
 
 - (void)connection:(NSURLConnection *)aConnection 
     didReceiveData:(NSData *)data {
-  [_data appendData:data];
+  if (! (aConnection == connection))
+    return;
+  receivedLength += [data length];
+  metrics.bytesReceived += [data length];
+  if (_inflateState == 0 && [_inflateHead length] + [data length] < 2) {
+    if (!_inflateHead)
+      _inflateHead = [[NSMutableData alloc] init];
+    [_inflateHead appendData:data];
+  } else {
+    if ([_inflateHead length]) {
+      [_inflateHead appendData:data];
+      data = [_inflateHead autorelease];
+      _inflateHead = nil;
+    }
+    if (![self _receiveBody:data])
+      return;
+  }
   [self _cbProgressUpdate];
 }
 
+// Inflates the bytes if the body is compressed, and hands them on. Returns
+// NO if they can't be inflated, after failing the load.
+- (BOOL)_receiveBody:(NSData *)data {
+  if (_inflateState == 0)
+    _inflateState = [self _beginInflate:data] ? 1 : -1;
+  if (_inflateState < 0) {
+    [self _receiveChunk:data];
+    return YES;
+  }
+  if ([self _inflate:data])
+    return YES;
+  NSString *reason = (_inflateState == 2 ? @"data after the end of the compressed stream"
+                      : _zstream->msg ? [NSString stringWithUTF8String:_zstream->msg] 
+                                      : @"invalid compressed data");
+  [connection cancel];
+  [self _connectionDidEnd:connection];
+  [self _endInflate];
+  [self errback:[NSError errorWithDomain:DKDeferredURLErrorDomain 
+                                    code:DKDeferredURLError
+                                userInfo:dict_(reason, NSLocalizedDescriptionKey)]];
+  return NO;
+}
+
+- (void)_receiveChunk:(NSData *)chunk {
+  if (buffersData)
+    [_data appendData:chunk];
+  if (dataCallback) {
+    deliveredData = YES;
+    id ret = [dataCallback :chunk];
+    if ([ret isKindOfClass:[NSError class]])
+      [self abortWithError:ret];
+  }
+}
+
+- (void)pauseReading {
+  if (readingPaused || !connection)
+    return;
+  readingPaused = YES;
+  [connection unscheduleFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+}
+
+- (void)resumeReading {
+  if (!readingPaused)
+    return;
+  readingPaused = NO;
+  [connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+}
+
+- (void)abortWithError:(NSError *)error {
+  if (! (self.fired == -1))
+    return;
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_cbRetry) object:nil];
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_cbHedge) object:nil];
+  [connection cancel];
+  [self _connectionDidEnd:connection];
+  [hedgeConnection cancel];
+  [self _connectionDidEnd:hedgeConnection];
+  [self _endInflate];
+  readingPaused = NO;
+  [self errback:error];
+}
+
+// Called with the first two or more bytes of a body, or all of a shorter one.
+// The URL loading system usually decodes Content-Encoding itself, so only
+// inflate when the bytes still look compressed.
+- (BOOL)_beginInflate:(NSData *)firstChunk {
+  NSString *encoding = nil;
+  if ([response isKindOfClass:[NSHTTPURLResponse class]])
+    encoding = [_headerValue([(NSHTTPURLResponse *)response allHeaderFields], 
+                             @"Content-Encoding") lowercaseString];
+  if (! ([encoding isEqualToString:@"gzip"] || [encoding isEqualToString:@"x-gzip"] ||
+         [encoding isEqualToString:@"deflate"]))
+    return NO;
+  const unsigned char *b = [firstChunk bytes];
+  int windowBits;
+  if ([firstChunk length] >= 2 && b[0] == 0x1f && b[1] == 0x8b)
+    windowBits = 15 + 16; // gzip
+  else if ([firstChunk length] >= 2 && (b[0] & 0x0f) == Z_DEFLATED && ((b[0] << 8) | b[1]) % 31 == 0)
+    windowBits = 15; // zlib
+  else if ([encoding isEqualToString:@"deflate"] && [firstChunk length])
+    windowBits = -15; // raw deflate, as some servers send it
+  else
+    return NO;
+  _zstream = calloc(1, sizeof(z_stream));
+  if (!_zstream || inflateInit2(_zstream, windowBits) != Z_OK) {
+    free(_zstream);
+    _zstream = NULL;
+    return NO;
+  }
+  _inflateMembers = (windowBits > 15);
+  return YES;
+}
+
+- (BOOL)_inflate:(NSData *)data {
+  unsigned char out[16384];
+  int err;
+  _zstream->next_in = (Bytef *)[data bytes];
+  _zstream->avail_in = [data length];
+  for (;;) {
+    if (_inflateState == 2) {
+      // only another gzip member (RFC 1952) may follow the end of the stream;
+      // zlib checks the second byte of its magic if it's in a later chunk
+      if (!_zstream->avail_in)
+        return YES;
+      if (!(_inflateMembers && _zstream->next_in[0] == 0x1f &&
+            (_zstream->avail_in < 2 || _zstream->next_in[1] == 0x8b)))
+        return NO;
+      inflateReset(_zstream);
+      _inflateState = 1;
+    }
+    _zstream->next_out = out;
+    _zstream->avail_out = sizeof(out);
+    err = inflate(_zstream, Z_NO_FLUSH);
+    if (err == Z_NEED_DICT || err == Z_DATA_ERROR || err == Z_MEM_ERROR || err == Z_STREAM_ERROR)
+      return NO;
+    if (_zstream->avail_out < sizeof(out)) {
+      [self _receiveChunk:[NSData dataWithBytes:out length:sizeof(out) - _zstream->avail_out]];
+      if (!_zstream) // the consumer stopped the load
+        return YES;
+    }
+    if (err == Z_STREAM_END)
+      _inflateState = 2;
+    else if (_zstream->avail_out) // all of the input is inflated
+      return YES;
+  }
+}
+
+- (void)_endInflate {
+  if (_zstream) {
+    inflateEnd(_zstream);
+    free(_zstream);
+    _zstream = NULL;
+  }
+  [_inflateHead release];
+  _inflateHead = nil;
+  _inflateState = 0;
+}
+
 - (void)connection:(NSURLConnection *)aConnection
   didFailWithError:(NSError *)error {
-  if (aConnection == connection) connection = nil;
-  [aConnection release];
-  NSLog(@"didFailWithError:%@", error);
+  if (! (aConnection == connection || aConnection == hedgeConnection))
+    return;
+  DKLogWarn(@"didFailWithError:%@", error);
+  [self _connectionDidEnd:aConnection];
+  if (!connection && hedgeConnection) { // the other request is still racing
+    connection = hedgeConnection;
+    hedgeConnection = nil;
+  }
+  if (connection)
+    return;
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_cbHedge) object:nil];
   [self _cbProgressUpdate];
+  [self _endInflate];
   if (self.fired == -1) { // could be multiple errors, only errback on the first
-    [self errback:error];
-    __urlConnectionCount -= 1;
+    // a streaming consumer has already seen part of the body, don't repeat it
+    if (!deliveredData && retryPolicy && [retryPolicy shouldRetryRequest:request] &&
+        [retryPolicy shouldRetryError:error attempt:attempts]) {
+      [self performSelector:@selector(_cbRetry) withObject:nil
+                 afterDelay:[retryPolicy delayForAttempt:attempts]];
+    } else {
+      [self errback:error];
+    }
   }
 }
 
 - (void)connectionDidFinishLoading:(NSURLConnection *)aConnection {
+  if (! (aConnection == connection))
+    return;
+  if ([_inflateHead length]) { // a body of a single byte
+    NSData *head = [_inflateHead autorelease];
+    _inflateHead = nil;
+    if (![self _receiveBody:head])
+      return;
+  }
+  [self _connectionDidEnd:aConnection];
+  BOOL truncated = (_inflateState == 1);
+  [self _endInflate];
+  if (truncated) { // the body stopped before the end of the compressed stream
+    [self errback:[NSError errorWithDomain:DKDeferredURLErrorDomain code:DKDeferredURLError
+                                  userInfo:dict_(@"compressed body ended early", NSLocalizedDescriptionKey)]];
+    return;
+  }
+  metrics.lastByte = metrics.decodeStart = CFAbsoluteTimeGetCurrent();
   id ret = nil;
   if (! (decodeFunction == nil)) {
     ret = [decodeFunction :_data];
   }
+  metrics.decodeEnd = CFAbsoluteTimeGetCurrent();
+  [DKDeferredURLConnection _recordMetrics:metrics];
+  DKLogDebug(@"loaded %@ : %@", url, metrics);
   if (progressCallback)
     [self _cbProgressUpdate];
-  __urlConnectionCount -= 1;
   [self callback:(ret == nil) ? [NSData dataWithData:_data] : ret];
-//  [aConnection release];
 }
 
 - (void)_cbProgressUpdate {
-  percentComplete = (double)[_data length] / (double)expectedContentLength;
+  // expectedContentLength counts bytes on the wire, which may be compressed
+  percentComplete = (double)receivedLength / (double)expectedContentLength;
 //  NSLog(@"_data:%i expectedContentLength:%i", [_data length], expectedContentLength);
 //  NSLog(@"percentComplete:%d", percentComplete);
   if (progressCallback) {
@@ -826,13 +1353,78 @@ didReceiveResponse:(NSURLResponse *)response {
 }
 
 + (int)requestCount {
-  return __urlConnectionCount;
+  return OSAtomicAdd32Barrier(0, &__urlConnectionCount);
+}
+
++ (DKRetryPolicy *)defaultRetryPolicy {
+  DKRetryPolicy *ret;
+  @synchronized([DKDeferredURLConnection class]) {
+    ret = [[__defaultRetryPolicy retain] autorelease];
+  }
+  return ret;
+}
+
++ (void)setDefaultRetryPolicy:(DKRetryPolicy *)policy {
+  @synchronized([DKDeferredURLConnection class]) {
+    [__defaultRetryPolicy autorelease];
+    __defaultRetryPolicy = [policy retain];
+  }
+}
+
++ (DKLatencyHistogram *)latencyHistogramForHost:(NSString *)host {
+  DKLatencyHistogram *ret;
+  if (!host)
+    host = @"";
+  @synchronized([DKDeferredURLConnection class]) {
+    if (!__latencyHistograms)
+      __latencyHistograms = [[NSMutableDictionary alloc] init];
+    ret = [__latencyHistograms objectForKey:host];
+    if (!ret) {
+      ret = [[[DKLatencyHistogram alloc] init] autorelease];
+      [__latencyHistograms setObject:ret forKey:host];
+    }
+  }
+  return ret;
+}
+
++ (DKLatencyHistogram *)latencyHistogramForHost:(NSString *)host phase:(NSString *)phase {
+  return [self latencyHistogramForHost:
+          [NSString stringWithFormat:@"%@ %@", phase, (host ? host : @"")]];
+}
+
++ (void)_recordMetrics:(DKURLConnectionMetrics *)m {
+  NSString *host = m.host;
+  [[self latencyHistogramForHost:host phase:DKURLPhaseQueue] addSample:[m queueTime]];
+  [[self latencyHistogramForHost:host phase:DKURLPhaseFirstByte] addSample:[m timeToFirstByte]];
+  [[self latencyHistogramForHost:host phase:DKURLPhaseTransfer] addSample:[m transferTime]];
+  [[self latencyHistogramForHost:host phase:DKURLPhaseDecode] addSample:[m decodeTime]];
+  [[self latencyHistogramForHost:host phase:DKURLPhaseTotal] addSample:[m totalTime]];
+}
+
+- (void)cancel {
+  if (self.fired == -1) {
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_cbRetry) object:nil];
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_cbHedge) object:nil];
+    [connection cancel];
+    [self _connectionDidEnd:connection];
+    [hedgeConnection cancel];
+    [self _connectionDidEnd:hedgeConnection];
+    [self _endInflate];
+  }
+  [super cancel];
 }
 
 - (void)dealloc {
   if (connection) [connection release];
+  if (hedgeConnection) [hedgeConnection release];
   [request release];
   [progressCallback release];
+  [self _endInflate];
+  [retryPolicy release];
+  [response release];
+  [dataCallback release];
+  [metrics release];
+  [decodeFunction release];
   [url release];
   [_data release];
   [super dealloc];
@@ -843,17 +1435,66 @@ didReceiveResponse:(NSURLResponse *)response {
 }
 
 - (id)_cbStartLoading:(id)result {
-  NSLog(@"connection: %@ : %@", self.started, url);
+  DKLogDebug(@"connection: %@ : %@", self.started, url);
+  [self _startAttempt];
+  return self;
+}
+
+- (void)_startAttempt {
+  if (![request valueForHTTPHeaderField:@"Accept-Encoding"]) {
+    NSMutableURLRequest *req = [[request mutableCopy] autorelease];
+    [req setValue:@"gzip, deflate" forHTTPHeaderField:@"Accept-Encoding"];
+    [request release];
+    request = [req retain];
+  }
+  attempts += 1;
+  statusCode = 0;
+  attemptStartTime = CFAbsoluteTimeGetCurrent();
+  if (!metrics.started)
+    metrics.started = attemptStartTime;
+  metrics.attempts = attempts;
   connection = [[NSURLConnection connectionWithRequest:request delegate:self] retain];
   if (connection) {
-    __urlConnectionCount += 1;
+    OSAtomicIncrement32Barrier(&__urlConnectionCount);
+    NSTimeInterval hedgeAfter;
+    if (retryPolicy && (hedgeAfter = [retryPolicy hedgeDelayForRequest:request]) > 0.0)
+      [self performSelector:@selector(_cbHedge) withObject:nil afterDelay:hedgeAfter];
   } else {
-    NSLog(@"nsurlconnection error: connection could not be initialized");
+    DKLogError(@"nsurlconnection error: connection could not be initialized");
     [self errback:[NSError
       errorWithDomain:DKDeferredURLErrorDomain 
       code:DKDeferredURLError userInfo:EMPTY_DICT]];
   }
-  return self;
+}
+
+- (void)_cbRetry {
+  if (self.fired == -1)
+    [self _startAttempt];
+}
+
+- (void)_cbHedge {
+  if (! (self.fired == -1) || !connection || hedgeConnection || statusCode)
+    return;
+  hedgeStartTime = CFAbsoluteTimeGetCurrent();
+  hedgeConnection = [[NSURLConnection connectionWithRequest:request delegate:self] retain];
+  if (hedgeConnection)
+    OSAtomicIncrement32Barrier(&__urlConnectionCount);
+}
+
+// releases a connection once the delegate will no longer hear from it
+- (void)_connectionDidEnd:(NSURLConnection *)aConnection {
+  if (!aConnection)
+    return;
+  if (aConnection == connection) {
+    [connection autorelease];
+    connection = nil;
+  } else if (aConnection == hedgeConnection) {
+    [hedgeConnection autorelease];
+    hedgeConnection = nil;
+  } else {
+    return;
+  }
+  OSAtomicDecrement32Barrier(&__urlConnectionCount);
 }
 
 @end
@@ -864,9 +1505,31 @@ didReceiveResponse:(NSURLResponse *)response {
 /// 
 static DKDeferredCache *__sharedCache;
 
+// Whether v is made only of types MessagePack has, so it reads back as it was
+static BOOL _isMessagePackValue(id v) {
+  if ([v isKindOfClass:[NSNumber class]])
+    return ![v isKindOfClass:[NSDecimalNumber class]];
+  if ([v isKindOfClass:[NSString class]] || [v isKindOfClass:[NSNull class]] ||
+      [v isKindOfClass:[NSData class]])
+    return YES;
+  if ([v isKindOfClass:[NSArray class]]) {
+    for (id e in v)
+      if (!_isMessagePackValue(e))
+        return NO;
+    return YES;
+  }
+  if ([v isKindOfClass:[NSDictionary class]]) {
+    for (id k in v)
+      if (!_isMessagePackValue(k) || !_isMessagePackValue([v objectForKey:k]))
+        return NO;
+    return YES;
+  }
+  return NO;
+}
+
 @implementation DKDeferredCache
 
-@synthesize defaultTimeout;
+@synthesize defaultTimeout, maxMemoryEntries, valueEncoding;
 
 /// DKCache Protocol
 - (id)setValue:(NSObject *)value forKey:(NSString *)key timeout:(NSTimeInterval)timeout {
@@ -884,6 +1547,60 @@ static DKDeferredCache *__sharedCache;
                    inQueue:operationQueue];
 }
 
+- (id)setValue:(NSObject *)value forKey:(NSString *)key 
+       timeout:(NSTimeInterval)timeout metadata:(NSDictionary *)metadata {
+  return [DKDeferred defer:
+          curryTS(self,
+                  @selector(_setValue:forKey:timeout:metadata:arg:),
+                  value, key, nsni((int)timeout), 
+                  (metadata ? metadata : (id)[NSNull null]))
+                withObject:[NSNull null] 
+                   inQueue:operationQueue];
+}
+
+- (id)entryForKey:(NSString *)key {
+  return [DKDeferred defer:callbackTS(self, _getEntry:) 
+                withObject:key
+                   inQueue:operationQueue];
+}
+
+/// Memory tier
+- (id)memoryValueForKey:(NSString *)key {
+  [memoryLock lock];
+  DKDeferredCacheEntry *entry = [[[memory objectForKey:key] retain] autorelease];
+  if (entry && [entry isExpired]) {
+    [memory removeObjectForKey:key];
+    [memoryKeys removeObject:key];
+    entry = nil;
+  }
+  [memoryLock unlock];
+  return entry.value;
+}
+
+- (void)setMemoryValue:(id)value forKey:(NSString *)key timeout:(NSTimeInterval)timeout {
+  NSDate *expires = [NSDate dateWithTimeIntervalSinceNow:(timeout > 0.0 ? timeout : defaultTimeout)];
+  DKDeferredCacheEntry *entry = [[DKDeferredCacheEntry alloc] 
+                                 initWithValue:value metadata:nil expires:expires];
+  [memoryLock lock];
+  if ([memory objectForKey:key])
+    [memoryKeys removeObject:key];
+  [memoryKeys addObject:key];
+  [memory setObject:entry forKey:key];
+  while ([memoryKeys count] > (NSUInteger)MAX(maxMemoryEntries, 0)) {
+    [memory removeObjectForKey:[memoryKeys objectAtIndex:0]];
+    [memoryKeys removeObjectAtIndex:0];
+  }
+  [memoryLock unlock];
+  [entry release];
+}
+
+- (void)deleteMemoryValueForKey:(NSString *)key {
+  [memoryLock lock];
+  [memory removeObjectForKey:key];
+  [memoryKeys removeObject:key];
+  [memoryLock unlock];
+}
+
 - (void)deleteValueForKey:(NSString *)key { // TODO: Make asynchronous
   [[NSFileManager defaultManager] 
    removeItemAtPath:[dir stringByAppendingPathComponent:md5(key)] 
@@ -931,17 +1648,44 @@ static DKDeferredCache *__sharedCache;
 
 // should always be executed in a thread
 - (id)_getValue:(NSString *)key { 
+  DKDeferredCacheEntry *entry = [self _getEntry:key];
+  if (!entry || [entry isExpired])
+    return nil;
+  return entry.value;
+}
+
+// should always be executed in a thread
+- (id)_getEntry:(NSString *)key {
   NSString *fname = [dir stringByAppendingPathComponent:md5(key)];
   NSFileManager *fm = [NSFileManager defaultManager];
   if ([fm fileExistsAtPath:fname]) {
-    NSArray *content = [NSKeyedUnarchiver unarchiveObjectWithFile:fname];
-    NSDate *expires = (NSDate *)[content objectAtIndex:0];
-    if (([expires compare:[NSDate date]] == NSOrderedAscending)) {
+    NSData *data = [NSData dataWithContentsOfFile:fname];
+    NSArray *content = nil;
+    id expires = nil;
+    // a MessagePack entry is an array of 2 or 3; an archive is a binary plist
+    const uint8_t *bytes = [data bytes];
+    if ([data length] && (bytes[0] == 0x92 || bytes[0] == 0x93)) {
+      content = [DKMessagePack objectWithData:data error:NULL];
+      if ([content count] > 1)
+        expires = [NSDate dateWithTimeIntervalSinceReferenceDate:[[content objectAtIndex:0] doubleValue]];
+    } else if (data) {
+      content = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+      if ([content count] > 1)
+        expires = [content objectAtIndex:0];
+    }
+    if (!expires) {
       [fm removeItemAtPath:fname error:nil];
       return nil;
-    } else {
-      return [content objectAtIndex:1];
     }
+    DKDeferredCacheEntry *entry = [[[DKDeferredCacheEntry alloc]
+      initWithValue:[content objectAtIndex:1]
+      metadata:(([content count] > 2) ? [content objectAtIndex:2] : nil)
+      expires:expires] autorelease];
+    if ([entry isExpired] && ![entry canRevalidate]) {
+      [fm removeItemAtPath:fname error:nil];
+      return nil;
+    }
+    return entry;
   }
   return nil;
 }
@@ -949,13 +1693,33 @@ static DKDeferredCache *__sharedCache;
 // should always be executed in a thread
 - (id)_setValue:(NSObject *)value forKey:(NSString *)key 
         timeout:(NSNumber *)timeout arg:(id)arg {
-  if (![[value class] canBeStoredInCache]) {
+  return [self _setValue:value forKey:key timeout:timeout metadata:nil arg:arg];
+}
+
+// should always be executed in a thread
+- (id)_setValue:(NSObject *)value forKey:(NSString *)key 
+        timeout:(NSNumber *)timeout metadata:(id)metadata arg:(id)arg {
+  if (metadata == [NSNull null])
+    metadata = nil;
+  NSDate *expires = [NSDate dateWithTimeIntervalSinceNow:[timeout intValue]];
+  NSData *packed = nil;
+  if (valueEncoding == DKCacheValueEncodingMessagePack && _isMessagePackValue(value) &&
+      (!metadata || _isMessagePackValue(metadata))) {
+    NSNumber *when = [NSNumber numberWithDouble:[expires timeIntervalSinceReferenceDate]];
+    packed = [DKMessagePack dataWithObject:(metadata ? array_(when, value, metadata) : array_(when, value))
+                                     error:NULL];
+  }
+  if (!packed && ![[value class] canBeStoredInCache]) {
     return nil;
   }
   NSString *fname = [dir stringByAppendingPathComponent:md5(key)];
   [self _cull];
-  NSArray *content = array_([NSDate dateWithTimeIntervalSinceNow:[timeout intValue]], value);
-  [NSKeyedArchiver archiveRootObject:content toFile:fname];
+  if (packed) {
+    [packed writeToFile:fname atomically:YES];
+  } else {
+    NSArray *content = (metadata ? array_(expires, value, metadata) : array_(expires, value));
+    [NSKeyedArchiver archiveRootObject:content toFile:fname];
+  }
   return nil;
 }
 
@@ -977,6 +1741,10 @@ static DKDeferredCache *__sharedCache;
     cullFrequency = (_cullFrequency < 1) ? 3 : _cullFrequency;
     operationQueue = [[NSOperationQueue alloc] init];
     self.defaultTimeout = 7200.0;
+    maxMemoryEntries = 200;
+    memory = [[NSMutableDictionary alloc] init];
+    memoryKeys = [[NSMutableArray alloc] init];
+    memoryLock = [[NSLock alloc] init];
     // init cache directory
     NSFileManager *fm = [NSFileManager defaultManager];
     NSArray *paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDirectory, YES);
@@ -995,6 +1763,9 @@ static DKDeferredCache *__sharedCache;
 - (void)dealloc {
   [operationQueue release];
   [dir release];
+  [memory release];
+  [memoryKeys release];
+  [memoryLock release];
   [super dealloc];
 }
 
@@ -1028,6 +1799,37 @@ static DKDeferredCache *__sharedCache;
 @end
 
 
+@implementation DKDeferredCacheEntry
+
+@synthesize value, metadata, expires;
+
+- (id)initWithValue:(id)_value metadata:(NSDictionary *)_metadata expires:(NSDate *)_expires {
+  if ((self = [super init])) {
+    value = [_value retain];
+    metadata = [(_metadata ? _metadata : EMPTY_DICT) retain];
+    expires = [_expires retain];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [value release];
+  [metadata release];
+  [expires release];
+  [super dealloc];
+}
+
+- (BOOL)isExpired {
+  return ! ([expires compare:[NSDate date]] == NSOrderedDescending);
+}
+
+- (BOOL)canRevalidate {
+  return _canRevalidate(metadata);
+}
+
+@end
+
+
 @implementation DKMappedPriorityQueue
 
 - (id)init {
@@ -1319,3 +2121,238 @@ static DKDeferredCache *__sharedCache;
 }
 
 @end
+
+
+///
+///  DKURLConnectionScheduler
+///
+///
+
+@interface DKScheduledURLLoad : NSObject
+{
+@public
+  DKDeferred *deferred;
+  NSString *host;
+  int priority;
+  unsigned long sequence;
+  BOOL running;
+}
+
+- (NSComparisonResult)comparePriority:(DKScheduledURLLoad *)otherLoad;
+
+@end
+
+
+@implementation DKScheduledURLLoad
+
+- (void)dealloc {
+  [deferred release];
+  [host release];
+  [super dealloc];
+}
+
+// higher priority classes first, first come first served within a class
+- (NSComparisonResult)comparePriority:(DKScheduledURLLoad *)otherLoad {
+  if (! (priority == otherLoad->priority))
+    return (priority > otherLoad->priority) ? NSOrderedAscending : NSOrderedDescending;
+  return (sequence < otherLoad->sequence) ? NSOrderedAscending : NSOrderedDescending;
+}
+
+@end
+
+
+@implementation DKURLConnectionScheduler
+
+static DKURLConnectionScheduler *__sharedScheduler;
+
+@synthesize maxConnections, maxConnectionsPerHost;
+
++ (id)sharedScheduler {
+  @synchronized([DKURLConnectionScheduler class]) {
+    if (!__sharedScheduler)
+      __sharedScheduler = [[DKURLConnectionScheduler alloc] init];
+  }
+  return __sharedScheduler;
+}
+
+- (id)init {
+  if ((self = [super init])) {
+    _queues = [[NSMutableDictionary alloc] init];
+    _running = [[NSMutableDictionary alloc] init];
+    _hostLimits = [[NSMutableDictionary alloc] init];
+    _hosts = [[NSMutableArray alloc] init];
+    _active = [[NSMutableSet alloc] init];
+    _nextHost = 0;
+    _sequence = 0;
+    inFlight = 0;
+    maxConnections = 16;
+    maxConnectionsPerHost = 4;
+    wLock = [[NSLock alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [_queues release];
+  [_running release];
+  [_hostLimits release];
+  [_hosts release];
+  [_active release];
+  [wLock release];
+  [super dealloc];
+}
+
+- (int)inFlight {
+  return OSAtomicAdd32Barrier(0, &inFlight);
+}
+
+- (int)waiting {
+  int ret = 0;
+  [wLock lock];
+  for (DKMappedPriorityQueue *q in [_queues allValues]) {
+    ret += [q count];
+  }
+  [wLock unlock];
+  return ret;
+}
+
+- (void)setMaxConnections:(int)numConnections forHost:(NSString *)host {
+  [wLock lock];
+  if (numConnections > 0)
+    [_hostLimits setObject:nsni(numConnections) forKey:[host lowercaseString]];
+  else
+    [_hostLimits removeObjectForKey:[host lowercaseString]];
+  [wLock unlock];
+  [self _resumeWaiting];
+}
+
+- (id)loadRequest:(NSURLRequest *)req 
+   decodeFunction:(id<DKCallback>)decodeF
+         priority:(DKURLPriority)priority {
+  DKDeferred *d = [[[DKDeferredURLConnection alloc] 
+                    initRequest:req decodeFunction:decodeF paused:YES] autorelease];
+  return [self add:d host:[[req URL] host] priority:priority];
+}
+
+- (id)loadURL:(NSString *)aUrl priority:(DKURLPriority)priority {
+  return [self loadRequest:
+          [NSURLRequest requestWithURL:[NSURL URLWithString:aUrl]
+                           cachePolicy:NSURLRequestReloadIgnoringCacheData
+                       timeoutInterval:15.0f]
+            decodeFunction:nil priority:priority];
+}
+
+- (id)add:(DKDeferred *)d host:(NSString *)host priority:(DKURLPriority)priority {
+  DKScheduledURLLoad *load = [[[DKScheduledURLLoad alloc] init] autorelease];
+  load->deferred = [d retain];
+  load->host = [(host ? [host lowercaseString] : @"") copy];
+  load->priority = priority;
+  [wLock lock];
+  load->sequence = ++_sequence;
+  DKMappedPriorityQueue *q = [_queues objectForKey:load->host];
+  if (!q) {
+    q = [[[DKMappedPriorityQueue alloc] init] autorelease];
+    [_queues setObject:q forKey:load->host];
+    [_hosts addObject:load->host];
+  }
+  [q enqueue:load key:[NSNumber numberWithUnsignedLong:load->sequence]
+      prioritySelector:@selector(comparePriority:)];
+  [wLock unlock];
+  [d addBoth:curryTS(self, @selector(_cbFinished::), load)];
+  [self _resumeWaiting];
+  return d;
+}
+
+- (id)_cbFinished:(id)load :(id)results {
+  if (isDeferred(results))
+    return [results addBoth:curryTS(self, @selector(_cbFinished::), load)];
+  DKScheduledURLLoad *l = load;
+  BOOL wasRunning = NO;
+  [wLock lock];
+  if (l->running) { // loads cancelled while waiting are skipped when dequeued
+    l->running = NO;
+    wasRunning = YES;
+    [_running setObject:nsni([[_running objectForKey:l->host] intValue] - 1)
+                 forKey:l->host];
+    [_active removeObject:l];
+  }
+  [wLock unlock];
+  if (wasRunning) {
+    OSAtomicDecrement32Barrier(&inFlight);
+    [self _resumeWaiting];
+  }
+  return results;
+}
+
+- (int)_limitForHost:(NSString *)host {
+  NSNumber *limit = [_hostLimits objectForKey:host];
+  return limit ? [limit intValue] : maxConnectionsPerHost;
+}
+
+- (void)_resumeWaiting {
+  NSMutableArray *resumables = [NSMutableArray array];
+  [wLock lock];
+  while (inFlight < maxConnections) {
+    DKScheduledURLLoad *best = nil;
+    NSUInteger bestIndex = 0;
+    NSUInteger count = [_hosts count];
+    // most urgent head of line wins, ties go to the next host in turn
+    for (NSUInteger i = 0; i < count; i++) {
+      NSUInteger idx = (_nextHost + i) % count;
+      NSString *host = [_hosts objectAtIndex:idx];
+      DKMappedPriorityQueue *q = [_queues objectForKey:host];
+      if (![q count] || 
+          [[_running objectForKey:host] intValue] >= [self _limitForHost:host])
+        continue;
+      DKScheduledURLLoad *head = [q objForKey:[q peek]];
+      if (!best || head->priority > best->priority) {
+        best = head;
+        bestIndex = idx;
+      }
+    }
+    if (!best)
+      break;
+    best = [[[_queues objectForKey:best->host] dequeue] objectAtIndex:0];
+    _nextHost = bestIndex + 1;
+    if (! (best->deferred.fired == -1))
+      continue;
+    best->running = YES;
+    [_running setObject:nsni([[_running objectForKey:best->host] intValue] + 1)
+                 forKey:best->host];
+    [_active addObject:best];
+    OSAtomicIncrement32Barrier(&inFlight);
+    [resumables addObject:best];
+  }
+  // forget idle hosts so the round robin doesn't grow without bound
+  for (int i = [_hosts count] - 1; i >= 0; i--) {
+    NSString *host = [_hosts objectAtIndex:i];
+    if (![[_queues objectForKey:host] count] && 
+        ![[_running objectForKey:host] intValue]) {
+      [_queues removeObjectForKey:host];
+      [_running removeObjectForKey:host];
+      [_hosts removeObjectAtIndex:i];
+    }
+  }
+  [wLock unlock]; // a load can finish in this thread and invoke _resumeWaiting again
+  for (DKScheduledURLLoad *load in resumables) {
+    [load->deferred callback:nil];
+  }
+}
+
+- (void)drain {
+  NSMutableArray *doomed = [NSMutableArray array];
+  id item;
+  [wLock lock];
+  [doomed addObjectsFromArray:[_active allObjects]];
+  for (DKMappedPriorityQueue *q in [_queues allValues]) {
+    while ((item = [q dequeue])) {
+      [doomed addObject:[item objectAtIndex:0]];
+    }
+  }
+  [wLock unlock];
+  for (DKScheduledURLLoad *load in doomed) {
+    [load->deferred cancel];
+  }
+}
+
+@end
@@ -0,0 +1,105 @@
+//
+//  DKJSONRPCTransport.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+#import "JSON/JSON.h"
+#import "DKDeferred.h"
+
+/**
+ * Carries JSON-RPC messages for a DKJSONServiceProxy.
+ *
+ * A message is a call, or a batch of calls as an NSArray. The returned
+ * deferred callbacks with the decoded response document (a response, or an
+ * array of responses for a batch) or errs back if it couldn't be had. Errors
+ * inside a response are left to the proxy.
+ */
+@protocol DKJSONRPCTransport <NSObject>
+
+/**
+ * Sends <code>message</code>. <code>streamBody</code> asks for the message
+ * to be serialized as it is sent rather than up front, where the transport
+ * supports it.
+ */
+- (DKDeferred *)sendMessage:(id)message streamed:(BOOL)streamBody;
+
+@end
+
+
+/**
+ * Sends each message as a JSON POST to a URL, with a DKDeferredURLConnection.
+ *
+ * With <code>acceptsMessagePack</code> on, the transport negotiates
+ * MessagePack (see DKMessagePack) with the service: requests ask for it in
+ * their Accept header, and each response is decoded according to its
+ * Content-Type, so a service that only speaks JSON keeps working. Once the
+ * service has answered in MessagePack, requests are sent in it too, except
+ * for streamed ones.
+ */
+@interface DKJSONRPCHTTPTransport : NSObject <DKJSONRPCTransport>
+{
+  NSString *url;
+  BOOL acceptsMessagePack;
+  BOOL sendsMessagePack;
+}
+
+@property(readonly) NSString *url;
+
+/**
+ * Asks the service for MessagePack responses. Default NO.
+ */
+@property(assign) BOOL acceptsMessagePack;
+
+/**
+ * Whether request bodies are MessagePack rather than JSON. Turned on by the
+ * first MessagePack response; set it to skip the first JSON request.
+ */
+@property(assign) BOOL sendsMessagePack;
+
+- (id)initWithURL:(NSString *)aUrl;
+
+@end
+
+
+/**
+ * Sends messages over a persistent connection to a Unix domain socket, for
+ * services on the same host. Saves the TCP and HTTP work of loopback HTTP.
+ *
+ * Messages and responses are framed as newline-delimited JSON: each one
+ * is a single line of compact JSON, which never contains a raw newline.
+ * Any number of calls may be in flight at once; responses may come in any
+ * order and are matched to their calls by id, so the ids of calls in flight
+ * must be unique. A response to a batch that matches none of its calls, such
+ * as an empty array, fails the oldest batch still waiting.
+ *
+ * The connection is opened by the first message, on the current run loop,
+ * and reopened by the next message after it closes. When it fails or the
+ * other end closes it, every call still in flight errs back. The transport
+ * keeps itself alive while calls are in flight, so the proxy that sent them
+ * may go away first. Use a transport from one thread only.
+ */
+@interface DKJSONRPCSocketTransport : NSObject <DKJSONRPCTransport>
+{
+  NSString *path;
+  NSInputStream *input;
+  NSOutputStream *output;
+  NSMutableData *inbuf;
+  NSMutableData *outbuf;
+  NSUInteger outOffset;
+  NSMutableDictionary *pending;
+  NSMutableArray *batches;
+  SBJsonWriter *writer;
+  SBJsonParser *parser;
+}
+
+@property(readonly) NSString *path;
+
+- (id)initWithPath:(NSString *)socketPath;
+
+/**
+ * Closes the connection. Calls in flight err back.
+ */
+- (void)close;
+
+@end
@@ -0,0 +1,394 @@
+//
+//  DKJSONRPCTransport.m
+//  CocoaDeferred
+//
+
+#import "DKJSONRPCTransport.h"
+#import "DKDeferred+JSON.h"
+#import "DKMessagePack.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+/**
+ * The size of the chunks a streamed request body is written in, and of the
+ * buffer between the writer thread and the connection.
+ */
+static const NSUInteger DKJSONBodyChunkSize = 16384;
+
+@interface DKJSONRPCHTTPTransport ()
++ (NSInputStream *)_bodyStreamWithObject:(id)object;
++ (void)_writeBody:(NSArray *)objectAndStream;
+- (id)_cbDecode:(DKDeferredURLConnection *)connection results:(id)data;
+@end
+
+@implementation DKJSONRPCHTTPTransport
+
+@synthesize url, acceptsMessagePack, sendsMessagePack;
+
+- (id)initWithURL:(NSString *)aUrl {
+  if ((self = [super init])) {
+    url = [aUrl retain];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [url release];
+  [super dealloc];
+}
+
+- (NSString *)description {
+  return url;
+}
+
+/**
+ * Sends <code>message</code> as a JSON POST, from an NSData or, if
+ * <code>streamBody</code>, from a body stream written as the request goes out.
+ */
+- (DKDeferred *)sendMessage:(id)message streamed:(BOOL)streamBody {
+  NSData *post = nil;
+  NSString *contentType = @"application/json";
+  if (!streamBody) {
+    NSError *error = nil;
+    if (sendsMessagePack) {
+      post = [DKMessagePack dataWithObject:message error:&error];
+      contentType = DKMessagePackContentType;
+    } else {
+      SBJSON *json = [[SBJSON alloc] init];
+      post = [json dataWithObject:message error:&error];
+      [json release];
+    }
+    if (!post)
+      return [DKDeferred fail:error];
+  }
+
+  NSMutableURLRequest *req = [[[NSMutableURLRequest alloc]
+                               initWithURL:[NSURL URLWithString:url]] autorelease];
+  [req setValue:(acceptsMessagePack
+                 ? [DKMessagePackContentType stringByAppendingString:@", application/json;q=0.5"]
+                 : @"application/json") forHTTPHeaderField:@"Accept"];
+  [req setValue:contentType forHTTPHeaderField:@"Content-Type"];
+  [req setValue:@"DeferredKit JSON-RPC Proxy 1.0" forHTTPHeaderField:@"User-Agent"];
+  [req setHTTPMethod:@"POST"];
+  if (post)
+    [req setHTTPBody:post];
+  else
+    [req setHTTPBodyStream:[DKJSONRPCHTTPTransport _bodyStreamWithObject:message]];
+  if (!acceptsMessagePack)
+    return [[[DKDeferredURLConnection alloc] initWithRequest:req pauseFor:0.0f
+                                              decodeFunction:callbackP(_decodeJSON)] autorelease];
+
+  // the decoder depends on the response, which the connection holds
+  DKDeferredURLConnection *d = [[[DKDeferredURLConnection alloc] initWithRequest:req pauseFor:0.0f
+                                                                  decodeFunction:nil] autorelease];
+  [d addCallback:curryTS(self, @selector(_cbDecode:results:), d)];
+  return d;
+}
+
+- (id)_cbDecode:(DKDeferredURLConnection *)connection results:(id)data {
+  if (![data isKindOfClass:[NSData class]])
+    return _decodeJSON(data);
+  if (![[connection.response MIMEType] isEqualToString:DKMessagePackContentType])
+    return _decodeJSON(data);
+  sendsMessagePack = YES;
+  NSError *error = nil;
+  id ret = [DKMessagePack objectWithData:data error:&error];
+  return ret ? ret : (id)error;
+}
+
+/**
+ * Returns the read end of a bound stream pair and starts a thread writing
+ * <code>object</code> into the other end. The writer blocks whenever the
+ * pair's buffer is full, so it only runs as fast as the connection sends.
+ * If the connection goes away, the write fails and the thread ends.
+ */
++ (NSInputStream *)_bodyStreamWithObject:(id)object {
+  CFReadStreamRef readStream = NULL;
+  CFWriteStreamRef writeStream = NULL;
+  CFStreamCreateBoundPair(kCFAllocatorDefault, &readStream, &writeStream, DKJSONBodyChunkSize);
+  [NSThread detachNewThreadSelector:@selector(_writeBody:) toTarget:self
+                         withObject:array_(object, (NSOutputStream *)writeStream)];
+  CFRelease(writeStream);
+  return [(NSInputStream *)readStream autorelease];
+}
+
++ (void)_writeBody:(NSArray *)objectAndStream {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSOutputStream *stream = [objectAndStream objectAtIndex:1];
+  SBJsonWriter *writer = [[SBJsonWriter alloc] init];
+  writer.chunkSize = DKJSONBodyChunkSize;
+  [stream open];
+  if (![writer writeObject:[objectAndStream objectAtIndex:0] toStream:stream])
+    DKLogError(@"json-rpc request body not sent: %@", [[writer errorTrace] lastObject]);
+  [stream close];
+  [writer release];
+  [pool drain];
+}
+
+@end
+
+
+@interface DKJSONRPCSocketTransport ()
+- (NSError *)_open;
+- (void)_write;
+- (void)_read;
+- (void)_receive:(id)response;
+- (void)_failWithError:(NSError *)error;
+@end
+
+@implementation DKJSONRPCSocketTransport
+
+@synthesize path;
+
+- (id)initWithPath:(NSString *)socketPath {
+  if ((self = [super init])) {
+    path = [socketPath copy];
+    inbuf = [[NSMutableData alloc] init];
+    outbuf = [[NSMutableData alloc] init];
+    pending = [[NSMutableDictionary alloc] init];
+    batches = [[NSMutableArray alloc] init];
+    writer = [[SBJsonWriter alloc] init];
+    parser = [[SBJsonParser alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [self close];
+  [path release];
+  [inbuf release];
+  [outbuf release];
+  [pending release];
+  [batches release];
+  [writer release];
+  [parser release];
+  [super dealloc];
+}
+
+- (NSString *)description {
+  return [NSString stringWithFormat:@"unix:%@", path];
+}
+
+/**
+ * Queues <code>message</code> as one line and registers its deferred under
+ * the id of every call in it, so that a batch's response can be found by
+ * any of them.
+ */
+- (DKDeferred *)sendMessage:(id)message streamed:(BOOL)streamBody {
+  NSData *data = [writer dataWithObject:message];
+  if (!data)
+    return [DKDeferred fail:[[writer errorTrace] lastObject]];
+  if (!output) {
+    NSError *error = [self _open];
+    if (error)
+      return [DKDeferred fail:error];
+  }
+
+  NSArray *calls = ([message isKindOfClass:[NSArray class]] ?
+                    message : [NSArray arrayWithObject:message]);
+  NSMutableArray *ids = [NSMutableArray arrayWithCapacity:[calls count]];
+  for (NSDictionary *call in calls) {
+    id callID = [call objectForKey:@"id"];
+    if (callID)
+      [ids addObject:callID];
+  }
+
+  DKDeferred *d = [DKDeferred deferred];
+  NSArray *entry = array_(d, ids);
+  if (![pending count] && [ids count])
+    [self retain]; // until the last call in flight is answered, see _receive:
+  for (id callID in ids)
+    [pending setObject:entry forKey:callID];
+  if ([message isKindOfClass:[NSArray class]] && [ids count])
+    [batches addObject:entry];
+  [outbuf appendData:data];
+  [outbuf appendBytes:"\n" length:1];
+  [self _write];
+  return d;
+}
+
+- (NSError *)_open {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  const char *fsPath = [path fileSystemRepresentation];
+  if (strlen(fsPath) >= sizeof(addr.sun_path))
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:ENAMETOOLONG
+                           userInfo:dict_(path, NSFilePathErrorKey)];
+  strcpy(addr.sun_path, fsPath);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int err = errno;
+    if (fd >= 0)
+      close(fd);
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:err
+                           userInfo:dict_(path, NSFilePathErrorKey)];
+  }
+
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  CFReadStreamRef readStream = NULL;
+  CFWriteStreamRef writeStream = NULL;
+  CFStreamCreatePairWithSocket(kCFAllocatorDefault, fd, &readStream, &writeStream);
+  CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+  input = (NSInputStream *)readStream;
+  output = (NSOutputStream *)writeStream;
+  for (NSStream *stream in array_(input, output)) {
+    [stream setDelegate:self];
+    [stream scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSRunLoopCommonModes];
+    [stream open];
+  }
+  return nil;
+}
+
+- (void)close {
+  for (NSStream *stream in array_(input, output)) {
+    [stream setDelegate:nil];
+    [stream removeFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSRunLoopCommonModes];
+    [stream close];
+  }
+  [input release];
+  input = nil;
+  [output release];
+  output = nil;
+  [inbuf setLength:0];
+  [outbuf setLength:0];
+  outOffset = 0;
+  [self _failWithError:[NSError errorWithDomain:DKDeferredErrorDomain code:DKDeferredCanceledError
+                                       userInfo:dict_(@"JSON-RPC connection closed",
+                                                      NSLocalizedDescriptionKey)]];
+}
+
+- (void)stream:(NSStream *)stream handleEvent:(NSStreamEvent)event {
+  switch (event) {
+    case NSStreamEventHasBytesAvailable:
+      [self _read];
+      break;
+    case NSStreamEventHasSpaceAvailable:
+      [self _write];
+      break;
+    case NSStreamEventErrorOccurred:
+      DKLogWarn(@"json-rpc socket %@ failed: %@", path, [stream streamError]);
+      [self close];
+      break;
+    case NSStreamEventEndEncountered:
+      [self close];
+      break;
+    default:
+      break;
+  }
+}
+
+- (void)_write {
+  while (outOffset < [outbuf length] && [output hasSpaceAvailable]) {
+    NSInteger n = [output write:(const uint8_t *)[outbuf bytes] + outOffset
+                      maxLength:[outbuf length] - outOffset];
+    if (n <= 0)
+      break; // the error event follows
+    outOffset += n;
+  }
+  if (outOffset == [outbuf length]) {
+    [outbuf setLength:0];
+    outOffset = 0;
+  }
+}
+
+/**
+ * Reads what is available and hands on every complete line. The responses
+ * are decoded before any deferred fires, as a callback may send or close.
+ */
+- (void)_read {
+  uint8_t buf[16384];
+  while ([input hasBytesAvailable]) {
+    NSInteger n = [input read:buf maxLength:sizeof(buf)];
+    if (n <= 0)
+      break;
+    [inbuf appendBytes:buf length:n];
+  }
+
+  NSMutableArray *responses = [NSMutableArray array];
+  const char *bytes = [inbuf bytes];
+  NSUInteger length = [inbuf length], start = 0;
+  const char *nl;
+  while ((nl = memchr(bytes + start, '\n', length - start))) {
+    NSUInteger lineLength = nl - (bytes + start);
+    if (lineLength) {
+      id response = [parser objectWithData:
+                     [NSData dataWithBytesNoCopy:(void *)(bytes + start) length:lineLength freeWhenDone:NO]];
+      if (!response) {
+        [self _failWithError:[[parser errorTrace] lastObject]];
+        [self close];
+        return;
+      }
+      [responses addObject:response];
+    }
+    start += lineLength + 1;
+  }
+  [inbuf replaceBytesInRange:NSMakeRange(0, start) withBytes:NULL length:0];
+
+  for (id response in responses)
+    [self _receive:response];
+}
+
+- (void)_receive:(id)response {
+  NSArray *responses = ([response isKindOfClass:[NSArray class]] ?
+                        response : [NSArray arrayWithObject:response]);
+  NSArray *entry = nil;
+  for (id r in responses) {
+    id callID = ([r isKindOfClass:[NSDictionary class]] ? [r objectForKey:@"id"] : nil);
+    if (callID && (entry = [pending objectForKey:callID]))
+      break;
+  }
+  
+  // An empty array, or an error about the batch as a whole (with a null id),
+  // doesn't say which batch it answers; the oldest one waiting is the
+  // likeliest, and failing it beats leaving it waiting forever.
+  BOOL aboutBatch = ([response isKindOfClass:[NSArray class]] ||
+                     ([response isKindOfClass:[NSDictionary class]] &&
+                      ![[response objectForKey:@"id"] isKindOfClass:[NSString class]] &&
+                      ![[response objectForKey:@"id"] isKindOfClass:[NSNumber class]]));
+  if (!entry && aboutBatch && [batches count]) {
+    entry = [batches objectAtIndex:0];
+    response = [NSError errorWithDomain:DKDeferredErrorDomain code:DKDeferredGenericError
+                               userInfo:dict_(@"JSON-RPC batch response matches none of its calls",
+                                              NSLocalizedDescriptionKey, response, @"response")];
+  }
+  if (!entry) {
+    DKLogWarn(@"json-rpc socket %@: response for no call in flight", path);
+    return;
+  }
+
+  [[entry retain] autorelease];
+  [pending removeObjectsForKeys:[entry objectAtIndex:1]];
+  [batches removeObjectIdenticalTo:entry];
+  if (![pending count])
+    [self autorelease];
+  DKDeferred *d = [entry objectAtIndex:0];
+  if (d.fired == -1) {
+    if ([response isKindOfClass:[NSError class]])
+      [d errback:response];
+    else
+      [d callback:response];
+  }
+}
+
+- (void)_failWithError:(NSError *)error {
+  NSArray *entries = [[NSSet setWithArray:[pending allValues]] allObjects];
+  [pending removeAllObjects];
+  [batches removeAllObjects];
+  if ([entries count])
+    [self autorelease];
+  for (NSArray *entry in entries) {
+    DKDeferred *d = [entry objectAtIndex:0];
+    if (d.fired == -1)
+      [d errback:error];
+  }
+}
+
+@end
@@ -67,6 +67,28 @@ static inline id<DKCallback> _curryTS(id target, SEL selector, ...) {
 #define EMPTY_ARRAY [NSArray array]
 #endif
 
+/**
+  * Leveled logging. Messages above DK_LOG_LEVEL are compiled out, the rest
+  * are checked against DKLogLevel at runtime before their arguments are
+  * evaluated, so a disabled log statement costs a compare.
+  **/
+#define DKLogLevelOff 0
+#define DKLogLevelError 1
+#define DKLogLevelWarn 2
+#define DKLogLevelInfo 3
+#define DKLogLevelDebug 4
+#ifndef DK_LOG_LEVEL
+#define DK_LOG_LEVEL DKLogLevelDebug
+#endif
+extern int DKLogLevel; // defaults to DKLogLevelWarn
+#define DKLog(__level, __fmt, args...) do { \
+  if ((__level) <= DK_LOG_LEVEL && (__level) <= DKLogLevel) NSLog(__fmt, ##args); \
+} while (0)
+#define DKLogError(__fmt, args...) DKLog(DKLogLevelError, __fmt, ##args)
+#define DKLogWarn(__fmt, args...) DKLog(DKLogLevelWarn, __fmt, ##args)
+#define DKLogInfo(__fmt, args...) DKLog(DKLogLevelInfo, __fmt, ##args)
+#define DKLogDebug(__fmt, args...) DKLog(DKLogLevelDebug, __fmt, ##args)
+
 /**
   * Creates a new NSString containing a UUID
   **/
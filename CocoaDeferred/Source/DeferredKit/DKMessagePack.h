@@ -0,0 +1,55 @@
+//
+//  DKMessagePack.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+
+extern NSString * const DKMessagePackErrorDomain;
+
+/// the media type of MessagePack bodies, as sent and accepted by the JSON-RPC HTTP transport
+extern NSString * const DKMessagePackContentType;
+
+enum {
+  DKMessagePackUnsupportedError = 1,  // a value with no MessagePack representation
+  DKMessagePackTruncatedError,        // the data ends inside a value
+  DKMessagePackInvalidError,          // a reserved or extension type, or a string that isn't UTF-8
+  DKMessagePackDepthError,            // nested more than 512 deep
+  DKMessagePackTrailingDataError      // bytes left over after the value
+};
+
+/**
+ * DKMessagePack
+ *
+ * Encodes and decodes MessagePack, a binary format with the same object model
+ * as JSON: NSDictionary, NSArray, NSString, NSNumber and NSNull, plus NSData
+ * as raw bytes. Numbers keep their type: integers are written in the fewest
+ * bytes that hold them, floats as 32 bit and doubles as 64 bit floating point,
+ * and booleans as such. There is no text to format or scan, so numeric data
+ * in particular is both smaller and much faster to encode and decode than
+ * JSON.
+ *
+ * As with SBJsonWriter, other objects are encoded through their
+ * <code>proxyForMessagePack</code> or, failing that, <code>proxyForJson</code>
+ * method. Decoded containers are mutable, as from SBJsonParser, and maps
+ * keep whatever key types they were written with.
+ *
+ * Both directions are safe to use from any thread.
+ */
+@interface DKMessagePack : NSObject
+
++ (NSData *)dataWithObject:(id)object error:(NSError **)error;
++ (id)objectWithData:(NSData *)data error:(NSError **)error;
++ (id)objectWithBytes:(const void *)bytes length:(NSUInteger)length error:(NSError **)error;
+
+@end
+
+
+/**
+ * Lets objects that aren't otherwise supported be written as MessagePack,
+ * in the manner of <code>proxyForJson</code>, when their MessagePack form
+ * should differ from their JSON one.
+ */
+@interface NSObject (DKProxyForMessagePack)
+- (id)proxyForMessagePack;
+@end
@@ -0,0 +1,389 @@
+//
+//  DKMessagePack.m
+//  CocoaDeferred
+//
+
+#import "DKMessagePack.h"
+#import "JSON/SBJsonWriter.h"
+
+NSString * const DKMessagePackErrorDomain = @"DKMessagePackErrorDomain";
+NSString * const DKMessagePackContentType = @"application/x-msgpack";
+
+static const NSUInteger DKMessagePackMaxDepth = 512;
+
+static NSError *DKMessagePackError(NSInteger code, NSString *description) {
+  return [NSError errorWithDomain:DKMessagePackErrorDomain code:code
+                         userInfo:[NSDictionary dictionaryWithObject:description
+                                                              forKey:NSLocalizedDescriptionKey]];
+}
+
+#pragma mark Encoding
+
+typedef struct DKMPOutput {
+  uint8_t *bytes;
+  NSUInteger length, capacity;
+  NSUInteger depth;
+  NSError *error;
+} DKMPOutput;
+
+static inline uint8_t *DKMPReserve(DKMPOutput *o, NSUInteger n) {
+  if (o->length + n > o->capacity) {
+    o->capacity = MAX(o->capacity * 2, o->length + n);
+    o->bytes = realloc(o->bytes, o->capacity);
+  }
+  uint8_t *p = o->bytes + o->length;
+  o->length += n;
+  return p;
+}
+
+// a type byte followed by size bytes of v, big endian
+static inline void DKMPAppend(DKMPOutput *o, uint8_t type, uint64_t v, int size) {
+  uint8_t *p = DKMPReserve(o, 1 + size);
+  *p++ = type;
+  for (int i = size - 1; i >= 0; i--) {
+    p[i] = (uint8_t)v;
+    v >>= 8;
+  }
+}
+
+// the header of a str, bin, array or map of n items; a zero type is a form that doesn't exist
+static void DKMPAppendLength(DKMPOutput *o, NSUInteger n, uint8_t fix, NSUInteger fixMax,
+                             uint8_t type8, uint8_t type16, uint8_t type32) {
+  if (fix && n <= fixMax)
+    DKMPAppend(o, fix | (uint8_t)n, 0, 0);
+  else if (type8 && n <= 0xff)
+    DKMPAppend(o, type8, n, 1);
+  else if (n <= 0xffff)
+    DKMPAppend(o, type16, n, 2);
+  else
+    DKMPAppend(o, type32, n, 4);
+}
+
+static void DKMPAppendUnsigned(DKMPOutput *o, unsigned long long v) {
+  if (v <= 0x7f)
+    DKMPAppend(o, (uint8_t)v, 0, 0);
+  else if (v <= 0xff)
+    DKMPAppend(o, 0xcc, v, 1);
+  else if (v <= 0xffff)
+    DKMPAppend(o, 0xcd, v, 2);
+  else if (v <= 0xffffffffULL)
+    DKMPAppend(o, 0xce, v, 4);
+  else
+    DKMPAppend(o, 0xcf, v, 8);
+}
+
+static void DKMPAppendInteger(DKMPOutput *o, long long v) {
+  if (v >= 0)
+    DKMPAppendUnsigned(o, v);
+  else if (v >= -32)
+    DKMPAppend(o, (uint8_t)v, 0, 0);
+  else if (v >= INT8_MIN)
+    DKMPAppend(o, 0xd0, (uint8_t)v, 1);
+  else if (v >= INT16_MIN)
+    DKMPAppend(o, 0xd1, (uint16_t)v, 2);
+  else if (v >= INT32_MIN)
+    DKMPAppend(o, 0xd2, (uint32_t)v, 4);
+  else
+    DKMPAppend(o, 0xd3, (uint64_t)v, 8);
+}
+
+static void DKMPAppendNumber(DKMPOutput *o, NSNumber *n) {
+  switch (*[n objCType]) {
+    case 'c': // as SBJsonWriter, chars are booleans
+      DKMPAppend(o, [n boolValue] ? 0xc3 : 0xc2, 0, 0);
+      break;
+    case 'f': {
+      union { float f; uint32_t i; } u;
+      u.f = [n floatValue];
+      DKMPAppend(o, 0xca, u.i, 4);
+      break;
+    }
+    case 'd': {
+      union { double d; uint64_t i; } u;
+      u.d = [n doubleValue];
+      DKMPAppend(o, 0xcb, u.i, 8);
+      break;
+    }
+    case 'C': case 'S': case 'I': case 'L': case 'Q':
+      DKMPAppendUnsigned(o, [n unsignedLongLongValue]);
+      break;
+    default:
+      DKMPAppendInteger(o, [n longLongValue]);
+      break;
+  }
+}
+
+static void DKMPAppendString(DKMPOutput *o, CFStringRef s) {
+  CFIndex length = CFStringGetLength(s);
+  const char *ascii = CFStringGetCStringPtr(s, kCFStringEncodingASCII);
+  if (ascii) {
+    DKMPAppendLength(o, length, 0xa0, 31, 0xd9, 0xda, 0xdb);
+    memcpy(DKMPReserve(o, length), ascii, length);
+    return;
+  }
+  CFIndex used = 0;
+  CFRange range = CFRangeMake(0, length);
+  CFStringGetBytes(s, range, kCFStringEncodingUTF8, 0, false, NULL, 0, &used);
+  DKMPAppendLength(o, used, 0xa0, 31, 0xd9, 0xda, 0xdb);
+  CFStringGetBytes(s, range, kCFStringEncodingUTF8, 0, false, DKMPReserve(o, used), used, NULL);
+}
+
+static BOOL DKMPAppendObject(DKMPOutput *o, id v) {
+  if ([v isKindOfClass:[NSString class]]) {
+    DKMPAppendString(o, (CFStringRef)v);
+
+  } else if ([v isKindOfClass:[NSNumber class]]) {
+    DKMPAppendNumber(o, v);
+
+  } else if ([v isKindOfClass:[NSDictionary class]] || [v isKindOfClass:[NSArray class]]) {
+    if (++o->depth > DKMessagePackMaxDepth) {
+      o->error = DKMessagePackError(DKMessagePackDepthError, @"Nested too deep");
+      return NO;
+    }
+    BOOL isMap = [v isKindOfClass:[NSDictionary class]];
+    if (isMap)
+      DKMPAppendLength(o, [v count], 0x80, 15, 0, 0xde, 0xdf);
+    else
+      DKMPAppendLength(o, [v count], 0x90, 15, 0, 0xdc, 0xdd);
+    for (id item in v) {
+      if (!DKMPAppendObject(o, item) || (isMap && !DKMPAppendObject(o, [v objectForKey:item])))
+        return NO;
+    }
+    o->depth--;
+
+  } else if ([v isKindOfClass:[NSNull class]]) {
+    DKMPAppend(o, 0xc0, 0, 0);
+
+  } else if ([v isKindOfClass:[NSData class]]) {
+    NSUInteger length = [v length];
+    DKMPAppendLength(o, length, 0, 0, 0xc4, 0xc5, 0xc6);
+    memcpy(DKMPReserve(o, length), [v bytes], length);
+
+  } else if ([v respondsToSelector:@selector(proxyForMessagePack)] ||
+             [v respondsToSelector:@selector(proxyForJson)]) {
+    if (++o->depth > DKMessagePackMaxDepth) {
+      o->error = DKMessagePackError(DKMessagePackDepthError, @"Nested too deep");
+      return NO;
+    }
+    id proxy = ([v respondsToSelector:@selector(proxyForMessagePack)] ?
+                [v proxyForMessagePack] : [v proxyForJson]);
+    if (!DKMPAppendObject(o, proxy))
+      return NO;
+    o->depth--;
+
+  } else {
+    o->error = DKMessagePackError(DKMessagePackUnsupportedError,
+                                 [NSString stringWithFormat:@"MessagePack serialisation not supported for %@",
+                                  [v class]]);
+    return NO;
+  }
+  return YES;
+}
+
+#pragma mark Decoding
+
+typedef struct DKMPInput {
+  const uint8_t *c, *end;
+  NSUInteger depth;
+  NSError *error;
+} DKMPInput;
+
+static id DKMPReadObject(DKMPInput *in);
+
+static id DKMPFail(DKMPInput *in, NSInteger code, NSString *description) {
+  if (!in->error)
+    in->error = DKMessagePackError(code, description);
+  return nil;
+}
+
+// size bytes, big endian; the caller checks they are there
+static inline uint64_t DKMPRead(DKMPInput *in, int size) {
+  uint64_t v = 0;
+  while (size--)
+    v = (v << 8) | *in->c++;
+  return v;
+}
+
+static inline BOOL DKMPHas(DKMPInput *in, uint64_t n) {
+  if ((uint64_t)(in->end - in->c) >= n)
+    return YES;
+  DKMPFail(in, DKMessagePackTruncatedError, @"Unexpected end of input");
+  return NO;
+}
+
+// reads the size byte length field that follows a type byte
+static inline BOOL DKMPReadLength(DKMPInput *in, int size, uint64_t *n) {
+  if (!DKMPHas(in, size))
+    return NO;
+  *n = DKMPRead(in, size);
+  return YES;
+}
+
+// everything returned from here on is retained
+static id DKMPReadString(DKMPInput *in, uint64_t n) {
+  if (!DKMPHas(in, n))
+    return nil;
+  CFStringRef s = CFStringCreateWithBytes(kCFAllocatorDefault, in->c, n, kCFStringEncodingUTF8, false);
+  if (!s)
+    return DKMPFail(in, DKMessagePackInvalidError, @"Broken UTF-8 in string");
+  in->c += n;
+  return (id)s;
+}
+
+static id DKMPReadData(DKMPInput *in, uint64_t n) {
+  if (!DKMPHas(in, n))
+    return nil;
+  NSData *data = [[NSData alloc] initWithBytes:in->c length:n];
+  in->c += n;
+  return data;
+}
+
+// every item takes at least a byte, which bounds the counts worth allocating for
+static id DKMPReadContainer(DKMPInput *in, uint64_t n, BOOL isMap) {
+  if (!DKMPHas(in, isMap ? n * 2 : n))
+    return nil;
+  if (++in->depth > DKMessagePackMaxDepth)
+    return DKMPFail(in, DKMessagePackDepthError, @"Nested too deep");
+
+  id container;
+  if (isMap) {
+    NSMutableDictionary *map = [[NSMutableDictionary alloc] initWithCapacity:n];
+    while (n--) {
+      id key = DKMPReadObject(in);
+      id value = key ? DKMPReadObject(in) : nil;
+      if (!value) {
+        [key release];
+        [map release];
+        return nil;
+      }
+      [map setObject:value forKey:key];
+      [key release];
+      [value release];
+    }
+    container = map;
+  } else {
+    NSMutableArray *array = [[NSMutableArray alloc] initWithCapacity:n];
+    while (n--) {
+      id value = DKMPReadObject(in);
+      if (!value) {
+        [array release];
+        return nil;
+      }
+      [array addObject:value];
+      [value release];
+    }
+    container = array;
+  }
+  in->depth--;
+  return container;
+}
+
+static id DKMPReadObject(DKMPInput *in) {
+  if (!DKMPHas(in, 1))
+    return nil;
+  uint8_t t = *in->c++;
+  uint64_t n;
+
+  if (t <= 0x7f)
+    return [[NSNumber alloc] initWithInt:t];
+  if (t >= 0xe0)
+    return [[NSNumber alloc] initWithInt:(int8_t)t];
+  if (t >= 0xa0 && t <= 0xbf)
+    return DKMPReadString(in, t & 0x1f);
+  if (t >= 0x90 && t <= 0x9f)
+    return DKMPReadContainer(in, t & 0x0f, NO);
+  if (t >= 0x80 && t <= 0x8f)
+    return DKMPReadContainer(in, t & 0x0f, YES);
+
+  switch (t) {
+    case 0xc0:
+      return [[NSNull null] retain];
+    case 0xc2:
+    case 0xc3:
+      return [[NSNumber alloc] initWithBool:(t == 0xc3)];
+    case 0xc4: case 0xc5: case 0xc6:
+      if (!DKMPReadLength(in, 1 << (t - 0xc4), &n))
+        return nil;
+      return DKMPReadData(in, n);
+    case 0xca: {
+      if (!DKMPHas(in, 4))
+        return nil;
+      union { float f; uint32_t i; } u;
+      u.i = (uint32_t)DKMPRead(in, 4);
+      return [[NSNumber alloc] initWithFloat:u.f];
+    }
+    case 0xcb: {
+      if (!DKMPHas(in, 8))
+        return nil;
+      union { double d; uint64_t i; } u;
+      u.i = DKMPRead(in, 8);
+      return [[NSNumber alloc] initWithDouble:u.d];
+    }
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+      if (!DKMPReadLength(in, 1 << (t - 0xcc), &n))
+        return nil;
+      if (n > LLONG_MAX)
+        return [[NSNumber alloc] initWithUnsignedLongLong:n];
+      return [[NSNumber alloc] initWithLongLong:(long long)n];
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+      int size = 1 << (t - 0xd0);
+      if (!DKMPReadLength(in, size, &n))
+        return nil;
+      int shift = 64 - 8 * size;  // sign extends the value
+      return [[NSNumber alloc] initWithLongLong:(long long)(n << shift) >> shift];
+    }
+    case 0xd9: case 0xda: case 0xdb:
+      if (!DKMPReadLength(in, 1 << (t - 0xd9), &n))
+        return nil;
+      return DKMPReadString(in, n);
+    case 0xdc: case 0xdd:
+      if (!DKMPReadLength(in, 2 << (t - 0xdc), &n))
+        return nil;
+      return DKMPReadContainer(in, n, NO);
+    case 0xde: case 0xdf:
+      if (!DKMPReadLength(in, 2 << (t - 0xde), &n))
+        return nil;
+      return DKMPReadContainer(in, n, YES);
+    default:
+      return DKMPFail(in, DKMessagePackInvalidError,
+                      [NSString stringWithFormat:@"Unsupported type byte 0x%02x", t]);
+  }
+}
+
+
+@implementation DKMessagePack
+
++ (NSData *)dataWithObject:(id)object error:(NSError **)error {
+  DKMPOutput o;
+  memset(&o, 0, sizeof(o));
+  o.capacity = 256;
+  o.bytes = malloc(o.capacity);
+  if (!DKMPAppendObject(&o, object)) {
+    free(o.bytes);
+    if (error)
+      *error = o.error;
+    return nil;
+  }
+  return [NSData dataWithBytesNoCopy:o.bytes length:o.length freeWhenDone:YES];
+}
+
++ (id)objectWithData:(NSData *)data error:(NSError **)error {
+  return [self objectWithBytes:[data bytes] length:[data length] error:error];
+}
+
++ (id)objectWithBytes:(const void *)bytes length:(NSUInteger)length error:(NSError **)error {
+  DKMPInput in;
+  memset(&in, 0, sizeof(in));
+  in.c = bytes;
+  in.end = in.c + length;
+  id ret = DKMPReadObject(&in);
+  if (ret && in.c != in.end) {
+    [ret release];
+    ret = DKMPFail(&in, DKMessagePackTrailingDataError, @"Garbage after the value");
+  }
+  if (!ret && error)
+    *error = in.error;
+  return [ret autorelease];
+}
+
+@end
@@ -8,6 +8,7 @@
 #import "DKDeferred.h"
 #import "DKDeferred+UIKit.h"
 #import "DKDeferred+JSON.h"
+#import "DKMessagePack.h"
 
 /*! \mainpage DKDeferred - Deferred objects for Objective-C
   <p>DeferredKit is an asynchronous library for cocoa built around the idea of a <a href="http://twistedmatrix.com/projects/core/documentation/howto/defer.html">Deferred Object</a> - that is, "an object created to encapsulate a sequence of callbacks in response to an object that may not yet be available." Besides the core class, DKDeferred, much other functionality is included in this project, including an asynchronous URL loading API, an asynchronous disk cache, and a JSON-RPC implementation.</p>
@@ -47,4 +47,9 @@
 #import "SBJSON.h"
 #import "NSObject+SBJSON.h"
 #import "NSString+SBJSON.h"
+#import "SBJsonStreamParser.h"
+#import "SBJsonEventParser.h"
+#import "SBJsonPathExtractor.h"
+#import "SBJsonModelDecoder.h"
+#import "SBJsonDocument.h"
 
@@ -52,6 +52,10 @@
 - (id)objectWithString:(NSString*)jsonrep
                  error:(NSError**)error;
 
+/// Return the object represented by the given UTF-8 data
+- (id)objectWithData:(NSData*)data
+               error:(NSError**)error;
+
 /// Parse the string and return the represented object (or scalar)
 - (id)objectWithString:(id)value
            allowScalar:(BOOL)x
@@ -62,6 +66,10 @@
 - (NSString*)stringWithObject:(id)value
                         error:(NSError**)error;
 
+/// Return UTF-8 encoded JSON representation of an array or dictionary
+- (NSData*)dataWithObject:(id)value
+                    error:(NSError**)error;
+
 /// Return JSON representation of any legal JSON value
 - (NSString*)stringWithFragment:(id)value
                           error:(NSError**)error;
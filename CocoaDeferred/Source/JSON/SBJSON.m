@@ -113,6 +113,30 @@
                             error:error];
 }
 
+- (NSData *)dataWithObject:(id)obj {
+    NSData *repr = [jsonWriter dataWithObject:obj];
+    if (repr)
+        return repr;
+    
+    [errorTrace release];
+    errorTrace = [[jsonWriter errorTrace] mutableCopy];
+    return nil;
+}
+
+/**
+ Returns the UTF-8 encoded JSON representation of the passed in value, or nil on error.
+ If nil is returned and @p error is not NULL, @p error can be interrogated to find the cause of the error.
+ 
+ @param value a NSDictionary or NSArray instance
+ @param error used to return an error by reference (pass NULL if this is not desired)
+ */
+- (NSData*)dataWithObject:(id)value error:(NSError**)error {
+    NSData *data = [self dataWithObject:value];
+    if (!data && error)
+        *error = [errorTrace lastObject];
+    return data;
+}
+
 #pragma mark Parsing
 
 - (id)objectWithString:(NSString *)repr {
@@ -180,6 +204,33 @@
 
 
 
+- (id)objectWithData:(NSData *)data {
+    id obj = [jsonParser objectWithData:data];
+    if (obj)
+        return obj;
+    
+    [errorTrace release];
+    errorTrace = [[jsonParser errorTrace] mutableCopy];
+    
+    return nil;
+}
+
+/**
+ Returns the object represented by the passed-in UTF-8 data or nil on error. The returned object
+ will be either a dictionary or an array. The bytes are parsed in place, without first being
+ decoded into a string.
+ 
+ @param data the UTF-8 encoded json to parse
+ @param error used to return an error by reference (pass NULL if this is not desired)
+ */
+- (id)objectWithData:(NSData*)data error:(NSError**)error {
+    id obj = [self objectWithData:data];
+    if (!obj && error)
+        *error = [errorTrace lastObject];
+    return obj;
+}
+
+
 #pragma mark Properties - parsing
 
 - (NSUInteger)maxDepth {
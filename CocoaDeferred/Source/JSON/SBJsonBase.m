@@ -69,6 +69,8 @@ NSString * SBJSONErrorDomain = @"org.brautaset.JSON.ErrorDomain";
 }
 
 - (void)clearErrorTrace {
+    if (!errorTrace)
+        return;
     [self willChangeValueForKey:@"errorTrace"];
     [errorTrace release];
     errorTrace = nil;
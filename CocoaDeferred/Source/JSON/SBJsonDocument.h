@@ -0,0 +1,89 @@
+//
+//  SBJsonDocument.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+#import "SBJsonBase.h"
+#import "SBJsonEventParser.h"
+
+/**
+ @brief An immutable JSON document held in a single buffer.
+
+ Where SBJsonParser creates an object for every value in a document, an
+ SBJsonDocument records the values in order in one array of fixed size
+ entries, the tape, followed by the member lists of its arrays and objects
+ and the text of any strings that had escapes. The text of other strings and
+ of numbers too large for 64 bits is read from the parsed data, which the
+ document keeps. A document therefore costs the one buffer however many values
+ it has, and is freed at once.
+
+ The arrays and objects of a document are NSArray and NSDictionary facades
+ that create their elements from the tape each time they are accessed;
+ hold on to an element rather than look it up again if it's used repeatedly.
+ Elements are mapped to the same types as by SBJsonParser, but strings,
+ arrays and dictionaries are immutable. Arrays index their elements directly.
+ Dictionaries of up to 16 keys find a key by comparing its UTF-8 bytes with
+ those of each of their keys in turn, which suits the small objects of a
+ typical response; larger ones look it up in a hash table of their keys kept
+ with their member list. A dictionary creates its key strings once, when it's
+ first enumerated or asked for its keys. When a key appears more than once
+ in an object only the last value is kept, as with SBJsonParser, so the
+ dictionaries equal those it would return.
+
+ Documents and their facades are safe to read from any thread.
+ */
+@interface SBJsonDocument : NSObject {
+
+@private
+    NSData *data;
+    struct SBJsonTapeValue *tape;
+    uint32_t *members;
+    const char *text;
+    const char *strings;
+}
+
+/**
+ @brief The UTF-8 the document was parsed from.
+ */
+@property(readonly) NSData *data;
+
+/**
+ @brief The top level NSArray or NSDictionary of the document.
+ */
+@property(readonly) id root;
+
+@end
+
+
+/**
+ @brief Parses JSON documents into SBJsonDocument instances.
+
+ The document is walked with an SBJsonEventParser and validated as strictly
+ as by SBJsonParser, including the UTF-8 of its strings. The working buffers
+ are kept between documents, so reuse a parser to parse many of them.
+ */
+@interface SBJsonDocumentParser : SBJsonBase <SBJsonEventParserDelegate> {
+
+@private
+    SBJsonEventParser *parser;
+    const char *base;
+    struct SBJsonTapeValue *tape;
+    NSUInteger tapeCount, tapeCapacity;
+    uint32_t *pending;
+    NSUInteger pendingCount, pendingCapacity;
+    uint32_t *members;
+    NSUInteger memberCount, memberCapacity;
+    char *strings;
+    NSUInteger stringsLength, stringsCapacity;
+    struct SBJsonTapeFrame *frames;
+    NSUInteger frameCount, frameCapacity;
+    BOOL failed;
+}
+
+/**
+ @brief The document for the given UTF-8 data, or nil if it is invalid.
+ */
+- (SBJsonDocument *)documentWithData:(NSData *)data;
+
+@end
@@ -0,0 +1,602 @@
+//
+//  SBJsonDocument.m
+//  CocoaDeferred
+//
+
+#import "SBJsonDocument.h"
+#import <xlocale.h>
+#import <limits.h>
+#import <libkern/OSAtomic.h>
+
+/*
+ One value of a document. Containers are followed on the tape by their
+ contents, and list the tape indexes of their elements, or of their keys
+ with each value right after its key, in the document's members. The keys of
+ an object past SBJsonIndexedKeys are followed there by a table of them.
+ */
+typedef struct SBJsonTapeValue {
+    char type;          // n t f, i for long long, d for double, D for decimal,
+                        // s for text in the data, S for text in the strings, [ {
+    uint32_t length;    // of the text, or the number of members
+    union {
+        long long i;
+        double d;
+        NSUInteger offset;  // of the text, or of the first member
+    } u;
+} SBJsonTapeValue;
+
+typedef struct SBJsonTapeFrame {
+    uint32_t value;
+    NSUInteger firstPending;
+    BOOL isArray;
+} SBJsonTapeFrame;
+
+#define SBJsonGrow(buf, count, capacity, n) do { \
+        if ((count) + (n) > (capacity)) { \
+            (capacity) = MAX((capacity) * 2, (count) + (n) + 64); \
+            (buf) = realloc((buf), (capacity) * sizeof(*(buf))); \
+        } \
+    } while (0)
+
+/*
+ Whether the bytes are well formed UTF-8, without overlong forms, surrogates
+ or code points past U+10FFFF. Runs of ASCII are checked 8 bytes at a time.
+ */
+static BOOL SBJsonIsUTF8(const unsigned char *s, NSUInteger length)
+{
+    const unsigned char *end = s + length;
+    while (s < end) {
+        if (end - s >= 8) {
+            uint64_t w;
+            memcpy(&w, s, 8);
+            if (!(w & 0x8080808080808080ULL)) {
+                s += 8;
+                continue;
+            }
+        }
+        if (*s < 0x80) {
+            s++;
+            continue;
+        }
+
+        int n;
+        uint32_t cp, min;
+        if ((*s & 0xE0) == 0xC0)      { n = 1; cp = *s & 0x1F; min = 0x80; }
+        else if ((*s & 0xF0) == 0xE0) { n = 2; cp = *s & 0x0F; min = 0x800; }
+        else if ((*s & 0xF8) == 0xF0) { n = 3; cp = *s & 0x07; min = 0x10000; }
+        else return NO;
+        if (end - s <= n)
+            return NO;
+        for (int i = 1; i <= n; i++) {
+            if ((s[i] & 0xC0) != 0x80)
+                return NO;
+            cp = cp << 6 | (s[i] & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+            return NO;
+        s += n + 1;
+    }
+    return YES;
+}
+
+/*
+ Converts the bytes of a valid JSON number as SBJsonParser would: integers
+ that fit in 64 bits to long long, other integers to decimals that keep the
+ text, and everything else to doubles in the C locale.
+ */
+static void SBJsonTapeNumber(SBJsonTapeValue *v, const char *bytes, NSUInteger length)
+{
+    BOOL negative = bytes[0] == '-';
+    unsigned long long mantissa = 0;
+    NSUInteger i = negative;
+    for (; i < length && isdigit((unsigned char)bytes[i]); i++) {
+        if (i - negative == 19)
+            break;
+        mantissa = mantissa * 10 + (bytes[i] - '0');
+    }
+
+    if (i == length) {
+        if (!negative && mantissa <= LLONG_MAX) {
+            v->type = 'i';
+            v->u.i = (long long)mantissa;
+            return;
+        } else if (negative && mantissa <= (unsigned long long)LLONG_MAX + 1) {
+            v->type = 'i';
+            v->u.i = (long long)(0ULL - mantissa);
+            return;
+        }
+    }
+
+    char buf[64];
+    char *s = length < sizeof(buf) ? buf : malloc(length + 1);
+    memcpy(s, bytes, length);
+    s[length] = 0;
+    if (strpbrk(s, ".eE")) {
+        v->type = 'd';
+        v->u.d = strtod_l(s, NULL, NULL);
+    } else {
+        v->type = 'D';
+        v->length = (uint32_t)length;
+    }
+    if (s != buf)
+        free(s);
+}
+
+/*
+ FNV-1a of the UTF-8 of a key, for the tables that find an object's keys.
+ */
+static uint32_t SBJsonKeyHash(const char *bytes, NSUInteger length)
+{
+    uint32_t h = 2166136261u;
+    for (NSUInteger i = 0; i < length; i++)
+        h = (h ^ (unsigned char)bytes[i]) * 16777619u;
+    return h;
+}
+
+// Objects with more keys keep their table to look keys up in
+#define SBJsonIndexedKeys 16
+
+// A power of two at least twice the number of keys
+static NSUInteger SBJsonKeyTableCapacity(NSUInteger count)
+{
+    NSUInteger capacity = 8;
+    while (capacity < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+/*
+ The slot of a table of the tape indexes of keys that holds the key with the
+ given bytes, or the empty slot where it would go. Empty slots are 0, as the
+ top level value is never a key.
+ */
+static uint32_t *SBJsonKeySlot(uint32_t *table, NSUInteger capacity, const SBJsonTapeValue *tape,
+                               const char *text, const char *strings,
+                               const char *bytes, NSUInteger length)
+{
+    NSUInteger mask = capacity - 1;
+    for (NSUInteger i = SBJsonKeyHash(bytes, length) & mask;; i = (i + 1) & mask) {
+        if (!table[i])
+            return &table[i];
+        const SBJsonTapeValue *k = tape + table[i];
+        if (k->length == length &&
+            !memcmp((k->type == 'S' ? strings : text) + k->u.offset, bytes, length))
+            return &table[i];
+    }
+}
+
+
+@interface SBJsonDocument ()
+- (id)initWithData:(NSData *)data tape:(const SBJsonTapeValue *)values count:(NSUInteger)count
+           members:(const uint32_t *)indexes count:(NSUInteger)memberCount
+           strings:(const char *)bytes length:(NSUInteger)length;
+- (id)objectForValue:(const SBJsonTapeValue *)v;
+- (const char *)textOfValue:(const SBJsonTapeValue *)v;
+- (const SBJsonTapeValue *)valueAtIndex:(uint32_t)i;
+- (const uint32_t *)membersOfValue:(const SBJsonTapeValue *)v;
+- (const SBJsonTapeValue *)keyOfValue:(const SBJsonTapeValue *)v bytes:(const char *)bytes length:(NSUInteger)length;
+@end
+
+
+@interface SBJsonDocumentArray : NSArray {
+    SBJsonDocument *document;
+    const SBJsonTapeValue *value;
+    const uint32_t *elements;
+}
+- (id)initWithDocument:(SBJsonDocument *)document value:(const SBJsonTapeValue *)v;
+@end
+
+@implementation SBJsonDocumentArray
+
+- (id)initWithDocument:(SBJsonDocument *)doc value:(const SBJsonTapeValue *)v {
+    self = [super init];
+    if (self) {
+        document = [doc retain];
+        value = v;
+        elements = [doc membersOfValue:v];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [document release];
+    [super dealloc];
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    return [self retain];
+}
+
+- (NSUInteger)count {
+    return value->length;
+}
+
+- (id)objectAtIndex:(NSUInteger)i {
+    if (i >= value->length)
+        [NSException raise:NSRangeException format:@"index %u beyond bounds [0 .. %u]",
+         (unsigned)i, (unsigned)value->length - 1];
+    return [document objectForValue:[document valueAtIndex:elements[i]]];
+}
+
+@end
+
+
+@interface SBJsonDocumentDictionary : NSDictionary {
+    SBJsonDocument *document;
+    const SBJsonTapeValue *value;
+    const uint32_t *keys;
+    NSArray *keyStrings;
+}
+- (id)initWithDocument:(SBJsonDocument *)document value:(const SBJsonTapeValue *)v;
+@end
+
+@implementation SBJsonDocumentDictionary
+
+- (id)initWithDocument:(SBJsonDocument *)doc value:(const SBJsonTapeValue *)v {
+    self = [super init];
+    if (self) {
+        document = [doc retain];
+        value = v;
+        keys = [doc membersOfValue:v];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [keyStrings release];
+    [document release];
+    [super dealloc];
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    return [self retain];
+}
+
+- (NSUInteger)count {
+    return value->length;
+}
+
+- (id)objectForKey:(id)key {
+    if (![key isKindOfClass:[NSString class]])
+        return nil;
+    const SBJsonTapeValue *k = [document keyOfValue:value bytes:[key UTF8String]
+                                             length:[key lengthOfBytesUsingEncoding:NSUTF8StringEncoding]];
+    return k ? [document objectForValue:k + 1] : nil;
+}
+
+// Created once, by whichever thread gets there first
+- (NSArray *)allKeys {
+    if (!keyStrings) {
+        NSUInteger count = value->length;
+        id *strings = malloc(MAX(count, 1) * sizeof(id));
+        for (NSUInteger i = 0; i < count; i++)
+            strings[i] = [document objectForValue:[document valueAtIndex:keys[i]]];
+        NSArray *a = [[NSArray alloc] initWithObjects:strings count:count];
+        free(strings);
+        if (!OSAtomicCompareAndSwapPtrBarrier(nil, a, (void * volatile *)&keyStrings))
+            [a release];
+    }
+    return keyStrings;
+}
+
+- (NSEnumerator *)keyEnumerator {
+    return [[self allKeys] objectEnumerator];
+}
+
+@end
+
+
+@implementation SBJsonDocument
+
+@synthesize data;
+
+- (id)initWithData:(NSData *)theData tape:(const SBJsonTapeValue *)values count:(NSUInteger)count
+           members:(const uint32_t *)indexes count:(NSUInteger)memberCount
+           strings:(const char *)bytes length:(NSUInteger)length {
+    self = [super init];
+    if (self) {
+        data = [theData copy];
+        text = [data bytes];
+
+        // the tape, members and strings share one buffer
+        size_t tapeSize = count * sizeof(SBJsonTapeValue);
+        size_t membersSize = memberCount * sizeof(uint32_t);
+        tape = malloc(tapeSize + membersSize + length);
+        members = (uint32_t *)((char *)tape + tapeSize);
+        strings = (char *)members + membersSize;
+        memcpy(tape, values, tapeSize);
+        memcpy(members, indexes, membersSize);
+        memcpy((char *)strings, bytes, length);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(tape);
+    [data release];
+    [super dealloc];
+}
+
+- (id)root {
+    return [self objectForValue:tape];
+}
+
+- (const SBJsonTapeValue *)valueAtIndex:(uint32_t)i {
+    return tape + i;
+}
+
+- (const uint32_t *)membersOfValue:(const SBJsonTapeValue *)v {
+    return members + v->u.offset;
+}
+
+- (const char *)textOfValue:(const SBJsonTapeValue *)v {
+    return (v->type == 'S' ? strings : text) + v->u.offset;
+}
+
+// Objects past SBJsonIndexedKeys have their table after their keys
+- (const SBJsonTapeValue *)keyOfValue:(const SBJsonTapeValue *)v bytes:(const char *)bytes length:(NSUInteger)length {
+    uint32_t *keys = members + v->u.offset;
+    if (v->length > SBJsonIndexedKeys) {
+        uint32_t k = *SBJsonKeySlot(keys + v->length, SBJsonKeyTableCapacity(v->length),
+                                    tape, text, strings, bytes, length);
+        return k ? tape + k : NULL;
+    }
+    for (NSUInteger i = 0; i < v->length; i++) {
+        const SBJsonTapeValue *k = tape + keys[i];
+        if (k->length == length && !memcmp([self textOfValue:k], bytes, length))
+            return k;
+    }
+    return NULL;
+}
+
+- (id)objectForValue:(const SBJsonTapeValue *)v {
+    switch (v->type) {
+        case '[':
+            return [[[SBJsonDocumentArray alloc] initWithDocument:self value:v] autorelease];
+        case '{':
+            return [[[SBJsonDocumentDictionary alloc] initWithDocument:self value:v] autorelease];
+        case 's':
+        case 'S':
+            return [[[NSString alloc] initWithBytes:[self textOfValue:v] length:v->length
+                                           encoding:NSUTF8StringEncoding] autorelease];
+        case 'i':
+            return [NSNumber numberWithLongLong:v->u.i];
+        case 'd':
+            return [NSNumber numberWithDouble:v->u.d];
+        case 'D': {
+            NSString *s = [[NSString alloc] initWithBytes:[self textOfValue:v] length:v->length
+                                                 encoding:NSUTF8StringEncoding];
+            NSDecimalNumber *n = [NSDecimalNumber decimalNumberWithString:s];
+            [s release];
+            return n;
+        }
+        case 't':
+            return [NSNumber numberWithBool:YES];
+        case 'f':
+            return [NSNumber numberWithBool:NO];
+        default:
+            return [NSNull null];
+    }
+}
+
+@end
+
+
+@interface SBJsonDocumentParser ()
+- (SBJsonTapeValue *)addValue:(char)type;
+- (void)addText:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped
+         parser:(SBJsonEventParser *)p key:(BOOL)isKey;
+- (void)startedContainer:(char)type;
+- (void)endedContainer;
+- (NSUInteger)dropRepeatedKeys:(uint32_t *)keys count:(NSUInteger)count
+                         table:(uint32_t *)table capacity:(NSUInteger)capacity;
+@end
+
+@implementation SBJsonDocumentParser
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        parser = [[SBJsonEventParser alloc] init];
+        parser.delegate = self;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(tape);
+    free(pending);
+    free(members);
+    free(strings);
+    free(frames);
+    parser.delegate = nil;
+    [parser release];
+    [super dealloc];
+}
+
+- (SBJsonDocument *)documentWithData:(NSData *)data {
+    [self clearErrorTrace];
+    if (!data) {
+        [self addErrorWithCode:EINPUT description:@"Input was 'nil'"];
+        return nil;
+    }
+
+    base = [data bytes];
+    tapeCount = pendingCount = memberCount = stringsLength = frameCount = 0;
+    failed = NO;
+    parser.maxDepth = maxDepth;
+    if (![parser parseBytes:base length:[data length]]) {
+        NSError *error = [parser.errorTrace lastObject];
+        [self addErrorWithCode:[error code] description:[error localizedDescription]];
+        return nil;
+    }
+    if (failed)
+        return nil;
+
+    return [[[SBJsonDocument alloc] initWithData:data tape:tape count:tapeCount
+                                         members:members count:memberCount
+                                         strings:strings length:stringsLength] autorelease];
+}
+
+#pragma mark SBJsonEventParserDelegate
+
+- (void)parserStartedObject:(SBJsonEventParser *)p {
+    [self startedContainer:'{'];
+}
+
+- (void)parserStartedArray:(SBJsonEventParser *)p {
+    [self startedContainer:'['];
+}
+
+- (void)parserEndedObject:(SBJsonEventParser *)p {
+    [self endedContainer];
+}
+
+- (void)parserEndedArray:(SBJsonEventParser *)p {
+    [self endedContainer];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundKey:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    [self addText:bytes length:length escaped:escaped parser:p key:YES];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundString:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    [self addText:bytes length:length escaped:escaped parser:p key:NO];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundNumber:(const char *)bytes length:(NSUInteger)length {
+    SBJsonTapeValue *v = [self addValue:'i'];
+    v->u.offset = bytes - base;
+    SBJsonTapeNumber(v, bytes, length);
+}
+
+- (void)parser:(SBJsonEventParser *)p foundBool:(BOOL)x {
+    [self addValue:x ? 't' : 'f'];
+}
+
+- (void)parserFoundNull:(SBJsonEventParser *)p {
+    [self addValue:'n'];
+}
+
+#pragma mark Building
+
+// A value on the tape, listed as a member when it's an element of an array
+- (SBJsonTapeValue *)addValue:(char)type {
+    SBJsonGrow(tape, tapeCount, tapeCapacity, 1);
+    if (frameCount && frames[frameCount - 1].isArray) {
+        SBJsonGrow(pending, pendingCount, pendingCapacity, 1);
+        pending[pendingCount++] = (uint32_t)tapeCount;
+    }
+    SBJsonTapeValue *v = &tape[tapeCount++];
+    memset(v, 0, sizeof(*v));
+    v->type = type;
+    return v;
+}
+
+/*
+ Strings without escapes are only checked, and read from the data when they're
+ needed. Others are unescaped into the strings.
+ */
+- (void)addText:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped
+         parser:(SBJsonEventParser *)p key:(BOOL)isKey {
+    if (failed)
+        return;
+    if (isKey) {
+        SBJsonGrow(pending, pendingCount, pendingCapacity, 1);
+        pending[pendingCount++] = (uint32_t)tapeCount;
+    }
+
+    if (!escaped) {
+        if (!SBJsonIsUTF8((const unsigned char *)bytes, length)) {
+            failed = YES;
+            [self addErrorWithCode:EUNICODE description:@"Invalid UTF-8 in string"];
+            [p stop];
+            return;
+        }
+        SBJsonTapeValue *v = [self addValue:'s'];
+        v->length = (uint32_t)length;
+        v->u.offset = bytes - base;
+        return;
+    }
+
+    NSData *utf8 = [[p stringWithBytes:bytes length:length escaped:YES] dataUsingEncoding:NSUTF8StringEncoding];
+    if (!utf8) {
+        failed = YES;
+        [self addErrorWithCode:EUNICODE description:@"Broken unicode character in string"];
+        [p stop];
+        return;
+    }
+    SBJsonTapeValue *v = [self addValue:'S'];
+    v->length = (uint32_t)[utf8 length];
+    v->u.offset = stringsLength;
+    SBJsonGrow(strings, stringsLength, stringsCapacity, [utf8 length]);
+    memcpy(strings + stringsLength, [utf8 bytes], [utf8 length]);
+    stringsLength += [utf8 length];
+}
+
+- (void)startedContainer:(char)type {
+    uint32_t value = (uint32_t)tapeCount;
+    [self addValue:type];
+    SBJsonGrow(frames, frameCount, frameCapacity, 1);
+    SBJsonTapeFrame *frame = &frames[frameCount++];
+    frame->value = value;
+    frame->firstPending = pendingCount;
+    frame->isArray = (type == '[');
+}
+
+/*
+ Moves the container's members from the pending stack to the members. Of the
+ keys an object repeats only the last is kept, as SBJsonParser would, so
+ objects count and enumerate each key once. The table that finds them is kept
+ after the keys of large objects, rebuilt if any were dropped.
+ */
+- (void)endedContainer {
+    SBJsonTapeFrame *frame = &frames[--frameCount];
+    NSUInteger count = pendingCount - frame->firstPending;
+    NSUInteger capacity = !frame->isArray && count > 1 ? SBJsonKeyTableCapacity(count) : 0;
+    SBJsonGrow(members, memberCount, memberCapacity, count + capacity);
+    uint32_t *list = members + memberCount;
+    memcpy(list, pending + frame->firstPending, count * sizeof(uint32_t));
+    pendingCount = frame->firstPending;
+    if (capacity) {
+        NSUInteger kept = [self dropRepeatedKeys:list count:count table:list + count capacity:capacity];
+        if (kept != count && kept > SBJsonIndexedKeys)
+            [self dropRepeatedKeys:list count:kept table:list + kept capacity:SBJsonKeyTableCapacity(kept)];
+        count = kept;
+    }
+
+    SBJsonTapeValue *v = &tape[frame->value];
+    v->length = (uint32_t)count;
+    v->u.offset = memberCount;
+    memberCount += count;
+    if (!frame->isArray && count > SBJsonIndexedKeys)
+        memberCount += SBJsonKeyTableCapacity(count);
+}
+
+// Keeps the last of each key in place, and puts those in the table past them
+- (NSUInteger)dropRepeatedKeys:(uint32_t *)keys count:(NSUInteger)count
+                         table:(uint32_t *)table capacity:(NSUInteger)capacity {
+    memset(table, 0, capacity * sizeof(uint32_t));
+    BOOL repeated = NO;
+    for (NSUInteger i = count; i > 0; i--) {
+        const SBJsonTapeValue *k = &tape[keys[i - 1]];
+        uint32_t *slot = SBJsonKeySlot(table, capacity, tape, base, strings,
+                                       (k->type == 'S' ? strings : base) + k->u.offset, k->length);
+        if (*slot) {
+            keys[i - 1] = 0;
+            repeated = YES;
+        } else {
+            *slot = keys[i - 1];
+        }
+    }
+    if (!repeated)
+        return count;
+
+    NSUInteger kept = 0;
+    for (NSUInteger i = 0; i < count; i++)
+        if (keys[i])
+            keys[kept++] = keys[i];
+    return kept;
+}
+
+@end
@@ -0,0 +1,113 @@
+//
+//  SBJsonEventParser.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+#import "SBJsonBase.h"
+
+@class SBJsonParser;
+@class SBJsonEventParser;
+
+/**
+ @brief Receives the events of an SBJsonEventParser.
+
+ Strings, keys and numbers are passed as byte ranges into the parsed buffer,
+ valid only for the duration of the call. Strings and keys are passed without
+ their quotes; @p escaped tells whether the range still contains escapes, and
+ if not it is the UTF-8 value itself. Use -stringWithBytes:length:escaped: and
+ -numberWithBytes:length: on the parser to turn a range into an object.
+ */
+@protocol SBJsonEventParserDelegate <NSObject>
+@optional
+- (void)parserStartedObject:(SBJsonEventParser *)parser;
+- (void)parserEndedObject:(SBJsonEventParser *)parser;
+- (void)parserStartedArray:(SBJsonEventParser *)parser;
+- (void)parserEndedArray:(SBJsonEventParser *)parser;
+- (void)parser:(SBJsonEventParser *)parser foundKey:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped;
+- (void)parser:(SBJsonEventParser *)parser foundString:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped;
+- (void)parser:(SBJsonEventParser *)parser foundNumber:(const char *)bytes length:(NSUInteger)length;
+- (void)parser:(SBJsonEventParser *)parser foundBool:(BOOL)x;
+- (void)parserFoundNull:(SBJsonEventParser *)parser;
+@end
+
+
+/**
+ @brief Reports the structure and values of a JSON document without building it.
+
+ The parser walks the document in place and calls its delegate for every
+ value, keeping only a stack of the open containers, so memory use is bounded
+ by the nesting depth rather than the size of the document.
+
+ From parser:foundKey:length:escaped: the delegate may call -skipValue or
+ -objectForValue to skip or build the member's value in one go; from
+ parserStartedObject: or parserStartedArray: the same calls apply to the
+ container that was just opened. No further events are sent for that value,
+ including its end event. Skipped values are only checked for balanced
+ brackets and terminated strings.
+
+ The document is otherwise validated as strictly as by SBJsonParser, except
+ that the UTF-8 in strings is only checked when they are turned into objects.
+ */
+@interface SBJsonEventParser : SBJsonBase {
+
+@private
+    id<SBJsonEventParserDelegate> delegate;
+    unsigned int respondsTo;
+    SBJsonParser *scalarParser;
+    const char *c;
+    const char *end;
+    char *kinds;
+    NSUInteger kindsCapacity;
+    int state;
+    const char *pendingStart;
+    BOOL pendingMember;
+    BOOL stopped;
+    BOOL failed;
+}
+
+@property(assign) id<SBJsonEventParserDelegate> delegate;
+
+/**
+ @brief The number of arrays and objects currently open.
+ */
+@property(readonly) NSUInteger depth;
+
+/**
+ @brief Walk the document, calling the delegate.
+
+ Returns NO if the document is invalid; the reason is in errorTrace.
+ */
+- (BOOL)parse:(NSData *)data;
+
+/**
+ @brief Walk the document in the given buffer, calling the delegate.
+ */
+- (BOOL)parseBytes:(const char *)bytes length:(NSUInteger)length;
+
+/**
+ @brief Stop parsing once the current event returns. The parse is considered successful.
+ */
+- (void)stop;
+
+/**
+ @brief Skip the pending value. See the class description.
+ */
+- (void)skipValue;
+
+/**
+ @brief Build and return the pending value. See the class description.
+ */
+- (id)objectForValue;
+
+/**
+ @brief The string for a range passed to parser:foundString:length:escaped: or parser:foundKey:length:escaped:.
+ */
+- (NSString *)stringWithBytes:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped;
+
+/**
+ @brief The number for a range passed to parser:foundNumber:length:.
+ */
+- (NSNumber *)numberWithBytes:(const char *)bytes length:(NSUInteger)length;
+
+@end
@@ -0,0 +1,475 @@
+//
+//  SBJsonEventParser.m
+//  CocoaDeferred
+//
+
+#import "SBJsonEventParser.h"
+#import "SBJsonParser.h"
+#import "SBJsonSIMD.h"
+
+enum {
+    SBEventStart,
+    SBEventValue,
+    SBEventValueOrEnd,      // just after '['
+    SBEventKey,
+    SBEventKeyOrEnd,        // just after '{'
+    SBEventColon,
+    SBEventCommaOrEnd,
+    SBEventDone
+};
+
+// which optional delegate methods are implemented
+enum {
+    SBRespondsStartedObject = 1 << 0,
+    SBRespondsEndedObject   = 1 << 1,
+    SBRespondsStartedArray  = 1 << 2,
+    SBRespondsEndedArray    = 1 << 3,
+    SBRespondsKey           = 1 << 4,
+    SBRespondsString        = 1 << 5,
+    SBRespondsNumber        = 1 << 6,
+    SBRespondsBool          = 1 << 7,
+    SBRespondsNull          = 1 << 8
+};
+
+#define cur (c < end ? (unsigned char)*c : 0)
+#define skipWhitespace(c) do { \
+        if (c < end && (unsigned char)*c <= ' ') c = SBJsonScanSpace(c, end); \
+    } while (0)
+#define isDigit(x) ((x) >= '0' && (x) <= '9')
+#define isHexDigit(x) (isDigit(x) || ((x) >= 'a' && (x) <= 'f') || ((x) >= 'A' && (x) <= 'F'))
+
+/*
+ Returns the end of the value starting at p, or NULL if the input ends first.
+ Only brackets and strings are looked at, nothing is validated.
+ */
+static const char *SBJsonSkipValue(const char *p, const char *end)
+{
+    NSUInteger open = 0;
+    while (p < end) {
+        switch (*p) {
+            case '"':
+                for (p++;;) {
+                    p = SBJsonScanString(p, end);
+                    if (p >= end)
+                        return NULL;
+                    if (*p == '"')
+                        break;
+                    p += (*p == '\\') ? 2 : 1;
+                }
+                p++;
+                if (!open)
+                    return p;
+                break;
+            case '[':
+            case '{':
+                open++;
+                p++;
+                break;
+            case ']':
+            case '}':
+                if (!open)
+                    return p;   // a number or literal ended by its container
+                p++;
+                if (!--open)
+                    return p;
+                break;
+            default:
+                if (!open && (*p == ',' || (unsigned char)*p <= ' '))
+                    return p;
+                p++;
+                break;
+        }
+    }
+    return open ? NULL : p;
+}
+
+@interface SBJsonEventParser ()
+
+- (BOOL)open:(char)kind;
+- (void)close;
+- (void)endValue;
+- (BOOL)scanString:(BOOL *)escaped;
+- (BOOL)scanNumber;
+- (id)scanPendingValue:(BOOL)build;
+- (BOOL)failWithCode:(NSUInteger)code description:(NSString *)str;
+
+@end
+
+
+@implementation SBJsonEventParser
+
+@synthesize delegate;
+
+- (id)init {
+    self = [super init];
+    if (self)
+        scalarParser = [[SBJsonParser alloc] init];
+    return self;
+}
+
+- (void)dealloc {
+    [scalarParser release];
+    free(kinds);
+    [super dealloc];
+}
+
+- (NSUInteger)depth {
+    return depth;
+}
+
+- (BOOL)parse:(NSData *)data {
+    if (!data) {
+        [self clearErrorTrace];
+        [self addErrorWithCode:EINPUT description:@"Input was 'nil'"];
+        return NO;
+    }
+    return [self parseBytes:[data bytes] length:[data length]];
+}
+
+- (BOOL)parseBytes:(const char *)bytes length:(NSUInteger)length {
+    [self clearErrorTrace];
+
+    respondsTo = 0;
+    if ([delegate respondsToSelector:@selector(parserStartedObject:)])
+        respondsTo |= SBRespondsStartedObject;
+    if ([delegate respondsToSelector:@selector(parserEndedObject:)])
+        respondsTo |= SBRespondsEndedObject;
+    if ([delegate respondsToSelector:@selector(parserStartedArray:)])
+        respondsTo |= SBRespondsStartedArray;
+    if ([delegate respondsToSelector:@selector(parserEndedArray:)])
+        respondsTo |= SBRespondsEndedArray;
+    if ([delegate respondsToSelector:@selector(parser:foundKey:length:escaped:)])
+        respondsTo |= SBRespondsKey;
+    if ([delegate respondsToSelector:@selector(parser:foundString:length:escaped:)])
+        respondsTo |= SBRespondsString;
+    if ([delegate respondsToSelector:@selector(parser:foundNumber:length:)])
+        respondsTo |= SBRespondsNumber;
+    if ([delegate respondsToSelector:@selector(parser:foundBool:)])
+        respondsTo |= SBRespondsBool;
+    if ([delegate respondsToSelector:@selector(parserFoundNull:)])
+        respondsTo |= SBRespondsNull;
+
+    c = bytes;
+    end = bytes + length;
+    depth = 0;
+    state = SBEventStart;
+    pendingStart = NULL;
+    pendingMember = NO;
+    stopped = failed = NO;
+
+    // A UTF-8 byte order mark is allowed in front of the document
+    if (length >= 3 && !memcmp(c, "\xEF\xBB\xBF", 3))
+        c += 3;
+
+    while (!stopped) {
+        skipWhitespace(c);
+        if (c >= end)
+            break;
+
+        unsigned char ch = *c;
+        switch (state) {
+            case SBEventStart:
+                if (ch != '{' && ch != '[')
+                    return [self failWithCode:EFRAGMENT description:@"Expected an array or object"];
+                // fall through
+            case SBEventValue:
+            case SBEventValueOrEnd:
+                if (ch == '{' || ch == '[') {
+                    if (![self open:ch])
+                        return NO;
+
+                } else if (ch == '"') {
+                    BOOL escaped;
+                    const char *s = ++c;
+                    if (![self scanString:&escaped])
+                        return NO;
+                    [self endValue];
+                    if (respondsTo & SBRespondsString)
+                        [delegate parser:self foundString:s length:c - 1 - s escaped:escaped];
+
+                } else if (ch == '-' || isDigit(ch)) {
+                    const char *s = c;
+                    if (![self scanNumber])
+                        return NO;
+                    [self endValue];
+                    if (respondsTo & SBRespondsNumber)
+                        [delegate parser:self foundNumber:s length:c - s];
+
+                } else if (ch == 't' || ch == 'f') {
+                    BOOL x = (ch == 't');
+                    const char *literal = x ? "true" : "false";
+                    size_t n = x ? 4 : 5;
+                    if (!((size_t)(end - c) >= n && !memcmp(c, literal, n)))
+                        return [self failWithCode:EPARSE description:
+                                [NSString stringWithFormat:@"Expected '%s'", literal]];
+                    c += n;
+                    [self endValue];
+                    if (respondsTo & SBRespondsBool)
+                        [delegate parser:self foundBool:x];
+
+                } else if (ch == 'n') {
+                    if (!(end - c >= 4 && !memcmp(c, "null", 4)))
+                        return [self failWithCode:EPARSE description:@"Expected 'null'"];
+                    c += 4;
+                    [self endValue];
+                    if (respondsTo & SBRespondsNull)
+                        [delegate parserFoundNull:self];
+
+                } else if (ch == ']' && state == SBEventValueOrEnd) {
+                    [self close];
+
+                } else if (ch == ']' && kinds[depth - 1] == '[') {
+                    return [self failWithCode:ETRAILCOMMA description:@"Trailing comma disallowed in array"];
+
+                } else if (ch == '+') {
+                    return [self failWithCode:EPARSENUM description:@"Leading + disallowed in number"];
+
+                } else {
+                    return [self failWithCode:EPARSE description:@"Unrecognised leading character"];
+                }
+                break;
+
+            case SBEventKey:
+            case SBEventKeyOrEnd:
+                if (ch == '"') {
+                    BOOL escaped;
+                    const char *s = ++c;
+                    if (![self scanString:&escaped])
+                        return NO;
+                    state = SBEventColon;
+                    if (respondsTo & SBRespondsKey) {
+                        pendingMember = YES;
+                        [delegate parser:self foundKey:s length:c - 1 - s escaped:escaped];
+                        pendingMember = NO;
+                    }
+
+                } else if (ch == '}' && state == SBEventKeyOrEnd) {
+                    [self close];
+
+                } else if (ch == '}') {
+                    return [self failWithCode:ETRAILCOMMA description:@"Trailing comma disallowed in object"];
+
+                } else {
+                    return [self failWithCode:EPARSE description:@"Object key string expected"];
+                }
+                break;
+
+            case SBEventColon:
+                if (ch != ':')
+                    return [self failWithCode:EPARSE description:@"Expected ':' separating key and value"];
+                c++;
+                state = SBEventValue;
+                break;
+
+            case SBEventCommaOrEnd:
+                if (ch == ',') {
+                    c++;
+                    state = (kinds[depth - 1] == '{') ? SBEventKey : SBEventValue;
+                } else if (ch == (kinds[depth - 1] == '{' ? '}' : ']')) {
+                    [self close];
+                } else {
+                    return [self failWithCode:EPARSE description:
+                            (kinds[depth - 1] == '{' ? @"Expected ',' or '}' after object value"
+                                                     : @"Expected ',' or ']' after array value")];
+                }
+                break;
+
+            case SBEventDone:
+                return [self failWithCode:ETRAILGARBAGE description:@"Garbage after JSON"];
+        }
+    }
+
+    if (failed)
+        return NO;
+    if (!stopped && state != SBEventDone) {
+        if (state == SBEventStart)
+            return [self failWithCode:EEOF description:@"Unexpected end of string"];
+        return [self failWithCode:EEOF description:
+                (kinds[depth - 1] == '{' ? @"End of input while parsing object"
+                                         : @"End of input while parsing array")];
+    }
+    return YES;
+}
+
+- (void)stop {
+    stopped = YES;
+}
+
+- (void)skipValue {
+    [self scanPendingValue:NO];
+}
+
+- (id)objectForValue {
+    return [self scanPendingValue:YES];
+}
+
+- (NSString *)stringWithBytes:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    if (!escaped)
+        return [[[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding] autorelease];
+    NSMutableData *quoted = [NSMutableData dataWithCapacity:length + 2];
+    [quoted appendBytes:"\"" length:1];
+    [quoted appendBytes:bytes length:length];
+    [quoted appendBytes:"\"" length:1];
+    return [scalarParser fragmentWithBytes:[quoted bytes] length:[quoted length]];
+}
+
+- (NSNumber *)numberWithBytes:(const char *)bytes length:(NSUInteger)length {
+    return [scalarParser fragmentWithBytes:bytes length:length];
+}
+
+#pragma mark Scanning
+
+- (BOOL)open:(char)kind {
+    if (maxDepth && depth >= maxDepth)
+        return [self failWithCode:EDEPTH description:@"Nested too deep"];
+    if (depth == kindsCapacity) {
+        kindsCapacity = kindsCapacity ? kindsCapacity * 2 : 32;
+        kinds = realloc(kinds, kindsCapacity);
+    }
+    kinds[depth++] = kind;
+    pendingStart = c++;
+    if (kind == '{') {
+        state = SBEventKeyOrEnd;
+        if (respondsTo & SBRespondsStartedObject)
+            [delegate parserStartedObject:self];
+    } else {
+        state = SBEventValueOrEnd;
+        if (respondsTo & SBRespondsStartedArray)
+            [delegate parserStartedArray:self];
+    }
+    pendingStart = NULL;
+    return !failed;
+}
+
+- (void)close {
+    char kind = kinds[--depth];
+    c++;
+    [self endValue];
+    if (kind == '{') {
+        if (respondsTo & SBRespondsEndedObject)
+            [delegate parserEndedObject:self];
+    } else {
+        if (respondsTo & SBRespondsEndedArray)
+            [delegate parserEndedArray:self];
+    }
+}
+
+- (void)endValue {
+    state = depth ? SBEventCommaOrEnd : SBEventDone;
+}
+
+// c is just past the opening quote; leaves it just past the closing one
+- (BOOL)scanString:(BOOL *)escaped {
+    *escaped = NO;
+    for (;;) {
+        c = SBJsonScanString(c, end);
+        if (c >= end)
+            return [self failWithCode:EEOF description:@"Unexpected EOF while parsing string"];
+
+        if (*c == '"') {
+            c++;
+            return YES;
+
+        } else if (*c == '\\') {
+            *escaped = YES;
+            c++;
+            switch (cur) {
+                case '"': case '\\': case '/':
+                case 'b': case 'f': case 'n': case 'r': case 't':
+                    c++;
+                    break;
+                case 'u':
+                    if (!(end - c >= 5 && isHexDigit(c[1]) && isHexDigit(c[2]) && isHexDigit(c[3]) && isHexDigit(c[4])))
+                        return [self failWithCode:EUNICODE description:@"Missing hex digit in quad"];
+                    c += 5;
+                    break;
+                default:
+                    return [self failWithCode:EESCAPE description:
+                            [NSString stringWithFormat:@"Illegal escape sequence '0x%x'", cur]];
+            }
+
+        } else {
+            return [self failWithCode:ECTRL description:
+                    [NSString stringWithFormat:@"Unescaped control character '0x%x'", *c]];
+        }
+    }
+}
+
+- (BOOL)scanNumber {
+    if ('-' == cur)
+        c++;
+
+    if ('0' == cur && c++) {
+        if (isDigit(cur))
+            return [self failWithCode:EPARSENUM description:@"Leading 0 disallowed in number"];
+    } else if (!isDigit(cur)) {
+        return [self failWithCode:EPARSENUM description:@"No digits after initial minus"];
+    } else {
+        while (isDigit(cur))
+            c++;
+    }
+
+    if ('.' == cur && c++) {
+        if (!isDigit(cur))
+            return [self failWithCode:EPARSENUM description:@"No digits after decimal point"];
+        while (isDigit(cur))
+            c++;
+    }
+
+    if ('e' == cur || 'E' == cur) {
+        c++;
+        if ('-' == cur || '+' == cur)
+            c++;
+        if (!isDigit(cur))
+            return [self failWithCode:EPARSENUM description:@"No digits after exponent"];
+        while (isDigit(cur))
+            c++;
+    }
+    return YES;
+}
+
+- (id)scanPendingValue:(BOOL)build {
+    const char *start;
+    if (pendingMember) {
+        skipWhitespace(c);
+        if (cur != ':') {
+            [self failWithCode:EPARSE description:@"Expected ':' separating key and value"];
+            return nil;
+        }
+        c++;
+        skipWhitespace(c);
+        start = c;
+    } else if (pendingStart) {
+        start = pendingStart;
+        depth--;
+    } else {
+        return nil;
+    }
+    pendingMember = NO;
+    pendingStart = NULL;
+
+    const char *stop = (start < end) ? SBJsonSkipValue(start, end) : NULL;
+    if (!stop || stop == start) {
+        [self failWithCode:EEOF description:@"Unexpected end of input in value"];
+        return nil;
+    }
+    c = stop;
+    [self endValue];
+    if (!build)
+        return nil;
+
+    id o = [scalarParser fragmentWithBytes:start length:stop - start];
+    if (!o) {
+        NSError *error = [[scalarParser errorTrace] lastObject];
+        [self failWithCode:[error code] description:[error localizedDescription]];
+    }
+    return o;
+}
+
+- (BOOL)failWithCode:(NSUInteger)code description:(NSString *)str {
+    [self addErrorWithCode:code description:str];
+    stopped = failed = YES;
+    return NO;
+}
+
+@end
@@ -0,0 +1,102 @@
+//
+//  SBJsonModelDecoder.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+#import "SBJsonBase.h"
+#import "SBJsonEventParser.h"
+
+/**
+ @brief Describes how the members of a JSON object map onto the properties of a model class.
+
+ Each mapped key names a declared, writable property of the class. Scalar
+ properties (integers, floating point, BOOL) are set from JSON numbers and
+ booleans; object properties take the value built for the member, which is
+ dropped if it isn't of the property's declared class. Members whose key
+ isn't mapped are skipped.
+
+ A key mapped with a nested mapping is decoded into an instance of that
+ mapping's class if its value is an object, or into an array of instances if
+ it is an array, so the element type of array properties is given here. A
+ mapping may be nested in itself for recursive models.
+
+ Set up a mapping before handing it to a decoder; after that it may be
+ shared between decoders and threads.
+ */
+@interface SBJsonClassMapping : NSObject {
+
+@private
+    Class modelClass;
+    NSMutableArray *keys;
+    NSMutableArray *mappings;
+    struct SBJsonProperty *properties;
+    NSUInteger propertyCount;
+}
+
++ (id)mappingWithClass:(Class)cls;
+- (id)initWithClass:(Class)cls;
+
+@property(readonly) Class modelClass;
+
+/**
+ @brief Map each key to the property of the same name. Returns NO if one of them can't be mapped.
+ */
+- (BOOL)mapKeys:(NSArray *)keys;
+
+/**
+ @brief Map a key to a property. Returns NO if the class has no writable property of that name and a supported type.
+ */
+- (BOOL)mapKey:(NSString *)key toProperty:(NSString *)property;
+
+/**
+ @brief Map a key to an object property whose value is decoded with another mapping.
+ */
+- (BOOL)mapKey:(NSString *)key toProperty:(NSString *)property mapping:(SBJsonClassMapping *)mapping;
+
+/// @internal the property a key maps to, starting the search at *hint
+- (const struct SBJsonProperty *)propertyForKey:(const char *)bytes length:(NSUInteger)length hint:(NSUInteger *)hint;
+
+@end
+
+
+/**
+ @brief Decodes JSON documents straight into instances of model classes.
+
+ The document is walked with an SBJsonEventParser and each object is created
+ as an instance of its mapping's class and populated member by member as the
+ parser reaches it. No dictionary is built for a mapped object, and members
+ that aren't mapped are skipped without creating any objects. Numbers and
+ booleans for scalar properties are converted from the document's bytes
+ without creating an NSNumber.
+
+ A document that is an object decodes to an instance of the root mapping's
+ class; a document that is an array decodes to an NSArray of instances.
+ Values of object properties without a nested mapping, and array elements
+ that aren't objects, are built as by SBJsonParser.
+ */
+@interface SBJsonModelDecoder : SBJsonBase <SBJsonEventParserDelegate> {
+
+@private
+    SBJsonClassMapping *mapping;
+    SBJsonEventParser *parser;
+    struct SBJsonModelFrame *frames;
+    NSUInteger frameCount, frameCapacity;
+    id result;
+}
+
+- (id)initWithMapping:(SBJsonClassMapping *)mapping;
+
+@property(readonly) SBJsonClassMapping *mapping;
+
+/**
+ @brief The model for the given UTF-8 document, or nil if it is invalid.
+ */
+- (id)objectWithData:(NSData *)data;
+
+/**
+ @brief The model for the given UTF-8 bytes, or nil if they are invalid.
+ */
+- (id)objectWithBytes:(const char *)bytes length:(NSUInteger)length;
+
+@end
@@ -0,0 +1,385 @@
+//
+//  SBJsonModelDecoder.m
+//  CocoaDeferred
+//
+
+#import "SBJsonModelDecoder.h"
+#import <objc/runtime.h>
+#import <objc/message.h>
+#import <xlocale.h>
+#import <limits.h>
+
+typedef struct SBJsonProperty {
+    const char *key;                // UTF-8, held by the mapping's keys
+    NSUInteger keyLength;
+    SEL setter;
+    char type;                      // @encode of the property
+    Class valueClass;               // declared class of an object property, or Nil
+    SBJsonClassMapping *mapping;    // nested mapping, or nil
+} SBJsonProperty;
+
+/*
+ Fills in the setter and type of a property of cls. Fails for missing and
+ readonly properties and for types that can't come from JSON.
+ */
+static BOOL SBJsonLookUpProperty(Class cls, NSString *name, SBJsonProperty *p)
+{
+    objc_property_t property = class_getProperty(cls, [name UTF8String]);
+    if (!property)
+        return NO;
+    const char *attrs = property_getAttributes(property);
+    if (attrs[0] != 'T' || !strchr("@cCsSiIlLqQfdB", attrs[1]))
+        return NO;
+    p->type = attrs[1];
+    p->valueClass = Nil;
+    if (p->type == '@' && attrs[2] == '"' && attrs[3] != '<') {
+        const char *end = strchr(attrs + 3, '"');
+        if (end) {
+            NSString *className = [[NSString alloc] initWithBytes:attrs + 3 length:end - (attrs + 3)
+                                                         encoding:NSUTF8StringEncoding];
+            p->valueClass = NSClassFromString(className);
+            [className release];
+        }
+    }
+
+    NSString *setter = nil;
+    for (const char *a = strchr(attrs, ','); a; a = strchr(a + 1, ',')) {
+        if (a[1] == 'R')
+            return NO;
+        if (a[1] == 'S') {
+            const char *end = strchr(a + 2, ',');
+            setter = [[[NSString alloc] initWithBytes:a + 2 length:(end ? end : a + strlen(a)) - (a + 2)
+                                             encoding:NSUTF8StringEncoding] autorelease];
+        }
+    }
+    if (!setter)
+        setter = [NSString stringWithFormat:@"set%@%@:",
+                  [[name substringToIndex:1] uppercaseString], [name substringFromIndex:1]];
+    p->setter = NSSelectorFromString(setter);
+    return [cls instancesRespondToSelector:p->setter];
+}
+
+
+@implementation SBJsonClassMapping
+
+@synthesize modelClass;
+
++ (id)mappingWithClass:(Class)cls {
+    return [[[self alloc] initWithClass:cls] autorelease];
+}
+
+- (id)initWithClass:(Class)cls {
+    self = [super init];
+    if (self) {
+        modelClass = cls;
+        keys = [[NSMutableArray alloc] init];
+        mappings = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(properties);
+    [keys release];
+    [mappings release];
+    [super dealloc];
+}
+
+- (BOOL)mapKeys:(NSArray *)theKeys {
+    for (NSString *key in theKeys)
+        if (![self mapKey:key toProperty:key])
+            return NO;
+    return YES;
+}
+
+- (BOOL)mapKey:(NSString *)key toProperty:(NSString *)property {
+    return [self mapKey:key toProperty:property mapping:nil];
+}
+
+- (BOOL)mapKey:(NSString *)key toProperty:(NSString *)property mapping:(SBJsonClassMapping *)mapping {
+    SBJsonProperty p;
+    if (![property length] || !SBJsonLookUpProperty(modelClass, property, &p))
+        return NO;
+    if (mapping && p.type != '@')
+        return NO;
+
+    NSData *utf8 = [key dataUsingEncoding:NSUTF8StringEncoding];
+    p.key = [utf8 bytes];
+    p.keyLength = [utf8 length];
+    p.mapping = mapping;
+    // a mapping nested in itself isn't retained, to avoid a cycle
+    if (mapping && mapping != self)
+        [mappings addObject:mapping];
+
+    NSUInteger i = [keys indexOfObject:utf8];
+    if (i == NSNotFound) {
+        i = propertyCount++;
+        properties = realloc(properties, propertyCount * sizeof(SBJsonProperty));
+        [keys addObject:utf8];
+    } else {
+        [keys replaceObjectAtIndex:i withObject:utf8];
+    }
+    properties[i] = p;
+    return YES;
+}
+
+/*
+ Members mostly come in the same order in every object of a kind, so the
+ search starts after the last match.
+ */
+- (const SBJsonProperty *)propertyForKey:(const char *)bytes length:(NSUInteger)length hint:(NSUInteger *)hint {
+    for (NSUInteger n = 0, i = *hint; n < propertyCount; n++, i++) {
+        if (i >= propertyCount)
+            i = 0;
+        const SBJsonProperty *p = &properties[i];
+        if (p->keyLength == length && !memcmp(p->key, bytes, length)) {
+            *hint = i + 1;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+@end
+
+
+typedef struct SBJsonModelFrame {
+    id container;                   // the instance, or an NSMutableArray
+    SBJsonClassMapping *mapping;    // of the instance, or of the array's elements
+    const SBJsonProperty *member;   // the property the next value is for
+    NSUInteger hint;
+    BOOL isArray;
+} SBJsonModelFrame;
+
+#define SBJsonSend(T, v) ((void (*)(id, SEL, T))objc_msgSend)(obj, p->setter, (T)(v))
+
+static void SBJsonSetObject(id obj, const SBJsonProperty *p, id v)
+{
+    if (v && p->valueClass && ![v isKindOfClass:p->valueClass])
+        return;
+    SBJsonSend(id, v);
+}
+
+static void SBJsonSetInteger(id obj, const SBJsonProperty *p, long long ll, unsigned long long u)
+{
+    switch (p->type) {
+        case 'c': SBJsonSend(char, ll); break;
+        case 's': SBJsonSend(short, ll); break;
+        case 'i': SBJsonSend(int, ll); break;
+        case 'l': SBJsonSend(long, ll); break;
+        case 'q': SBJsonSend(long long, ll); break;
+        case 'C': SBJsonSend(unsigned char, u); break;
+        case 'S': SBJsonSend(unsigned short, u); break;
+        case 'I': SBJsonSend(unsigned int, u); break;
+        case 'L': SBJsonSend(unsigned long, u); break;
+        case 'Q': SBJsonSend(unsigned long long, u); break;
+    }
+}
+
+static void SBJsonSetDouble(id obj, const SBJsonProperty *p, double d)
+{
+    switch (p->type) {
+        case 'f': SBJsonSend(float, d); break;
+        case 'd': SBJsonSend(double, d); break;
+        case 'B': SBJsonSend(bool, d != 0); break;
+        default: {
+            long long ll = (d >= (double)LLONG_MAX ? LLONG_MAX : d <= (double)LLONG_MIN ? LLONG_MIN : (long long)d);
+            SBJsonSetInteger(obj, p, ll, (unsigned long long)ll);
+            break;
+        }
+    }
+}
+
+/*
+ Sets a scalar property from the bytes of a JSON number, converted in the C
+ locale.
+ */
+static void SBJsonSetNumber(id obj, const SBJsonProperty *p, const char *bytes, NSUInteger length)
+{
+    char buf[64];
+    char *s = length < sizeof(buf) ? buf : malloc(length + 1);
+    memcpy(s, bytes, length);
+    s[length] = 0;
+
+    if (p->type == 'f' || p->type == 'd' || p->type == 'B' || strpbrk(s, ".eE")) {
+        SBJsonSetDouble(obj, p, strtod_l(s, NULL, NULL));
+    } else {
+        long long ll = strtoll_l(s, NULL, 10, NULL);
+        SBJsonSetInteger(obj, p, ll, s[0] == '-' ? (unsigned long long)ll : strtoull_l(s, NULL, 10, NULL));
+    }
+    if (s != buf)
+        free(s);
+}
+
+
+@interface SBJsonModelDecoder ()
+- (void)startedContainer:(BOOL)isArray;
+- (void)endedContainer;
+- (void)foundValue:(id)v;
+@end
+
+@implementation SBJsonModelDecoder
+
+@synthesize mapping;
+
+- (id)initWithMapping:(SBJsonClassMapping *)aMapping {
+    self = [super init];
+    if (self) {
+        mapping = [aMapping retain];
+        parser = [[SBJsonEventParser alloc] init];
+        parser.delegate = self;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    while (frameCount)
+        [frames[--frameCount].container release];
+    free(frames);
+    [result release];
+    [mapping release];
+    parser.delegate = nil;
+    [parser release];
+    [super dealloc];
+}
+
+- (id)objectWithData:(NSData *)data {
+    return [self objectWithBytes:[data bytes] length:[data length]];
+}
+
+- (id)objectWithBytes:(const char *)bytes length:(NSUInteger)length {
+    [self clearErrorTrace];
+
+    BOOL ok = [parser parseBytes:bytes length:length];
+    while (frameCount)
+        [frames[--frameCount].container release];
+
+    id ret = [result autorelease];
+    result = nil;
+    if (!ok) {
+        NSError *error = [parser.errorTrace lastObject];
+        [self addErrorWithCode:[error code] description:[error localizedDescription]];
+        return nil;
+    }
+    return ret;
+}
+
+#pragma mark SBJsonEventParserDelegate
+
+- (void)parserStartedObject:(SBJsonEventParser *)p {
+    [self startedContainer:NO];
+}
+
+- (void)parserStartedArray:(SBJsonEventParser *)p {
+    [self startedContainer:YES];
+}
+
+- (void)parserEndedObject:(SBJsonEventParser *)p {
+    [self endedContainer];
+}
+
+- (void)parserEndedArray:(SBJsonEventParser *)p {
+    [self endedContainer];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundKey:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    if (escaped) {
+        const char *utf8 = [[p stringWithBytes:bytes length:length escaped:YES] UTF8String];
+        bytes = utf8;
+        length = utf8 ? strlen(utf8) : 0;
+    }
+    SBJsonModelFrame *top = &frames[frameCount - 1];
+    top->member = [top->mapping propertyForKey:bytes length:length hint:&top->hint];
+    if (!top->member)
+        [p skipValue];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundString:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    SBJsonModelFrame *top = &frames[frameCount - 1];
+    if (top->isArray || top->member->type == '@')
+        [self foundValue:[p stringWithBytes:bytes length:length escaped:escaped]];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundNumber:(const char *)bytes length:(NSUInteger)length {
+    SBJsonModelFrame *top = &frames[frameCount - 1];
+    if (top->isArray || top->member->type == '@')
+        [self foundValue:[p numberWithBytes:bytes length:length]];
+    else
+        SBJsonSetNumber(top->container, top->member, bytes, length);
+}
+
+- (void)parser:(SBJsonEventParser *)p foundBool:(BOOL)x {
+    SBJsonModelFrame *top = &frames[frameCount - 1];
+    if (top->isArray || top->member->type == '@')
+        [self foundValue:[NSNumber numberWithBool:x]];
+    else
+        SBJsonSetDouble(top->container, top->member, x);
+}
+
+- (void)parserFoundNull:(SBJsonEventParser *)p {
+    SBJsonModelFrame *top = &frames[frameCount - 1];
+    if (top->isArray)
+        [self foundValue:[NSNull null]];
+    else if (top->member->type == '@')
+        [self foundValue:nil];
+}
+
+#pragma mark Building
+
+/*
+ Opens an instance or array of instances where the mapping calls for one,
+ and otherwise builds or skips the container in one go.
+ */
+- (void)startedContainer:(BOOL)isArray {
+    SBJsonClassMapping *m = mapping;
+    if (frameCount) {
+        SBJsonModelFrame *top = &frames[frameCount - 1];
+        if (!top->isArray) {
+            m = top->member->mapping;
+            if (!m) {
+                if (top->member->type == '@')
+                    [self foundValue:[parser objectForValue]];
+                else
+                    [parser skipValue];
+                return;
+            }
+        } else {
+            m = top->mapping;
+        }
+    }
+
+    if (frameCount == frameCapacity) {
+        frameCapacity = frameCapacity ? frameCapacity * 2 : 8;
+        frames = realloc(frames, frameCapacity * sizeof(SBJsonModelFrame));
+    }
+    SBJsonModelFrame *f = &frames[frameCount++];
+    f->container = isArray ? [[NSMutableArray alloc] init] : [[m.modelClass alloc] init];
+    f->mapping = m;
+    f->member = NULL;
+    f->hint = 0;
+    f->isArray = isArray;
+}
+
+- (void)endedContainer {
+    id container = frames[--frameCount].container;
+    [self foundValue:container];
+    [container release];
+}
+
+// a value for the top container, or the document itself
+- (void)foundValue:(id)v {
+    if (!frameCount) {
+        [result release];
+        result = [v retain];
+        return;
+    }
+    SBJsonModelFrame *top = &frames[frameCount - 1];
+    if (top->isArray) {
+        if (v)
+            [top->container addObject:v];
+    } else {
+        SBJsonSetObject(top->container, top->member, v);
+    }
+}
+
+@end
@@ -47,6 +47,16 @@
  */
 - (id)objectWithString:(NSString *)repr;
 
+/**
+ @brief Return the object represented by the given UTF-8 data.
+ 
+ Scans the bytes in place, without building an intermediate string. A leading
+ UTF-8 byte order mark is skipped.
+ 
+ @param data the UTF-8 encoded json to parse
+ */
+- (id)objectWithData:(NSData *)data;
+
 @end
 
 
@@ -60,28 +70,92 @@
  @li Array -> NSMutableArray
  @li Object -> NSMutableDictionary
  @li Boolean -> NSNumber (initialised with -initWithBool:)
- @li Number -> NSDecimalNumber
+ @li Number -> NSNumber (long long for integers, double otherwise)
  
  Since Objective-C doesn't have a dedicated class for boolean values, these turns into NSNumber
  instances. These are initialised with the -initWithBool: method, and 
  round-trip back to JSON properly. (They won't silently suddenly become 0 or 1; they'll be
  represented as 'true' and 'false' again.)
  
- JSON numbers turn into NSDecimalNumber instances,
- as we can thus avoid any loss of precision. (JSON allows ridiculously large numbers.)
+ Short dictionary keys without escapes are interned per parser, so the keys of a long
+ array of similar objects share a single immutable NSString each.
+ 
+ Integers that fit in 64 bits become long long NSNumbers and other numbers become
+ correctly rounded doubles. Integers too large for 64 bits become NSDecimalNumber instances
+ so they don't lose precision. (JSON allows ridiculously large numbers.) Set
+ useDecimalNumbers to get NSDecimalNumber for every number, as older versions did.
+ 
+ Large documents are parsed in two stages instead: first an index of the
+ offsets of their structural characters and string quotes is built 64 bytes at a time
+ (see SBJsonStructuralIndex.h), then the objects are built by walking the index
+ rather than rescanning the text for them. A large document whose top level is
+ an array can also have its elements split into ranges that are built on
+ several threads at once. Which engine is used only depends on the size of the
+ document; the results and errors are the same.
+ 
+ Either way documents are parsed without recursion: the arrays and objects
+ being built are kept on a stack of frames that is allocated once per parser,
+ so deeply nested documents can be parsed on threads with small stacks,
+ including the threads that build the parts of a large array. The nesting is
+ still limited by maxDepth.
  
  */
 @interface SBJsonParser : SBJsonBase <SBJsonParser> {
     
 @private
     const char *c;
+    const char *end;
+    BOOL useDecimalNumbers;
+    struct SBKeyCacheSlot *keyCache;
+    NSUInteger indexedParsingThreshold, parallelParsingThreshold;
+    const char *base;
+    const uint32_t *ix, *ixEnd;
+    struct SBJsonParseFrame *frames;
+    NSUInteger frameCapacity;
+    IMP scanStringIMP, scanKeyIMP, scanNumberIMP;
 }
 
+/**
+ @brief Whether every number is returned as an exact NSDecimalNumber.
+ 
+ Defaults to NO. Decimal numbers are exact but much slower to create than
+ long long or double NSNumbers.
+ */
+@property BOOL useDecimalNumbers;
+
+/**
+ @brief The size in bytes from which documents are parsed through a structural index.
+ 
+ Defaults to 1MB. Building the index costs a pass over the document that only
+ pays off once the document is well out of the cache. Set to 0 to always scan
+ the bytes directly.
+ */
+@property NSUInteger indexedParsingThreshold;
+
+/**
+ @brief The size in bytes from which the elements of a top level array are parsed on several threads.
+ 
+ Defaults to 8MB, and has no effect on a single core. Only applies to
+ documents that are also indexed. Set to 0 to always parse on the calling
+ thread.
+ */
+@property NSUInteger parallelParsingThreshold;
+
+/**
+ @brief Return the object represented by the given UTF-8 bytes.
+ 
+ The buffer does not need to be NUL terminated; scanning stops at @p length.
+ */
+- (id)objectWithBytes:(const char *)bytes length:(NSUInteger)length;
+
 @end
 
 // don't use - exists for backwards compatibility with 2.1.x only. Will be removed in 2.3.
 @interface SBJsonParser (Private)
 - (id)fragmentWithString:(id)repr;
+- (id)fragmentWithBytes:(const char *)bytes length:(NSUInteger)length;
+// a complete, quoted object key; goes through the key cache
+- (id)keyWithBytes:(const char *)bytes length:(NSUInteger)length;
 @end
 
 
@@ -28,17 +28,40 @@
  */
 
 #import "SBJsonParser.h"
+#import "SBJsonSIMD.h"
+#import "SBJsonStructuralIndex.h"
+#import <xlocale.h>
+
+/*
+ A range of the elements of a top level array, and the index entries within
+ it, to be built by a parser of its own.
+ */
+@interface SBJsonArrayChunk : NSObject {
+@public
+    SBJsonParser *parser;
+    const char *base, *start, *stop;
+    const uint32_t *ix, *ixEnd;
+    NSMutableArray *elements;
+}
+@end
+
+@implementation SBJsonArrayChunk
+
+- (void)dealloc {
+    [parser release];
+    [elements release];
+    [super dealloc];
+}
+
+@end
+
 
 @interface SBJsonParser ()
 
 - (BOOL)scanValue:(NSObject **)o;
 
-- (BOOL)scanRestOfArray:(NSMutableArray **)o;
-- (BOOL)scanRestOfDictionary:(NSMutableDictionary **)o;
-- (BOOL)scanRestOfNull:(NSNull **)o;
-- (BOOL)scanRestOfFalse:(NSNumber **)o;
-- (BOOL)scanRestOfTrue:(NSNumber **)o;
 - (BOOL)scanRestOfString:(NSMutableString **)o;
+- (BOOL)scanKey:(NSString **)o;
 
 // Cannot manage without looking at the first digit
 - (BOOL)scanNumber:(NSNumber **)o;
@@ -48,23 +71,123 @@
 
 - (BOOL)scanIsAtEnd;
 
+- (id)containerOrNil:(id)o;
+
+- (id)walkFragment;
+- (BOOL)walkString:(NSMutableString **)o;
+
+- (BOOL)walkParallelArray:(NSMutableArray **)o;
+- (void)walkChunk:(SBJsonArrayChunk *)chunk;
+- (BOOL)walkElements:(NSMutableArray *)a;
+
 @end
 
-#define skipWhitespace(c) while (isspace(*c)) c++
-#define skipDigits(c) while (isdigit(*c)) c++
+// The input is not NUL terminated, every read is checked against `end`.
+#define cur (c < end ? (unsigned char)*c : 0)
+#define skipWhitespace(c) do { \
+        if (c < end && (unsigned char)*c <= ' ') c = SBJsonScanSpace(c, end); \
+    } while (0)
+#define skipDigits(c) while (c < end && isdigit((unsigned char)*c)) c++
 
+// Whether c is at the next indexed character, and it is ch
+#define atIndex(ch) (ix < ixEnd && c == base + *ix && *c == ch)
+// Skips the index entries that were scanned over along with a string
+#define syncIndex() while (ix < ixEnd && base + *ix < c) ix++
+// Steps over a structural character, and its entry if an index is walked
+#define skipStructural() do { if (ix < ixEnd && c == base + *ix) ix++; c++; } while (0)
 
-@implementation SBJsonParser
+/*
+ Direct mapped cache of recently seen dictionary keys, indexed by an FNV-1a
+ hash of their raw bytes. A colliding key simply replaces the slot.
+ */
+#define SBKeyCacheSize 512
+#define SBKeyCacheMaxLength 32
 
-static char ctrl[0x22];
+typedef struct SBKeyCacheSlot {
+    NSString *key;
+    unsigned int hash;
+    unsigned int length;
+    char bytes[SBKeyCacheMaxLength];
+} SBKeyCacheSlot;
 
-+ (void)initialize
+static inline unsigned int SBHashBytes(const char *bytes, size_t length)
 {
-    ctrl[0] = '\"';
-    ctrl[1] = '\\';
-    for (int i = 1; i < 0x20; i++)
-        ctrl[i+1] = i;
-    ctrl[0x21] = 0;    
+    unsigned int h = 2166136261U;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)bytes[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// Powers of ten that are exact in a double
+static const double SBExactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ Clinger's fast path. When the decimal mantissa and the power of ten are both
+ exact in a double, a single multiply or divide is correctly rounded. This
+ covers nearly every number seen in practice.
+ */
+static inline BOOL SBFastDouble(unsigned long long mantissa, int exp10, double *out)
+{
+    if (mantissa > (1ULL << 53))
+        return NO;
+    if (exp10 < -22 || exp10 > 22 + 15)
+        return NO;
+    double d = (double)mantissa;
+    if (exp10 > 22) {
+        // 1.5e30 is 15e29: move the excess into the mantissa while it stays exact
+        d *= SBExactPowersOfTen[exp10 - 22];
+        if (d >= 9007199254740992.0)
+            return NO;
+        exp10 = 22;
+    }
+    *out = (exp10 < 0) ? d / SBExactPowersOfTen[-exp10] : d * SBExactPowersOfTen[exp10];
+    return YES;
+}
+
+// Correctly rounded conversion for everything else, independent of the current locale
+static double SBSlowDouble(const char *bytes, size_t length)
+{
+    char stackbuf[64];
+    char *buf = (length < sizeof(stackbuf)) ? stackbuf : malloc(length + 1);
+    memcpy(buf, bytes, length);
+    buf[length] = 0;
+    double d = strtod_l(buf, NULL, NULL);
+    if (buf != stackbuf)
+        free(buf);
+    return d;
+}
+
+
+@implementation SBJsonParser
+
+@synthesize useDecimalNumbers;
+@synthesize indexedParsingThreshold;
+@synthesize parallelParsingThreshold;
+
+- (id)init {
+    if ((self = [super init])) {
+        indexedParsingThreshold = 1024 * 1024;
+        parallelParsingThreshold = 8 * 1024 * 1024;
+        scanStringIMP = [self methodForSelector:@selector(scanRestOfString:)];
+        scanKeyIMP = [self methodForSelector:@selector(scanKey:)];
+        scanNumberIMP = [self methodForSelector:@selector(scanNumber:)];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (keyCache) {
+        for (int i = 0; i < SBKeyCacheSize; i++)
+            [keyCache[i].key release];
+        free(keyCache);
+    }
+    free(frames);
+    [super dealloc];
 }
 
 /**
@@ -72,15 +195,43 @@ static char ctrl[0x22];
  It should be removed in the next major version.
  */
 - (id)fragmentWithString:(id)repr {
+    if (!repr) {
+        [self clearErrorTrace];
+        [self addErrorWithCode:EINPUT description:@"Input was 'nil'"];
+        return nil;
+    }
+    const char *utf8 = [repr UTF8String];
+    return [self fragmentWithBytes:utf8 length:strlen(utf8)];
+}
+
+- (id)fragmentWithBytes:(const char *)bytes length:(NSUInteger)length {
     [self clearErrorTrace];
     
-    if (!repr) {
+    if (!bytes && length) {
         [self addErrorWithCode:EINPUT description:@"Input was 'nil'"];
         return nil;
     }
     
     depth = 0;
-    c = [repr UTF8String];
+    c = bytes;
+    end = bytes + length;
+    
+    // A UTF-8 byte order mark is allowed in front of the document
+    if (length >= 3 && !memcmp(c, "\xEF\xBB\xBF", 3))
+        c += 3;
+    
+    SBJsonStructuralIndex index;
+    if (indexedParsingThreshold && length >= indexedParsingThreshold
+        && SBJsonStructuralIndexBuild(&index, bytes, length)) {
+        base = bytes;
+        ix = index.offsets;
+        ixEnd = index.offsets + index.count;
+        id o = [self walkFragment];
+        base = NULL;
+        ix = ixEnd = NULL;
+        SBJsonStructuralIndexFree(&index);
+        return o;
+    }
     
     id o;
     if (![self scanValue:&o]) {
@@ -93,13 +244,49 @@ static char ctrl[0x22];
         return nil;
     }
         
-    NSAssert1(o, @"Should have a valid object from %@", repr);
+    NSAssert(o, @"Should have a valid object");
     return o;    
 }
 
+- (id)keyWithBytes:(const char *)bytes length:(NSUInteger)length {
+    [self clearErrorTrace];
+    
+    c = bytes;
+    end = bytes + length;
+    
+    id k;
+    if (!(cur == '\"' && c++ && [self scanKey:&k])) {
+        [self addErrorWithCode:EPARSE description: @"Object key string expected"];
+        return nil;
+    }
+    if (c != end) {
+        [self addErrorWithCode:ETRAILGARBAGE description:@"Garbage after object key"];
+        return nil;
+    }
+    return k;
+}
+
 - (id)objectWithString:(NSString *)repr {
 
     id o = [self fragmentWithString:repr];
+    return [self containerOrNil:o];
+}
+
+- (id)objectWithData:(NSData *)data {
+    if (!data) {
+        [self clearErrorTrace];
+        [self addErrorWithCode:EINPUT description:@"Input was 'nil'"];
+        return nil;
+    }
+    return [self objectWithBytes:[data bytes] length:[data length]];
+}
+
+- (id)objectWithBytes:(const char *)bytes length:(NSUInteger)length {
+    id o = [self fragmentWithBytes:bytes length:length];
+    return [self containerOrNil:o];
+}
+
+- (id)containerOrNil:(id)o {
     if (!o)
         return nil;
     
@@ -112,203 +299,275 @@ static char ctrl[0x22];
     return o;
 }
 
+/*
+ An array or object that scanValue: is inside of. The frame owns the
+ container and the key of the member being scanned, so a key the key cache
+ drops in the meantime stays alive until the value is set.
+ */
+typedef struct SBJsonParseFrame {
+    id container;
+    NSString *key;
+    BOOL isObject;
+} SBJsonParseFrame;
+
+// What each byte can start, for the switch in scanValue:
+enum {
+    SBJsonLeadNone = 0,
+    SBJsonLeadObject,
+    SBJsonLeadArray,
+    SBJsonLeadString,
+    SBJsonLeadNumber,
+    SBJsonLeadTrue,
+    SBJsonLeadFalse,
+    SBJsonLeadNull,
+    SBJsonLeadPlus
+};
+
+static const unsigned char SBJsonLeadBytes[256] = {
+    ['{'] = SBJsonLeadObject,
+    ['['] = SBJsonLeadArray,
+    ['"'] = SBJsonLeadString,
+    ['-'] = SBJsonLeadNumber,
+    ['0' ... '9'] = SBJsonLeadNumber,
+    ['t'] = SBJsonLeadTrue,
+    ['f'] = SBJsonLeadFalse,
+    ['n'] = SBJsonLeadNull,
+    ['+'] = SBJsonLeadPlus
+};
+
+typedef BOOL (*SBJsonScanIMP)(id, SEL, id *);
+
 /*
  In contrast to the public methods, it is an error to omit the error parameter here.
+ 
+ Arrays and objects are scanned in a loop rather than by recursing into each
+ level, with the ones still open kept on a stack of frames that the parser
+ reuses between documents, so the nesting a document can have is only
+ limited by maxDepth and not by the stack of the thread parsing it. Values
+ are dispatched on their first byte through SBJsonLeadBytes, and strings,
+ keys and numbers are scanned through their methods' implementations directly.
+ 
+ The same loop walks the structural index of a large document: it then steps
+ over the index entry of each structural character it passes, and takes the
+ end of a string from the index. Elsewhere the text is scanned either way.
+ 
+ The errors are those the recursive descent parser this replaces reported:
+ the error itself, then one for each array or object it is in, innermost first.
  */
 - (BOOL)scanValue:(NSObject **)o
 {
+    SBJsonParseFrame *top = NULL;
+    NSUInteger count = 0;   // frames in use
+    NSUInteger blamed;      // how many of them add to the error trace
+    id v;
+    BOOL owned;             // whether v is a container we have to release
+    BOOL keyed;
+    
+value:
     skipWhitespace(c);
     
-    switch (*c++) {
-        case '{':
-            return [self scanRestOfDictionary:(NSMutableDictionary **)o];
-            break;
-        case '[':
-            return [self scanRestOfArray:(NSMutableArray **)o];
-            break;
-        case '"':
-            return [self scanRestOfString:(NSMutableString **)o];
+    if (c >= end) {
+        [self addErrorWithCode:EEOF description:@"Unexpected end of string"];
+        goto fail;
+    }
+    
+    owned = NO;
+    switch (SBJsonLeadBytes[(unsigned char)*c]) {
+        case SBJsonLeadObject:
+        case SBJsonLeadArray:
+            if (maxDepth && ++depth > maxDepth) {
+                [self addErrorWithCode:EDEPTH description: @"Nested too deep"];
+                goto fail;
+            }
+            if (count == frameCapacity) {
+                frameCapacity = frameCapacity ? frameCapacity * 2 : 32;
+                frames = realloc(frames, frameCapacity * sizeof(SBJsonParseFrame));
+            }
+            top = &frames[count++];
+            top->isObject = *c == '{';
+            top->container = top->isObject 
+                ? (id)[[NSMutableDictionary alloc] initWithCapacity:7] 
+                : (id)[[NSMutableArray alloc] initWithCapacity:8];
+            top->key = nil;
+            skipStructural();
+            goto member;
+            
+        case SBJsonLeadString:
+            if (atIndex('"')) {
+                if (![self walkString:&v])
+                    goto fail;
+                break;
+            }
+            c++;
+            if (!((SBJsonScanIMP)scanStringIMP)(self, @selector(scanRestOfString:), &v))
+                goto fail;
+            syncIndex();
             break;
-        case 'f':
-            return [self scanRestOfFalse:(NSNumber **)o];
+            
+        case SBJsonLeadNumber:
+            if (!((SBJsonScanIMP)scanNumberIMP)(self, @selector(scanNumber:), &v))
+                goto fail;
             break;
-        case 't':
-            return [self scanRestOfTrue:(NSNumber **)o];
+            
+        case SBJsonLeadTrue:
+            if (!(end - c >= 4 && !memcmp(c, "true", 4))) {
+                [self addErrorWithCode:EPARSE description:@"Expected 'true'"];
+                goto fail;
+            }
+            c += 4;
+            v = [NSNumber numberWithBool:YES];
             break;
-        case 'n':
-            return [self scanRestOfNull:(NSNull **)o];
+            
+        case SBJsonLeadFalse:
+            if (!(end - c >= 5 && !memcmp(c, "false", 5))) {
+                [self addErrorWithCode:EPARSE description: @"Expected 'false'"];
+                goto fail;
+            }
+            c += 5;
+            v = [NSNumber numberWithBool:NO];
             break;
-        case '-':
-        case '0'...'9':
-            c--; // cannot verify number correctly without the first character
-            return [self scanNumber:(NSNumber **)o];
+            
+        case SBJsonLeadNull:
+            if (!(end - c >= 4 && !memcmp(c, "null", 4))) {
+                [self addErrorWithCode:EPARSE description: @"Expected 'null'"];
+                goto fail;
+            }
+            c += 4;
+            v = [NSNull null];
             break;
-        case '+':
+            
+        case SBJsonLeadPlus:
             [self addErrorWithCode:EPARSENUM description: @"Leading + disallowed in number"];
-            return NO;
-            break;
-        case 0x0:
-            [self addErrorWithCode:EEOF description:@"Unexpected end of string"];
-            return NO;
-            break;
+            goto fail;
+            
         default:
             [self addErrorWithCode:EPARSE description: @"Unrecognised leading character"];
-            return NO;
-            break;
+            goto fail;
     }
     
-    NSAssert(0, @"Should never get here");
-    return NO;
-}
-
-- (BOOL)scanRestOfTrue:(NSNumber **)o
-{
-    if (!strncmp(c, "rue", 3)) {
-        c += 3;
-        *o = [NSNumber numberWithBool:YES];
+add:
+    if (!count) {
+        *o = owned ? [v autorelease] : v;
         return YES;
     }
-    [self addErrorWithCode:EPARSE description:@"Expected 'true'"];
-    return NO;
-}
-
-- (BOOL)scanRestOfFalse:(NSNumber **)o
-{
-    if (!strncmp(c, "alse", 4)) {
-        c += 4;
-        *o = [NSNumber numberWithBool:NO];
-        return YES;
-    }
-    [self addErrorWithCode:EPARSE description: @"Expected 'false'"];
-    return NO;
-}
-
-- (BOOL)scanRestOfNull:(NSNull **)o {
-    if (!strncmp(c, "ull", 3)) {
-        c += 3;
-        *o = [NSNull null];
-        return YES;
-    }
-    [self addErrorWithCode:EPARSE description: @"Expected 'null'"];
-    return NO;
-}
-
-- (BOOL)scanRestOfArray:(NSMutableArray **)o {
-    if (maxDepth && ++depth > maxDepth) {
-        [self addErrorWithCode:EDEPTH description: @"Nested too deep"];
-        return NO;
+    if (top->isObject) {
+        [top->container setObject:v forKey:top->key];
+        [top->key release];
+        top->key = nil;
+    } else {
+        [top->container addObject:v];
     }
+    if (owned)
+        [v release];
     
-    *o = [NSMutableArray arrayWithCapacity:8];
-    
-    for (; *c ;) {
-        id v;
-        
+    skipWhitespace(c);
+    if (cur == ',') {
+        skipStructural();
         skipWhitespace(c);
-        if (*c == ']' && c++) {
-            depth--;
-            return YES;
-        }
-        
-        if (![self scanValue:&v]) {
-            [self addErrorWithCode:EPARSE description:@"Expected value while parsing array"];
-            return NO;
+        if (cur == (top->isObject ? '}' : ']')) {
+            [self addErrorWithCode:ETRAILCOMMA description:top->isObject 
+             ? @"Trailing comma disallowed in object" 
+             : @"Trailing comma disallowed in array"];
+            goto failInContainer;
         }
-        
-        [*o addObject:v];
-        
-        skipWhitespace(c);
-        if (*c == ',' && c++) {
-            skipWhitespace(c);
-            if (*c == ']') {
-                [self addErrorWithCode:ETRAILCOMMA description: @"Trailing comma disallowed in array"];
-                return NO;
-            }
-        }        
     }
     
-    [self addErrorWithCode:EEOF description: @"End of input while parsing array"];
-    return NO;
-}
-
-- (BOOL)scanRestOfDictionary:(NSMutableDictionary **)o 
-{
-    if (maxDepth && ++depth > maxDepth) {
-        [self addErrorWithCode:EDEPTH description: @"Nested too deep"];
-        return NO;
+member:
+    if (c >= end) {
+        [self addErrorWithCode:EEOF description:top->isObject
+         ? @"End of input while parsing object"
+         : @"End of input while parsing array"];
+        goto failInContainer;
     }
     
-    *o = [NSMutableDictionary dictionaryWithCapacity:7];
+    skipWhitespace(c);
+    if (cur == (top->isObject ? '}' : ']')) {
+        skipStructural();
+        depth--;
+        v = top->container;
+        owned = YES;
+        top = --count ? &frames[count - 1] : NULL;
+        goto add;
+    }
     
-    for (; *c ;) {
-        id k, v;
-        
-        skipWhitespace(c);
-        if (*c == '}' && c++) {
-            depth--;
-            return YES;
-        }    
-        
-        if (!(*c == '\"' && c++ && [self scanRestOfString:&k])) {
+    if (top->isObject) {
+        NSString *k;
+        keyed = cur == '\"';
+        if (keyed) {
+            skipStructural();
+            keyed = ((SBJsonScanIMP)scanKeyIMP)(self, @selector(scanKey:), &k);
+        }
+        if (!keyed) {
             [self addErrorWithCode:EPARSE description: @"Object key string expected"];
-            return NO;
+            goto failInContainer;
         }
+        syncIndex();
+        top->key = [k retain];
         
         skipWhitespace(c);
-        if (*c != ':') {
+        if (cur != ':') {
             [self addErrorWithCode:EPARSE description: @"Expected ':' separating key and value"];
-            return NO;
+            goto failInContainer;
         }
-        
-        c++;
-        if (![self scanValue:&v]) {
-            NSString *string = [NSString stringWithFormat:@"Object value expected for key: %@", k];
-            [self addErrorWithCode:EPARSE description: string];
-            return NO;
-        }
-        
-        [*o setObject:v forKey:k];
-        
-        skipWhitespace(c);
-        if (*c == ',' && c++) {
-            skipWhitespace(c);
-            if (*c == '}') {
-                [self addErrorWithCode:ETRAILCOMMA description: @"Trailing comma disallowed in object"];
-                return NO;
-            }
-        }        
+        skipStructural();
     }
+    goto value;
     
-    [self addErrorWithCode:EEOF description: @"End of input while parsing object"];
+failInContainer:
+    // the innermost array or object failed itself, rather than a value in it
+    blamed = count - 1;
+    goto unwind;
+fail:
+    blamed = count;
+unwind:
+    while (count--) {
+        SBJsonParseFrame *frame = &frames[count];
+        if (count < blamed) {
+            if (frame->isObject) {
+                NSString *string = [NSString stringWithFormat:@"Object value expected for key: %@", frame->key];
+                [self addErrorWithCode:EPARSE description: string];
+            } else {
+                [self addErrorWithCode:EPARSE description:@"Expected value while parsing array"];
+            }
+        }
+        [frame->container release];
+        [frame->key release];
+    }
     return NO;
 }
 
 - (BOOL)scanRestOfString:(NSMutableString **)o 
 {
     *o = [NSMutableString stringWithCapacity:16];
-    do {
+    while (c < end) {
         // First see if there's a portion we can grab in one go. 
         // Doing this caused a massive speedup on the long string.
-        size_t len = strcspn(c, ctrl);
-        if (len) {
-            // check for 
-            id t = [[NSString alloc] initWithBytesNoCopy:(char*)c
-                                                  length:len
+        const char *run = c;
+        c = SBJsonScanString(c, end);
+        if (c > run) {
+            id t = [[NSString alloc] initWithBytesNoCopy:(char*)run
+                                                  length:c - run
                                                 encoding:NSUTF8StringEncoding
                                             freeWhenDone:NO];
-            if (t) {
-                [*o appendString:t];
-                [t release];
-                c += len;
+            if (!t) {
+                [self addErrorWithCode:EUNICODE description:@"Invalid UTF-8 in string"];
+                return NO;
             }
+            [*o appendString:t];
+            [t release];
         }
         
-        if (*c == '"') {
+        if (c >= end) {
+            break;
+            
+        } else if (*c == '"') {
             c++;
             return YES;
             
         } else if (*c == '\\') {
-            unichar uc = *++c;
+            if (++c >= end)
+                break;
+            unichar uc = *c;
             switch (uc) {
                 case '\\':
                 case '/':
@@ -337,19 +596,56 @@ static char ctrl[0x22];
             CFStringAppendCharacters((CFMutableStringRef)*o, &uc, 1);
             c++;
             
-        } else if (*c < 0x20) {
+        } else {
             [self addErrorWithCode:ECTRL description: [NSString stringWithFormat:@"Unescaped control character '0x%x'", *c]];
             return NO;
-            
-        } else {
-            NSLog(@"should not be able to get here");
         }
-    } while (*c);
+    }
     
     [self addErrorWithCode:EEOF description:@"Unexpected EOF while parsing string"];
     return NO;
 }
 
+/*
+ Keys are most often short and free of escapes, and repeat throughout a
+ document. Those come from the key cache; anything else is scanned like a
+ regular string. A cached key is handed out autoreleased, as the slot may
+ give it up to another key before the caller is done with it.
+ */
+- (BOOL)scanKey:(NSString **)o
+{
+    const char *run = c;
+    c = SBJsonScanString(c, MIN(end, run + SBKeyCacheMaxLength + 1));
+    size_t length = c - run;
+    if (!(c < end && *c == '"' && length <= SBKeyCacheMaxLength)) {
+        c = run;
+        return [self scanRestOfString:(NSMutableString **)o];
+    }
+    c++;
+    
+    if (!keyCache)
+        keyCache = calloc(SBKeyCacheSize, sizeof(SBKeyCacheSlot));
+    unsigned int hash = SBHashBytes(run, length);
+    SBKeyCacheSlot *slot = &keyCache[hash & (SBKeyCacheSize - 1)];
+    if (slot->key && slot->hash == hash && slot->length == length && !memcmp(slot->bytes, run, length)) {
+        *o = [[slot->key retain] autorelease];
+        return YES;
+    }
+    
+    NSString *key = [[NSString alloc] initWithBytes:run length:length encoding:NSUTF8StringEncoding];
+    if (!key) {
+        [self addErrorWithCode:EUNICODE description:@"Invalid UTF-8 in string"];
+        return NO;
+    }
+    [slot->key release];
+    slot->key = key;
+    slot->hash = hash;
+    slot->length = length;
+    memcpy(slot->bytes, run, length);
+    *o = [[key retain] autorelease];
+    return YES;
+}
+
 - (BOOL)scanUnicodeChar:(unichar *)x
 {
     unichar hi, lo;
@@ -362,7 +658,7 @@ static char ctrl[0x22];
     if (hi >= 0xd800) {     // high surrogate char?
         if (hi < 0xdc00) {  // yes - expect a low char
             
-            if (!(*c == '\\' && ++c && *c == 'u' && ++c && [self scanHexQuad:&lo])) {
+            if (!(cur == '\\' && ++c && cur == 'u' && ++c && [self scanHexQuad:&lo])) {
                 [self addErrorWithCode:EUNICODE description: @"Missing low character in surrogate pair"];
                 return NO;
             }
@@ -387,9 +683,12 @@ static char ctrl[0x22];
 - (BOOL)scanHexQuad:(unichar *)x
 {
     *x = 0;
+    if (end - c < 4) {
+        [self addErrorWithCode:EUNICODE description:@"Missing hex digit in quad"];
+        return NO;
+    }
     for (int i = 0; i < 4; i++) {
-        unichar uc = *c;
-        c++;
+        unichar uc = (unsigned char)*c++;
         int d = (uc >= '0' && uc <= '9')
         ? uc - '0' : (uc >= 'a' && uc <= 'f')
         ? (uc - 'a' + 10) : (uc >= 'A' && uc <= 'F')
@@ -407,50 +706,103 @@ static char ctrl[0x22];
 - (BOOL)scanNumber:(NSNumber **)o
 {
     const char *ns = c;
+    BOOL negative = NO, integer = YES, exact = YES;
+    unsigned long long mantissa = 0;
+    int digits = 0;     // significant digits held in mantissa
+    int exp10 = 0;
     
     // The logic to test for validity of the number formatting is relicensed
     // from JSON::XS with permission from its author Marc Lehmann.
     // (Available at the CPAN: http://search.cpan.org/dist/JSON-XS/ .)
     
-    if ('-' == *c)
+    if ('-' == cur) {
+        negative = YES;
         c++;
+    }
     
-    if ('0' == *c && c++) {        
-        if (isdigit(*c)) {
+    if ('0' == cur && c++) {        
+        if (isdigit(cur)) {
             [self addErrorWithCode:EPARSENUM description: @"Leading 0 disallowed in number"];
             return NO;
         }
         
-    } else if (!isdigit(*c) && c != ns) {
+    } else if (!isdigit(cur) && c != ns) {
         [self addErrorWithCode:EPARSENUM description: @"No digits after initial minus"];
         return NO;
         
     } else {
-        skipDigits(c);
+        for (; c < end && isdigit((unsigned char)*c); c++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*c - '0');
+                digits++;
+            } else {
+                exp10++;
+                exact = NO;
+            }
+        }
     }
     
     // Fractional part
-    if ('.' == *c && c++) {
+    if ('.' == cur && c++) {
+        integer = NO;
         
-        if (!isdigit(*c)) {
+        if (!isdigit(cur)) {
             [self addErrorWithCode:EPARSENUM description: @"No digits after decimal point"];
             return NO;
         }        
-        skipDigits(c);
+        for (; c < end && isdigit((unsigned char)*c); c++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*c - '0');
+                if (mantissa)
+                    digits++;
+                exp10--;
+            } else if (*c != '0') {
+                exact = NO;
+            }
+        }
     }
     
     // Exponential part
-    if ('e' == *c || 'E' == *c) {
+    if ('e' == cur || 'E' == cur) {
+        integer = NO;
         c++;
         
-        if ('-' == *c || '+' == *c)
+        BOOL expNegative = ('-' == cur);
+        if ('-' == cur || '+' == cur)
             c++;
         
-        if (!isdigit(*c)) {
+        if (!isdigit(cur)) {
             [self addErrorWithCode:EPARSENUM description: @"No digits after exponent"];
             return NO;
         }
-        skipDigits(c);
+        int e = 0;
+        for (; c < end && isdigit((unsigned char)*c); c++) {
+            if (e < 100000)
+                e = e * 10 + (*c - '0');
+        }
+        exp10 += expNegative ? -e : e;
+    }
+    
+    if (!useDecimalNumbers) {
+        if (integer && exact) {
+            if (!negative && mantissa <= LLONG_MAX) {
+                *o = [NSNumber numberWithLongLong:(long long)mantissa];
+                return YES;
+            } else if (negative && mantissa <= (unsigned long long)LLONG_MAX + 1) {
+                *o = [NSNumber numberWithLongLong:(long long)(0ULL - mantissa)];
+                return YES;
+            }
+            // too big for 64 bits, keep it exact below
+            
+        } else if (!integer) {
+            double d;
+            if (!(exact && SBFastDouble(mantissa, exp10, &d)))
+                d = SBSlowDouble(ns, c - ns);
+            else if (negative)
+                d = -d;
+            *o = [NSNumber numberWithDouble:d];
+            return YES;
+        }
     }
     
     id str = [[NSString alloc] initWithBytesNoCopy:(char*)ns
@@ -468,7 +820,204 @@ static char ctrl[0x22];
 - (BOOL)scanIsAtEnd
 {
     skipWhitespace(c);
-    return !*c;
+    return c == end;
+}
+
+
+/*
+ The second stage of parsing large documents. scanValue: builds the values
+ as it would from the text, but with the index to walk, and a large enough
+ top level array is split between threads. The errors are the same.
+ */
+- (id)walkFragment
+{
+    id o;
+    skipWhitespace(c);
+    BOOL parallel = parallelParsingThreshold && (NSUInteger)(end - base) >= parallelParsingThreshold && atIndex('[');
+    if (!(parallel ? [self walkParallelArray:&o] : [self scanValue:&o]))
+        return nil;
+    
+    if (![self scanIsAtEnd]) {
+        [self addErrorWithCode:ETRAILGARBAGE description:@"Garbage after JSON"];
+        return nil;
+    }
+    
+    NSAssert(o, @"Should have a valid object");
+    return o;
+}
+
+/*
+ The closing quote is the next index entry, so a string without escapes is
+ created in one go. Anything else is left to scanRestOfString.
+ */
+- (BOOL)walkString:(NSMutableString **)o
+{
+    const char *close = (ix + 1 < ixEnd) ? base + ix[1] : end;
+    const char *run = ++c;
+    ix++;
+    
+    c = SBJsonScanString(c, close);
+    if (c == close && c < end) {
+        *o = [[[NSMutableString alloc] initWithBytes:run length:c - run encoding:NSUTF8StringEncoding] autorelease];
+        if (!*o) {
+            [self addErrorWithCode:EUNICODE description:@"Invalid UTF-8 in string"];
+            return NO;
+        }
+        c++, ix++;
+        return YES;
+    }
+    
+    c = run;
+    if (![self scanRestOfString:o])
+        return NO;
+    syncIndex();
+    return YES;
+}
+
+#define SBJsonMaxChunks 16
+
+/*
+ Splits the elements of the top level array into ranges of about the same
+ size at commas found in the index, and builds the ranges on an operation
+ queue with a parser each. An array that is too small to split, or whose
+ end can't be found, is walked here instead so it's reported the same way.
+ */
+- (BOOL)walkParallelArray:(NSMutableArray **)o
+{
+    NSUInteger workers = MIN([[NSProcessInfo processInfo] activeProcessorCount], SBJsonMaxChunks);
+    if (workers < 2)
+        return [self scanValue:(NSObject **)o];
+    
+    const uint32_t *close = NULL, *splits[SBJsonMaxChunks];
+    NSUInteger chunks = 1, level = 0;
+    size_t span = end - c;
+    for (const uint32_t *p = ix + 1; p < ixEnd && !close; p++) {
+        switch (base[*p]) {
+            case '"':
+                p++;    // and the closing quote
+                break;
+            case '[':
+            case '{':
+                level++;
+                break;
+            case ']':
+            case '}':
+                if (!level--)
+                    close = p;
+                break;
+            case ',':
+                if (!level && chunks < workers && (size_t)(base + *p - c) >= span / workers * chunks)
+                    splits[chunks++ - 1] = p;
+                break;
+        }
+    }
+    if (chunks < 2 || !close || base[*close] != ']')
+        return [self scanValue:(NSObject **)o];
+    
+    // a trailing comma would leave the last range empty
+    const char *last = base + *splits[chunks - 2] + 1;
+    skipWhitespace(last);
+    if (last == base + *close)
+        return [self scanValue:(NSObject **)o];
+    
+    if (maxDepth && ++depth > maxDepth) {
+        [self addErrorWithCode:EDEPTH description: @"Nested too deep"];
+        return NO;
+    }
+    
+    NSMutableArray *parts = [NSMutableArray arrayWithCapacity:chunks];
+    NSOperationQueue *queue = [[NSOperationQueue alloc] init];
+    [queue setMaxConcurrentOperationCount:workers];
+    for (NSUInteger i = 0; i < chunks; i++) {
+        SBJsonArrayChunk *chunk = [[SBJsonArrayChunk alloc] init];
+        chunk->parser = [[SBJsonParser alloc] init];
+        chunk->parser.maxDepth = maxDepth;
+        chunk->parser.useDecimalNumbers = useDecimalNumbers;
+        chunk->base = base;
+        chunk->ix = i ? splits[i - 1] + 1 : ix + 1;
+        chunk->ixEnd = (i < chunks - 1) ? splits[i] : close;
+        chunk->start = base + chunk->ix[-1] + 1;
+        chunk->stop = base + *chunk->ixEnd;
+        [parts addObject:chunk];
+        [chunk release];
+        
+        NSOperation *op = [[NSInvocationOperation alloc] initWithTarget:chunk->parser
+                                                               selector:@selector(walkChunk:)
+                                                                 object:chunk];
+        [queue addOperation:op];
+        [op release];
+    }
+    [queue waitUntilAllOperationsAreFinished];
+    [queue release];
+    
+    NSUInteger count = 0;
+    for (SBJsonArrayChunk *chunk in parts) {
+        if (!chunk->elements) {
+            for (NSError *error in chunk->parser.errorTrace)
+                [self addErrorWithCode:[error code] description:[error localizedDescription]];
+            return NO;
+        }
+        count += [chunk->elements count];
+    }
+    
+    *o = [NSMutableArray arrayWithCapacity:count];
+    for (SBJsonArrayChunk *chunk in parts)
+        [*o addObjectsFromArray:chunk->elements];
+    
+    c = base + *close + 1;
+    ix = close + 1;
+    depth--;
+    return YES;
+}
+
+// Runs on the queue, in a parser of its own
+- (void)walkChunk:(SBJsonArrayChunk *)chunk
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    [self clearErrorTrace];
+    
+    base = chunk->base;
+    c = chunk->start;
+    end = chunk->stop;
+    ix = chunk->ix;
+    ixEnd = chunk->ixEnd;
+    depth = 1;
+    
+    NSMutableArray *a = [NSMutableArray array];
+    if ([self walkElements:a])
+        chunk->elements = [a retain];
+    
+    base = NULL;
+    ix = ixEnd = NULL;
+    [pool release];
+}
+
+// The elements of a chunk, as they appear between the brackets of an array
+- (BOOL)walkElements:(NSMutableArray *)a
+{
+    for (;;) {
+        id v;
+        
+        if (![self scanValue:&v]) {
+            [self addErrorWithCode:EPARSE description:@"Expected value while parsing array"];
+            return NO;
+        }
+        
+        [a addObject:v];
+        
+        skipWhitespace(c);
+        if (c >= end)
+            return YES;
+        
+        if (atIndex(',')) {
+            c++, ix++;
+            skipWhitespace(c);
+            if (c >= end) {
+                [self addErrorWithCode:ETRAILCOMMA description: @"Trailing comma disallowed in array"];
+                return NO;
+            }
+        }
+    }
 }
 
 
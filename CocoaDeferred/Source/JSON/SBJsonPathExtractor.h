@@ -0,0 +1,60 @@
+//
+//  SBJsonPathExtractor.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+#import "SBJsonBase.h"
+#import "SBJsonEventParser.h"
+
+/**
+ @brief Picks a few values out of a JSON document without building the rest of it.
+
+ Paths are written either with dots and brackets, as in
+ @c result.items[*].id or @c result.items[0], or as JSON pointers, as in
+ @c /result/items/ * /id (without the spaces). A @c * matches every element of an
+ array or every member of an object, and numeric pointer segments select array
+ elements. The empty path selects the whole document.
+
+ The document is walked with an SBJsonEventParser. Members and elements that
+ lie on no path are skipped with its bracket scanner, without creating any
+ objects; only the values at the end of a path are built.
+
+ The result maps each path to its value. Paths with a @c * map to an array of
+ every match, in document order for arrays; other paths are missing from the
+ result if the document has no value there. When none of the paths has a
+ @c *, parsing stops as soon as all of them have been found; a path with a
+ @c * may match up to the end of the document, so then all of it is read.
+ */
+@interface SBJsonPathExtractor : SBJsonBase <SBJsonEventParserDelegate> {
+
+@private
+    NSArray *paths;
+    id root;
+    NSMutableSet *wildcardPaths;
+    SBJsonEventParser *parser;
+    NSMutableDictionary *results;
+    struct SBJsonPathFrame *frames;
+    NSUInteger frameCount, frameCapacity;
+    NSArray *memberNodes;
+    NSUInteger remaining;
+}
+
+/**
+ @brief Returns an extractor for the given paths, or nil if one of them can't be parsed.
+ */
+- (id)initWithPaths:(NSArray *)paths;
+
+@property(readonly) NSArray *paths;
+
+/**
+ @brief The values at the paths in the given UTF-8 document, or nil if it is invalid.
+ */
+- (NSDictionary *)valuesWithData:(NSData *)data;
+
+/**
+ @brief The values at the paths in the given UTF-8 bytes, or nil if they are invalid.
+ */
+- (NSDictionary *)valuesWithBytes:(const char *)bytes length:(NSUInteger)length;
+
+@end
@@ -0,0 +1,399 @@
+//
+//  SBJsonPathExtractor.m
+//  CocoaDeferred
+//
+
+#import "SBJsonPathExtractor.h"
+
+/*
+ One step of the compiled paths. Paths sharing a prefix share the nodes for
+ it; a node lists the paths that end there.
+ */
+@interface SBJsonPathNode : NSObject {
+@public
+    NSMutableArray *keys;       // UTF-8 NSData for each key child
+    NSMutableArray *keyNodes;
+    NSMutableDictionary *indexNodes;
+    SBJsonPathNode *wildcard;
+    NSMutableArray *terminals;
+}
+- (SBJsonPathNode *)childForComponent:(id)component;
+@end
+
+@implementation SBJsonPathNode
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        keys = [[NSMutableArray alloc] init];
+        keyNodes = [[NSMutableArray alloc] init];
+        indexNodes = [[NSMutableDictionary alloc] init];
+        terminals = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [keys release];
+    [keyNodes release];
+    [indexNodes release];
+    [wildcard release];
+    [terminals release];
+    [super dealloc];
+}
+
+- (SBJsonPathNode *)childForComponent:(id)component {
+    SBJsonPathNode *node;
+    if (component == [NSNull null]) {
+        if (!wildcard)
+            wildcard = [[SBJsonPathNode alloc] init];
+        return wildcard;
+    }
+    if ([component isKindOfClass:[NSNumber class]]) {
+        if (!(node = [indexNodes objectForKey:component])) {
+            node = [[[SBJsonPathNode alloc] init] autorelease];
+            [indexNodes setObject:node forKey:component];
+        }
+        return node;
+    }
+    NSData *utf8 = [component dataUsingEncoding:NSUTF8StringEncoding];
+    NSUInteger i = [keys indexOfObject:utf8];
+    if (i != NSNotFound)
+        return [keyNodes objectAtIndex:i];
+    node = [[[SBJsonPathNode alloc] init] autorelease];
+    [keys addObject:utf8];
+    [keyNodes addObject:node];
+    return node;
+}
+
+@end
+
+
+typedef struct SBJsonPathFrame {
+    NSArray *nodes;
+    BOOL isArray;
+    NSUInteger index;
+} SBJsonPathFrame;
+
+/*
+ Splits a path into keys (NSString), array indexes (NSNumber) and wildcards
+ (NSNull). Returns nil if the path is malformed.
+ */
+static NSArray *SBJsonPathComponents(NSString *path)
+{
+    NSMutableArray *components = [NSMutableArray array];
+    if ([path hasPrefix:@"/"]) {
+        for (NSString *token in [[path substringFromIndex:1] componentsSeparatedByString:@"/"]) {
+            token = [[token stringByReplacingOccurrencesOfString:@"~1" withString:@"/"]
+                     stringByReplacingOccurrencesOfString:@"~0" withString:@"~"];
+            NSScanner *scanner = [NSScanner scannerWithString:token];
+            NSInteger i;
+            if ([token isEqualToString:@"*"])
+                [components addObject:[NSNull null]];
+            else if ([token length] && [scanner scanInteger:&i] && [scanner isAtEnd] && i >= 0)
+                [components addObject:[NSNumber numberWithInteger:i]];
+            else
+                [components addObject:token];
+        }
+        return components;
+    }
+
+    NSScanner *scanner = [NSScanner scannerWithString:path];
+    [scanner setCharactersToBeSkipped:nil];
+    NSCharacterSet *stops = [NSCharacterSet characterSetWithCharactersInString:@".["];
+    while (![scanner isAtEnd]) {
+        NSString *key;
+        NSInteger i;
+        if ([scanner scanString:@"[" intoString:NULL]) {
+            if ([scanner scanString:@"*" intoString:NULL])
+                [components addObject:[NSNull null]];
+            else if ([scanner scanInteger:&i] && i >= 0)
+                [components addObject:[NSNumber numberWithInteger:i]];
+            else
+                return nil;
+            if (![scanner scanString:@"]" intoString:NULL])
+                return nil;
+        } else if ([scanner scanString:@"." intoString:NULL]) {
+            if ([scanner isAtEnd])
+                return nil;
+        } else if ([scanner scanUpToCharactersFromSet:stops intoString:&key]) {
+            [components addObject:([key isEqualToString:@"*"] ? (id)[NSNull null] : key)];
+        } else {
+            return nil;
+        }
+    }
+    return components;
+}
+
+/*
+ The children of nodes matching an object key or an array index.
+ */
+static NSArray *SBJsonPathMatch(NSArray *nodes, const char *key, NSUInteger length, NSUInteger index, BOOL isArray)
+{
+    NSMutableArray *matches = nil;
+    for (SBJsonPathNode *node in nodes) {
+        SBJsonPathNode *match = nil;
+        if (isArray) {
+            if ([node->indexNodes count])
+                match = [node->indexNodes objectForKey:[NSNumber numberWithUnsignedInteger:index]];
+        } else {
+            NSUInteger n = [node->keys count];
+            for (NSUInteger i = 0; i < n; i++) {
+                NSData *k = [node->keys objectAtIndex:i];
+                if ([k length] == length && !memcmp([k bytes], key, length)) {
+                    match = [node->keyNodes objectAtIndex:i];
+                    break;
+                }
+            }
+        }
+        if (match || node->wildcard) {
+            if (!matches)
+                matches = [NSMutableArray arrayWithCapacity:2];
+            if (match)
+                [matches addObject:match];
+            if (node->wildcard)
+                [matches addObject:node->wildcard];
+        }
+    }
+    return matches;
+}
+
+static BOOL SBJsonPathHasTerminals(NSArray *nodes)
+{
+    for (SBJsonPathNode *node in nodes)
+        if ([node->terminals count])
+            return YES;
+    return NO;
+}
+
+
+@interface SBJsonPathExtractor ()
+
+- (void)startedContainer:(BOOL)isArray;
+- (void)endedContainer;
+- (void)foundValue:(id)v;
+- (void)store:(id)v atNode:(SBJsonPathNode *)node;
+
+@end
+
+
+@implementation SBJsonPathExtractor
+
+@synthesize paths;
+
+- (id)initWithPaths:(NSArray *)thePaths {
+    self = [super init];
+    if (self) {
+        paths = [thePaths copy];
+        root = [[SBJsonPathNode alloc] init];
+        wildcardPaths = [[NSMutableSet alloc] init];
+        parser = [[SBJsonEventParser alloc] init];
+        parser.delegate = self;
+
+        for (NSString *path in paths) {
+            NSArray *components = SBJsonPathComponents(path);
+            if (!components) {
+                [self release];
+                return nil;
+            }
+            SBJsonPathNode *node = root;
+            for (id component in components) {
+                node = [node childForComponent:component];
+                if (component == [NSNull null])
+                    [wildcardPaths addObject:path];
+            }
+            [node->terminals addObject:path];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    while (frameCount)
+        [self endedContainer];
+    free(frames);
+    [memberNodes release];
+    [paths release];
+    [root release];
+    [wildcardPaths release];
+    parser.delegate = nil;
+    [parser release];
+    [super dealloc];
+}
+
+- (NSDictionary *)valuesWithData:(NSData *)data {
+    return [self valuesWithBytes:[data bytes] length:[data length]];
+}
+
+- (NSDictionary *)valuesWithBytes:(const char *)bytes length:(NSUInteger)length {
+    [self clearErrorTrace];
+
+    results = [NSMutableDictionary dictionaryWithCapacity:[paths count]];
+    for (NSString *path in wildcardPaths)
+        [results setObject:[NSMutableArray array] forKey:path];
+    remaining = [[NSSet setWithArray:paths] count] - [wildcardPaths count];
+
+    BOOL ok = [parser parseBytes:bytes length:length];
+    while (frameCount)
+        [self endedContainer];
+    [memberNodes release];
+    memberNodes = nil;
+
+    NSDictionary *ret = results;
+    results = nil;
+    if (!ok) {
+        NSError *error = [parser.errorTrace lastObject];
+        [self addErrorWithCode:[error code] description:[error localizedDescription]];
+        return nil;
+    }
+    return ret;
+}
+
+#pragma mark SBJsonEventParserDelegate
+
+- (void)parserStartedObject:(SBJsonEventParser *)p {
+    [self startedContainer:NO];
+}
+
+- (void)parserStartedArray:(SBJsonEventParser *)p {
+    [self startedContainer:YES];
+}
+
+- (void)parserEndedObject:(SBJsonEventParser *)p {
+    [self endedContainer];
+}
+
+- (void)parserEndedArray:(SBJsonEventParser *)p {
+    [self endedContainer];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundKey:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    if (escaped) {
+        const char *utf8 = [[p stringWithBytes:bytes length:length escaped:YES] UTF8String];
+        bytes = utf8;
+        length = utf8 ? strlen(utf8) : 0;
+    }
+    NSArray *nodes = SBJsonPathMatch(frames[frameCount - 1].nodes, bytes, length, 0, NO);
+    if (!nodes) {
+        [p skipValue];
+
+    } else if (SBJsonPathHasTerminals(nodes)) {
+        id v = [p objectForValue];
+        if (v)
+            for (SBJsonPathNode *node in nodes)
+                [self store:v atNode:node];
+
+    } else {
+        // the value has to be a container for the path to go on
+        [memberNodes release];
+        memberNodes = [nodes retain];
+    }
+}
+
+- (void)parser:(SBJsonEventParser *)p foundString:(const char *)bytes length:(NSUInteger)length escaped:(BOOL)escaped {
+    if (frames[frameCount - 1].isArray)
+        [self foundValue:[p stringWithBytes:bytes length:length escaped:escaped]];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundNumber:(const char *)bytes length:(NSUInteger)length {
+    if (frames[frameCount - 1].isArray)
+        [self foundValue:[p numberWithBytes:bytes length:length]];
+}
+
+- (void)parser:(SBJsonEventParser *)p foundBool:(BOOL)x {
+    if (frames[frameCount - 1].isArray)
+        [self foundValue:[NSNumber numberWithBool:x]];
+}
+
+- (void)parserFoundNull:(SBJsonEventParser *)p {
+    if (frames[frameCount - 1].isArray)
+        [self foundValue:[NSNull null]];
+}
+
+#pragma mark Matching
+
+- (void)startedContainer:(BOOL)isArray {
+    NSArray *nodes;
+    if (!frameCount) {
+        nodes = [NSArray arrayWithObject:root];
+    } else if (frames[frameCount - 1].isArray) {
+        SBJsonPathFrame *top = &frames[frameCount - 1];
+        nodes = SBJsonPathMatch(top->nodes, NULL, 0, top->index++, YES);
+    } else {
+        nodes = [memberNodes autorelease];
+        memberNodes = nil;
+    }
+
+    if (![nodes count]) {
+        [parser skipValue];
+        return;
+    }
+    if (SBJsonPathHasTerminals(nodes)) {
+        id v = [parser objectForValue];
+        if (v)
+            for (SBJsonPathNode *node in nodes)
+                [self store:v atNode:node];
+        return;
+    }
+
+    if (frameCount == frameCapacity) {
+        frameCapacity = frameCapacity ? frameCapacity * 2 : 8;
+        frames = realloc(frames, frameCapacity * sizeof(SBJsonPathFrame));
+    }
+    frames[frameCount].nodes = [nodes retain];
+    frames[frameCount].isArray = isArray;
+    frames[frameCount].index = 0;
+    frameCount++;
+}
+
+- (void)endedContainer {
+    [frames[--frameCount].nodes release];
+}
+
+// a scalar element of an array on some path
+- (void)foundValue:(id)v {
+    SBJsonPathFrame *top = &frames[frameCount - 1];
+    NSArray *nodes = SBJsonPathMatch(top->nodes, NULL, 0, top->index++, YES);
+    for (SBJsonPathNode *node in nodes)
+        [self store:v atNode:node];
+}
+
+/*
+ Records v for the paths ending at node, and follows the paths that go on
+ from node into v itself.
+ */
+- (void)store:(id)v atNode:(SBJsonPathNode *)node {
+    for (NSString *path in node->terminals) {
+        if ([wildcardPaths containsObject:path]) {
+            [[results objectForKey:path] addObject:v];
+        } else if (![results objectForKey:path]) {
+            [results setObject:v forKey:path];
+            if (!--remaining && ![wildcardPaths count])
+                [parser stop];
+        }
+    }
+
+    if ([v isKindOfClass:[NSDictionary class]]) {
+        NSUInteger n = [node->keys count];
+        for (NSUInteger i = 0; i < n; i++) {
+            NSString *k = [[[NSString alloc] initWithData:[node->keys objectAtIndex:i]
+                                                 encoding:NSUTF8StringEncoding] autorelease];
+            id child = [v objectForKey:k];
+            if (child)
+                [self store:child atNode:[node->keyNodes objectAtIndex:i]];
+        }
+        if (node->wildcard)
+            for (id k in v)
+                [self store:[v objectForKey:k] atNode:node->wildcard];
+
+    } else if ([v isKindOfClass:[NSArray class]]) {
+        for (NSNumber *i in node->indexNodes)
+            if ([i unsignedIntegerValue] < [v count])
+                [self store:[v objectAtIndex:[i unsignedIntegerValue]] atNode:[node->indexNodes objectForKey:i]];
+        if (node->wildcard)
+            for (id child in v)
+                [self store:child atNode:node->wildcard];
+    }
+}
+
+@end
@@ -0,0 +1,363 @@
+//
+//  SBJsonSIMD.c
+//  CocoaDeferred
+//
+
+#include "SBJsonSIMD.h"
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__has_attribute) && defined(__has_builtin)
+#if __has_attribute(target) && __has_builtin(__builtin_cpu_supports)
+#define SB_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SB_HAVE_NEON 1
+#endif
+
+#define SBIsStringStop(b) ((b) == '"' || (b) == '\\' || (unsigned char)(b) < 0x20)
+#define SBIsSpace(b) ((b) == ' ' || (b) == '\n' || (b) == '\r' || (b) == '\t')
+
+
+#pragma mark Scalar
+
+static const char *SBScanStringScalar(const char *p, const char *end)
+{
+    while (p < end && !SBIsStringStop(*p))
+        p++;
+    return p;
+}
+
+static const char *SBScanSpaceScalar(const char *p, const char *end)
+{
+    while (p < end && SBIsSpace(*p))
+        p++;
+    return p;
+}
+
+static void SBClassifyBlockScalar(const char *block, SBJsonBlockMasks *masks)
+{
+    uint64_t quote = 0, backslash = 0, structural = 0;
+    for (int i = 0; i < 64; i++) {
+        switch (block[i]) {
+            case '"': quote |= 1ULL << i; break;
+            case '\\': backslash |= 1ULL << i; break;
+            case '{': case '}': case '[': case ']': case ':': case ',':
+                structural |= 1ULL << i;
+                break;
+        }
+    }
+    masks->quote = quote;
+    masks->backslash = backslash;
+    masks->structural = structural;
+}
+
+
+#pragma mark SSE2
+
+#if defined(__SSE2__)
+
+static const char *SBScanStringSSE2(const char *p, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        // max(v, 0x1f) == 0x1f exactly for the unsigned bytes below 0x20
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)),
+                                 _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return SBScanStringScalar(p, end);
+}
+
+static const char *SBScanSpaceSSE2(const char *p, const char *end)
+{
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+        int mask = ~_mm_movemask_epi8(m) & 0xffff;
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return SBScanSpaceScalar(p, end);
+}
+
+/*
+ The structural characters are told apart with two compares: ',' and ':'
+ directly, and the brackets by clearing the bit that separates '[' from '{'
+ and ']' from '}'.
+ */
+static void SBClassifyBlockSSE2(const char *block, SBJsonBlockMasks *masks)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i fold = _mm_set1_epi8(~0x20);
+    const __m128i open = _mm_set1_epi8('[');
+    const __m128i close = _mm_set1_epi8(']');
+    uint64_t q = 0, b = 0, st = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+        __m128i folded = _mm_and_si128(v, fold);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, colon)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)));
+        q |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << (16 * i);
+        b |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash)) << (16 * i);
+        st |= (uint64_t)(unsigned int)_mm_movemask_epi8(m) << (16 * i);
+    }
+    masks->quote = q;
+    masks->backslash = b;
+    masks->structural = st;
+}
+
+#endif
+
+
+#pragma mark AVX2
+
+#if SB_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static const char *SBScanStringAVX2(const char *p, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i slash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, slash)),
+                                    _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return SBScanStringSSE2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *SBScanSpaceAVX2(const char *p, const char *end)
+{
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return SBScanSpaceSSE2(p, end);
+}
+
+__attribute__((target("avx2")))
+static void SBClassifyBlockAVX2(const char *block, SBJsonBlockMasks *masks)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i slash = _mm256_set1_epi8('\\');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i fold = _mm256_set1_epi8(~0x20);
+    const __m256i open = _mm256_set1_epi8('[');
+    const __m256i close = _mm256_set1_epi8(']');
+    uint64_t q = 0, b = 0, st = 0;
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + 32 * i));
+        __m256i folded = _mm256_and_si256(v, fold);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, colon)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(folded, open),
+                                                    _mm256_cmpeq_epi8(folded, close)));
+        q |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)) << (32 * i);
+        b |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, slash)) << (32 * i);
+        st |= (uint64_t)(unsigned int)_mm256_movemask_epi8(m) << (32 * i);
+    }
+    masks->quote = q;
+    masks->backslash = b;
+    masks->structural = st;
+}
+
+#endif
+
+
+#pragma mark NEON
+
+#if SB_HAVE_NEON
+
+// NEON has no movemask; narrowing each 16 bit lane by 4 leaves one nibble per byte.
+static inline uint64_t SBNibbleMask(uint8x16_t m)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static const char *SBScanStringNEON(const char *p, const char *end)
+{
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t slash = vdupq_n_u8('\\');
+    const uint8x16_t ctrl = vdupq_n_u8(0x20);
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, slash)), vcltq_u8(v, ctrl));
+        uint64_t mask = SBNibbleMask(m);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+    }
+    return SBScanStringScalar(p, end);
+}
+
+static const char *SBScanSpaceNEON(const char *p, const char *end)
+{
+    const uint8x16_t sp = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, sp), vceqq_u8(v, tab)),
+                                vorrq_u8(vceqq_u8(v, lf), vceqq_u8(v, cr)));
+        uint64_t mask = ~SBNibbleMask(m);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+    }
+    return SBScanSpaceScalar(p, end);
+}
+
+// one bit per byte, by weighting the lanes and adding them up pairwise
+static inline uint64_t SBMoveMask16(uint8x16_t m)
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t t = vandq_u8(m, vld1q_u8(weights));
+    uint8x8_t v = vpadd_u8(vget_low_u8(t), vget_high_u8(t));
+    v = vpadd_u8(v, v);
+    v = vpadd_u8(v, v);
+    return vget_lane_u8(v, 0) | ((uint64_t)vget_lane_u8(v, 1) << 8);
+}
+
+static void SBClassifyBlockNEON(const char *block, SBJsonBlockMasks *masks)
+{
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t slash = vdupq_n_u8('\\');
+    const uint8x16_t comma = vdupq_n_u8(',');
+    const uint8x16_t colon = vdupq_n_u8(':');
+    const uint8x16_t fold = vdupq_n_u8((uint8_t)~0x20);
+    const uint8x16_t open = vdupq_n_u8('[');
+    const uint8x16_t close = vdupq_n_u8(']');
+    uint64_t q = 0, b = 0, st = 0;
+    for (int i = 0; i < 4; i++) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)block + 16 * i);
+        uint8x16_t folded = vandq_u8(v, fold);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, comma), vceqq_u8(v, colon)),
+                                vorrq_u8(vceqq_u8(folded, open), vceqq_u8(folded, close)));
+        q |= SBMoveMask16(vceqq_u8(v, quote)) << (16 * i);
+        b |= SBMoveMask16(vceqq_u8(v, slash)) << (16 * i);
+        st |= SBMoveMask16(m) << (16 * i);
+    }
+    masks->quote = q;
+    masks->backslash = b;
+    masks->structural = st;
+}
+
+#endif
+
+
+#pragma mark Dispatch
+
+// the first call through either pointer installs the best implementation
+static const char *SBScanStringResolve(const char *p, const char *end)
+{
+    SBJsonSIMDSelect(SBJsonSIMDBest);
+    return SBJsonScanString(p, end);
+}
+
+static const char *SBScanSpaceResolve(const char *p, const char *end)
+{
+    SBJsonSIMDSelect(SBJsonSIMDBest);
+    return SBJsonScanSpace(p, end);
+}
+
+static void SBClassifyBlockResolve(const char *block, SBJsonBlockMasks *masks)
+{
+    SBJsonSIMDSelect(SBJsonSIMDBest);
+    SBJsonClassifyBlock(block, masks);
+}
+
+SBJsonScanFunction SBJsonScanString = SBScanStringResolve;
+SBJsonScanFunction SBJsonScanSpace = SBScanSpaceResolve;
+SBJsonClassifyFunction SBJsonClassifyBlock = SBClassifyBlockResolve;
+
+SBJsonSIMDLevel SBJsonSIMDAvailable(void)
+{
+#if SB_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return SBJsonSIMDAVX2;
+#endif
+#if defined(__SSE2__)
+    return SBJsonSIMDSSE2;
+#elif SB_HAVE_NEON
+    return SBJsonSIMDNEON;
+#else
+    return SBJsonSIMDScalar;
+#endif
+}
+
+/*
+ Each pointer is replaced with a single aligned store, and every implementation
+ gives the same answers, so a parser running on another thread meanwhile may
+ mix old and new functions but still gets the right results.
+ */
+static void SBInstall(SBJsonScanFunction scanString, SBJsonScanFunction scanSpace,
+                      SBJsonClassifyFunction classifyBlock)
+{
+    __atomic_store_n(&SBJsonScanString, scanString, __ATOMIC_RELEASE);
+    __atomic_store_n(&SBJsonScanSpace, scanSpace, __ATOMIC_RELEASE);
+    __atomic_store_n(&SBJsonClassifyBlock, classifyBlock, __ATOMIC_RELEASE);
+}
+
+SBJsonSIMDLevel SBJsonSIMDSelect(SBJsonSIMDLevel level)
+{
+    SBJsonSIMDLevel available = SBJsonSIMDAvailable();
+    if (level == SBJsonSIMDBest || level > available)
+        level = available;
+
+    switch (level) {
+#if SB_HAVE_AVX2
+        case SBJsonSIMDAVX2:
+            SBInstall(SBScanStringAVX2, SBScanSpaceAVX2, SBClassifyBlockAVX2);
+            break;
+#endif
+#if defined(__SSE2__)
+        case SBJsonSIMDSSE2:
+            SBInstall(SBScanStringSSE2, SBScanSpaceSSE2, SBClassifyBlockSSE2);
+            break;
+#endif
+#if SB_HAVE_NEON
+        case SBJsonSIMDNEON:
+            SBInstall(SBScanStringNEON, SBScanSpaceNEON, SBClassifyBlockNEON);
+            break;
+#endif
+        default:
+            if (level != SBJsonSIMDScalar)
+                return SBJsonSIMDSelect(available);
+            SBInstall(SBScanStringScalar, SBScanSpaceScalar, SBClassifyBlockScalar);
+            break;
+    }
+    return level;
+}
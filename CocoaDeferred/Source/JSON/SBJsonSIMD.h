@@ -0,0 +1,81 @@
+//
+//  SBJsonSIMD.h
+//  CocoaDeferred
+//
+//  Byte classification used by the JSON parser, 16 or 32 bytes at a time
+//  where the CPU allows it. The best implementation is installed the first
+//  time any of the functions is called, unless SBJsonSIMDSelect() picked one
+//  before.
+//
+
+#ifndef SBJSON_SIMD_H
+#define SBJSON_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    SBJsonSIMDScalar = 0,
+    SBJsonSIMDSSE2,
+    SBJsonSIMDAVX2,
+    SBJsonSIMDNEON,
+    SBJsonSIMDBest = 0xff
+} SBJsonSIMDLevel;
+
+typedef const char *(*SBJsonScanFunction)(const char *p, const char *end);
+
+/**
+ @brief Returns a pointer to the first quote, backslash or control byte in [p, end), or end.
+ */
+extern SBJsonScanFunction SBJsonScanString;
+
+/**
+ @brief Returns a pointer to the first byte in [p, end) that is not JSON whitespace, or end.
+
+ JSON whitespace is space, tab, line feed and carriage return only.
+ */
+extern SBJsonScanFunction SBJsonScanSpace;
+
+/**
+ @brief Bit masks over a 64 byte block, bit i standing for byte i.
+ */
+typedef struct SBJsonBlockMasks {
+    uint64_t quote;         // "
+    uint64_t backslash;     // reverse solidus
+    uint64_t structural;    // { } [ ] : ,
+} SBJsonBlockMasks;
+
+typedef void (*SBJsonClassifyFunction)(const char *block, SBJsonBlockMasks *masks);
+
+/**
+ @brief Classifies the 64 bytes at block, for building a structural index.
+ */
+extern SBJsonClassifyFunction SBJsonClassifyBlock;
+
+/**
+ @brief The fastest implementation this CPU supports.
+ */
+SBJsonSIMDLevel SBJsonSIMDAvailable(void);
+
+/**
+ @brief Installs the implementation for level, or the best available one if this CPU lacks it.
+
+ Returns the level actually installed. Pass SBJsonSIMDScalar to compare
+ against the plain byte loops.
+
+ The functions are process-wide, so call this at startup, before any parsing
+ begins. Switching later is safe but not synchronized with parsers on other
+ threads: one already scanning may keep using the previous implementation
+ for a while, which gives the same results.
+ */
+SBJsonSIMDLevel SBJsonSIMDSelect(SBJsonSIMDLevel level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
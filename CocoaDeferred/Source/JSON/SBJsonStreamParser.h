@@ -0,0 +1,98 @@
+//
+//  SBJsonStreamParser.h
+//  CocoaDeferred
+//
+
+#import <Foundation/Foundation.h>
+#import "SBJsonBase.h"
+
+@class SBJsonParser;
+
+typedef enum {
+    SBJsonStreamParserWaitingForData,
+    SBJsonStreamParserComplete,
+    SBJsonStreamParserError
+} SBJsonStreamParserStatus;
+
+/**
+ @brief Parses a JSON document that arrives in pieces.
+
+ Feed it the chunks of a document, in order, as they arrive, for example
+ from connection:didReceiveData:. Chunks may split the document anywhere,
+ including in the middle of a string, a number or a multi-byte character.
+ The object graph is built up as the bytes come in, with the open arrays and
+ objects kept on an explicit stack, so it is complete as soon as the closing
+ bracket of the document has been fed in.
+
+ Only bytes of a string, number or literal that straddles a chunk boundary are
+ copied; everything else is scanned in place. Values are mapped to
+ Objective-C types exactly as SBJsonParser maps them, and the top level value
+ must be an array or an object. The same documents are accepted as by
+ SBJsonParser, which includes letting the commas between members be left out.
+
+ @code
+ SBJsonStreamParser *parser = [[SBJsonStreamParser alloc] init];
+ for (NSData *chunk in chunks)
+     if ([parser parse:chunk] == SBJsonStreamParserError)
+         break;
+ id o = [parser finish];
+ @endcode
+ */
+@interface SBJsonStreamParser : SBJsonBase {
+
+@private
+    SBJsonParser *scalarParser;
+    NSMutableArray *stack;
+    id top;
+    BOOL inObject;
+    id root;
+    NSString *key;
+    int state;
+    SBJsonStreamParserStatus status;
+    int bomOffset;
+    int tokenKind;
+    NSMutableData *token;
+    BOOL tokenEscape;
+}
+
+/**
+ @brief Whether the last chunk completed the document or caused an error.
+ */
+@property(readonly) SBJsonStreamParserStatus status;
+
+/**
+ @brief Whether every number is returned as an exact NSDecimalNumber.
+
+ See SBJsonParser. Defaults to NO.
+ */
+@property BOOL useDecimalNumbers;
+
+/**
+ @brief Parse the next chunk of the document.
+
+ Returns SBJsonStreamParserComplete once the top level array or object has
+ been closed. Only whitespace may follow it. After an error further chunks are
+ ignored and the error is available from errorTrace.
+ */
+- (SBJsonStreamParserStatus)parse:(NSData *)data;
+
+/**
+ @brief Parse the next chunk of the document from a byte buffer.
+
+ The bytes don't need to outlive the call.
+ */
+- (SBJsonStreamParserStatus)parseBytes:(const char *)bytes length:(NSUInteger)length;
+
+/**
+ @brief Signal the end of input.
+
+ Returns the parsed document, or nil if it was incomplete or invalid.
+ */
+- (id)finish;
+
+/**
+ @brief Forget all state so the parser can read another document.
+ */
+- (void)reset;
+
+@end
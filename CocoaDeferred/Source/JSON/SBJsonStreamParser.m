@@ -0,0 +1,362 @@
+//
+//  SBJsonStreamParser.m
+//  CocoaDeferred
+//
+
+#import "SBJsonStreamParser.h"
+#import "SBJsonParser.h"
+#import "SBJsonSIMD.h"
+
+// what the parser expects next, outside of a token
+enum {
+    SBStreamStart,
+    SBStreamValue,
+    SBStreamValueOrEnd,     // just after '['
+    SBStreamKey,
+    SBStreamKeyOrEnd,       // just after '{'
+    SBStreamColon,
+    SBStreamCommaOrEnd,
+    SBStreamDone
+};
+
+// a string, number or literal that may straddle chunks
+enum {
+    SBTokenNone,
+    SBTokenString,
+    SBTokenKey,
+    SBTokenScalar
+};
+
+static inline BOOL SBIsScalarByte(unsigned char b)
+{
+    return (b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') ||
+        b == '-' || b == '+' || b == '.';
+}
+
+@interface SBJsonStreamParser ()
+
+- (const char *)scanToken:(const char *)p end:(const char *)e;
+- (BOOL)finishToken:(const char *)bytes length:(NSUInteger)length;
+- (BOOL)addValue:(id)v;
+- (BOOL)push:(id)container;
+- (void)pop;
+- (SBJsonStreamParserStatus)failWithCode:(NSUInteger)code description:(NSString *)str;
+
+@end
+
+
+@implementation SBJsonStreamParser
+
+@synthesize status;
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        scalarParser = [[SBJsonParser alloc] init];
+        stack = [[NSMutableArray alloc] initWithCapacity:16];
+        token = [[NSMutableData alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [scalarParser release];
+    [stack release];
+    [root release];
+    [key release];
+    [token release];
+    [super dealloc];
+}
+
+- (BOOL)useDecimalNumbers {
+    return scalarParser.useDecimalNumbers;
+}
+
+- (void)setUseDecimalNumbers:(BOOL)x {
+    scalarParser.useDecimalNumbers = x;
+}
+
+- (void)reset {
+    [self clearErrorTrace];
+    [stack removeAllObjects];
+    top = nil;
+    inObject = NO;
+    [root release];
+    root = nil;
+    [key release];
+    key = nil;
+    state = SBStreamStart;
+    status = SBJsonStreamParserWaitingForData;
+    bomOffset = 0;
+    tokenKind = SBTokenNone;
+    tokenEscape = NO;
+    [token setLength:0];
+}
+
+- (SBJsonStreamParserStatus)parse:(NSData *)data {
+    return [self parseBytes:[data bytes] length:[data length]];
+}
+
+- (SBJsonStreamParserStatus)parseBytes:(const char *)bytes length:(NSUInteger)length {
+    if (status == SBJsonStreamParserError)
+        return status;
+
+    const char *p = bytes;
+    const char *e = bytes + length;
+
+    // A UTF-8 byte order mark is allowed in front of the document, and may be split too
+    while (bomOffset < 3 && p < e) {
+        if ((unsigned char)*p != (unsigned char)"\xEF\xBB\xBF"[bomOffset]) {
+            if (bomOffset)
+                return [self failWithCode:EPARSE description:@"Unrecognised leading character"];
+            bomOffset = 3;
+            break;
+        }
+        bomOffset++;
+        p++;
+    }
+
+    // finish the token the last chunk ended in
+    if (tokenKind != SBTokenNone) {
+        const char *q = [self scanToken:p end:e];
+        if (!q) {
+            [token appendBytes:p length:e - p];
+            return status;
+        }
+        [token appendBytes:p length:q - p];
+        p = q;
+        if (![self finishToken:[token bytes] length:[token length]])
+            return status;
+        [token setLength:0];
+    }
+
+    while (p < e) {
+        if ((unsigned char)*p <= ' ') {
+            p = SBJsonScanSpace(p, e);
+            if (p >= e)
+                break;
+        }
+
+        unsigned char ch = *p;
+        switch (state) {
+            case SBStreamStart:
+                if (ch == '{')
+                    [self push:[NSMutableDictionary dictionaryWithCapacity:7]];
+                else if (ch == '[')
+                    [self push:[NSMutableArray arrayWithCapacity:8]];
+                else
+                    return [self failWithCode:EFRAGMENT description:@"Expected an array or object"];
+                p++;
+                break;
+
+            case SBStreamValue:
+            case SBStreamValueOrEnd:
+                if (ch == '{') {
+                    if (![self push:[NSMutableDictionary dictionaryWithCapacity:7]])
+                        return status;
+                    p++;
+
+                } else if (ch == '[') {
+                    if (![self push:[NSMutableArray arrayWithCapacity:8]])
+                        return status;
+                    p++;
+
+                } else if (ch == '"' || ch == '-' || (ch >= '0' && ch <= '9') ||
+                           ch == 't' || ch == 'f' || ch == 'n') {
+                    const char *start = p;
+                    tokenKind = (ch == '"') ? SBTokenString : SBTokenScalar;
+                    tokenEscape = NO;
+                    const char *q = [self scanToken:(ch == '"' ? p + 1 : p) end:e];
+                    if (!q) {
+                        [token appendBytes:start length:e - start];
+                        return status;
+                    }
+                    if (![self finishToken:start length:q - start])
+                        return status;
+                    p = q;
+
+                } else if (ch == ']' && state == SBStreamValueOrEnd) {
+                    [self pop];
+                    p++;
+
+                } else if (ch == ']' && !inObject) {
+                    return [self failWithCode:ETRAILCOMMA description:@"Trailing comma disallowed in array"];
+
+                } else if (ch == '+') {
+                    return [self failWithCode:EPARSENUM description:@"Leading + disallowed in number"];
+
+                } else if (inObject) {
+                    return [self failWithCode:EPARSE description:
+                            [NSString stringWithFormat:@"Object value expected for key: %@", key]];
+
+                } else {
+                    return [self failWithCode:EPARSE description:@"Unrecognised leading character"];
+                }
+                break;
+
+            case SBStreamKey:
+            case SBStreamKeyOrEnd:
+                if (ch == '"') {
+                    const char *start = p;
+                    tokenKind = SBTokenKey;
+                    tokenEscape = NO;
+                    const char *q = [self scanToken:p + 1 end:e];
+                    if (!q) {
+                        [token appendBytes:start length:e - start];
+                        return status;
+                    }
+                    if (![self finishToken:start length:q - start])
+                        return status;
+                    p = q;
+
+                } else if (ch == '}' && state == SBStreamKeyOrEnd) {
+                    [self pop];
+                    p++;
+
+                } else if (ch == '}') {
+                    return [self failWithCode:ETRAILCOMMA description:@"Trailing comma disallowed in object"];
+
+                } else {
+                    return [self failWithCode:EPARSE description:@"Object key string expected"];
+                }
+                break;
+
+            case SBStreamColon:
+                if (ch != ':')
+                    return [self failWithCode:EPARSE description:@"Expected ':' separating key and value"];
+                state = SBStreamValue;
+                p++;
+                break;
+
+            case SBStreamCommaOrEnd:
+                if (ch == ',') {
+                    state = inObject ? SBStreamKey : SBStreamValue;
+                    p++;
+                } else if (ch == (inObject ? '}' : ']')) {
+                    [self pop];
+                    p++;
+                } else {
+                    // SBJsonParser lets the comma between members be left out
+                    state = inObject ? SBStreamKey : SBStreamValue;
+                }
+                break;
+
+            case SBStreamDone:
+                return [self failWithCode:ETRAILGARBAGE description:@"Garbage after JSON"];
+        }
+    }
+
+    return status;
+}
+
+- (id)finish {
+    if (status == SBJsonStreamParserWaitingForData) {
+        if (!root)
+            [self failWithCode:EEOF description:@"Unexpected end of string"];
+        else if (inObject)
+            [self failWithCode:EEOF description:@"End of input while parsing object"];
+        else
+            [self failWithCode:EEOF description:@"End of input while parsing array"];
+    }
+    if (status == SBJsonStreamParserError)
+        return nil;
+    return [[root retain] autorelease];
+}
+
+/*
+ Returns the end of the token starting before p, or NULL if it runs past e.
+ The opening quote of a string has already been consumed.
+ */
+- (const char *)scanToken:(const char *)p end:(const char *)e {
+    if (tokenKind == SBTokenScalar) {
+        while (p < e && SBIsScalarByte(*p))
+            p++;
+        return p < e ? p : NULL;
+    }
+
+    for (;;) {
+        if (tokenEscape) {
+            if (p >= e)
+                return NULL;
+            p++;
+            tokenEscape = NO;
+        }
+        p = SBJsonScanString(p, e);
+        if (p >= e)
+            return NULL;
+        if (*p == '\\') {
+            tokenEscape = YES;
+            p++;
+            continue;
+        }
+        // the closing quote, or a control character the string scanner will reject
+        return p + 1;
+    }
+}
+
+- (BOOL)finishToken:(const char *)bytes length:(NSUInteger)length {
+    int kind = tokenKind;
+    tokenKind = SBTokenNone;
+
+    id v = (kind == SBTokenKey) ? [scalarParser keyWithBytes:bytes length:length]
+                                : [scalarParser fragmentWithBytes:bytes length:length];
+    if (!v) {
+        NSError *error = [[scalarParser errorTrace] lastObject];
+        [self failWithCode:[error code] description:[error localizedDescription]];
+        return NO;
+    }
+
+    if (kind == SBTokenKey) {
+        [key release];
+        key = [v retain];
+        state = SBStreamColon;
+        return YES;
+    }
+    return [self addValue:v];
+}
+
+- (BOOL)addValue:(id)v {
+    if (inObject)
+        [top setObject:v forKey:key];
+    else
+        [top addObject:v];
+    state = SBStreamCommaOrEnd;
+    return YES;
+}
+
+- (BOOL)push:(id)container {
+    if (maxDepth && [stack count] >= maxDepth) {
+        [self failWithCode:EDEPTH description:@"Nested too deep"];
+        return NO;
+    }
+    if (!root)
+        root = [container retain];
+    else
+        [self addValue:container];
+
+    [stack addObject:container];
+    top = container;
+    inObject = [container isKindOfClass:[NSDictionary class]];
+    state = inObject ? SBStreamKeyOrEnd : SBStreamValueOrEnd;
+    return YES;
+}
+
+- (void)pop {
+    [stack removeLastObject];
+    top = [stack lastObject];
+    if (!top) {
+        state = SBStreamDone;
+        status = SBJsonStreamParserComplete;
+        return;
+    }
+    inObject = [top isKindOfClass:[NSDictionary class]];
+    state = SBStreamCommaOrEnd;
+}
+
+- (SBJsonStreamParserStatus)failWithCode:(NSUInteger)code description:(NSString *)str {
+    [self addErrorWithCode:code description:str];
+    status = SBJsonStreamParserError;
+    return status;
+}
+
+@end
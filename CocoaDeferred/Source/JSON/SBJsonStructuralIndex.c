@@ -0,0 +1,109 @@
+//
+//  SBJsonStructuralIndex.c
+//  CocoaDeferred
+//
+
+#include "SBJsonStructuralIndex.h"
+#include "SBJsonSIMD.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SBEvenBits 0x5555555555555555ULL
+#define SBOddBits (~SBEvenBits)
+
+/*
+ The bytes escaped by an odd-length run of backslashes: the byte after a
+ run is escaped when the run starts on an even bit and ends on an odd one,
+ or the other way round. Runs are found by adding their start bits to them
+ and letting the carry ripple through; a run reaching the end of the block
+ carries over through *carry.
+ */
+static inline uint64_t SBEscapedBytes(uint64_t backslash, uint64_t *carry)
+{
+    uint64_t starts = backslash & ~(backslash << 1);
+    uint64_t evenStartMask = SBEvenBits ^ *carry;
+    uint64_t evenStarts = starts & evenStartMask;
+    uint64_t oddStarts = starts & ~evenStartMask;
+
+    uint64_t evenCarries = backslash + evenStarts;
+    uint64_t oddCarries = backslash + oddStarts;
+    int endsOdd = oddCarries < backslash;
+    oddCarries |= *carry;
+    *carry = endsOdd ? 1 : 0;
+
+    uint64_t evenCarryEnds = evenCarries & ~backslash;
+    uint64_t oddCarryEnds = oddCarries & ~backslash;
+    return (evenCarryEnds & SBOddBits) | (oddCarryEnds & SBEvenBits);
+}
+
+// bit i set when an odd number of the bits up to and including i are set
+static inline uint64_t SBPrefixXor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static int SBIndexReserve(SBJsonStructuralIndex *index, size_t n)
+{
+    if (index->count + n <= index->capacity)
+        return 1;
+    size_t capacity = index->capacity * 2;
+    if (capacity < index->count + n)
+        capacity = index->count + n;
+    uint32_t *offsets = realloc(index->offsets, capacity * sizeof(uint32_t));
+    if (!offsets)
+        return 0;
+    index->offsets = offsets;
+    index->capacity = capacity;
+    return 1;
+}
+
+int SBJsonStructuralIndexBuild(SBJsonStructuralIndex *index, const char *p, size_t length)
+{
+    memset(index, 0, sizeof(*index));
+    if (length > UINT32_MAX)
+        return 0;
+    // most documents have a structural character every 4 to 16 bytes
+    if (!SBIndexReserve(index, length / 8 + 64))
+        return 0;
+
+    uint64_t escapeCarry = 0;
+    uint64_t inString = 0;
+    for (size_t block = 0; block < length; block += 64) {
+        SBJsonBlockMasks masks;
+        if (length - block >= 64) {
+            SBJsonClassifyBlock(p + block, &masks);
+        } else {
+            char tail[64];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p + block, length - block);
+            SBJsonClassifyBlock(tail, &masks);
+        }
+
+        uint64_t quotes = masks.quote & ~SBEscapedBytes(masks.backslash, &escapeCarry);
+        uint64_t strings = SBPrefixXor(quotes) ^ inString;
+        inString = (uint64_t)((int64_t)strings >> 63);
+        uint64_t bits = (masks.structural & ~strings) | quotes;
+
+        if (!SBIndexReserve(index, 64))
+            return 0;
+        uint32_t *out = index->offsets + index->count;
+        while (bits) {
+            *out++ = (uint32_t)(block + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+        index->count = out - index->offsets;
+    }
+    return 1;
+}
+
+void SBJsonStructuralIndexFree(SBJsonStructuralIndex *index)
+{
+    free(index->offsets);
+    memset(index, 0, sizeof(*index));
+}
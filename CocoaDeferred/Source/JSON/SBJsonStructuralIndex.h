@@ -0,0 +1,43 @@
+//
+//  SBJsonStructuralIndex.h
+//  CocoaDeferred
+//
+//  The first stage of the two-stage parser: the offsets of every structural
+//  character ({ } [ ] : ,) outside strings, and of every quote that opens or
+//  closes a string, found 64 bytes at a time with SBJsonClassifyBlock.
+//
+
+#ifndef SBJSON_STRUCTURAL_INDEX_H
+#define SBJSON_STRUCTURAL_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SBJsonStructuralIndex {
+    uint32_t *offsets;
+    size_t count;
+    size_t capacity;
+} SBJsonStructuralIndex;
+
+/**
+ @brief Indexes the length bytes at p. Returns 0 if the buffer is too large to index or memory runs out.
+
+ Escaped quotes are told apart from real ones by the length of the run of
+ backslashes before them, so the quotes in the index always pair up, an
+ opening one followed by its closing one, unless the last string is
+ unterminated. Nothing is validated here; characters that are neither
+ structural nor quotes are left for the second stage.
+ */
+int SBJsonStructuralIndexBuild(SBJsonStructuralIndex *index, const char *p, size_t length);
+
+void SBJsonStructuralIndexFree(SBJsonStructuralIndex *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -66,9 +66,28 @@
  */
 - (NSString*)stringWithObject:(id)value;
 
+/**
+ @brief Return the UTF-8 encoded JSON representation for the given array or dictionary.
+ 
+ The output is written as bytes from the start, so this is cheaper than encoding the
+ result of stringWithObject:, and the data can be used as an HTTP body as is.
+ Returns nil on error.
+ 
+ @param value a NSDictionary or NSArray instance
+ */
+- (NSData*)dataWithObject:(id)value;
+
 @end
 
 
+/**
+ @brief Receives the output of -[SBJsonWriter writeObject:toFunction:context:].
+ 
+ Returns NO to abandon the rest of the document.
+ */
+typedef BOOL (*SBJsonChunkFunction)(const char *bytes, NSUInteger length, void *context);
+
+
 /**
  @brief The JSON writer class.
  
@@ -95,13 +114,41 @@
 
 @private
     BOOL sortKeys, humanReadable;
+    NSUInteger chunkSize;
 }
 
+/**
+ @brief The size of the chunks written by -writeObject:toStream: and -writeObject:toFunction:context:.
+ 
+ The writer never buffers more than this, except for a single indent deeper
+ than the chunk is long. Defaults to 16384.
+ */
+@property NSUInteger chunkSize;
+
+/**
+ @brief Write the JSON representation of the given array or dictionary to a stream.
+ 
+ The stream must already be open. The output is written as UTF-8, a chunk at a time,
+ blocking until the stream accepts each one. Returns NO if the value can't be written
+ or the stream fails; part of the document may have been written by then.
+ */
+- (BOOL)writeObject:(id)value toStream:(NSOutputStream *)stream;
+
+/**
+ @brief Pass the JSON representation of the given array or dictionary to a function, a chunk at a time.
+ 
+ Each chunk is at most chunkSize bytes; only the last one may be shorter. The bytes are
+ valid only for the duration of the call. The function returns NO to stop the writer,
+ which then returns NO itself.
+ */
+- (BOOL)writeObject:(id)value toFunction:(SBJsonChunkFunction)function context:(void *)context;
+
 @end
 
 // don't use - exists for backwards compatibility. Will be removed in 2.3.
 @interface SBJsonWriter (Private)
 - (NSString*)stringWithFragment:(id)value;
+- (NSData*)dataWithFragment:(id)value;
 @end
 
 /**
@@ -28,15 +28,221 @@
  */
 
 #import "SBJsonWriter.h"
+#import "SBJsonSIMD.h"
+#import <xlocale.h>
+#include <float.h>
+#include <math.h>
+
+/*
+ The UTF-8 output of one call. Without a flush function it is grown by
+ doubling, and ownership of the bytes passes to the NSData or NSString
+ returned. With one, it is handed to the function in chunks whenever the
+ next write would overflow it, and only grows for a write larger than that.
+ */
+typedef struct SBJsonOutput {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+    SBJsonChunkFunction flush;
+    void *context;
+    size_t chunk;
+    BOOL failed;
+} SBJsonOutput;
+
+static void SBJsonOutputFlush(SBJsonOutput *o)
+{
+    size_t done = 0;
+    while (done < o->length && !o->failed) {
+        size_t n = MIN(o->chunk, o->length - done);
+        if (!o->flush(o->bytes + done, n, o->context))
+            o->failed = YES;
+        done += n;
+    }
+    o->length = 0;
+}
+
+static inline char *SBJsonOutputReserve(SBJsonOutput *o, size_t n)
+{
+    if (o->length + n > o->capacity) {
+        if (o->flush) {
+            SBJsonOutputFlush(o);
+            if (n <= o->capacity)
+                return o->bytes;
+        }
+        size_t capacity = o->capacity ? o->capacity : 256;
+        while (capacity < o->length + n)
+            capacity *= 2;
+        o->bytes = realloc(o->bytes, capacity);
+        o->capacity = capacity;
+    }
+    return o->bytes + o->length;
+}
+
+static inline void SBJsonOutputAppend(SBJsonOutput *o, const char *bytes, size_t n)
+{
+    memcpy(SBJsonOutputReserve(o, n), bytes, n);
+    o->length += n;
+}
+
+#define SBJsonOutputAppendLiteral(o, s) SBJsonOutputAppend(o, s, sizeof(s) - 1)
+
+// The string's own bytes, if CoreFoundation keeps it as ASCII.
+static inline const char *SBJsonASCIIPtr(CFStringRef s, CFIndex length)
+{
+    const char *ascii = CFStringGetCStringPtr(s, kCFStringEncodingUTF8);
+    return (ascii && (CFIndex)strlen(ascii) == length) ? ascii : NULL;
+}
+
+// Appends the UTF-8 for part of a string without escaping it and returns where it starts.
+static size_t SBJsonOutputAppendUTF8(SBJsonOutput *o, CFStringRef s, const char *ascii, CFRange range)
+{
+    if (ascii) {
+        SBJsonOutputAppend(o, ascii + range.location, range.length);
+        return o->length - range.length;
+    }
+    CFIndex max = CFStringGetMaximumSizeForEncoding(range.length, kCFStringEncodingUTF8);
+    CFIndex used = 0;
+    char *p = SBJsonOutputReserve(o, max);
+    CFStringGetBytes(s, range, kCFStringEncodingUTF8, '?', false, (UInt8 *)p, max, &used);
+    o->length += used;
+    return p - o->bytes;
+}
+
+/*
+ Rewrites the UTF-8 from start to the end of the output with escapes, if it
+ contains a quote, backslash or control character, copying the runs in
+ between in bulk.
+ */
+static void SBJsonOutputEscape(SBJsonOutput *o, size_t start)
+{
+    const char *end = o->bytes + o->length;
+    const char *esc = SBJsonScanString(o->bytes + start, end);
+    if (esc == end)
+        return;
+    
+    size_t length = o->length - start;
+    char *raw = malloc(length);
+    memcpy(raw, o->bytes + start, length);
+    esc = raw + (esc - (o->bytes + start));
+    o->length = start;
+    
+    const char *c = raw;
+    const char *rawEnd = raw + length;
+    for (;;) {
+        SBJsonOutputAppend(o, c, esc - c);
+        if (esc == rawEnd)
+            break;
+        
+        unsigned char uc = *esc;
+        switch (uc) {
+            case '"':   SBJsonOutputAppendLiteral(o, "\\\"");   break;
+            case '\\':  SBJsonOutputAppendLiteral(o, "\\\\");   break;
+            case '\t':  SBJsonOutputAppendLiteral(o, "\\t");    break;
+            case '\n':  SBJsonOutputAppendLiteral(o, "\\n");    break;
+            case '\r':  SBJsonOutputAppendLiteral(o, "\\r");    break;
+            case '\b':  SBJsonOutputAppendLiteral(o, "\\b");    break;
+            case '\f':  SBJsonOutputAppendLiteral(o, "\\f");    break;
+            default: {
+                static const char hex[] = "0123456789abcdef";
+                char u[6] = { '\\', 'u', '0', '0', hex[uc >> 4], hex[uc & 0xf] };
+                SBJsonOutputAppend(o, u, sizeof(u));
+                break;
+            }
+        }
+        c = esc + 1;
+        esc = SBJsonScanString(c, rawEnd);
+    }
+    free(raw);
+}
+
+// Formats an integer backwards from the end of a buffer and returns where it starts.
+static inline char *SBJsonFormatUnsigned(unsigned long long u, char *end)
+{
+    char *p = end;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    return p;
+}
+
+/*
+ Appends a number without creating a string for it. Integers are formatted
+ by hand; floats and doubles are printed in the C locale with the fewest
+ significant digits that read back as the same value. The number must be finite.
+ */
+static void SBJsonOutputAppendNumber(SBJsonOutput *o, NSNumber *number)
+{
+    char buf[32];
+    char *end = buf + sizeof(buf);
+    char *p;
+    int length;
+    
+    switch (*[number objCType]) {
+        case 's': case 'i': case 'l': case 'q': {
+            long long v = [number longLongValue];
+            p = SBJsonFormatUnsigned(v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v, end);
+            if (v < 0)
+                *--p = '-';
+            SBJsonOutputAppend(o, p, end - p);
+            break;
+        }
+        case 'C': case 'S': case 'I': case 'L': case 'Q':
+            p = SBJsonFormatUnsigned([number unsignedLongLongValue], end);
+            SBJsonOutputAppend(o, p, end - p);
+            break;
+            
+        case 'f': {
+            float f = [number floatValue];
+            for (int precision = FLT_DIG; ; precision++) {
+                length = snprintf_l(buf, sizeof(buf), NULL, "%.*g", precision, f);
+                if (precision == FLT_DIG + 3 || strtof_l(buf, NULL, NULL) == f)
+                    break;
+            }
+            SBJsonOutputAppend(o, buf, length);
+            break;
+        }
+        case 'd': {
+            double d = [number doubleValue];
+            for (int precision = DBL_DIG; ; precision++) {
+                length = snprintf_l(buf, sizeof(buf), NULL, "%.*g", precision, d);
+                if (precision == DBL_DIG + 2 || strtod_l(buf, NULL, NULL) == d)
+                    break;
+            }
+            SBJsonOutputAppend(o, buf, length);
+            break;
+        }
+        default: {
+            CFStringRef str = (CFStringRef)[number stringValue];
+            CFIndex strLength = CFStringGetLength(str);
+            SBJsonOutputAppendUTF8(o, str, SBJsonASCIIPtr(str, strLength), CFRangeMake(0, strLength));
+            break;
+        }
+    }
+}
+
+static BOOL SBJsonWriteToStream(const char *bytes, NSUInteger length, void *context)
+{
+    NSOutputStream *stream = (NSOutputStream *)context;
+    while (length) {
+        NSInteger n = [stream write:(const uint8_t *)bytes maxLength:length];
+        if (n <= 0)
+            return NO;
+        bytes += n;
+        length -= n;
+    }
+    return YES;
+}
 
 @interface SBJsonWriter ()
 
-- (BOOL)appendValue:(id)fragment into:(NSMutableString*)json;
-- (BOOL)appendArray:(NSArray*)fragment into:(NSMutableString*)json;
-- (BOOL)appendDictionary:(NSDictionary*)fragment into:(NSMutableString*)json;
-- (BOOL)appendString:(NSString*)fragment into:(NSMutableString*)json;
+- (BOOL)writeValue:(id)fragment into:(SBJsonOutput *)json;
+- (BOOL)appendValue:(id)fragment into:(SBJsonOutput *)json;
+- (BOOL)appendArray:(NSArray*)fragment into:(SBJsonOutput *)json;
+- (BOOL)appendDictionary:(NSDictionary*)fragment into:(SBJsonOutput *)json;
+- (BOOL)appendString:(NSString*)fragment into:(SBJsonOutput *)json;
 
-- (NSString*)indent;
+- (void)appendIndent:(SBJsonOutput *)json;
 
 @end
 
@@ -44,20 +250,36 @@
 
 @synthesize sortKeys;
 @synthesize humanReadable;
+@synthesize chunkSize;
+
+- (id)init {
+    self = [super init];
+    if (self)
+        chunkSize = 16384;
+    return self;
+}
 
 /**
  @deprecated This exists in order to provide fragment support in older APIs in one more version.
  It should be removed in the next major version.
  */
 - (NSString*)stringWithFragment:(id)value {
-    [self clearErrorTrace];
-    depth = 0;
-    NSMutableString *json = [NSMutableString stringWithCapacity:128];
+    SBJsonOutput json = { NULL, 0, 0 };
+    if (![self writeValue:value into:&json])
+        return nil;
     
-    if ([self appendValue:value into:json])
-        return json;
+    return [[[NSString alloc] initWithBytesNoCopy:json.bytes
+                                           length:json.length
+                                         encoding:NSUTF8StringEncoding
+                                     freeWhenDone:YES] autorelease];
+}
+
+- (NSData*)dataWithFragment:(id)value {
+    SBJsonOutput json = { NULL, 0, 0 };
+    if (![self writeValue:value into:&json])
+        return nil;
     
-    return nil;
+    return [NSData dataWithBytesNoCopy:json.bytes length:json.length freeWhenDone:YES];
 }
 
 
@@ -72,12 +294,65 @@
     return nil;
 }
 
+- (NSData*)dataWithObject:(id)value {
+    
+    if ([value isKindOfClass:[NSDictionary class]] || [value isKindOfClass:[NSArray class]]) {
+        return [self dataWithFragment:value];
+    }
+    
+    [self clearErrorTrace];
+    [self addErrorWithCode:EFRAGMENT description:@"Not valid type for JSON"];
+    return nil;
+}
+
+- (BOOL)writeObject:(id)value toStream:(NSOutputStream *)stream {
+    return [self writeObject:value toFunction:SBJsonWriteToStream context:stream];
+}
 
-- (NSString*)indent {
-    return [@"\n" stringByPaddingToLength:1 + 2 * depth withString:@" " startingAtIndex:0];
+- (BOOL)writeObject:(id)value toFunction:(SBJsonChunkFunction)function context:(void *)context {
+    
+    if (![value isKindOfClass:[NSDictionary class]] && ![value isKindOfClass:[NSArray class]]) {
+        [self clearErrorTrace];
+        [self addErrorWithCode:EFRAGMENT description:@"Not valid type for JSON"];
+        return NO;
+    }
+    
+    size_t chunk = MAX(chunkSize, 64);
+    SBJsonOutput json = { malloc(chunk), 0, chunk, function, context, chunk, NO };
+    if (![self writeValue:value into:&json])
+        return NO;
+    
+    free(json.bytes);
+    return YES;
 }
 
-- (BOOL)appendValue:(id)fragment into:(NSMutableString*)json {
+- (BOOL)writeValue:(id)value into:(SBJsonOutput *)json {
+    [self clearErrorTrace];
+    depth = 0;
+    SBJsonOutputReserve(json, 128);
+    
+    if ([self appendValue:value into:json]) {
+        if (json->flush)
+            SBJsonOutputFlush(json);
+        if (!json->failed)
+            return YES;
+    }
+    
+    if (json->failed)
+        [self addErrorWithCode:EOUTPUT description:@"Output did not accept the JSON"];
+    free(json->bytes);
+    return NO;
+}
+
+
+- (void)appendIndent:(SBJsonOutput *)json {
+    char *p = SBJsonOutputReserve(json, 1 + 2 * depth);
+    *p = '\n';
+    memset(p + 1, ' ', 2 * depth);
+    json->length += 1 + 2 * depth;
+}
+
+- (BOOL)appendValue:(id)fragment into:(SBJsonOutput *)json {
     if ([fragment isKindOfClass:[NSDictionary class]]) {
         if (![self appendDictionary:fragment into:json])
             return NO;
@@ -91,13 +366,25 @@
             return NO;
         
     } else if ([fragment isKindOfClass:[NSNumber class]]) {
-        if ('c' == *[fragment objCType])
-            [json appendString:[fragment boolValue] ? @"true" : @"false"];
-        else
-            [json appendString:[fragment stringValue]];
+        if ('c' == *[fragment objCType]) {
+            if ([fragment boolValue])
+                SBJsonOutputAppendLiteral(json, "true");
+            else
+                SBJsonOutputAppendLiteral(json, "false");
+        } else if ([fragment isKindOfClass:[NSDecimalNumber class]]) {
+            // keeps every digit, which a double can't
+            CFStringRef str = (CFStringRef)[fragment stringValue];
+            CFIndex length = CFStringGetLength(str);
+            SBJsonOutputAppendUTF8(json, str, SBJsonASCIIPtr(str, length), CFRangeMake(0, length));
+        } else if (!isfinite([fragment doubleValue])) {
+            [self addErrorWithCode:EUNSUPPORTED description:@"NaN and infinity are not valid JSON numbers"];
+            return NO;
+        } else {
+            SBJsonOutputAppendNumber(json, fragment);
+        }
         
     } else if ([fragment isKindOfClass:[NSNull class]]) {
-        [json appendString:@"null"];
+        SBJsonOutputAppendLiteral(json, "null");
     } else if ([fragment respondsToSelector:@selector(proxyForJson)]) {
         [self appendValue:[fragment proxyForJson] into:json];
         
@@ -108,22 +395,25 @@
     return YES;
 }
 
-- (BOOL)appendArray:(NSArray*)fragment into:(NSMutableString*)json {
+- (BOOL)appendArray:(NSArray*)fragment into:(SBJsonOutput *)json {
     if (maxDepth && ++depth > maxDepth) {
         [self addErrorWithCode:EDEPTH description: @"Nested too deep"];
         return NO;
     }
-    [json appendString:@"["];
+    SBJsonOutputAppendLiteral(json, "[");
     
     BOOL addComma = NO;    
     for (id value in fragment) {
+        if (json->failed)
+            return NO;
+        
         if (addComma)
-            [json appendString:@","];
+            SBJsonOutputAppendLiteral(json, ",");
         else
             addComma = YES;
         
-        if ([self humanReadable])
-            [json appendString:[self indent]];
+        if (humanReadable)
+            [self appendIndent:json];
         
         if (![self appendValue:value into:json]) {
             return NO;
@@ -131,33 +421,35 @@
     }
     
     depth--;
-    if ([self humanReadable] && [fragment count])
-        [json appendString:[self indent]];
-    [json appendString:@"]"];
+    if (humanReadable && [fragment count])
+        [self appendIndent:json];
+    SBJsonOutputAppendLiteral(json, "]");
     return YES;
 }
 
-- (BOOL)appendDictionary:(NSDictionary*)fragment into:(NSMutableString*)json {
+- (BOOL)appendDictionary:(NSDictionary*)fragment into:(SBJsonOutput *)json {
     if (maxDepth && ++depth > maxDepth) {
         [self addErrorWithCode:EDEPTH description: @"Nested too deep"];
         return NO;
     }
-    [json appendString:@"{"];
+    SBJsonOutputAppendLiteral(json, "{");
     
-    NSString *colon = [self humanReadable] ? @" : " : @":";
     BOOL addComma = NO;
     NSArray *keys = [fragment allKeys];
     if (self.sortKeys)
         keys = [keys sortedArrayUsingSelector:@selector(compare:)];
     
     for (id value in keys) {
+        if (json->failed)
+            return NO;
+        
         if (addComma)
-            [json appendString:@","];
+            SBJsonOutputAppendLiteral(json, ",");
         else
             addComma = YES;
         
-        if ([self humanReadable])
-            [json appendString:[self indent]];
+        if (humanReadable)
+            [self appendIndent:json];
         
         if (![value isKindOfClass:[NSString class]]) {
             [self addErrorWithCode:EUNSUPPORTED description: @"JSON object key must be string"];
@@ -167,7 +459,10 @@
         if (![self appendString:value into:json])
             return NO;
         
-        [json appendString:colon];
+        if (humanReadable)
+            SBJsonOutputAppendLiteral(json, " : ");
+        else
+            SBJsonOutputAppendLiteral(json, ":");
         if (![self appendValue:[fragment objectForKey:value] into:json]) {
             [self addErrorWithCode:EUNSUPPORTED description:[NSString stringWithFormat:@"Unsupported value for key %@ in object", value]];
             return NO;
@@ -175,52 +470,32 @@
     }
     
     depth--;
-    if ([self humanReadable] && [fragment count])
-        [json appendString:[self indent]];
-    [json appendString:@"}"];
+    if (humanReadable && [fragment count])
+        [self appendIndent:json];
+    SBJsonOutputAppendLiteral(json, "}");
     return YES;    
 }
 
-- (BOOL)appendString:(NSString*)fragment into:(NSMutableString*)json {
-    
-    static NSMutableCharacterSet *kEscapeChars;
-    if( ! kEscapeChars ) {
-        kEscapeChars = [[NSMutableCharacterSet characterSetWithRange: NSMakeRange(0,32)] retain];
-        [kEscapeChars addCharactersInString: @"\"\\"];
-    }
-    
-    [json appendString:@"\""];
+/*
+ The string's UTF-8 is copied straight into the output and only escaped if
+ it needs to be. When writing in chunks, a long string is copied a slice at
+ a time so that it never takes more than the chunk buffer.
+ */
+- (BOOL)appendString:(NSString*)fragment into:(SBJsonOutput *)json {
+    CFStringRef s = (CFStringRef)fragment;
+    CFIndex length = CFStringGetLength(s);
+    const char *ascii = SBJsonASCIIPtr(s, length);
+    CFIndex slice = json->flush ? MAX((CFIndex)json->chunk / 4, 16) : length;
     
-    NSRange esc = [fragment rangeOfCharacterFromSet:kEscapeChars];
-    if ( !esc.length ) {
-        // No special chars -- can just add the raw string:
-        [json appendString:fragment];
-        
-    } else {
-        NSUInteger length = [fragment length];
-        for (NSUInteger i = 0; i < length; i++) {
-            unichar uc = [fragment characterAtIndex:i];
-            switch (uc) {
-                case '"':   [json appendString:@"\\\""];       break;
-                case '\\':  [json appendString:@"\\\\"];       break;
-                case '\t':  [json appendString:@"\\t"];        break;
-                case '\n':  [json appendString:@"\\n"];        break;
-                case '\r':  [json appendString:@"\\r"];        break;
-                case '\b':  [json appendString:@"\\b"];        break;
-                case '\f':  [json appendString:@"\\f"];        break;
-                default:    
-                    if (uc < 0x20) {
-                        [json appendFormat:@"\\u%04x", uc];
-                    } else {
-                        CFStringAppendCharacters((CFMutableStringRef)json, &uc, 1);
-                    }
-                    break;
-                    
-            }
-        }
+    SBJsonOutputAppendLiteral(json, "\"");
+    for (CFIndex i = 0; i < length; ) {
+        CFIndex n = MIN(slice, length - i);
+        if (!ascii && i + n < length && CFStringIsSurrogateHighCharacter(CFStringGetCharacterAtIndex(s, i + n - 1)))
+            n--;
+        SBJsonOutputEscape(json, SBJsonOutputAppendUTF8(json, s, ascii, CFRangeMake(i, n)));
+        i += n;
     }
-    
-    [json appendString:@"\""];
+    SBJsonOutputAppendLiteral(json, "\"");
     return YES;
 }
 